@@ -93,7 +93,7 @@ int Application::main()
 					if (mSourceCodeRedo.size() > 50) // limit the size of the history
 						mSourceCodeRedo.pop_front();
 					mSourceCode = mSourceCodeHistory.back();
-					mSourceDirty = true;
+					postRequest(REQUEST_SOURCE);
 					mSourceCodeHistory.pop_back();
 					mMutex.unlock();
 					mSourceCodeEditBox->setText(mSourceCode);
@@ -106,7 +106,7 @@ int Application::main()
 					if (mSourceCodeHistory.size() > 50)//limit the size of the history
 						mSourceCodeHistory.pop_front();
 					mSourceCode = mSourceCodeRedo.back();
-					mSourceDirty = true;
+					postRequest(REQUEST_SOURCE);
 					mSourceCodeRedo.pop_back();
 					mMutex.unlock();
 					mSourceCodeEditBox->setText(mSourceCode);
@@ -139,6 +139,7 @@ int Application::main()
 			if (drag != NO_DRAG)
 			{
 				sf::Lock lock(mMutex);
+				sf::FloatRect previousRect = mGraphRect;
 				sf::Vector2i delta = sf::Mouse::getPosition() - dragMousePosition;
 				const float sensibility = 0.001f;
 				if (drag == DRAG_XY)
@@ -158,7 +159,10 @@ int Application::main()
 					mGraphRect.height = dragGraphRect.height * pow(2.f, delta.y * 0.01f);
 					mGraphRect.top = center - 0.5f * mGraphRect.height;
 				}
-				mSourceDirty = true;
+				if (mGraphRect != previousRect)
+				{
+					postRequest(REQUEST_VIEWPORT);
+				}
 			}
 			else if ((float)sf::Mouse::getPosition(mWindow).x > 0.25f * mGui.getSize().x)
 			{
@@ -216,10 +220,12 @@ int Application::main()
 		mMutex.lock();
 		mErrorMessage.setPosition(30, mGui.getSize().y - 70);
 		mWindow.draw(mErrorMessage);
+		mTierMessage.setPosition(30, mGui.getSize().y - 40);
+		mWindow.draw(mTierMessage);
 		mMutex.unlock();
 
 		// Progression bar
-		sf::RectangleShape bar (sf::Vector2f(mProgression * 0.25f * mGui.getSize().x, 3.f));
+		sf::RectangleShape bar (sf::Vector2f(mProgression.load() * 0.25f * mGui.getSize().x, 3.f));
 		bar.setPosition(0, 15);
 		bar.setFillColor(sf::Color(50, 50, 255));
 		bar.setOutlineThickness(1.f);
@@ -230,8 +236,21 @@ int Application::main()
 		mWindow.display();
 	}
 
+	// stop the evaluation thread
 	if (mThread)
-		mThread->detach();
+	{
+		mMutex.lock();
+		mQuit = true;
+		if (mJob)
+		{
+			*mJob = true;
+		}
+		mRequestPosted.notify_one();
+		mMutex.unlock();
+		mThread->join();
+		delete mThread;
+		mThread = nullptr;
+	}
 	return EXIT_SUCCESS;
 }
 
@@ -242,21 +261,44 @@ void Application::execute()
 	
 	while (1)
 	{
-		while (!mSourceDirty)
+		// sleep until a request is posted and its debounce delay is over, the requests
+		// posted meanwhile are served together from the latest state
+		std::unique_lock<sf::Mutex> lock(mMutex);
+		while (!mQuit && (mRequests == 0 || std::chrono::steady_clock::now() < mRequestTime))
 		{
-			std::this_thread::sleep_for(std::chrono::milliseconds(10));
+			if (mRequests == 0)
+				mRequestPosted.wait(lock);
+			else
+				mRequestPosted.wait_until(lock, mRequestTime);
+		}
+		if (mQuit)
+		{
+			return;
 		}
-		mSourceDirty = false;
 
-		mMutex.lock();
-		enumCoordinate coordinate = mCoordinate;
-		mMutex.unlock();
+		// a new job, the programs of the previous one are stopped by postRequest()
+		mRequests = 0;
+		mJob = std::make_shared<CancelToken>(false);
+		JobInput input;
+		input.coordinate = mCoordinate;
+		input.source = mSourceCode;
+		input.graphRect = mGraphRect;
+		input.numPoint = (mCoordinate != THREE_D) ? mNumPoint2D : mNumPoint3D;
+		lock.unlock();
 		int curveWidth = 0;
 
-		if (coordinate != THREE_D)
+		if (showCachedResult(input))
+		{
+			continue;
+		}
+
+		// every round and pass of the job runs on the same programs
+		JobPrograms programs(input.source, (input.coordinate != THREE_D) ? 1 : 2, mJob.get());
+		mProgression = 0.f;
+		if (input.coordinate != THREE_D)
 		{
 			result2D.clear();
-			if (evaluate2D(result2D, coordinate))
+			if (evaluate2D(result2D, input, programs))
 			{
 				continue;
 			}
@@ -264,114 +306,626 @@ void Application::execute()
 		else // 3D curve
 		{
 			result3D.clear();
-			if (evaluate3D(result3D, curveWidth))
+			if (evaluate3D(result3D, curveWidth, input, programs))
 			{
 				continue;
 			}
 		}
 
-		mMutex.lock();
-		if (coordinate == mCoordinate)
+		mProgression = 1.f;
+		if (input.coordinate != THREE_D)
 		{
-			if (coordinate != THREE_D)
-			{
-				mPoints2D = result2D;
-			}
-			else // 3d curve
-			{
-				mPoints3D = result3D;
-				mCurveWidth = curveWidth;
-			}
+			cacheResult(input, publish2D(std::move(result2D), input.coordinate), nullptr);
+		}
+		else // 3d curve
+		{
+			cacheResult(input, nullptr, publish3D(std::move(result3D), curveWidth));
 		}
-		mMutex.unlock();
 	}
 }
 
-bool Application::evaluate2D(std::vector<sf::Vector2f>& result, enumCoordinate coordinate)
+JobPrograms::JobPrograms(const std::string& source, int paramCount, std::atomic<bool>* cancel)
+	: source(source)
+	, paramCount(paramCount)
+	, cancel(cancel)
+	, programs(std::max(1u, std::thread::hardware_concurrency()))
 {
-	mMutex.lock();
-	float width = mGraphRect.width;
-	float start = mGraphRect.left;
-	std::string buffer = mSourceCode;
-	int numPoint = mNumPoint2D;
-	mMutex.unlock();
+}
+
+JobPrograms::~JobPrograms()
+{
+}
+
+size_t JobInput::hash() const
+{
+	size_t h = std::hash<std::string>()(source);
+	size_t values[] = { (size_t)coordinate, (size_t)numPoint, std::hash<float>()(graphRect.left), std::hash<float>()(graphRect.top),
+		std::hash<float>()(graphRect.width), std::hash<float>()(graphRect.height) };
+	for (size_t value : values)
+	{
+		h ^= value + 0x9e3779b9 + (h << 6) + (h >> 2);
+	}
+	return h;
+}
+
+// Publishes the curve of a job done before with the same input, without running the interpreter
+bool Application::showCachedResult(const JobInput& input)
+{
+	std::map<size_t, ResultList::iterator>::iterator result = mResultIndex.find(input.hash());
+	if (result == mResultIndex.end() || !(result->second->input == input))
+		return false;
+
+	mResultCache.splice(mResultCache.begin(), mResultCache, result->second);
+	if (result->second->curve2D)
+		std::atomic_store(&mCurve2D, result->second->curve2D);
+	else
+		std::atomic_store(&mCurve3D, result->second->curve3D);
+
+	sf::Lock lock(mMutex);
+	mErrorMessage.setString(sf::String());
+	mTierMessage.setString(sf::String());
+	mProgression = 1.f;
+	return true;
+}
+
+// Keeps the curve of a finished job, the least recently shown ones are dropped past the size limit
+void Application::cacheResult(const JobInput& input, const std::shared_ptr<const Curve2D>& curve2D, const std::shared_ptr<const Curve3D>& curve3D)
+{
+	const size_t cacheLimit = 16 * 1024 * 1024;
+	size_t hash = input.hash();
+	std::map<size_t, ResultList::iterator>::iterator result = mResultIndex.find(hash);
+	if (result != mResultIndex.end())
+	{
+		mResultCacheSize -= result->second->size;
+		mResultCache.erase(result->second);
+		mResultIndex.erase(result);
+	}
+
+	CachedResult entry;
+	entry.input = input;
+	entry.curve2D = curve2D;
+	entry.curve3D = curve3D;
+	entry.size = input.source.size() + (curve2D ? curve2D->points.size() * sizeof(sf::Vector2f) : curve3D->points.size() * sizeof(sf::Vector3f));
+	mResultCache.push_front(entry);
+	mResultIndex[hash] = mResultCache.begin();
+	mResultCacheSize += entry.size;
+
+	while (mResultCacheSize > cacheLimit && mResultCache.size() > 1)
+	{
+		mResultCacheSize -= mResultCache.back().size;
+		mResultIndex.erase(mResultCache.back().input.hash());
+		mResultCache.pop_back();
+	}
+}
+
+// Hands points over to the render thread as a new snapshot, the one it may still be drawing
+// is released by the last of the two threads holding it
+std::shared_ptr<const Curve2D> Application::publish2D(std::vector<sf::Vector2f> points, enumCoordinate coordinate)
+{
+	std::shared_ptr<Curve2D> curve = std::make_shared<Curve2D>();
+	curve->coordinate = coordinate;
+	curve->points.swap(points);
+	std::atomic_store(&mCurve2D, std::shared_ptr<const Curve2D>(curve));
+	return curve;
+}
+
+std::shared_ptr<const Curve3D> Application::publish3D(std::vector<sf::Vector3f> points, int curveWidth)
+{
+	std::shared_ptr<Curve3D> curve = std::make_shared<Curve3D>();
+	curve->curveWidth = curveWidth;
+	curve->points.swap(points);
+	std::atomic_store(&mCurve3D, std::shared_ptr<const Curve3D>(curve));
+	return curve;
+}
+
+bool Application::evaluate2D(std::vector<sf::Vector2f>& result, const JobInput& input, JobPrograms& programs)
+{
+	enumCoordinate coordinate = input.coordinate;
+	const sf::FloatRect& graphRect = input.graphRect;
+	const std::string& buffer = input.source;
+	int numPoint = input.numPoint;
 	bool isCrash = false;
 	char errorBuffer[1024];
 
-	for (int i = 0; i < numPoint; i++)
+	if (coordinate == CARTESIAN)
 	{
-		double x = (double)i / numPoint;
-		mProgression = (float)x;
-		if (coordinate == CARTESIAN)
-		{
-			x = x * width + start;
-		}
-		else
+		isCrash = evaluateTiles(result, buffer, graphRect, numPoint, programs, errorBuffer);
+	}
+	else // polar coordinate, the whole turn refined for the current view
+	{
+		SampleWindow window = { coordinate, graphRect.left, graphRect.top, graphRect.width, graphRect.height, 0.001, 6.283185307179586 / (numPoint * 64.0) };
+		int numCoarse = numPoint / 8;
+		std::vector<double> xs;
+		std::vector<double> ys;
+		std::vector<char> canSplit;
+		std::vector<char> breakAfter;
+		for (int i = 0; i <= numCoarse; i++)
 		{
-			x *= 6.283185307179586;
+			xs.push_back(6.283185307179586 * i / numCoarse);
+			canSplit.push_back(i < numCoarse);
 		}
 
-		float y = (float)parse(buffer.c_str(), &x, 1, isCrash, errorBuffer);
-		if (isCrash)
+		// the curve is shown after every round of refinement
+		auto publishRound = [&]()
 		{
-			break;
+			std::vector<sf::Vector2f> partial;
+			appendSamples(partial, xs, ys, breakAfter, 0, xs.size());
+			publish2D(std::move(partial), coordinate);
+		};
+
+		programs.numSample = numPoint;
+		isCrash = refineSamples(programs, window, numPoint - (numCoarse + 1), xs, ys, canSplit, breakAfter, publishRound, errorBuffer);
+		if (!isCrash)
+		{
+			appendSamples(result, xs, ys, breakAfter, 0, xs.size());
 		}
-
-		result.push_back(sf::Vector2f((float)x, y));
 	}
+
+	mMutex.lock();
 	if (isCrash)
-		mErrorMessage.setString(errorBuffer);
+	{
+		if (mRequests == 0) // otherwise the job was cancelled for a newer one
+			mErrorMessage.setString(errorBuffer);
+	}
 	else
 		mErrorMessage.setString(sf::String());
+	mMutex.unlock();
 
 	return isCrash;
 }
 
-bool Application::evaluate3D(std::vector<sf::Vector3f>& result, int& curveWidth)
+// Cartesian curves are sampled by tiles of the x axis. The zoom level is the power of two above the
+// view size, a tile covers 1/16 of its width and is refined for the band of two level heights which
+// holds the view. Panning or zooming only evaluates the tiles which aren't in the cache yet.
+bool Application::evaluateTiles(std::vector<sf::Vector2f>& result, const std::string& source, const sf::FloatRect& graphRect, int numPoint, JobPrograms& programs, char errorBuffer[1024])
 {
-	mMutex.lock();
-	float width = mGraphRect.width;
-	float start = mGraphRect.left;
-	std::string buffer = mSourceCode;
-	curveWidth = mNumPoint3D;
-	mMutex.unlock();
-	bool isCrash = false;
-	char errorBuffer[1024];
+	const int tilesPerLevel = 16;
+	const size_t cacheLimit = 16 * 1024 * 1024; // bytes
+
+	if (source != mTileSource || numPoint != mTileNumPoint)
+	{
+		mTileCache.clear();
+		mTileIndex.clear();
+		mTileCacheSize = 0;
+		mTileSource = source;
+		mTileNumPoint = numPoint;
+	}
 
-	double point[2];
-	for (int i = 0; i < curveWidth; i++)
+	TileKey key;
+	key.xLevel = (int)ceil(log2(graphRect.width));
+	key.yLevel = (int)ceil(log2(graphRect.height));
+	double levelWidth = ldexp(1.0, key.xLevel);
+	double levelHeight = ldexp(1.0, key.yLevel);
+	double tileWidth = levelWidth / tilesPerLevel;
+	key.yBand = (long long)floor(graphRect.top / levelHeight);
+	long long firstTile = (long long)floor(graphRect.left / tileWidth);
+	long long lastTile = (long long)floor((graphRect.left + graphRect.width) / tileWidth);
+
+	// a quarter of the tolerance of a whole view, the band is up to 4 times the view height
+	SampleWindow window = { CARTESIAN, 0.0, (double)key.yBand * levelHeight, levelWidth, 2.0 * levelHeight, 0.00025, levelWidth / (numPoint * 64.0) };
+	int numCoarse = numPoint / (8 * tilesPerLevel);
+	if (numCoarse < 1)
+		numCoarse = 1;
+
+	// reuse the cached tiles, most recently used first
+	std::vector<long long> missingTiles;
+	for (key.index = firstTile; key.index <= lastTile; key.index++)
 	{
-		double posX = (double)i / curveWidth;
-		mProgression = (float)posX;
-		point[0] = posX * width + start;
+		std::map<TileKey, TileList::iterator>::iterator tile = mTileIndex.find(key);
+		if (tile != mTileIndex.end())
+			mTileCache.splice(mTileCache.begin(), mTileCache, tile->second);
+		else
+			missingTiles.push_back(key.index);
+	}
+
+	std::vector<double> xs;
+	std::vector<double> ys;
+	std::vector<char> canSplit;
+	std::vector<char> breakAfter;
+	std::vector<std::vector<sf::Vector2f>> newTiles(missingTiles.size());
 
-		for (int j = 0; j < curveWidth; j++)
+	// points of the missing tiles, the last sample of a tile is never split with the next one
+	auto cutTiles = [&]()
+	{
+		size_t firstSample = 0;
+		size_t tile = 0;
+		for (size_t i = 0; i < xs.size(); i++)
+		{
+			if (!canSplit[i])
+			{
+				newTiles[tile].clear();
+				appendSamples(newTiles[tile++], xs, ys, breakAfter, firstSample, i + 1);
+				firstSample = i + 1;
+			}
+		}
+	};
+
+	// puts the tiles together, keeping the part of the curve inside the view
+	auto assemble = [&](std::vector<sf::Vector2f>& points)
+	{
+		float left = graphRect.left;
+		float right = graphRect.left + graphRect.width;
+		sf::Vector2f previous(0.f, NAN);
+		size_t missing = 0;
+		for (key.index = firstTile; key.index <= lastTile; key.index++)
 		{
-			double posY = (double)j / curveWidth;
-			point[1] = posY * width + start;
+			const std::vector<sf::Vector2f>* tile = nullptr;
+			if (missing < missingTiles.size() && missingTiles[missing] == key.index)
+				tile = &newTiles[missing++];
+			else
+				tile = &mTileIndex[key]->second;
 
-			float z = (float)parse(buffer.c_str(), point, 2, isCrash, errorBuffer);
-			if (isCrash)
+			for (const sf::Vector2f& p : *tile)
 			{
-				break;
+				if (p.x >= left && p.x <= right)
+				{
+					if (points.empty() && p.x > left && !std::isnan(previous.y) && !std::isnan(p.y))
+						points.push_back(sf::Vector2f(left, previous.y + (p.y - previous.y) * (left - previous.x) / (p.x - previous.x)));
+					if (points.empty() || p.x != points.back().x)
+						points.push_back(p);
+				}
+				else if (p.x > right)
+				{
+					if (!points.empty() && points.back().x < right && !std::isnan(previous.y) && !std::isnan(p.y))
+						points.push_back(sf::Vector2f(right, previous.y + (p.y - previous.y) * (right - previous.x) / (p.x - previous.x)));
+					return;
+				}
+				previous = p;
+			}
+		}
+	};
+
+	if (!missingTiles.empty())
+	{
+		// all the missing tiles are refined together
+		for (long long index : missingTiles)
+		{
+			for (int i = 0; i <= numCoarse; i++)
+			{
+				xs.push_back((index + (double)i / numCoarse) * tileWidth);
+				canSplit.push_back(i < numCoarse);
+			}
+		}
+
+		// the curve is shown after every round of refinement
+		auto publishRound = [&]()
+		{
+			std::vector<sf::Vector2f> partial;
+			cutTiles();
+			assemble(partial);
+			publish2D(std::move(partial), CARTESIAN);
+		};
+
+		int budget = (int)missingTiles.size() * numPoint / 8;
+		programs.numSample = (int)missingTiles.size() * (numCoarse + 1) + budget;
+		if (refineSamples(programs, window, budget, xs, ys, canSplit, breakAfter, publishRound, errorBuffer))
+		{
+			return true;
+		}
+
+		cutTiles();
+		for (size_t tile = 0; tile < missingTiles.size(); tile++)
+		{
+			key.index = missingTiles[tile];
+			mTileCache.push_front(std::make_pair(key, std::vector<sf::Vector2f>()));
+			mTileCache.front().second.swap(newTiles[tile]);
+			mTileIndex[key] = mTileCache.begin();
+			mTileCacheSize += mTileCache.front().second.size() * sizeof(sf::Vector2f);
+		}
+		missingTiles.clear();
+	}
+
+	// the tiles of the view are at the front, evict the least recently used ones
+	size_t numViewTile = (size_t)(lastTile - firstTile + 1);
+	while (mTileCacheSize > cacheLimit && mTileCache.size() > numViewTile)
+	{
+		mTileCacheSize -= mTileCache.back().second.size() * sizeof(sf::Vector2f);
+		mTileIndex.erase(mTileCache.back().first);
+		mTileCache.pop_back();
+	}
+
+	assemble(result);
+	return false;
+}
+
+// Adaptive sampling: starting from the sorted samples xs, every interval whose midpoint is too far
+// from its chord is split, until the curve is smooth or budget more samples have been spent.
+// An interval which is still not smooth at the finest step is a discontinuity, like a pole of tan(x).
+// Intervals after a sample with a 0 in canSplit are left alone. onRound is called before every round,
+// with the samples so far.
+bool Application::refineSamples(JobPrograms& programs, const SampleWindow& window, int budget, std::vector<double>& xs, std::vector<double>& ys, std::vector<char>& canSplit, std::vector<char>& breakAfter, const std::function<void()>& onRound, char errorBuffer[1024])
+{
+	// position of a sample in the window, which goes from 0 to 1
+	auto toView = [&](double x, double y)
+	{
+		if (window.coordinate == CARTESIAN)
+			return sf::Vector2<double>(x / window.width, (y - window.bottom) / window.height);
+		return sf::Vector2<double>((y * cos(x) - window.left) / window.width, (y * sin(x) - window.bottom) / window.height);
+	};
+
+	// distance between the midpoint of an interval and its chord, 0 if nothing of it can be seen
+	auto deviation = [&](double xa, double ya, double xm, double ym, double xb, double yb)
+	{
+		int numDefined = std::isfinite(ya) + std::isfinite(ym) + std::isfinite(yb);
+		if (numDefined == 0)
+			return 0.0;
+		if (numDefined < 3) // edge of the domain of the function
+			return HUGE_VAL;
+
+		sf::Vector2<double> a = toView(xa, ya);
+		sf::Vector2<double> m = toView(xm, ym);
+		sf::Vector2<double> b = toView(xb, yb);
+		if ((a.y > 1.0 && m.y > 1.0 && b.y > 1.0) || (a.y < 0.0 && m.y < 0.0 && b.y < 0.0))
+			return 0.0;
+		if (window.coordinate != CARTESIAN && ((a.x > 1.0 && m.x > 1.0 && b.x > 1.0) || (a.x < 0.0 && m.x < 0.0 && b.x < 0.0)))
+			return 0.0;
+
+		return std::max(std::abs(m.x - 0.5 * (a.x + b.x)), std::abs(m.y - 0.5 * (a.y + b.y)));
+	};
+
+	ys.resize(xs.size());
+	breakAfter.assign(xs.size(), 0);
+	if (evaluateSamples(programs, xs, ys, errorBuffer))
+	{
+		return true;
+	}
+
+	// (deviation, first sample) of the intervals to split
+	typedef std::pair<double, int> Interval;
+	std::vector<Interval> toSplit;
+	for (size_t i = 0; i < xs.size(); i++)
+	{
+		if (canSplit[i])
+			toSplit.push_back(Interval(HUGE_VAL, (int)i));
+	}
+
+	while (!toSplit.empty() && budget > 0)
+	{
+		onRound();
+
+		// not enough budget left for all of them: split the worst ones
+		if ((int)toSplit.size() > budget)
+		{
+			std::nth_element(toSplit.begin(), toSplit.begin() + budget, toSplit.end(), std::greater<Interval>());
+			toSplit.resize(budget);
+			std::sort(toSplit.begin(), toSplit.end(), [](const Interval& a, const Interval& b) { return a.second < b.second; });
+		}
+		budget -= (int)toSplit.size();
+
+		std::vector<double> midXs(toSplit.size());
+		std::vector<double> midYs(toSplit.size());
+		for (size_t k = 0; k < toSplit.size(); k++)
+		{
+			midXs[k] = 0.5 * (xs[toSplit[k].second] + xs[toSplit[k].second + 1]);
+		}
+		if (evaluateSamples(programs, midXs, midYs, errorBuffer))
+		{
+			return true;
+		}
+
+		// merge the midpoints in and keep the halves which are still not smooth
+		std::vector<double> newXs;
+		std::vector<double> newYs;
+		std::vector<char> newCanSplit;
+		std::vector<char> newBreakAfter;
+		std::vector<Interval> nextSplit;
+		size_t k = 0;
+		for (size_t i = 0; i < xs.size(); i++)
+		{
+			newXs.push_back(xs[i]);
+			newYs.push_back(ys[i]);
+			newCanSplit.push_back(canSplit[i]);
+			newBreakAfter.push_back(breakAfter[i]);
+			if (k == toSplit.size() || toSplit[k].second != (int)i)
+			{
+				continue;
 			}
 
-			result.push_back(sf::Vector3f((float)(posX-0.5f), (float)(posY-0.5f), z));
+			// the halves of a split interval are judged again
+			int left = (int)newXs.size() - 1;
+			newBreakAfter[left] = 0;
+			newXs.push_back(midXs[k]);
+			newYs.push_back(midYs[k]);
+			newCanSplit.push_back(1);
+			newBreakAfter.push_back(0);
+
+			double dev = deviation(xs[i], ys[i], midXs[k], midYs[k], xs[i + 1], ys[i + 1]);
+			if (dev > window.tolerance)
+			{
+				sf::Vector2<double> a = toView(xs[i], ys[i]);
+				sf::Vector2<double> m = toView(midXs[k], midYs[k]);
+				sf::Vector2<double> b = toView(xs[i + 1], ys[i + 1]);
+				bool canSplitAgain = midXs[k] - xs[i] > window.minInterval;
+				if (canSplitAgain)
+				{
+					nextSplit.push_back(Interval(dev, left));
+					nextSplit.push_back(Interval(dev, left + 1));
+				}
+
+				// a midpoint going further than the window past both ends looks like a pole: break the
+				// curve on the half with the biggest jump, unless that half is split and found smooth later
+				bool isPole = m.y > std::max(a.y, b.y) + 1.0 || m.y < std::min(a.y, b.y) - 1.0;
+				if (isPole || !canSplitAgain)
+				{
+					bool isLeftJump = std::abs(m.y - a.y) + std::abs(m.x - a.x) > std::abs(b.y - m.y) + std::abs(b.x - m.x);
+					newBreakAfter[isLeftJump ? left : left + 1] = 1;
+				}
+			}
+			k++;
 		}
 
+		xs.swap(newXs);
+		ys.swap(newYs);
+		canSplit.swap(newCanSplit);
+		breakAfter.swap(newBreakAfter);
+		toSplit.swap(nextSplit);
+	}
+
+	return false;
+}
+
+// Appends the samples [first, last) as points, a NaN y breaks the curve in showGraph
+void Application::appendSamples(std::vector<sf::Vector2f>& points, const std::vector<double>& xs, const std::vector<double>& ys, const std::vector<char>& breakAfter, size_t first, size_t last)
+{
+	for (size_t i = first; i < last; i++)
+	{
+		float y = (float)ys[i];
+		points.push_back(sf::Vector2f((float)xs[i], std::isfinite(y) ? y : NAN));
+		if (breakAfter[i])
+		{
+			points.push_back(sf::Vector2f((float)(0.5 * (xs[i] + xs[i + 1])), NAN));
+		}
+	}
+}
+
+bool Application::evaluate3D(std::vector<sf::Vector3f>& result, int& curveWidth, const JobInput& input, JobPrograms& programs)
+{
+	float width = input.graphRect.width;
+	float start = input.graphRect.left;
+	curveWidth = input.numPoint;
+	bool isCrash = false;
+	char errorBuffer[1024];
+
+	// Coarse to fine: every 16th row and column first, then every 8th and so on. A pass only
+	// evaluates the samples the previous ones didn't have, and is shown as a grid of its own.
+	std::vector<double> z(curveWidth * curveWidth);
+	programs.numSample = curveWidth * curveWidth;
+	const int firstStep = 16;
+	for (int step = firstStep; step >= 1 && !isCrash; step /= 2)
+	{
+		// (x, y) pairs of the new samples of the pass
+		std::vector<int> indices;
+		std::vector<double> inputs;
+		for (int i = 0; i < curveWidth; i += step)
+		{
+			for (int j = 0; j < curveWidth; j += step)
+			{
+				if (step != firstStep && i % (step * 2) == 0 && j % (step * 2) == 0)
+					continue;
+
+				indices.push_back(i * curveWidth + j);
+				inputs.push_back((double)i / curveWidth * width + start);
+				inputs.push_back((double)j / curveWidth * width + start);
+			}
+		}
+
+		std::vector<double> outputs(indices.size());
+		isCrash = evaluateSamples(programs, inputs, outputs, errorBuffer);
 		if (isCrash)
 		{
 			break;
 		}
+		for (size_t k = 0; k < indices.size(); k++)
+		{
+			z[indices[k]] = outputs[k];
+		}
+
+		// the grid of the pass
+		int passWidth = (curveWidth + step - 1) / step;
+		result.clear();
+		for (int i = 0; i < curveWidth; i += step)
+		{
+			double posX = (double)i / curveWidth;
+			for (int j = 0; j < curveWidth; j += step)
+			{
+				double posY = (double)j / curveWidth;
+				result.push_back(sf::Vector3f((float)(posX-0.5f), (float)(posY-0.5f), (float)z[i * curveWidth + j]));
+			}
+		}
+
+		// the last pass is published by execute()
+		if (step > 1 && passWidth > 1)
+		{
+			publish3D(result, passWidth);
+		}
 	}
+	mMutex.lock();
 	if (isCrash)
-		mErrorMessage.setString(errorBuffer);
+	{
+		if (mRequests == 0) // otherwise the job was cancelled for a newer one
+			mErrorMessage.setString(errorBuffer);
+	}
 	else
 		mErrorMessage.setString(sf::String());
+	mMutex.unlock();
 	
 	return isCrash;
 }
 
+// Evaluates main() on every sample with one of the job's programs per worker thread. Workers take
+// slices of samples until none is left, so each one writes a disjoint part of outputs.
+// The calling thread's program reports how far up its functions got once it's done.
+bool Application::evaluateSamples(JobPrograms& programs, const std::vector<double>& inputs, std::vector<double>& outputs, char errorBuffer[1024])
+{
+	const int batchSize = 64;
+	int paramCount = programs.paramCount;
+	int numSample = (int)outputs.size();
+	int numWorker = (int)programs.programs.size();
+	int numBatch = (numSample + batchSize - 1) / batchSize;
+	if (numWorker > numBatch)
+		numWorker = numBatch;
+	if (numWorker < 1)
+		numWorker = 1;
+
+	std::atomic<int> nextSample(0);
+	std::atomic<bool> isCrash(false);
+	int crashIndex = numSample;
+	sf::Mutex crashMutex;
+
+	auto work = [&](int index)
+	{
+		std::unique_ptr<CompiledProgram>& slot = programs.programs[index];
+		if (!slot)
+			slot.reset(new CompiledProgram(programs.source.c_str(), paramCount, programs.cancel));
+		CompiledProgram& program = *slot;
+		char workerError[ERROR_BUFFER_SIZE];
+
+		while (!isCrash)
+		{
+			int first = nextSample.fetch_add(batchSize);
+			if (first >= numSample)
+				break;
+
+			int count = (numSample - first < batchSize) ? numSample - first : batchSize;
+			int failed = program.callBatch(&inputs[first * paramCount], &outputs[first], count, workerError);
+			if (failed >= 0)
+			{
+				// keep the error of the earliest sample
+				sf::Lock lock(crashMutex);
+				if (first + failed < crashIndex)
+				{
+					crashIndex = first + failed;
+					strcpy_s(errorBuffer, ERROR_BUFFER_SIZE, workerError);
+				}
+				isCrash = true;
+				break;
+			}
+
+			// over the whole job, refinement may stop before its budget is spent
+			mProgression = std::min(1.f, (float)(programs.doneSample += count) / programs.numSample);
+		}
+
+		if (index == 0)
+		{
+			sf::Lock lock(mMutex);
+			mTierMessage.setString(program.tierReport());
+		}
+	};
+
+	std::vector<std::thread> workers;
+	for (int i = 1; i < numWorker; i++)
+	{
+		workers.push_back(std::thread(work, i));
+	}
+	work(0);
+	for (std::thread& worker : workers)
+	{
+		worker.join();
+	}
+
+	return isCrash;
+}
+
 void Application::ApplyZoomOnGraph(float factor)
 {
 	sf::Vector2f center(mGraphRect.left + 0.5f * mGraphRect.width, mGraphRect.top + 0.5f * mGraphRect.height);
@@ -380,16 +934,45 @@ void Application::ApplyZoomOnGraph(float factor)
 	mGraphRect.height *= factor;
 	mGraphRect.left = center.x - 0.5f * mGraphRect.width;
 	mGraphRect.top = center.y - 0.5f * mGraphRect.height;
-	mSourceDirty = true;
+	postRequest(REQUEST_VIEWPORT);
+}
+
+// Asks the evaluation thread for a new pass and stops the one running, mMutex must be locked.
+// Source edits are served once no other keystroke came for mSourceDebounce.
+void Application::postRequest(enumRequest request)
+{
+	std::chrono::steady_clock::time_point time = std::chrono::steady_clock::now();
+	if (request == REQUEST_SOURCE)
+		time += mSourceDebounce;
+	if (mRequests == 0 || time > mRequestTime)
+		mRequestTime = time;
+	mRequests |= request;
+
+	if (mJob)
+	{
+		*mJob = true;
+	}
+	mRequestPosted.notify_one();
 }
 
 void Application::showGraph()
 {
+	// a curve left over from the other coordinate system isn't drawn
+	std::shared_ptr<const Curve2D> curve = std::atomic_load(&mCurve2D);
+	if (curve && curve->coordinate != mCoordinate)
+		curve.reset();
+	static const std::vector<sf::Vector2f> noPoints;
+	const std::vector<sf::Vector2f>& points = curve ? curve->points : noPoints;
+
 	std::vector<sf::Vertex> lines;
-	mMutex.lock();
-	for (const sf::Vector2f& p : mPoints2D)
+	std::vector<size_t> curveBreaks;
+	for (const sf::Vector2f& p : points)
 	{
-		if (mCoordinate == CARTESIAN)
+		if (std::isnan(p.y)) // discontinuity, start a new strip
+		{
+			curveBreaks.push_back(lines.size());
+		}
+		else if (mCoordinate == CARTESIAN)
 		{
 			lines.push_back(convertGraphCoordToScreen(p));
 		}
@@ -399,8 +982,16 @@ void Application::showGraph()
 			lines.push_back(convertGraphCoordToScreen(p));
 		}
 	}
-	mMutex.unlock();
-	mGui.getWindow()->draw(lines.data(), lines.size(), sf::LinesStrip);
+	curveBreaks.push_back(lines.size());
+	size_t stripStart = 0;
+	for (size_t stripEnd : curveBreaks)
+	{
+		if (stripEnd > stripStart + 1)
+		{
+			mGui.getWindow()->draw(lines.data() + stripStart, stripEnd - stripStart, sf::LinesStrip);
+		}
+		stripStart = stripEnd;
+	}
 	lines.clear();
 
 	// Axis
@@ -457,7 +1048,7 @@ void Application::showGraph()
 				mouse.x += 6.283185307179586f;
 		}
 
-		float y = getAccurateYValue(mouse.x);
+		float y = getAccurateYValue(points, mouse.x);
 		char str[64];
 		sprintf_s<64>(str, "(%g, %g)", mouse.x, y);
 		sf::Text text(str, *mGui.getFont(), 12);
@@ -485,13 +1076,14 @@ void Application::show3DGraph()
 {
 	mWindow.popGLStates();
 
-	mMutex.lock();
-	if (mPoints3D.empty())
+	std::shared_ptr<const Curve3D> curve = std::atomic_load(&mCurve3D);
+	if (!curve || curve->points.empty())
 	{
-		mMutex.unlock();
 		mWindow.pushGLStates();
 		return;
 	}
+	const std::vector<sf::Vector3f>& points = curve->points;
+	int curveWidth = curve->curveWidth;
 
 	// Clear the depth buffer
 	glClear(GL_DEPTH_BUFFER_BIT);
@@ -509,7 +1101,7 @@ void Application::show3DGraph()
 	std::vector<sf::Color> colors;
 
 	float minZ = 0, maxZ = 0;
-	for (const sf::Vector3f& p : mPoints3D)
+	for (const sf::Vector3f& p : points)
 	{
 		if (minZ > p.z)
 			minZ = p.z;
@@ -520,14 +1112,14 @@ void Application::show3DGraph()
 	if (maxZ - minZ > 1e-7f)
 		deltaZ = 1.f / (maxZ - minZ);
 
-	for (int x = 0; x < mCurveWidth-1; x++)
+	for (int x = 0; x < curveWidth-1; x++)
 	{
-		for (int y = 0; y < mCurveWidth-1; y++)
+		for (int y = 0; y < curveWidth-1; y++)
 		{
-			sf::Vector3f p0 = mPoints3D[x * mCurveWidth + y];
-			sf::Vector3f p1 = mPoints3D[(x+1) * mCurveWidth + y];
-			sf::Vector3f p2 = mPoints3D[(x+1) * mCurveWidth + y + 1];
-			sf::Vector3f p3 = mPoints3D[x * mCurveWidth + y + 1];
+			sf::Vector3f p0 = points[x * curveWidth + y];
+			sf::Vector3f p1 = points[(x+1) * curveWidth + y];
+			sf::Vector3f p2 = points[(x+1) * curveWidth + y + 1];
+			sf::Vector3f p3 = points[x * curveWidth + y + 1];
 			sf::Color c0 = rainbowColor(p0.z = (p0.z - minZ) * deltaZ);
 			sf::Color c1 = rainbowColor(p1.z = (p1.z - minZ) * deltaZ);
 			sf::Color c2 = rainbowColor(p2.z = (p2.z - minZ) * deltaZ);
@@ -549,7 +1141,6 @@ void Application::show3DGraph()
 			colors.push_back(c0);
 		}
 	}
-	mMutex.unlock();
 
 	glVertexPointer(3, GL_FLOAT, 3 * sizeof(float), positions.data());
 	glColorPointer(4, GL_UNSIGNED_BYTE, 4 * sizeof(unsigned char), colors.data());
@@ -629,7 +1220,7 @@ void Application::callbackTextEdit(tgui::TextBox::Ptr source)
 		mSourceCodeHistory.pop_front();
 	mSourceCodeRedo.clear();
 	mSourceCode = source->getText().toAnsiString();
-	mSourceDirty = true;
+	postRequest(REQUEST_SOURCE);
 	mMutex.unlock();
 }
 
@@ -713,8 +1304,11 @@ void Application::loadWidgets()
 	resetButton->setText("Reset interpreter");
 	mGui.add(resetButton);
 	resetButton->connect("pressed", [this] {
-		extern bool gResetParser;
-		gResetParser = true;
+		sf::Lock lock(mMutex);
+		if (mJob)
+		{
+			*mJob = true;
+		}
 	});
 
 	tgui::ComboBox::Ptr coordinateBox = theme->load("ComboBox");
@@ -726,14 +1320,17 @@ void Application::loadWidgets()
 	coordinateBox->setSelectedItemByIndex(mCoordinate);
 	mGui.add(coordinateBox);
 	coordinateBox->connect("ItemSelected", [this](tgui::ComboBox::Ptr box) {
-		mPoints2D.clear();
-		mPoints3D.clear();
-		if (mCoordinate != (enumCoordinate)box->getSelectedItemIndex())
+		mMutex.lock();
+		std::atomic_store(&mCurve2D, std::shared_ptr<const Curve2D>());
+		std::atomic_store(&mCurve3D, std::shared_ptr<const Curve3D>());
+		bool isChanged = mCoordinate != (enumCoordinate)box->getSelectedItemIndex();
+		mCoordinate = (enumCoordinate)box->getSelectedItemIndex();
+		postRequest(REQUEST_COORDINATE);
+		mMutex.unlock();
+		if (isChanged)
 		{
-			mCoordinate = (enumCoordinate)box->getSelectedItemIndex();
 			fillDefaultSourceCode();
 		}
-		mCoordinate = (enumCoordinate)box->getSelectedItemIndex();
 	}, coordinateBox);
 
 	tgui::CheckBox::Ptr highDefBox = theme->load("CheckBox");
@@ -742,17 +1339,25 @@ void Application::loadWidgets()
 	highDefBox->setText("High Def");
 	mGui.add(highDefBox);
 	highDefBox->connect("checked", [this]() {
+		sf::Lock lock(mMutex);
 		mNumPoint2D = 1500;
 		mNumPoint3D = 64;
+		postRequest(REQUEST_RESOLUTION);
 	});
 	highDefBox->connect("unchecked", [this]() {
+		sf::Lock lock(mMutex);
 		mNumPoint2D = 1024;
 		mNumPoint3D = 32;
+		postRequest(REQUEST_RESOLUTION);
 	});
 
 	mErrorMessage.setFont(*mGui.getFont());
 	mErrorMessage.setCharacterSize(14);
 	mErrorMessage.setColor(sf::Color::Red);
+
+	mTierMessage.setFont(*mGui.getFont());
+	mTierMessage.setCharacterSize(12);
+	mTierMessage.setColor(sf::Color(150, 150, 150));
 }
 
 sf::Vector2f Application::convertGraphCoordToScreen(const sf::Vector2f& point) const
@@ -822,25 +1427,29 @@ std::vector<float> Application::computeAxisGraduation(float min, float max) cons
 	return axis;
 }
 
-float Application::getAccurateYValue(float x) const
+float Application::getAccurateYValue(const std::vector<sf::Vector2f>& points, float x) const
 {
-	if (mPoints2D.size() < 2)
+	if (points.size() < 2)
 		return 0.f;
 
-	sf::Lock lock(mMutex);
-
-	sf::Vector2f p0 = mPoints2D[0];
-	sf::Vector2f p1 = mPoints2D[1];
-	for (unsigned i = 1; i < mPoints2D.size(); i++)
+	sf::Vector2f p0 = points[0];
+	sf::Vector2f p1 = points[1];
+	for (unsigned i = 1; i < points.size(); i++)
 	{
-		if (mPoints2D[i].x > x)
+		if (points[i].x > x)
 		{
-			p0 = mPoints2D[i-1];
-			p1 = mPoints2D[i];
+			p0 = points[i-1];
+			p1 = points[i];
 			break;
 		}
 	}
 
+	// don't interpolate across a break of the curve
+	if (std::isnan(p0.y))
+		return p1.y;
+	if (std::isnan(p1.y))
+		return p0.y;
+
 	float a = (x - p0.x) / (p1.x - p0.x);
 	return a * (p1.y - p0.y) + p0.y;
 }
@@ -7,6 +7,16 @@
 #include <string>
 #include <thread>
 #include <chrono>
+#include <atomic>
+#include <algorithm>
+#include <cmath>
+#include <list>
+#include <map>
+#include <functional>
+#include <memory>
+#include <condition_variable>
+
+class CompiledProgram;
 
 enum enumCoordinate
 {
@@ -15,6 +25,15 @@ enum enumCoordinate
 	THREE_D
 };
 
+// What a request to the evaluation thread was posted for, pending requests are or-ed together
+enum enumRequest
+{
+	REQUEST_SOURCE     = 1,
+	REQUEST_VIEWPORT   = 2,
+	REQUEST_RESOLUTION = 4,
+	REQUEST_COORDINATE = 8,
+};
+
 enum enumDragMode
 {
 	NO_DRAG,
@@ -23,6 +42,89 @@ enum enumDragMode
 	DRAG_XY,
 };
 
+// Area the 2D sampler makes the curve smooth for: samples which can't be seen in it aren't
+// refined, and a midpoint can be tolerance (in units of the window) away from its chord
+struct SampleWindow
+{
+	enumCoordinate coordinate;
+	double         left;
+	double         bottom;
+	double         width;
+	double         height;
+	double         tolerance;
+	double         minInterval;
+};
+
+// A tile of cartesian samples: its position on the x axis and the zoom level and band it was refined for
+struct TileKey
+{
+	long long index;
+	int       xLevel;
+	int       yLevel;
+	long long yBand;
+
+	bool operator<(const TileKey& other) const
+	{
+		if (index != other.index) return index < other.index;
+		if (xLevel != other.xLevel) return xLevel < other.xLevel;
+		if (yLevel != other.yLevel) return yLevel < other.yLevel;
+		return yBand < other.yBand;
+	}
+};
+
+// Samples published to the render thread, never modified once published
+struct Curve2D
+{
+	enumCoordinate            coordinate;
+	std::vector<sf::Vector2f> points;
+};
+
+struct Curve3D
+{
+	int                       curveWidth;
+	std::vector<sf::Vector3f> points;
+};
+
+// State an evaluation job is run for, read once when the job starts
+struct JobInput
+{
+	enumCoordinate coordinate;
+	std::string    source;
+	sf::FloatRect  graphRect;
+	int            numPoint; // of the 2D or 3D curve
+
+	size_t hash() const;
+
+	bool operator==(const JobInput& other) const
+	{
+		return coordinate == other.coordinate && numPoint == other.numPoint && graphRect == other.graphRect && source == other.source;
+	}
+};
+
+// The programs evaluating a job, one per worker thread. A worker makes its program the first time it gets
+// samples, and keeps it for the rest of the job, so later rounds and passes run on functions already hot
+struct JobPrograms
+{
+	std::string                                   source;
+	int                                           paramCount;
+	std::atomic<bool>*                            cancel;
+	std::vector<std::unique_ptr<CompiledProgram>> programs;
+	int                                           numSample = 1; // samples the whole job is expected to take, for the progression bar
+	std::atomic<int>                              doneSample{0};
+
+	JobPrograms(const std::string& source, int paramCount, std::atomic<bool>* cancel);
+	~JobPrograms();
+};
+
+// A finished job and the curve it published
+struct CachedResult
+{
+	JobInput                       input;
+	std::shared_ptr<const Curve2D> curve2D; // one of the two is null
+	std::shared_ptr<const Curve3D> curve3D;
+	size_t                         size;
+};
+
 class Application
 {
 public:
@@ -32,9 +134,18 @@ public:
 
 private:
 	void               execute();
-	bool               evaluate2D(std::vector<sf::Vector2f>& result, enumCoordinate coordinate);
-	bool               evaluate3D(std::vector<sf::Vector3f>& result, int& curveWidth);
+	bool               showCachedResult(const JobInput& input);
+	void               cacheResult(const JobInput& input, const std::shared_ptr<const Curve2D>& curve2D, const std::shared_ptr<const Curve3D>& curve3D);
+	bool               evaluate2D(std::vector<sf::Vector2f>& result, const JobInput& input, JobPrograms& programs);
+	bool               evaluateTiles(std::vector<sf::Vector2f>& result, const std::string& source, const sf::FloatRect& graphRect, int numPoint, JobPrograms& programs, char errorBuffer[1024]);
+	bool               refineSamples(JobPrograms& programs, const SampleWindow& window, int budget, std::vector<double>& xs, std::vector<double>& ys, std::vector<char>& canSplit, std::vector<char>& breakAfter, const std::function<void()>& onRound, char errorBuffer[1024]);
+	void               appendSamples(std::vector<sf::Vector2f>& points, const std::vector<double>& xs, const std::vector<double>& ys, const std::vector<char>& breakAfter, size_t first, size_t last);
+	bool               evaluate3D(std::vector<sf::Vector3f>& result, int& curveWidth, const JobInput& input, JobPrograms& programs);
+	std::shared_ptr<const Curve2D> publish2D(std::vector<sf::Vector2f> points, enumCoordinate coordinate);
+	std::shared_ptr<const Curve3D> publish3D(std::vector<sf::Vector3f> points, int curveWidth);
+	bool               evaluateSamples(JobPrograms& programs, const std::vector<double>& inputs, std::vector<double>& outputs, char errorBuffer[1024]);
 	void               ApplyZoomOnGraph(float factor);
+	void               postRequest(enumRequest request);
 	void               showGraph();
 	void               show3DGraph();
 	void               callbackTextEdit(tgui::TextBox::Ptr source);
@@ -46,7 +157,7 @@ private:
 	bool               isMouseOverXAxis();
 	bool               isMouseOverYAxis();
 	std::vector<float> computeAxisGraduation(float min, float max) const;
-	float              getAccurateYValue(float x) const;
+	float              getAccurateYValue(const std::vector<sf::Vector2f>& points, float x) const;
 	sf::Color          rainbowColor(float i);
 
 
@@ -58,17 +169,36 @@ private:
 	std::string               mSourceCode;
 	std::list<std::string>    mSourceCodeHistory;
 	std::list<std::string>    mSourceCodeRedo;
-	bool                      mSourceDirty = true;
-	std::vector<sf::Vector2f> mPoints2D;
-	std::vector<sf::Vector3f> mPoints3D;
-	int                       mCurveWidth = 32;
+	int                       mRequests = REQUEST_SOURCE; // pending requests, none when 0
+	std::chrono::steady_clock::time_point mRequestTime; // when the pending requests can be served
+	std::chrono::milliseconds mSourceDebounce = std::chrono::milliseconds(150); // quiet time after a keystroke before evaluating
+	std::condition_variable_any mRequestPosted;
+	bool                      mQuit = false;
+	std::shared_ptr<std::atomic<bool>> mJob; // cancel token of the running job, only replaced by the evaluation thread
+	std::shared_ptr<const Curve2D> mCurve2D; // latest snapshots, only accessed with std::atomic_load/atomic_store
+	std::shared_ptr<const Curve3D> mCurve3D;
 	int                       mNumPoint2D = 1024;
 	int                       mNumPoint3D = 32;
 	sf::FloatRect             mGraphRect = sf::FloatRect(-10.f, -10.f, 20.f, 20.f);
 	sf::FloatRect             mGraphScreen;
 	sf::Text                  mErrorMessage;
-	float                     mProgression = 0.f;
+	sf::Text                  mTierMessage; // which tier each function of the last evaluation ended up in
+	std::atomic<float>        mProgression{0.f}; // of the running job, written by the workers and read by the render thread
 	bool                      mShowFunctionList = false;
 	enumCoordinate            mCoordinate = CARTESIAN;
 
+	// cartesian samples by tile, only used by the evaluation thread
+	typedef std::list<std::pair<TileKey, std::vector<sf::Vector2f>>> TileList;
+	TileList                  mTileCache; // most recently used first
+	std::map<TileKey, TileList::iterator> mTileIndex;
+	size_t                    mTileCacheSize = 0;
+	std::string               mTileSource;
+	int                       mTileNumPoint = 0;
+
+	// finished jobs by hash of their input, only used by the evaluation thread
+	typedef std::list<CachedResult> ResultList;
+	ResultList                mResultCache; // most recently shown first
+	std::map<size_t, ResultList::iterator> mResultIndex;
+	size_t                    mResultCacheSize = 0;
+
 };
\ No newline at end of file
@@ -0,0 +1,1069 @@
+/* picoc batch evaluator - runs main() for a group of samples at once. Each
+ * instruction of the bytecode compile.c makes is done for all of them in a
+ * loop over the lanes, which the C compiler turns into SIMD instructions, so
+ * the cost of working out what to do is shared by the whole group. Lanes which
+ * branch differently each keep their own place in the code. The ones furthest
+ * behind go first with the others masked out, so they come together again
+ * after an if or a loop.
+ *
+ * Only what can be done the same as the virtual machine does it runs here:
+ * functions of ints and doubles which don't change global variables and only
+ * call each other and the math library. Anything else, and any group which
+ * goes wrong, like with an error, is run again one sample at a time */
+
+#include "picoc.h"
+#include "interpreter.h"
+
+/* a variable or a value on the stack, for every lane */
+union BatchSlot
+{
+    double FP[BATCH_LANES];
+    int Integer[BATCH_LANES];
+};
+
+/* what's worked out once for each function it runs */
+struct BatchCode
+{
+    int Usable;                     /* FALSE if it has to run one sample at a time */
+    int StackSize;                  /* the most values on its stack */
+    short *Depth;                   /* the number of values on the stack before each instruction, -1 if it can't be reached */
+    unsigned char *Types;           /* their types, VM_STACK_MAX for each instruction */
+};
+
+struct BatchProgram
+{
+    Picoc *pc;
+    struct FuncDef *Main;
+    int NumArgs;
+    union BatchSlot Memory[BATCH_MEMORY];   /* the variables and stacks of the functions running */
+    int MemoryUsed;
+};
+
+/* the math library's functions of doubles, done for every lane. The loops
+ * are left simple enough for the compiler to use its vector math library.
+ * They all take three arguments, those a function hasn't got are left unnamed */
+typedef void (*BatchMathKernel)(double *Result, const double *A, const double *B, const double *C);
+
+#define BATCH_MATH_LOOP(Expression) \
+    { \
+        int Lane; \
+        for (Lane = 0; Lane < BATCH_LANES; Lane++) \
+            Result[Lane] = Expression; \
+    }
+
+#define BATCH_MATH1(Name, Expression) \
+    static void Name(double *Result, const double *A, const double *, const double *) \
+    BATCH_MATH_LOOP(Expression)
+
+#define BATCH_MATH2(Name, Expression) \
+    static void Name(double *Result, const double *A, const double *B, const double *) \
+    BATCH_MATH_LOOP(Expression)
+
+#define BATCH_MATH3(Name, Expression) \
+    static void Name(double *Result, const double *A, const double *B, const double *C) \
+    BATCH_MATH_LOOP(Expression)
+
+BATCH_MATH1(BatchAcos, acos(A[Lane]))
+BATCH_MATH1(BatchAsin, asin(A[Lane]))
+BATCH_MATH1(BatchAtan, atan(A[Lane]))
+BATCH_MATH2(BatchAtan2, atan2(A[Lane], B[Lane]))
+BATCH_MATH1(BatchCeil, ceil(A[Lane]))
+BATCH_MATH1(BatchCos, cos(A[Lane]))
+BATCH_MATH1(BatchCosh, cosh(A[Lane]))
+BATCH_MATH1(BatchExp, exp(A[Lane]))
+BATCH_MATH1(BatchFabs, fabs(A[Lane]))
+BATCH_MATH1(BatchFloor, floor(A[Lane]))
+BATCH_MATH2(BatchFmod, fmod(A[Lane], B[Lane]))
+BATCH_MATH1(BatchLog, log(A[Lane]))
+BATCH_MATH1(BatchLog10, log10(A[Lane]))
+BATCH_MATH2(BatchPow, pow(A[Lane], B[Lane]))
+BATCH_MATH1(BatchRound, ceil(A[Lane] - 0.5))
+BATCH_MATH1(BatchSin, sin(A[Lane]))
+BATCH_MATH1(BatchSinh, sinh(A[Lane]))
+BATCH_MATH1(BatchSqrt, sqrt(A[Lane]))
+BATCH_MATH1(BatchTan, tan(A[Lane]))
+BATCH_MATH1(BatchTanh, tanh(A[Lane]))
+BATCH_MATH2(BatchMin, (A[Lane] < B[Lane]) ? A[Lane] : B[Lane])
+BATCH_MATH2(BatchMax, (A[Lane] > B[Lane]) ? A[Lane] : B[Lane])
+BATCH_MATH3(BatchClamp, (A[Lane] < B[Lane]) ? B[Lane] : (A[Lane] > C[Lane]) ? C[Lane] : A[Lane])
+BATCH_MATH3(BatchLerp, (1.0 - A[Lane]) * B[Lane] + A[Lane] * C[Lane])
+
+struct BatchMathFunction
+{
+    const char *Name;
+    BatchMathKernel Kernel;
+};
+
+static struct BatchMathFunction BatchMathFunctions[] =
+{
+    { "acos",   BatchAcos },
+    { "asin",   BatchAsin },
+    { "atan",   BatchAtan },
+    { "atan2",  BatchAtan2 },
+    { "ceil",   BatchCeil },
+    { "cos",    BatchCos },
+    { "cosh",   BatchCosh },
+    { "exp",    BatchExp },
+    { "fabs",   BatchFabs },
+    { "floor",  BatchFloor },
+    { "fmod",   BatchFmod },
+    { "log",    BatchLog },
+    { "log10",  BatchLog10 },
+    { "pow",    BatchPow },
+    { "round",  BatchRound },
+    { "sin",    BatchSin },
+    { "sinh",   BatchSinh },
+    { "sqrt",   BatchSqrt },
+    { "tan",    BatchTan },
+    { "tanh",   BatchTanh },
+    { "min",    BatchMin },
+    { "max",    BatchMax },
+    { "clamp",  BatchClamp },
+    { "lerp",   BatchLerp },
+    { NULL,     NULL }
+};
+
+/* the kernel of the math library's function a call is to, or NULL if it's to something else */
+static BatchMathKernel BatchFindMath(struct FuncDef *Callee)
+{
+#if !defined(BUILTIN_MINI_STDLIB) && !defined(NO_FP)
+    struct LibraryFunction *Library;
+    struct BatchMathFunction *Math;
+
+    if (Callee->Intrinsic == NULL)
+        return NULL;
+
+    for (Library = &MathFunctions[0]; Library->Func != NULL; Library++)
+    {
+        if (Library->Func != Callee->Intrinsic)
+            continue;
+
+        /* the prototypes are "double name(...);" */
+        for (Math = &BatchMathFunctions[0]; Math->Name != NULL; Math++)
+        {
+            int Length = (int)strlen(Math->Name);
+
+            if (strncmp(&Library->Prototype[7], Math->Name, Length) == 0 && Library->Prototype[7 + Length] == '(')
+                return Math->Kernel;
+        }
+    }
+#endif
+    return NULL;
+}
+
+/* the operators the virtual machine can do on ints and on doubles, the others fail in it */
+static int BatchIntOperator(enum LexToken Op)
+{
+    switch (Op)
+    {
+        case TokenLogicalOr: case TokenLogicalAnd: case TokenArithmeticOr: case TokenArithmeticExor:
+        case TokenAmpersand: case TokenEqual: case TokenNotEqual: case TokenLessThan:
+        case TokenGreaterThan: case TokenLessEqual: case TokenGreaterEqual: case TokenShiftLeft:
+        case TokenShiftRight: case TokenPlus: case TokenMinus: case TokenAsterisk:
+        case TokenSlash: case TokenModulus:
+            return TRUE;
+
+        default:
+            return FALSE;
+    }
+}
+
+static int BatchFPOperator(enum LexToken Op)
+{
+    switch (Op)
+    {
+        case TokenEqual: case TokenNotEqual: case TokenLessThan: case TokenGreaterThan:
+        case TokenLessEqual: case TokenGreaterEqual:
+        case TokenPlus: case TokenMinus: case TokenAsterisk: case TokenSlash:
+            return TRUE;
+
+        default:
+            return FALSE;
+    }
+}
+
+static int BatchIntAssign(enum LexToken Op)
+{
+    switch (Op)
+    {
+        case TokenAssign: case TokenAddAssign: case TokenSubtractAssign: case TokenMultiplyAssign:
+        case TokenDivideAssign: case TokenModulusAssign: case TokenShiftLeftAssign: case TokenShiftRightAssign:
+        case TokenArithmeticAndAssign: case TokenArithmeticOrAssign: case TokenArithmeticExorAssign:
+            return TRUE;
+
+        default:
+            return FALSE;
+    }
+}
+
+static int BatchFPAssign(enum LexToken Op)
+{
+    switch (Op)
+    {
+        case TokenAssign: case TokenAddAssign: case TokenSubtractAssign: case TokenMultiplyAssign:
+        case TokenDivideAssign:
+            return TRUE;
+
+        default:
+            return FALSE;
+    }
+}
+
+/* the stack before an instruction reached from another one, which has to be the same whichever way it's reached */
+static int BatchReach(struct VmFunction *Func, struct BatchCode *Code, int PC, int Depth, const unsigned char *Types)
+{
+    if (PC < 0 || PC >= Func->CodeSize)
+        return FALSE;
+
+    if (Code->Depth[PC] == -1)
+    {
+        Code->Depth[PC] = (short)Depth;
+        memcpy((void *)&Code->Types[PC * VM_STACK_MAX], (void *)Types, Depth);
+        return TRUE;
+    }
+
+    return Code->Depth[PC] == Depth && memcmp((void *)&Code->Types[PC * VM_STACK_MAX], (void *)Types, Depth) == 0;
+}
+
+static int BatchCheck(Picoc *pc, struct VmFunction *Func);
+
+/* work out the types on the stack before each instruction and whether a group
+ * can do every one of them the way the virtual machine would */
+static int BatchCheckCode(Picoc *pc, struct VmFunction *Func, struct BatchCode *Code)
+{
+    unsigned char Types[VM_STACK_MAX + 1];
+    int Depth = 0;
+    int PC;
+
+    for (PC = 0; PC < Func->CodeSize; PC++)
+        Code->Depth[PC] = -1;
+
+    Code->Depth[0] = 0;
+    for (PC = 0; PC < Func->CodeSize; PC++)
+    {
+        const struct VmInstruction *Ins = &Func->Code[PC];
+        enum LexToken Op = (enum LexToken)Ins->Token;
+        unsigned char Bottom, Top;
+        struct FuncDef *Callee;
+        int Count;
+
+        if (Depth != -1 && !BatchReach(Func, Code, PC, Depth, Types))
+            return FALSE;
+
+        Depth = Code->Depth[PC];
+        if (Depth == -1)
+            continue;
+
+        memcpy((void *)Types, (void *)&Code->Types[PC * VM_STACK_MAX], Depth);
+        if (Depth + 1 > Code->StackSize)
+            Code->StackSize = Depth + 1;
+
+        switch (Ins->Op)
+        {
+            case VmOpPushInt:
+                Types[Depth++] = TypeInt;
+                break;
+
+            case VmOpPushFP:
+                Types[Depth++] = TypeFP;
+                break;
+
+            case VmOpLoad:
+                Types[Depth++] = Func->Type[Ins->Operand];
+                break;
+
+            case VmOpPrefix: case VmOpPostfix:
+                /* global variables keep their value between samples, so the lanes can't change them */
+                if (Ins->Operand >= Func->NumLocals)
+                    return FALSE;
+
+                Types[Depth++] = Func->Type[Ins->Operand];
+                break;
+
+            case VmOpAssign: case VmOpAssignInt: case VmOpAssignFP:
+                if (Ins->Operand >= Func->NumLocals)
+                    return FALSE;
+
+                if (Ins->Op == VmOpAssignFP || (Ins->Op == VmOpAssign && (Func->Type[Ins->Operand] == TypeFP || Types[Depth-1] == TypeFP)))
+                {
+                    if (!BatchFPAssign(Op))
+                        return FALSE;
+                }
+                else if (!BatchIntAssign(Op))
+                    return FALSE;
+
+                Types[Depth-1] = Func->Type[Ins->Operand];
+                break;
+
+            case VmOpInitialise: case VmOpPop:
+                Depth--;
+                break;
+
+            case VmOpUnary:
+                if (Op != TokenMinus && Op != TokenUnaryNot && (Op != TokenUnaryExor || Types[Depth-1] == TypeFP))
+                    return FALSE;
+                break;
+
+            case VmOpInfix: case VmOpInfixInt: case VmOpInfixFP:
+                Bottom = Types[Depth-2];
+                Top = Types[Depth-1];
+                Depth--;
+                if (Bottom == TypeFP || Top == TypeFP)
+                {
+                    if (!BatchFPOperator(Op))
+                        return FALSE;
+
+                    Types[Depth-1] = (Op == TokenPlus || Op == TokenMinus || Op == TokenAsterisk || Op == TokenSlash) ? TypeFP : TypeInt;
+                }
+                else
+                {
+                    if (!BatchIntOperator(Op))
+                        return FALSE;
+
+                    Types[Depth-1] = TypeInt;
+                }
+                break;
+
+            case VmOpIntToFP:
+                Types[Depth-1] = TypeFP;
+                break;
+
+            case VmOpCast:
+                Types[Depth-1] = Ins->Token;
+                break;
+
+            case VmOpTernary:
+                /* an int or a double depending on each lane's condition isn't something a lane can hold */
+                if (Types[Depth-2] != Types[Depth-1])
+                    return FALSE;
+
+                Depth -= 2;
+                Types[Depth-1] = Types[Depth];
+                break;
+
+            case VmOpSkipIfFalse: case VmOpSkipIfTrue:
+                Types[Depth] = TypeInt;
+                if (!BatchReach(Func, Code, Ins->Operand, Depth + 1, Types))
+                    return FALSE;
+                break;
+
+            case VmOpJumpIfFalse:
+                Depth--;
+                if (!BatchReach(Func, Code, Ins->Operand, Depth, Types))
+                    return FALSE;
+                break;
+
+            case VmOpJump: case VmOpLoop:
+                if (!BatchReach(Func, Code, Ins->Operand, Depth, Types))
+                    return FALSE;
+
+                Depth = -1;
+                break;
+
+            case VmOpCall:
+                Callee = &Func->Global[Ins->Operand]->Val->FuncDef;
+                Depth -= Ins->Token;
+                if (BatchFindMath(Callee) != NULL)
+                {
+                    if (Ins->Token > 3)
+                        return FALSE;
+
+                    Types[Depth++] = TypeFP;
+                    break;
+                }
+
+                if (Callee->Compiled == NULL || Ins->Token != Callee->Compiled->NumParams || !BatchCheck(pc, Callee->Compiled))
+                    return FALSE;
+
+                if (Callee->ReturnType == &pc->FPType)
+                    Types[Depth++] = TypeFP;
+                else if (Callee->ReturnType == &pc->IntType)
+                    Types[Depth++] = TypeInt;
+                else if (Callee->ReturnType != &pc->VoidType)
+                    return FALSE;
+
+                for (Count = 0; Count < Callee->Compiled->NumParams; Count++)
+                {
+                    if (Callee->Compiled->Type[Count] != TypeInt && Callee->Compiled->Type[Count] != TypeFP)
+                        return FALSE;
+                }
+                break;
+
+            case VmOpReturn: case VmOpReturnVoid: case VmOpEnd:
+                Depth = -1;
+                break;
+
+            default:
+                return FALSE;
+        }
+    }
+
+    return TRUE;
+}
+
+/* see if a group can run a function, working it out the first time */
+static int BatchCheck(Picoc *pc, struct VmFunction *Func)
+{
+    struct BatchCode *Code = Func->Batch;
+
+    if (Code != NULL)
+        return Code->Usable;
+
+    Code = (struct BatchCode *)calloc(1, sizeof(struct BatchCode));
+    if (Code == NULL)
+        return FALSE;
+
+    /* a function calling itself finds it usable while it's checked. If it
+     * turns out not to be the call fails when it's run */
+    Func->Batch = Code;
+    Code->Usable = TRUE;
+    Code->Depth = (short *)malloc(sizeof(short) * Func->CodeSize);
+    Code->Types = (unsigned char *)malloc(VM_STACK_MAX * Func->CodeSize);
+    if (Code->Depth == NULL || Code->Types == NULL || !BatchCheckCode(pc, Func, Code))
+        Code->Usable = FALSE;
+
+    return Code->Usable;
+}
+
+void BatchFreeCode(struct VmFunction *Func)
+{
+    struct BatchCode *Code = Func->Batch;
+
+    if (Code == NULL)
+        return;
+
+    free(Code->Depth);
+    free(Code->Types);
+    free(Code);
+    Func->Batch = NULL;
+}
+
+/* a value as doubles, see VM_FP() */
+static void BatchToFP(const union BatchSlot *From, unsigned char Typ, double *To)
+{
+    int Lane;
+
+    if (Typ == TypeFP)
+    {
+        for (Lane = 0; Lane < BATCH_LANES; Lane++)
+            To[Lane] = From->FP[Lane];
+    }
+    else
+    {
+        for (Lane = 0; Lane < BATCH_LANES; Lane++)
+            To[Lane] = (double)(long)From->Integer[Lane];
+    }
+}
+
+/* a value as ints the way a double is stored in an int variable */
+static void BatchToInt(const union BatchSlot *From, unsigned char Typ, int *To)
+{
+    int Lane;
+
+    if (Typ == TypeFP)
+    {
+        for (Lane = 0; Lane < BATCH_LANES; Lane++)
+            To[Lane] = (int)(long)From->FP[Lane];
+    }
+    else
+    {
+        for (Lane = 0; Lane < BATCH_LANES; Lane++)
+            To[Lane] = From->Integer[Lane];
+    }
+}
+
+/* the truth of the operand of ?, && and ||, see VM_TRUTH() */
+static void BatchTruth(const union BatchSlot *From, unsigned char Typ, unsigned char *To)
+{
+    int Lane;
+
+    if (Typ == TypeFP)
+    {
+        for (Lane = 0; Lane < BATCH_LANES; Lane++)
+            To[Lane] = (long)From->FP[Lane] != 0;
+    }
+    else
+    {
+        for (Lane = 0; Lane < BATCH_LANES; Lane++)
+            To[Lane] = From->Integer[Lane] != 0;
+    }
+}
+
+/* store the lanes which are running the instruction. The others might still need what's there */
+static void BatchStoreFP(union BatchSlot *To, const double *Value, const unsigned char *Mask, int All)
+{
+    int Lane;
+
+    if (All)
+    {
+        for (Lane = 0; Lane < BATCH_LANES; Lane++)
+            To->FP[Lane] = Value[Lane];
+    }
+    else
+    {
+        for (Lane = 0; Lane < BATCH_LANES; Lane++)
+            To->FP[Lane] = Mask[Lane] ? Value[Lane] : To->FP[Lane];
+    }
+}
+
+static void BatchStoreInt(union BatchSlot *To, const int *Value, const unsigned char *Mask, int All)
+{
+    int Lane;
+
+    if (All)
+    {
+        for (Lane = 0; Lane < BATCH_LANES; Lane++)
+            To->Integer[Lane] = Value[Lane];
+    }
+    else
+    {
+        for (Lane = 0; Lane < BATCH_LANES; Lane++)
+            To->Integer[Lane] = Mask[Lane] ? Value[Lane] : To->Integer[Lane];
+    }
+}
+
+static void BatchStore(union BatchSlot *To, unsigned char Typ, const union BatchSlot *Value, const unsigned char *Mask, int All)
+{
+    if (Typ == TypeFP)
+        BatchStoreFP(To, Value->FP, Mask, All);
+    else
+        BatchStoreInt(To, Value->Integer, Mask, All);
+}
+
+/* an infix operator on doubles, see VmInfixFP(). Returns the type of the result */
+static unsigned char BatchInfixFP(enum LexToken Op, const double *Bottom, const double *Top, union BatchSlot *Result)
+{
+    int Lane;
+
+    switch (Op)
+    {
+        case TokenEqual:        for (Lane = 0; Lane < BATCH_LANES; Lane++) Result->Integer[Lane] = Bottom[Lane] == Top[Lane]; return TypeInt;
+        case TokenNotEqual:     for (Lane = 0; Lane < BATCH_LANES; Lane++) Result->Integer[Lane] = Bottom[Lane] != Top[Lane]; return TypeInt;
+        case TokenLessThan:     for (Lane = 0; Lane < BATCH_LANES; Lane++) Result->Integer[Lane] = Bottom[Lane] < Top[Lane]; return TypeInt;
+        case TokenGreaterThan:  for (Lane = 0; Lane < BATCH_LANES; Lane++) Result->Integer[Lane] = Bottom[Lane] > Top[Lane]; return TypeInt;
+        case TokenLessEqual:    for (Lane = 0; Lane < BATCH_LANES; Lane++) Result->Integer[Lane] = Bottom[Lane] <= Top[Lane]; return TypeInt;
+        case TokenGreaterEqual: for (Lane = 0; Lane < BATCH_LANES; Lane++) Result->Integer[Lane] = Bottom[Lane] >= Top[Lane]; return TypeInt;
+        case TokenPlus:         for (Lane = 0; Lane < BATCH_LANES; Lane++) Result->FP[Lane] = Bottom[Lane] + Top[Lane]; return TypeFP;
+        case TokenMinus:        for (Lane = 0; Lane < BATCH_LANES; Lane++) Result->FP[Lane] = Bottom[Lane] - Top[Lane]; return TypeFP;
+        case TokenAsterisk:     for (Lane = 0; Lane < BATCH_LANES; Lane++) Result->FP[Lane] = Bottom[Lane] * Top[Lane]; return TypeFP;
+        default:                for (Lane = 0; Lane < BATCH_LANES; Lane++) Result->FP[Lane] = Bottom[Lane] / Top[Lane]; return TypeFP;
+    }
+}
+
+/* an infix operator on ints, see VmInfixInt(). Dividing by zero in a lane
+ * which is running fails the group, the others aren't worked out at all */
+static int BatchInfixInt(enum LexToken Op, const int *Bottom, const int *Top, const unsigned char *Mask, int *Result)
+{
+    int Lane;
+
+    switch (Op)
+    {
+        case TokenLogicalOr:        for (Lane = 0; Lane < BATCH_LANES; Lane++) Result[Lane] = (long)Bottom[Lane] || (long)Top[Lane]; break;
+        case TokenLogicalAnd:       for (Lane = 0; Lane < BATCH_LANES; Lane++) Result[Lane] = (long)Bottom[Lane] && (long)Top[Lane]; break;
+        case TokenArithmeticOr:     for (Lane = 0; Lane < BATCH_LANES; Lane++) Result[Lane] = (int)((long)Bottom[Lane] | (long)Top[Lane]); break;
+        case TokenArithmeticExor:   for (Lane = 0; Lane < BATCH_LANES; Lane++) Result[Lane] = (int)((long)Bottom[Lane] ^ (long)Top[Lane]); break;
+        case TokenAmpersand:        for (Lane = 0; Lane < BATCH_LANES; Lane++) Result[Lane] = (int)((long)Bottom[Lane] & (long)Top[Lane]); break;
+        case TokenEqual:            for (Lane = 0; Lane < BATCH_LANES; Lane++) Result[Lane] = Bottom[Lane] == Top[Lane]; break;
+        case TokenNotEqual:         for (Lane = 0; Lane < BATCH_LANES; Lane++) Result[Lane] = Bottom[Lane] != Top[Lane]; break;
+        case TokenLessThan:         for (Lane = 0; Lane < BATCH_LANES; Lane++) Result[Lane] = Bottom[Lane] < Top[Lane]; break;
+        case TokenGreaterThan:      for (Lane = 0; Lane < BATCH_LANES; Lane++) Result[Lane] = Bottom[Lane] > Top[Lane]; break;
+        case TokenLessEqual:        for (Lane = 0; Lane < BATCH_LANES; Lane++) Result[Lane] = Bottom[Lane] <= Top[Lane]; break;
+        case TokenGreaterEqual:     for (Lane = 0; Lane < BATCH_LANES; Lane++) Result[Lane] = Bottom[Lane] >= Top[Lane]; break;
+        case TokenPlus:             for (Lane = 0; Lane < BATCH_LANES; Lane++) Result[Lane] = (int)((long)Bottom[Lane] + (long)Top[Lane]); break;
+        case TokenMinus:            for (Lane = 0; Lane < BATCH_LANES; Lane++) Result[Lane] = (int)((long)Bottom[Lane] - (long)Top[Lane]); break;
+        case TokenAsterisk:         for (Lane = 0; Lane < BATCH_LANES; Lane++) Result[Lane] = (int)((long)Bottom[Lane] * (long)Top[Lane]); break;
+
+        default:
+            /* shifts and divisions only for the lanes running, the others may hold anything */
+            for (Lane = 0; Lane < BATCH_LANES; Lane++)
+            {
+                long BottomInt = Bottom[Lane];
+                long TopInt = Top[Lane];
+
+                if (!Mask[Lane])
+                    continue;
+
+                if ((Op == TokenSlash || Op == TokenModulus) && TopInt == 0)
+                    return FALSE;
+
+                switch (Op)
+                {
+                    case TokenShiftLeft:    Result[Lane] = (int)(BottomInt << TopInt); break;
+                    case TokenShiftRight:   Result[Lane] = (int)(BottomInt >> TopInt); break;
+                    case TokenSlash:        Result[Lane] = (int)(BottomInt / TopInt); break;
+                    default:                Result[Lane] = (int)(BottomInt % TopInt); break;
+                }
+            }
+            break;
+    }
+
+    return TRUE;
+}
+
+/* the infix operator an assignment operator does */
+static enum LexToken BatchAssignOperator(enum LexToken Op)
+{
+    switch (Op)
+    {
+        case TokenAddAssign:            return TokenPlus;
+        case TokenSubtractAssign:       return TokenMinus;
+        case TokenMultiplyAssign:       return TokenAsterisk;
+        case TokenDivideAssign:         return TokenSlash;
+        case TokenModulusAssign:        return TokenModulus;
+        case TokenShiftLeftAssign:      return TokenShiftLeft;
+        case TokenShiftRightAssign:     return TokenShiftRight;
+        case TokenArithmeticAndAssign:  return TokenAmpersand;
+        case TokenArithmeticOrAssign:   return TokenArithmeticOr;
+        default:                        return TokenArithmeticExor;
+    }
+}
+
+static union BatchSlot *BatchAllocFrame(struct BatchProgram *Program, int Size)
+{
+    union BatchSlot *Frame;
+
+    if (Program->MemoryUsed + Size > BATCH_MEMORY)
+        return NULL;
+
+    Frame = &Program->Memory[Program->MemoryUsed];
+    Program->MemoryUsed += Size;
+    return Frame;
+}
+
+/* run a function for the lanes in Live with its parameters in Local, which has
+ * room for its stack after the variables. What each lane returns is left in
+ * Result as the function's return type. Returns FALSE if the group has to be
+ * run one sample at a time instead */
+static int BatchExecute(struct BatchProgram *Program, struct VmFunction *Func, struct FuncDef *Def, union BatchSlot *Local, const unsigned char *Live, union BatchSlot *Result)
+{
+    Picoc *pc = Program->pc;
+    struct BatchCode *Code = Func->Batch;
+    union BatchSlot *Stack = &Local[Func->NumLocals];
+    unsigned char Returns = (Def->ReturnType == &pc->FPType) ? TypeFP : TypeInt;
+    unsigned char Running[BATCH_LANES];
+    unsigned char Mask[BATCH_LANES];
+    unsigned char Truth[BATCH_LANES];
+    int PCs[BATCH_LANES];
+    union BatchSlot Value;
+    double Left[BATCH_LANES];
+    double Right[BATCH_LANES];
+    int Lane, Count;
+
+    /* the rest start at 0 like a newly defined variable */
+    memset((void *)&Local[Func->NumParams], '\0', sizeof(union BatchSlot) * (Func->NumLocals - Func->NumParams));
+    for (Lane = 0; Lane < BATCH_LANES; Lane++)
+    {
+        Running[Lane] = Live[Lane];
+        PCs[Lane] = 0;
+    }
+
+    for (;;)
+    {
+        const struct VmInstruction *Ins;
+        const unsigned char *Types;
+        enum LexToken Op;
+        union BatchSlot *Var;
+        int PC = Func->CodeSize;
+        int All = TRUE;
+        int Depth;
+
+        /* the lanes furthest behind go next */
+        for (Lane = 0; Lane < BATCH_LANES; Lane++)
+        {
+            if (Running[Lane] && PCs[Lane] < PC)
+                PC = PCs[Lane];
+        }
+
+        if (PC == Func->CodeSize)
+            return TRUE;
+
+        for (Lane = 0; Lane < BATCH_LANES; Lane++)
+        {
+            Mask[Lane] = Running[Lane] && PCs[Lane] == PC;
+            if (!Mask[Lane])
+                All = FALSE;
+        }
+
+        Ins = &Func->Code[PC];
+        Op = (enum LexToken)Ins->Token;
+        Depth = Code->Depth[PC];
+        Types = &Code->Types[PC * VM_STACK_MAX];
+        Var = (Ins->Operand < Func->NumLocals) ? &Local[Ins->Operand] : NULL;
+        switch (Ins->Op)
+        {
+            case VmOpPushInt:
+                for (Lane = 0; Lane < BATCH_LANES; Lane++)
+                    Value.Integer[Lane] = Ins->Operand;
+
+                BatchStoreInt(&Stack[Depth], Value.Integer, Mask, All);
+                break;
+
+            case VmOpPushFP:
+                for (Lane = 0; Lane < BATCH_LANES; Lane++)
+                    Value.FP[Lane] = Func->Constant[Ins->Operand];
+
+                BatchStoreFP(&Stack[Depth], Value.FP, Mask, All);
+                break;
+
+            case VmOpLoad:
+                if (Var != NULL)
+                    BatchStore(&Stack[Depth], Func->Type[Ins->Operand], Var, Mask, All);
+                else
+                {
+                    /* a global variable, which is the same for every lane */
+                    union VmNumber *Global = (union VmNumber *)Func->Global[Ins->Operand - Func->NumLocals]->Val;
+
+                    for (Lane = 0; Lane < BATCH_LANES; Lane++)
+                    {
+                        if (Func->Type[Ins->Operand] == TypeFP)
+                            Value.FP[Lane] = Global->FP;
+                        else
+                            Value.Integer[Lane] = Global->Integer;
+                    }
+
+                    BatchStore(&Stack[Depth], Func->Type[Ins->Operand], &Value, Mask, All);
+                }
+                break;
+
+            case VmOpAssign: case VmOpAssignInt: case VmOpAssignFP:
+                if (Ins->Op == VmOpAssignFP || (Ins->Op == VmOpAssign && (Func->Type[Ins->Operand] == TypeFP || Types[Depth-1] == TypeFP)))
+                {
+                    /* see VmAssign() */
+                    BatchToFP(&Stack[Depth-1], Types[Depth-1], Right);
+                    if (Op == TokenAssign)
+                        memcpy((void *)Value.FP, (void *)Right, sizeof(Right));
+                    else
+                    {
+                        BatchToFP(Var, Func->Type[Ins->Operand], Left);
+                        BatchInfixFP(BatchAssignOperator(Op), Left, Right, &Value);
+                    }
+
+                    if (Func->Type[Ins->Operand] != TypeFP)
+                    {
+                        union BatchSlot Converted;
+
+                        BatchToInt(&Value, TypeFP, Converted.Integer);
+                        Value = Converted;
+                    }
+                }
+                else
+                {
+                    /* see VmAssignInt() */
+                    if (Op == TokenAssign)
+                        memcpy((void *)Value.Integer, (void *)Stack[Depth-1].Integer, sizeof(Value.Integer));
+                    else if (!BatchInfixInt(BatchAssignOperator(Op), Var->Integer, Stack[Depth-1].Integer, Mask, Value.Integer))
+                        return FALSE;
+                }
+
+                BatchStore(Var, Func->Type[Ins->Operand], &Value, Mask, All);
+                BatchStore(&Stack[Depth-1], Func->Type[Ins->Operand], &Value, Mask, All);
+                break;
+
+            case VmOpInitialise:
+                if (Func->Type[Ins->Operand] == TypeFP)
+                    BatchToFP(&Stack[Depth-1], Types[Depth-1], Value.FP);
+                else
+                    BatchToInt(&Stack[Depth-1], Types[Depth-1], Value.Integer);
+
+                BatchStore(Var, Func->Type[Ins->Operand], &Value, Mask, All);
+                break;
+
+            case VmOpPrefix: case VmOpPostfix:
+                /* see VmIncrement() */
+                if (Func->Type[Ins->Operand] == TypeFP)
+                {
+                    for (Lane = 0; Lane < BATCH_LANES; Lane++)
+                        Value.FP[Lane] = (Op == TokenIncrement) ? Var->FP[Lane] + 1.0 : Var->FP[Lane] - 1.0;
+
+                    BatchStoreFP(Var, Value.FP, Mask, All);
+                    BatchStoreFP(&Stack[Depth], Value.FP, Mask, All);
+                }
+                else
+                {
+                    union BatchSlot Old = *Var;
+
+                    for (Lane = 0; Lane < BATCH_LANES; Lane++)
+                        Value.Integer[Lane] = (int)((Op == TokenIncrement) ? (long)Old.Integer[Lane] + 1 : (long)Old.Integer[Lane] - 1);
+
+                    BatchStoreInt(Var, Value.Integer, Mask, All);
+                    BatchStoreInt(&Stack[Depth], (Ins->Op == VmOpPostfix) ? Old.Integer : Value.Integer, Mask, All);
+                }
+                break;
+
+            case VmOpUnary:
+                /* see VmUnary() */
+                if (Types[Depth-1] == TypeFP)
+                {
+                    for (Lane = 0; Lane < BATCH_LANES; Lane++)
+                        Value.FP[Lane] = (Op == TokenMinus) ? -Stack[Depth-1].FP[Lane] : !Stack[Depth-1].FP[Lane];
+                }
+                else
+                {
+                    for (Lane = 0; Lane < BATCH_LANES; Lane++)
+                    {
+                        long TopInt = Stack[Depth-1].Integer[Lane];
+
+                        Value.Integer[Lane] = (int)((Op == TokenMinus) ? -TopInt : (Op == TokenUnaryNot) ? !TopInt : ~TopInt);
+                    }
+                }
+
+                BatchStore(&Stack[Depth-1], Types[Depth-1], &Value, Mask, All);
+                break;
+
+            case VmOpInfix: case VmOpInfixInt: case VmOpInfixFP:
+                if (Types[Depth-2] == TypeFP || Types[Depth-1] == TypeFP)
+                {
+                    unsigned char Typ;
+
+                    BatchToFP(&Stack[Depth-2], Types[Depth-2], Left);
+                    BatchToFP(&Stack[Depth-1], Types[Depth-1], Right);
+                    Typ = BatchInfixFP(Op, Left, Right, &Value);
+                    BatchStore(&Stack[Depth-2], Typ, &Value, Mask, All);
+                }
+                else
+                {
+                    if (!BatchInfixInt(Op, Stack[Depth-2].Integer, Stack[Depth-1].Integer, Mask, Value.Integer))
+                        return FALSE;
+
+                    BatchStoreInt(&Stack[Depth-2], Value.Integer, Mask, All);
+                }
+                break;
+
+            case VmOpIntToFP:
+                for (Lane = 0; Lane < BATCH_LANES; Lane++)
+                    Value.FP[Lane] = (double)Stack[Depth-1].Integer[Lane];
+
+                BatchStoreFP(&Stack[Depth-1], Value.FP, Mask, All);
+                break;
+
+            case VmOpCast:
+                if (Ins->Token == TypeFP)
+                    BatchToFP(&Stack[Depth-1], Types[Depth-1], Value.FP);
+                else
+                    BatchToInt(&Stack[Depth-1], Types[Depth-1], Value.Integer);
+
+                BatchStore(&Stack[Depth-1], Ins->Token, &Value, Mask, All);
+                break;
+
+            case VmOpTernary:
+                BatchTruth(&Stack[Depth-3], Types[Depth-3], Truth);
+                if (Types[Depth-1] == TypeFP)
+                {
+                    for (Lane = 0; Lane < BATCH_LANES; Lane++)
+                        Value.FP[Lane] = Truth[Lane] ? Stack[Depth-2].FP[Lane] : Stack[Depth-1].FP[Lane];
+                }
+                else
+                {
+                    for (Lane = 0; Lane < BATCH_LANES; Lane++)
+                        Value.Integer[Lane] = Truth[Lane] ? Stack[Depth-2].Integer[Lane] : Stack[Depth-1].Integer[Lane];
+                }
+
+                BatchStore(&Stack[Depth-3], Types[Depth-1], &Value, Mask, All);
+                break;
+
+            case VmOpSkipIfFalse: case VmOpSkipIfTrue:
+                /* the lanes which skip the other side push 0 for it, see VmExecute() */
+                BatchTruth(&Stack[Depth-1], Types[Depth-1], Truth);
+                for (Lane = 0; Lane < BATCH_LANES; Lane++)
+                {
+                    if (!Mask[Lane])
+                        continue;
+
+                    if (Truth[Lane] == (Ins->Op == VmOpSkipIfTrue))
+                    {
+                        Stack[Depth].Integer[Lane] = 0;
+                        PCs[Lane] = Ins->Operand;
+                    }
+                    else
+                        PCs[Lane] = PC + 1;
+                }
+                continue;
+
+            case VmOpJump:
+                for (Lane = 0; Lane < BATCH_LANES; Lane++)
+                {
+                    if (Mask[Lane])
+                        PCs[Lane] = Ins->Operand;
+                }
+                continue;
+
+            case VmOpJumpIfFalse:
+                /* see VM_CONDITION() */
+                BatchToInt(&Stack[Depth-1], Types[Depth-1], Value.Integer);
+                for (Lane = 0; Lane < BATCH_LANES; Lane++)
+                {
+                    if (Mask[Lane])
+                        PCs[Lane] = (Value.Integer[Lane] == 0) ? Ins->Operand : PC + 1;
+                }
+                continue;
+
+            case VmOpLoop:
+                /* let the samples being run one at a time say it's been cancelled */
+                if (pc->Cancel != NULL && pc->Cancel->load(std::memory_order_relaxed))
+                    return FALSE;
+
+                for (Lane = 0; Lane < BATCH_LANES; Lane++)
+                {
+                    if (Mask[Lane])
+                        PCs[Lane] = Ins->Operand;
+                }
+                continue;
+
+            case VmOpCall:
+            {
+                struct FuncDef *Callee = &Func->Global[Ins->Operand]->Val->FuncDef;
+                BatchMathKernel Kernel = BatchFindMath(Callee);
+                int First = Depth - Ins->Token;
+
+                if (Kernel != NULL)
+                {
+                    double Arg[3][BATCH_LANES];
+
+                    for (Count = 0; Count < Ins->Token; Count++)
+                        BatchToFP(&Stack[First + Count], Types[First + Count], Arg[Count]);
+
+                    Kernel(Value.FP, Arg[0], Arg[1], Arg[2]);
+                    BatchStoreFP(&Stack[First], Value.FP, Mask, All);
+                }
+                else
+                {
+                    struct VmFunction *CalleeFunc = Callee->Compiled;
+                    union BatchSlot *Frame;
+                    int Ok;
+
+                    if (!CalleeFunc->Batch->Usable)
+                        return FALSE;
+
+                    /* the callee's variables and stack go after the caller's, running out fails the group like picoc's stack would */
+                    Frame = BatchAllocFrame(Program, CalleeFunc->NumLocals + CalleeFunc->Batch->StackSize + 1);
+                    if (Frame == NULL)
+                        return FALSE;
+
+                    /* see VmCallCompiled() */
+                    for (Count = 0; Count < Ins->Token; Count++)
+                    {
+                        if (CalleeFunc->Type[Count] == TypeFP)
+                            BatchToFP(&Stack[First + Count], Types[First + Count], Frame[Count].FP);
+                        else
+                            BatchToInt(&Stack[First + Count], Types[First + Count], Frame[Count].Integer);
+                    }
+
+                    Ok = BatchExecute(Program, CalleeFunc, Callee, Frame, Mask, &Frame[CalleeFunc->NumLocals + CalleeFunc->Batch->StackSize]);
+                    if (Ok && Callee->ReturnType != &pc->VoidType)
+                        BatchStore(&Stack[First], (Callee->ReturnType == &pc->FPType) ? TypeFP : TypeInt, &Frame[CalleeFunc->NumLocals + CalleeFunc->Batch->StackSize], Mask, All);
+
+                    Program->MemoryUsed -= CalleeFunc->NumLocals + CalleeFunc->Batch->StackSize + 1;
+                    if (!Ok)
+                        return FALSE;
+                }
+                break;
+            }
+
+            case VmOpPop:
+                break;
+
+            case VmOpReturn:
+                if (Returns == TypeFP)
+                    BatchToFP(&Stack[Depth-1], Types[Depth-1], Value.FP);
+                else
+                    BatchToInt(&Stack[Depth-1], Types[Depth-1], Value.Integer);
+
+                BatchStore(Result, Returns, &Value, Mask, All);
+                for (Lane = 0; Lane < BATCH_LANES; Lane++)
+                {
+                    if (Mask[Lane])
+                        Running[Lane] = FALSE;
+                }
+                continue;
+
+            case VmOpReturnVoid: case VmOpEnd:
+                /* falling off the end of a function which returns something is an error */
+                if (Ins->Op == VmOpEnd && Def->ReturnType != &pc->VoidType)
+                    return FALSE;
+
+                for (Lane = 0; Lane < BATCH_LANES; Lane++)
+                {
+                    if (Mask[Lane])
+                        Running[Lane] = FALSE;
+                }
+                continue;
+        }
+
+        for (Lane = 0; Lane < BATCH_LANES; Lane++)
+        {
+            if (Mask[Lane])
+                PCs[Lane] = PC + 1;
+        }
+    }
+}
+
+/* get ready to run main() in groups, returns NULL if it can only be run one sample at a time */
+struct BatchProgram *BatchPrepare(Picoc *pc, int NumArgs)
+{
+    struct BatchProgram *Program;
+    struct Value *FuncValue = NULL;
+    struct VmFunction *Main;
+    int Count;
+
+    /* NOBATCH in the environment runs every sample on its own */
+    if (getenv("NOBATCH") != NULL)
+        return NULL;
+
+    VariableGet(pc, NULL, TableStrRegister(pc, "main"), &FuncValue);
+    Main = FuncValue->Val->FuncDef.Compiled;
+    if (Main == NULL || Main->NumParams != NumArgs || !BatchCheck(pc, Main))
+        return NULL;
+
+    for (Count = 0; Count < NumArgs; Count++)
+    {
+        if (Main->Type[Count] != TypeFP)
+            return NULL;
+    }
+
+    Program = (struct BatchProgram *)malloc(sizeof(struct BatchProgram));
+    if (Program == NULL)
+        return NULL;
+
+    Program->pc = pc;
+    Program->Main = &FuncValue->Val->FuncDef;
+    Program->NumArgs = NumArgs;
+    Program->MemoryUsed = 0;
+    return Program;
+}
+
+/* run main() for Count samples, at most BATCH_LANES, with NumArgs doubles for
+ * each in Args. Returns FALSE if they have to be run one at a time instead */
+int BatchRun(struct BatchProgram *Program, const double *Args, int Count, double *Results)
+{
+    struct VmFunction *Main = Program->Main->Compiled;
+    unsigned char Live[BATCH_LANES];
+    union BatchSlot *Frame;
+    union BatchSlot Result;
+    int Lane, Arg, Ok;
+
+    Program->MemoryUsed = 0;
+    Frame = BatchAllocFrame(Program, Main->NumLocals + Main->Batch->StackSize);
+    if (Frame == NULL || !Main->Batch->Usable)
+        return FALSE;
+
+    for (Lane = 0; Lane < BATCH_LANES; Lane++)
+    {
+        Live[Lane] = Lane < Count;
+        for (Arg = 0; Arg < Program->NumArgs; Arg++)
+            Frame[Arg].FP[Lane] = (Lane < Count) ? Args[Lane * Program->NumArgs + Arg] : 0.0;
+    }
+
+    Ok = BatchExecute(Program, Main, Program->Main, Frame, Live, &Result);
+    if (Ok)
+    {
+        for (Lane = 0; Lane < Count; Lane++)
+            Results[Lane] = Result.FP[Lane];
+    }
+
+    return Ok;
+}
+
+void BatchFree(struct BatchProgram *Program)
+{
+    free(Program);
+}
@@ -0,0 +1,68 @@
+// Times main() of a script over samples spread on an interval, the way the plotter evaluates a curve:
+// one CompiledProgram, fed in batches of 64 samples. Prints the time, a checksum of the results to
+// compare runs with, and how each function ended up running. See README for building and running it.
+//
+//     bench script.c [samples [left right]]
+
+#include "picoc.h"
+
+#include <chrono>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+int main(int argc, char** argv)
+{
+	if (argc < 2)
+	{
+		fprintf(stderr, "usage: %s script.c [samples [left right]]\n", argv[0]);
+		return 2;
+	}
+
+	std::ifstream file(argv[1]);
+	if (!file)
+	{
+		fprintf(stderr, "can't read %s\n", argv[1]);
+		return 2;
+	}
+	std::stringstream source;
+	source << file.rdbuf();
+
+	int numSample = (argc > 2) ? atoi(argv[2]) : 100000;
+	double left = (argc > 4) ? atof(argv[3]) : -10.0;
+	double right = (argc > 4) ? atof(argv[4]) : 10.0;
+
+	std::vector<double> inputs(numSample);
+	std::vector<double> outputs(numSample);
+	for (int i = 0; i < numSample; i++)
+	{
+		inputs[i] = left + (right - left) * i / numSample;
+	}
+
+	const int batchSize = 64;
+	char errorBuffer[ERROR_BUFFER_SIZE];
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+	CompiledProgram program(source.str().c_str(), 1);
+	for (int first = 0; first < numSample; first += batchSize)
+	{
+		int count = (numSample - first < batchSize) ? numSample - first : batchSize;
+		int failed = program.callBatch(&inputs[first], &outputs[first], count, errorBuffer);
+		if (failed >= 0)
+		{
+			fprintf(stderr, "sample %d failed: %s\n", first + failed, errorBuffer);
+			return 1;
+		}
+	}
+	double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+
+	double checksum = 0.0;
+	for (int i = 0; i < numSample; i++)
+	{
+		checksum += outputs[i];
+	}
+
+	printf("%s: %d samples in %.0f ms, checksum %.17g\n", argv[1], numSample, ms, checksum);
+	printf("%s\n", program.tierReport());
+	return 0;
+}
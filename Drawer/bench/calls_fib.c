@@ -0,0 +1,16 @@
+/* a recursive fib(), nearly all the time goes in calling it and returning,
+ * being recursive it can't be inlined */
+int fib(int n)
+{
+    if (n < 2)
+        return n;
+
+    return fib(n - 1) + fib(n - 2);
+}
+
+double main(double x)
+{
+    int n = 10 + (int)fabs(x) % 4;
+
+    return fib(n) * x;
+}
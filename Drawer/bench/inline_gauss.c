@@ -0,0 +1,15 @@
+/* a sum of gaussians built from small helpers, each call of them is worth inlining */
+double sq(double v) { return v * v; }
+double blend(double t, double a, double b) { return a + (b - a) * t; }
+double gauss(double x, double mu, double sigma) { return exp(-sq(x - mu) / (2.0 * sq(sigma))); }
+
+double main(double x)
+{
+    double y = 0.0;
+    int i;
+
+    for (i = 0; i < 32; i++)
+        y += blend(gauss(x, i * 0.25 - 4.0, 0.5), 0.0, 1.0 / (i + 1));
+
+    return y;
+}
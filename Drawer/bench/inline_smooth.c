@@ -0,0 +1,14 @@
+/* smoothstep on a clamp of its own, called with constant edges the inliner can fold in */
+double limit(double v, double a, double b) { return (v < a) ? a : ((v > b) ? b : v); }
+double smooth(double e0, double e1, double v) { double t = limit((v - e0) / (e1 - e0), 0.0, 1.0); return t * t * (3.0 - 2.0 * t); }
+
+double main(double x)
+{
+    double y = 0.0;
+    int i;
+
+    for (i = 0; i < 32; i++)
+        y += smooth(i * 0.25 - 4.0, i * 0.25 - 3.0, x) - smooth(i * 0.25 - 2.0, i * 0.25 - 1.0, x);
+
+    return y;
+}
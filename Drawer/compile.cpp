@@ -0,0 +1,2762 @@
+/* picoc compiler - turns function bodies into bytecode for the virtual machine
+ * in vm.c so calling them doesn't parse their tokens over again. Only the
+ * numeric subset of the language is compiled, a function using anything else
+ * stays with the interpreter */
+
+#include "picoc.h"
+#include "interpreter.h"
+
+#include <limits.h>
+
+#define COMPILE_MACRO_DEPTH 16              /* deepest nesting of macros inside macros */
+#define COMPILE_NODE_BLOCK 64               /* nodes allocated at once */
+#define COMPILE_FOLD_ARGS 4                 /* most arguments of a call the optimiser works out */
+#define COMPILE_INLINE_SIZE 40              /* most nodes in the body of a function which is inlined */
+#define COMPILE_INLINE_BUDGET 400           /* most nodes inlining can add to a function */
+#define COMPILE_INLINE_DEPTH 4              /* most calls inlined into each other */
+
+/* the static type of an expression */
+enum CompileType
+{
+    CompileTypeVoid,                /* a call to a void function */
+    CompileTypeInt,
+    CompileTypeFP,
+    CompileTypeEither               /* int or double depending on the values */
+};
+
+enum CompileNodeType
+{
+    /* expressions */
+    NodeInteger,                    /* Integer */
+    NodeFP,                         /* FP */
+    NodeVariable,                   /* Identifier */
+    NodeCall,                       /* Identifier(Child[0], with more arguments in Next) */
+    NodePrefix,                     /* Op Identifier */
+    NodePostfix,                    /* Identifier Op */
+    NodeUnary,                      /* Op Child[0] */
+    NodeInfix,                      /* Child[0] Op Child[1] */
+    NodeAssign,                     /* Identifier Op Child[0] */
+    NodeCast,                       /* (Type) Child[0] */
+    NodeTernary,                    /* Child[0] ? Child[1] : Child[2] */
+    NodeInline,                     /* the declarations in Child[0] then Child[1], an inlined call */
+
+    /* statements */
+    NodeExpression,                 /* Child[0]; */
+    NodeDeclare,                    /* Type Identifier = Child[0]; */
+    NodeBlock,                      /* { Child[0] with more statements in Next } */
+    NodeIf,                         /* if (Child[0]) Child[1] else Child[2] */
+    NodeWhile,                      /* while (Child[0]) Child[1] */
+    NodeDo,                         /* do Child[1] while (Child[0]); */
+    NodeFor,                        /* for (Child[2]; Child[0]; Child[3]) Child[1] */
+    NodeBreak,
+    NodeContinue,
+    NodeReturn                      /* return Child[0]; */
+};
+
+/* a node of the syntax tree of a function body */
+struct CompileNode
+{
+    enum CompileNodeType Kind;
+    enum CompileType Typ;           /* the static type of an expression */
+    enum LexToken Op;               /* the operator */
+    short int Line;                 /* where it is in the source */
+    short int CharacterPos;
+    short int EndLine;              /* where the interpreter finishes with a declaration's initialiser */
+    short int EndCharacterPos;
+    char *Identifier;               /* variable or function name */
+    int Integer;                    /* integer constant, or the scope position of a block */
+    double FP;                      /* floating point constant */
+    int InMacro;                    /* it came from expanding a macro */
+    int IsIntrinsic;                /* a call to a library function */
+    int Variable;                   /* the variable or function it uses, locals from 0 up and globals from -1 down */
+    struct CompileNode *Child[4];
+    struct CompileNode *Next;       /* next statement in a block or argument of a call */
+};
+
+struct CompileNodeBlock
+{
+    struct CompileNodeBlock *Next;
+    int Used;
+    struct CompileNode Node[COMPILE_NODE_BLOCK];
+};
+
+/* a local variable in scope while parsing */
+struct CompileLocal
+{
+    char *Identifier;
+    enum CompileType Typ;
+    int Slot;                       /* where it's kept while the function runs */
+};
+
+/* the loop we're generating code for, so break and continue know where to go */
+struct CompileLoop
+{
+    struct CompileLoop *Outer;
+    int ContinueTarget;             /* where continue goes, or -1 if it isn't there yet */
+    int BreakList;                  /* jumps waiting for the end of the loop, chained through their operands */
+    int ContinueList;               /* jumps waiting for ContinueTarget */
+};
+
+struct Compiler
+{
+    Picoc *pc;
+    struct ParseState Parser;       /* where we're at in the function body */
+    const unsigned char *Tokens;    /* the start of the function body */
+    struct FuncDef *Func;
+    jmp_buf Fail;                   /* where to go if the function can't be compiled */
+    const char *Reason;             /* why it couldn't be */
+    struct CompileNodeBlock *Nodes;
+    struct CompileLocal Local[VM_LOCALS_MAX];
+    int NumLocals;                  /* locals in scope */
+    int NumSlots;                   /* locals declared anywhere in the function */
+    unsigned char SlotType[VM_LOCALS_MAX];
+    char **Used;                    /* every identifier used so far, in order */
+    int NumUsed;
+    int UsedAlloc;
+    int BlockUsed;                  /* where the current block starts in Used */
+    int LoopDepth;
+    int MacroDepth;
+    int BracketDepth;               /* brackets open in the current expression */
+    short int LastLine;             /* the last token read */
+    short int LastCharacterPos;
+
+    /* code generation */
+    struct VmInstruction *Code;
+    struct VmPosition *Position;
+    int CodeSize;
+    int CodeAlloc;
+    double *Constant;
+    int NumConstants;
+    struct Value **Global;
+    char **Name;
+    int NumGlobals;
+    int StackDepth;
+    int StackSize;
+    struct CompileLoop *Loop;
+
+    /* optimisation */
+    unsigned char *Changed;         /* the variables a loop changes, indexed by Variable + NumGlobals */
+    int Inline;                     /* calls to small functions can be inlined */
+    int Inlined;                    /* one has been */
+    int InlineBudget;               /* nodes inlining can still add */
+    int InlineDepth;
+    struct FuncDef *InlineChain[COMPILE_INLINE_DEPTH + 1];     /* the function being compiled then the ones being inlined into it */
+};
+
+static struct CompileNode *CompileExpression(struct Compiler *C);
+static struct CompileNode *CompileFullExpression(struct Compiler *C);
+static struct CompileNode *CompileTernary(struct Compiler *C);
+static struct CompileNode *CompileUnary(struct Compiler *C);
+static struct CompileNode *CompileStatement(struct Compiler *C);
+static void CompileGenerate(struct Compiler *C, struct CompileNode *Node);
+
+/* give up on compiling this function */
+static void CompileFail(struct Compiler *C, const char *Reason)
+{
+    C->Reason = Reason;
+    longjmp(C->Fail, 1);
+}
+
+static void *CompileAlloc(struct Compiler *C, void *Mem, int Size)
+{
+    void *NewMem = realloc(Mem, Size);
+    if (NewMem == NULL)
+        CompileFail(C, "out of memory");
+
+    return NewMem;
+}
+
+/* make a node at the current source position */
+static struct CompileNode *CompileNewNode(struct Compiler *C, enum CompileNodeType Kind)
+{
+    struct CompileNode *Node;
+
+    if (C->Nodes == NULL || C->Nodes->Used == COMPILE_NODE_BLOCK)
+    {
+        struct CompileNodeBlock *Block = (struct CompileNodeBlock *)CompileAlloc(C, NULL, sizeof(struct CompileNodeBlock));
+        Block->Next = C->Nodes;
+        Block->Used = 0;
+        C->Nodes = Block;
+    }
+
+    Node = &C->Nodes->Node[C->Nodes->Used++];
+    memset((void *)Node, '\0', sizeof(*Node));
+    Node->Kind = Kind;
+    Node->Line = C->Parser.Line;
+    Node->CharacterPos = C->Parser.CharacterPos;
+    Node->InMacro = C->MacroDepth > 0;
+    return Node;
+}
+
+static enum LexToken CompilePeek(struct Compiler *C, struct Value **LexValue)
+{
+    return LexGetToken(&C->Parser, LexValue, FALSE);
+}
+
+static enum LexToken CompileGet(struct Compiler *C, struct Value **LexValue)
+{
+    enum LexToken Token = LexGetToken(&C->Parser, LexValue, TRUE);
+
+    C->LastLine = C->Parser.Line;
+    C->LastCharacterPos = C->Parser.CharacterPos;
+    return Token;
+}
+
+static void CompileExpect(struct Compiler *C, enum LexToken Token)
+{
+    if (CompileGet(C, NULL) != Token)
+        CompileFail(C, "unexpected token");
+}
+
+/* the interpreter runs an operator when it reads the next operator or gets to the
+ * end of the expression, errors are reported there */
+static void CompileSetPosition(struct Compiler *C, struct CompileNode *Node)
+{
+    enum LexToken Token = CompilePeek(C, NULL);
+
+    if ((Token >= TokenAssign && Token <= TokenModulus) || (Token == TokenCloseBracket && C->BracketDepth > 0))
+    {
+        Node->Line = C->Parser.Line;
+        Node->CharacterPos = C->Parser.CharacterPos;
+    }
+    else
+    {
+        Node->Line = C->LastLine;
+        Node->CharacterPos = C->LastCharacterPos;
+    }
+}
+
+/* the compiled type of a variable or parameter type, if it has one */
+static enum CompileType CompileTypeOf(Picoc *pc, struct ValueType *Typ)
+{
+    if (Typ == &pc->IntType)
+        return CompileTypeInt;
+
+    if (Typ == &pc->FPType)
+        return CompileTypeFP;
+
+    return CompileTypeVoid;
+}
+
+/* the type of a numeric operator's result given the types of its operands */
+static enum CompileType CompileTypeArithmetic(enum CompileType Left, enum CompileType Right)
+{
+    if (Left == CompileTypeFP || Right == CompileTypeFP)
+        return CompileTypeFP;
+
+    if (Left == CompileTypeInt && Right == CompileTypeInt)
+        return CompileTypeInt;
+
+    return CompileTypeEither;
+}
+
+/* find a local variable, innermost first */
+static struct CompileLocal *CompileFindLocal(struct Compiler *C, const char *Identifier)
+{
+    int Count;
+
+    for (Count = C->NumLocals - 1; Count >= 0; Count--)
+    {
+        if (C->Local[Count].Identifier == Identifier)
+            return &C->Local[Count];
+    }
+
+    return NULL;
+}
+
+/* bring a local into scope, every declaration gets a slot of its own */
+static int CompileAddLocal(struct Compiler *C, char *Identifier, enum CompileType Typ)
+{
+    if (C->NumSlots == VM_LOCALS_MAX)
+        CompileFail(C, "too many local variables");
+
+    C->Local[C->NumLocals].Identifier = Identifier;
+    C->Local[C->NumLocals].Typ = Typ;
+    C->Local[C->NumLocals].Slot = C->NumSlots;
+    C->NumLocals++;
+    C->SlotType[C->NumSlots] = (Typ == CompileTypeFP) ? TypeFP : TypeInt;
+    return C->NumSlots++;
+}
+
+/* the number of a global variable or function the function uses */
+static int CompileGlobal(struct Compiler *C, char *Identifier, struct Value *Val)
+{
+    int Count;
+
+    for (Count = 0; Count < C->NumGlobals; Count++)
+    {
+        if (C->Global[Count] == Val)
+            return -1 - Count;
+    }
+
+    C->Global = (struct Value **)CompileAlloc(C, C->Global, sizeof(struct Value *) * (C->NumGlobals + 1));
+    C->Name = (char **)CompileAlloc(C, C->Name, sizeof(char *) * (C->NumGlobals + 1));
+    C->Global[C->NumGlobals] = Val;
+    C->Name[C->NumGlobals] = Identifier;
+    return -1 - C->NumGlobals++;
+}
+
+/* remember an identifier was used, in case a later declaration in a loop brings it back into scope */
+static void CompileUse(struct Compiler *C, char *Identifier)
+{
+    if (C->NumUsed == C->UsedAlloc)
+    {
+        C->UsedAlloc = C->UsedAlloc * 2 + 64;
+        C->Used = (char **)CompileAlloc(C, C->Used, sizeof(char *) * C->UsedAlloc);
+    }
+
+    C->Used[C->NumUsed++] = Identifier;
+}
+
+/* assignments to a variable are checked while compiling, the interpreter reports it if it happens */
+static void CompileCheckWritable(struct Compiler *C, struct CompileNode *Node)
+{
+    if (Node->Kind != NodeVariable || (Node->Variable < 0 && !C->Global[-1 - Node->Variable]->IsLValue))
+        CompileFail(C, "can't assign to this");
+}
+
+/* is this token the start of a type we can compile? */
+static struct ValueType *CompileTypeToken(struct Compiler *C, enum LexToken Token, struct Value *LexValue)
+{
+    struct Value *Val;
+
+    switch (Token)
+    {
+        case TokenIntType: return &C->pc->IntType;
+        case TokenFloatType: case TokenDoubleType: return &C->pc->FPType;
+        case TokenIdentifier:
+            if (CompileFindLocal(C, LexValue->Val->Identifier) == NULL && TableGet(&C->pc->GlobalTable, LexValue->Val->Identifier, &Val, NULL, NULL, NULL) && Val->Typ == &C->pc->TypeType)
+            {
+                if (CompileTypeOf(C->pc, Val->Val->Typ) == CompileTypeVoid)
+                    CompileFail(C, "unsupported type");
+
+                return Val->Val->Typ;
+            }
+            return NULL;
+
+        default:
+            if (Token >= TokenIntType && Token <= TokenUnsignedType)
+                CompileFail(C, "unsupported type");
+
+            return NULL;
+    }
+}
+
+/* a call to a function */
+static struct CompileNode *CompileCall(struct Compiler *C, char *Identifier)
+{
+    struct CompileNode *Node;
+    struct CompileNode **LastArg;
+    struct Value *FuncValue;
+    struct FuncDef *Func;
+    int ArgCount = 0;
+    int Count;
+
+    CompileUse(C, Identifier);
+    if (CompileFindLocal(C, Identifier) != NULL || !TableGet(&C->pc->GlobalTable, Identifier, &FuncValue, NULL, NULL, NULL) || FuncValue->Typ->Base != TypeFunction)
+        CompileFail(C, "call to something which isn't a function");
+
+    Func = &FuncValue->Val->FuncDef;
+    if (Func->VarArgs || (Func->Intrinsic == NULL && Func->Body.Pos == NULL))
+        CompileFail(C, "unsupported function");
+
+    for (Count = 0; Count < Func->NumParams; Count++)
+    {
+        if (!IS_INTEGER_NUMERIC_TYPE(Func->ParamType[Count]) && Func->ParamType[Count]->Base != TypeFP)
+            CompileFail(C, "unsupported parameter type");
+    }
+
+    CompileExpect(C, TokenOpenBracket);
+    Node = CompileNewNode(C, NodeCall);
+    Node->Identifier = Identifier;
+    Node->Variable = CompileGlobal(C, Identifier, FuncValue);
+    Node->IsIntrinsic = Func->Intrinsic != NULL;
+    switch (Func->ReturnType->Base)
+    {
+        case TypeVoid: Node->Typ = CompileTypeVoid; break;
+        case TypeFP: Node->Typ = CompileTypeFP; break;
+        case TypeInt: case TypeShort: case TypeChar: case TypeUnsignedShort: case TypeUnsignedChar: Node->Typ = CompileTypeInt; break;
+        default: CompileFail(C, "unsupported return type");
+    }
+
+    LastArg = &Node->Child[0];
+    if (CompilePeek(C, NULL) == TokenCloseBracket)
+        CompileGet(C, NULL);
+    else
+    {
+        enum LexToken Token;
+
+        do
+        {
+            *LastArg = CompileFullExpression(C);
+            if ((*LastArg)->Typ == CompileTypeVoid)
+                CompileFail(C, "void argument");
+
+            LastArg = &(*LastArg)->Next;
+            ArgCount++;
+            Token = CompileGet(C, NULL);
+            if (Token != TokenComma && Token != TokenCloseBracket)
+                CompileFail(C, "comma expected");
+
+        } while (Token == TokenComma);
+    }
+
+    if (ArgCount != Func->NumParams || ArgCount > UCHAR_MAX)
+        CompileFail(C, "wrong number of arguments");
+
+    /* it's called once the ')' is read */
+    Node->Line = C->LastLine;
+    Node->CharacterPos = C->LastCharacterPos;
+    Node->Integer = ArgCount;
+    return Node;
+}
+
+/* a macro without parameters is compiled in place, it's evaluated like a bracketed expression */
+static struct CompileNode *CompileMacro(struct Compiler *C, struct MacroDef *Macro)
+{
+    struct ParseState Before;
+    struct CompileNode *Node;
+    short int LastLine = C->LastLine;
+    short int LastCharacterPos = C->LastCharacterPos;
+
+    if (Macro->NumParams != 0 || C->MacroDepth == COMPILE_MACRO_DEPTH)
+        CompileFail(C, "unsupported macro");
+
+    ParserCopy(&Before, &C->Parser);
+    ParserCopy(&C->Parser, &Macro->Body);
+    C->MacroDepth++;
+    Node = CompileFullExpression(C);
+    if (CompilePeek(C, NULL) != TokenEndOfFunction)
+        CompileFail(C, "expression expected");
+
+    C->MacroDepth--;
+    ParserCopy(&C->Parser, &Before);
+    C->LastLine = LastLine;
+    C->LastCharacterPos = LastCharacterPos;
+    return Node;
+}
+
+/* a value, variable, call or bracketed expression */
+static struct CompileNode *CompilePrimary(struct Compiler *C)
+{
+    struct Value *LexValue;
+    struct CompileNode *Node;
+    enum LexToken Token = CompileGet(C, &LexValue);
+
+    switch (Token)
+    {
+        case TokenOpenBracket:
+            C->BracketDepth++;
+            Node = CompileExpression(C);
+            CompileExpect(C, TokenCloseBracket);
+            C->BracketDepth--;
+            return Node;
+
+        case TokenIntegerConstant:
+            if (LexValue->Val->LongInteger < INT_MIN || LexValue->Val->LongInteger > INT_MAX)
+                CompileFail(C, "constant out of range");
+
+            Node = CompileNewNode(C, NodeInteger);
+            Node->Typ = CompileTypeInt;
+            Node->Integer = (int)LexValue->Val->LongInteger;
+            return Node;
+
+        case TokenCharacterConstant:
+            Node = CompileNewNode(C, NodeInteger);
+            Node->Typ = CompileTypeInt;
+            Node->Integer = LexValue->Val->Character;
+            return Node;
+
+        case TokenFPConstant:
+            Node = CompileNewNode(C, NodeFP);
+            Node->Typ = CompileTypeFP;
+            Node->FP = LexValue->Val->FP;
+            return Node;
+
+        case TokenIdentifier:
+        {
+            char *Identifier = LexValue->Val->Identifier;
+            struct CompileLocal *Local;
+            struct Value *Val;
+
+            if (CompilePeek(C, NULL) == TokenOpenBracket)
+                return CompileCall(C, Identifier);
+
+            CompileUse(C, Identifier);
+
+            /* the interpreter has looked at the next token by the time it gets the variable */
+            C->LastLine = C->Parser.Line;
+            C->LastCharacterPos = C->Parser.CharacterPos;
+
+            Node = CompileNewNode(C, NodeVariable);
+            Node->Identifier = Identifier;
+            Local = CompileFindLocal(C, Identifier);
+            if (Local != NULL)
+            {
+                Node->Typ = Local->Typ;
+                Node->Variable = Local->Slot;
+            }
+
+            else if (TableGet(&C->pc->GlobalTable, Identifier, &Val, NULL, NULL, NULL))
+            {
+                if (Val->Typ->Base == TypeMacro)
+                    return CompileMacro(C, &Val->Val->MacroDef);
+
+                Node->Typ = CompileTypeOf(C->pc, Val->Typ);
+                if (Node->Typ == CompileTypeVoid)
+                    CompileFail(C, "unsupported variable type");
+
+                Node->Variable = CompileGlobal(C, Identifier, Val);
+            }
+            else
+                CompileFail(C, "undefined variable");
+
+            return Node;
+        }
+
+        default:
+            CompileFail(C, "unsupported expression");
+            return NULL;
+    }
+}
+
+/* postfix ++ and -- */
+static struct CompileNode *CompilePostfix(struct Compiler *C)
+{
+    struct CompileNode *Node = CompilePrimary(C);
+    enum LexToken Token = CompilePeek(C, NULL);
+
+    if (Token == TokenIncrement || Token == TokenDecrement)
+    {
+        struct CompileNode *Variable = Node;
+
+        CompileCheckWritable(C, Variable);
+        CompileGet(C, NULL);
+        CompilePeek(C, NULL);
+        Node = CompileNewNode(C, NodePostfix);
+        Node->Op = Token;
+        Node->Identifier = Variable->Identifier;
+        Node->Variable = Variable->Variable;
+        Node->Typ = Variable->Typ;
+    }
+
+    return Node;
+}
+
+/* prefix operators and casts */
+static struct CompileNode *CompileUnary(struct Compiler *C)
+{
+    struct ParseState Before;
+    struct Value *LexValue;
+    struct CompileNode *Node;
+    enum LexToken Token = CompilePeek(C, NULL);
+
+    switch (Token)
+    {
+        case TokenPlus: case TokenMinus: case TokenUnaryNot: case TokenUnaryExor:
+            CompileGet(C, NULL);
+            Node = CompileNewNode(C, NodeUnary);
+            Node->Op = Token;
+            Node->Child[0] = CompileUnary(C);
+            CompileSetPosition(C, Node);
+            Node->Typ = (Token == TokenUnaryExor) ? CompileTypeInt : Node->Child[0]->Typ;
+            if (Node->Child[0]->Typ == CompileTypeVoid)
+                CompileFail(C, "void value");
+            return Node;
+
+        case TokenIncrement: case TokenDecrement:
+            CompileGet(C, NULL);
+            Node = CompileNewNode(C, NodePrefix);
+            Node->Op = Token;
+            Node->Child[0] = CompileUnary(C);
+            CompileCheckWritable(C, Node->Child[0]);
+            CompileSetPosition(C, Node);
+            Node->Identifier = Node->Child[0]->Identifier;
+            Node->Variable = Node->Child[0]->Variable;
+            Node->Typ = Node->Child[0]->Typ;
+            Node->Child[0] = NULL;
+            return Node;
+
+        case TokenOpenBracket:
+        {
+            struct ValueType *CastType;
+
+            ParserCopy(&Before, &C->Parser);
+            CompileGet(C, NULL);
+            Token = CompileGet(C, &LexValue);
+            CastType = CompileTypeToken(C, Token, LexValue);
+            if (CastType == NULL)
+            {
+                /* just a bracketed expression */
+                ParserCopy(&C->Parser, &Before);
+                return CompilePostfix(C);
+            }
+
+            CompileExpect(C, TokenCloseBracket);
+            Node = CompileNewNode(C, NodeCast);
+            Node->Typ = CompileTypeOf(C->pc, CastType);
+            Node->Child[0] = CompileUnary(C);
+            if (Node->Child[0]->Typ == CompileTypeVoid)
+                CompileFail(C, "void value");
+            return Node;
+        }
+
+        default:
+            return CompilePostfix(C);
+    }
+}
+
+/* the precedence of an infix operator, or 0 if it isn't one */
+static int CompileInfixPrecedence(enum LexToken Token)
+{
+    switch (Token)
+    {
+        case TokenLogicalOr: return 4;
+        case TokenLogicalAnd: return 5;
+        case TokenArithmeticOr: return 6;
+        case TokenArithmeticExor: return 7;
+        case TokenAmpersand: return 8;
+        case TokenEqual: case TokenNotEqual: return 9;
+        case TokenLessThan: case TokenGreaterThan: case TokenLessEqual: case TokenGreaterEqual: return 10;
+        case TokenShiftLeft: case TokenShiftRight: return 11;
+        case TokenPlus: case TokenMinus: return 12;
+        case TokenAsterisk: case TokenSlash: case TokenModulus: return 13;
+        default: return 0;
+    }
+}
+
+/* could this operator be an invalid operation on a double? Its operands aren't looked at */
+static int CompileIsInvalid(struct CompileNode *Node)
+{
+    switch (Node->Kind)
+    {
+        case NodeUnary:
+            return Node->Op == TokenUnaryExor && Node->Child[0]->Typ != CompileTypeInt;
+
+        case NodeInfix:
+            if (CompileInfixPrecedence(Node->Op) <= 8 || Node->Op == TokenShiftLeft || Node->Op == TokenShiftRight || Node->Op == TokenModulus)
+                return Node->Child[0]->Typ != CompileTypeInt || Node->Child[1]->Typ != CompileTypeInt;
+
+            return FALSE;
+
+        default:
+            return FALSE;
+    }
+}
+
+/* can this expression fail with an invalid operation on a double? */
+static int CompileCanFail(struct CompileNode *Node)
+{
+    int Count;
+
+    if (Node == NULL)
+        return FALSE;
+
+    if (CompileIsInvalid(Node))
+        return TRUE;
+
+    switch (Node->Kind)
+    {
+        case NodeCall:
+            for (Node = Node->Child[0]; Node != NULL; Node = Node->Next)
+            {
+                if (CompileCanFail(Node))
+                    return TRUE;
+            }
+            return FALSE;
+
+        default:
+            break;
+    }
+
+    for (Count = 0; Count < 4; Count++)
+    {
+        if (CompileCanFail(Node->Child[Count]))
+            return TRUE;
+    }
+
+    return FALSE;
+}
+
+/* the interpreter evaluates the right side of && and || even when it doesn't need it,
+ * only skipping the calls just after the operator. Check it doesn't matter that we
+ * skip the lot: no assignments, no user functions called later on, and nothing that
+ * could fail */
+static int CompileCanSkip(struct CompileNode *Node, int *SeenIdentifier)
+{
+    int Count;
+
+    if (Node == NULL)
+        return TRUE;
+
+    if (Node->InMacro)
+    {
+        if (Node->Kind == NodeCall && !Node->IsIntrinsic)
+            return FALSE;
+
+        *SeenIdentifier = TRUE;
+    }
+
+    switch (Node->Kind)
+    {
+        case NodeAssign: case NodePrefix: case NodePostfix:
+            return FALSE;
+
+        case NodeVariable:
+            *SeenIdentifier = TRUE;
+            return TRUE;
+
+        case NodeCall:
+            if (!Node->IsIntrinsic && *SeenIdentifier)
+                return FALSE;
+
+            *SeenIdentifier = TRUE;
+            for (Node = Node->Child[0]; Node != NULL; Node = Node->Next)
+            {
+                if (!CompileCanSkip(Node, SeenIdentifier))
+                    return FALSE;
+            }
+            return TRUE;
+
+        default:
+            break;
+    }
+
+    for (Count = 0; Count < 4; Count++)
+    {
+        if (!CompileCanSkip(Node->Child[Count], SeenIdentifier))
+            return FALSE;
+    }
+
+    return TRUE;
+}
+
+/* could evaluating this expression change the variable? User functions might change any global */
+static int CompileChanges(struct CompileNode *Node, int Variable)
+{
+    int Count;
+
+    if (Node == NULL)
+        return FALSE;
+
+    switch (Node->Kind)
+    {
+        case NodeAssign: case NodePrefix: case NodePostfix:
+            if (Node->Variable == Variable)
+                return TRUE;
+            break;
+
+        case NodeCall:
+            if (!Node->IsIntrinsic && Variable < 0)
+                return TRUE;
+
+            for (Node = Node->Child[0]; Node != NULL; Node = Node->Next)
+            {
+                if (CompileChanges(Node, Variable))
+                    return TRUE;
+            }
+            return FALSE;
+
+        default:
+            break;
+    }
+
+    for (Count = 0; Count < 4; Count++)
+    {
+        if (CompileChanges(Node->Child[Count], Variable))
+            return TRUE;
+    }
+
+    return FALSE;
+}
+
+/* the interpreter keeps a variable on its stack and only reads it when the operator
+ * runs, so it sees whatever the operands to its right did to it. We read it first */
+static void CompileCheckOperand(struct Compiler *C, struct CompileNode *Operand, struct CompileNode *Later)
+{
+    if (Operand->Kind == NodeVariable && CompileChanges(Later, Operand->Variable))
+        CompileFail(C, "variable changed by its own expression");
+}
+
+/* infix operators from precedence MinPrecedence up, all left to right */
+static struct CompileNode *CompileInfix(struct Compiler *C, int MinPrecedence)
+{
+    struct CompileNode *Node = CompileUnary(C);
+
+    for (;;)
+    {
+        struct CompileNode *Infix;
+        enum LexToken Token = CompilePeek(C, NULL);
+        int Precedence = CompileInfixPrecedence(Token);
+
+        if (Precedence == 0 || Precedence < MinPrecedence)
+            return Node;
+
+        CompileGet(C, NULL);
+        Infix = CompileNewNode(C, NodeInfix);
+        Infix->Op = Token;
+        Infix->Child[0] = Node;
+        Infix->Child[1] = CompileInfix(C, Precedence + 1);
+        CompileSetPosition(C, Infix);
+        if (Infix->Child[0]->Typ == CompileTypeVoid || Infix->Child[1]->Typ == CompileTypeVoid)
+            CompileFail(C, "void value");
+
+        CompileCheckOperand(C, Infix->Child[0], Infix->Child[1]);
+
+        if (Token == TokenLogicalAnd || Token == TokenLogicalOr)
+        {
+            int SeenIdentifier = FALSE;
+
+            if (Infix->Child[1]->Typ != CompileTypeInt || CompileCanFail(Infix->Child[1]) || !CompileCanSkip(Infix->Child[1], &SeenIdentifier))
+                CompileFail(C, "unsupported right side of && or ||");
+        }
+
+        switch (Token)
+        {
+            case TokenEqual: case TokenNotEqual: case TokenLessThan: case TokenGreaterThan: case TokenLessEqual: case TokenGreaterEqual:
+                Infix->Typ = CompileTypeInt;
+                break;
+
+            case TokenPlus: case TokenMinus: case TokenAsterisk: case TokenSlash:
+                Infix->Typ = CompileTypeArithmetic(Infix->Child[0]->Typ, Infix->Child[1]->Typ);
+                break;
+
+            default:
+                Infix->Typ = CompileTypeInt;
+                break;
+        }
+
+        Node = Infix;
+    }
+}
+
+/* ?: groups to the left like the interpreter does it */
+static struct CompileNode *CompileTernary(struct Compiler *C)
+{
+    struct CompileNode *Node = CompileInfix(C, 4);
+
+    while (CompilePeek(C, NULL) == TokenQuestionMark)
+    {
+        struct CompileNode *Ternary;
+
+        CompileGet(C, NULL);
+        Ternary = CompileNewNode(C, NodeTernary);
+        Ternary->Child[0] = Node;
+        Ternary->Child[1] = CompileInfix(C, 4);
+        CompileExpect(C, TokenColon);
+        Ternary->Child[2] = CompileInfix(C, 4);
+        if (Ternary->Child[0]->Typ == CompileTypeVoid || Ternary->Child[1]->Typ == CompileTypeVoid || Ternary->Child[2]->Typ == CompileTypeVoid)
+            CompileFail(C, "void value");
+
+        CompileCheckOperand(C, Ternary->Child[0], Ternary->Child[1]);
+        CompileCheckOperand(C, Ternary->Child[0], Ternary->Child[2]);
+        CompileCheckOperand(C, Ternary->Child[1], Ternary->Child[2]);
+        Ternary->Typ = (Ternary->Child[1]->Typ == Ternary->Child[2]->Typ) ? Ternary->Child[1]->Typ : CompileTypeEither;
+        Node = Ternary;
+    }
+
+    return Node;
+}
+
+/* a whole expression, assignments group to the right */
+static struct CompileNode *CompileExpression(struct Compiler *C)
+{
+    struct CompileNode *Node = CompileTernary(C);
+    enum LexToken Token = CompilePeek(C, NULL);
+
+    if (Token >= TokenAssign && Token <= TokenArithmeticExorAssign)
+    {
+        struct CompileNode *Assign;
+
+        CompileCheckWritable(C, Node);
+        CompileGet(C, NULL);
+        Assign = CompileNewNode(C, NodeAssign);
+        Assign->Op = Token;
+        Assign->Identifier = Node->Identifier;
+        Assign->Variable = Node->Variable;
+        Assign->Typ = Node->Typ;
+        Assign->Child[0] = CompileExpression(C);
+        CompileSetPosition(C, Assign);
+        if (Assign->Child[0]->Typ == CompileTypeVoid)
+            CompileFail(C, "void value");
+
+        Node = Assign;
+    }
+
+    return Node;
+}
+
+/* an expression the interpreter would parse with its own call to ExpressionParse() */
+static struct CompileNode *CompileFullExpression(struct Compiler *C)
+{
+    int BracketDepth = C->BracketDepth;
+    struct CompileNode *Node;
+
+    C->BracketDepth = 0;
+    Node = CompileExpression(C);
+    C->BracketDepth = BracketDepth;
+    return Node;
+}
+
+/* the interpreter keeps the locals of a function in one table, so a local can't
+ * hide another. Leaving a block only hides its locals, they're back as soon as it's
+ * entered again: on the next time round a loop an identifier used before its
+ * declaration isn't the one it was the first time */
+static void CompileCheckDeclaration(struct Compiler *C, char *Identifier)
+{
+    int Count;
+
+    if (CompileFindLocal(C, Identifier) != NULL)
+        CompileFail(C, "variable already defined");
+
+    if (C->LoopDepth > 0)
+    {
+        for (Count = C->BlockUsed; Count < C->NumUsed; Count++)
+        {
+            if (C->Used[Count] == Identifier)
+                CompileFail(C, "variable used before its declaration");
+        }
+    }
+}
+
+/* a list of variable declarations, all in a block which doesn't start a scope */
+static struct CompileNode *CompileDeclaration(struct Compiler *C, struct ValueType *Typ)
+{
+    struct CompileNode *Block = CompileNewNode(C, NodeBlock);
+    struct CompileNode **Last = &Block->Child[0];
+    struct Value *LexValue;
+    enum LexToken Token;
+
+    Block->Integer = -1;
+    do
+    {
+        struct CompileNode *Node;
+
+        if (CompileGet(C, &LexValue) != TokenIdentifier)
+            CompileFail(C, "unsupported declaration");
+
+        /* the interpreter identifies the declaration by where it's looking after the name */
+        Token = CompilePeek(C, NULL);
+        if (Token == TokenOpenBracket || Token == TokenLeftSquareBracket)
+            CompileFail(C, "unsupported declaration");
+
+        Node = CompileNewNode(C, NodeDeclare);
+        Node->Identifier = LexValue->Val->Identifier;
+        Node->Typ = CompileTypeOf(C->pc, Typ);
+        CompileCheckDeclaration(C, Node->Identifier);
+
+        /* in scope from here on, including in its own initialiser */
+        Node->Variable = CompileAddLocal(C, Node->Identifier, Node->Typ);
+        if (Token == TokenAssign)
+        {
+            CompileGet(C, NULL);
+            Node->Child[0] = CompileFullExpression(C);
+            if (Node->Child[0]->Typ == CompileTypeVoid)
+                CompileFail(C, "void value");
+
+            Node->EndLine = C->LastLine;
+            Node->EndCharacterPos = C->LastCharacterPos;
+        }
+
+        *Last = Node;
+        Last = &Node->Next;
+
+        Token = CompileGet(C, NULL);
+        if (Token != TokenComma && Token != TokenSemicolon)
+            CompileFail(C, "';' expected");
+
+    } while (Token == TokenComma);
+
+    return Block;
+}
+
+/* a block of statements, having just read the '{' */
+static struct CompileNode *CompileBlock(struct Compiler *C)
+{
+    struct CompileNode *Block = CompileNewNode(C, NodeBlock);
+    struct CompileNode **Last = &Block->Child[0];
+    int NumLocals = C->NumLocals;
+    int BlockUsed = C->BlockUsed;
+
+    Block->Integer = (int)(C->Parser.Pos - C->Tokens);
+    C->BlockUsed = C->NumUsed;
+    while (CompilePeek(C, NULL) != TokenRightBrace)
+    {
+        *Last = CompileStatement(C);
+        Last = &(*Last)->Next;
+    }
+
+    CompileGet(C, NULL);
+    C->NumLocals = NumLocals;
+    C->BlockUsed = BlockUsed;
+    return Block;
+}
+
+/* the statement controlled by an if, else or loop. A declaration there goes in the
+ * enclosing block but is only defined if the statement runs */
+static struct CompileNode *CompileBody(struct Compiler *C)
+{
+    struct CompileNode *Node = CompileStatement(C);
+
+    if (Node->Kind == NodeBlock && Node->Integer < 0 && Node->Child[0] != NULL)
+        CompileFail(C, "declaration outside a block");
+
+    return Node;
+}
+
+/* the condition of an if, while or do */
+static struct CompileNode *CompileCondition(struct Compiler *C)
+{
+    struct CompileNode *Node;
+
+    CompileExpect(C, TokenOpenBracket);
+    Node = CompileFullExpression(C);
+    if (Node->Typ == CompileTypeVoid)
+        CompileFail(C, "void value");
+
+    CompileExpect(C, TokenCloseBracket);
+    return Node;
+}
+
+/* an expression statement, with or without its semicolon */
+static struct CompileNode *CompileExpressionStatement(struct Compiler *C, int CheckTrailingSemicolon)
+{
+    struct CompileNode *Node = CompileNewNode(C, NodeExpression);
+
+    Node->Child[0] = CompileFullExpression(C);
+    if (CheckTrailingSemicolon)
+        CompileExpect(C, TokenSemicolon);
+
+    return Node;
+}
+
+static struct CompileNode *CompileStatement(struct Compiler *C)
+{
+    struct Value *LexValue;
+    struct CompileNode *Node;
+    struct ValueType *Typ;
+    enum LexToken Token = CompilePeek(C, &LexValue);
+
+    switch (Token)
+    {
+        case TokenIdentifier:
+            Typ = CompileTypeToken(C, Token, LexValue);
+            if (Typ != NULL)
+            {
+                CompileGet(C, NULL);
+                return CompileDeclaration(C, Typ);
+            }
+            return CompileExpressionStatement(C, TRUE);
+
+        case TokenIncrement: case TokenDecrement: case TokenOpenBracket:
+        case TokenPlus: case TokenMinus: case TokenUnaryNot: case TokenUnaryExor:
+        case TokenIntegerConstant: case TokenFPConstant: case TokenCharacterConstant:
+            return CompileExpressionStatement(C, TRUE);
+
+        case TokenIntType: case TokenFloatType: case TokenDoubleType:
+            CompileGet(C, NULL);
+            return CompileDeclaration(C, CompileTypeToken(C, Token, LexValue));
+
+        case TokenLeftBrace:
+            CompileGet(C, NULL);
+            return CompileBlock(C);
+
+        case TokenSemicolon:
+            CompileGet(C, NULL);
+            Node = CompileNewNode(C, NodeBlock);
+            Node->Integer = -1;
+            return Node;
+
+        case TokenIf:
+            CompileGet(C, NULL);
+            Node = CompileNewNode(C, NodeIf);
+            Node->Child[0] = CompileCondition(C);
+            Node->Child[1] = CompileBody(C);
+            if (CompilePeek(C, NULL) == TokenElse)
+            {
+                CompileGet(C, NULL);
+                Node->Child[2] = CompileBody(C);
+            }
+            return Node;
+
+        case TokenWhile:
+            CompileGet(C, NULL);
+            Node = CompileNewNode(C, NodeWhile);
+            Node->Child[0] = CompileCondition(C);
+            C->LoopDepth++;
+            Node->Child[1] = CompileBody(C);
+            C->LoopDepth--;
+            return Node;
+
+        case TokenDo:
+            CompileGet(C, NULL);
+            Node = CompileNewNode(C, NodeDo);
+            C->LoopDepth++;
+            Node->Child[1] = CompileBody(C);
+            C->LoopDepth--;
+            CompileExpect(C, TokenWhile);
+            Node->Child[0] = CompileCondition(C);
+            CompileExpect(C, TokenSemicolon);
+            return Node;
+
+        case TokenFor:
+        {
+            int NumLocals = C->NumLocals;
+            int BlockUsed = C->BlockUsed;
+
+            CompileGet(C, NULL);
+            C->BlockUsed = C->NumUsed;
+            Node = CompileNewNode(C, NodeFor);
+            CompileExpect(C, TokenOpenBracket);
+            Node->Child[2] = CompileStatement(C);
+            if (CompilePeek(C, NULL) != TokenSemicolon)
+            {
+                Node->Child[0] = CompileFullExpression(C);
+                if (Node->Child[0]->Typ == CompileTypeVoid)
+                    CompileFail(C, "void value");
+            }
+            CompileExpect(C, TokenSemicolon);
+            if (CompilePeek(C, NULL) != TokenCloseBracket)
+                Node->Child[3] = CompileExpressionStatement(C, FALSE);
+
+            CompileExpect(C, TokenCloseBracket);
+            C->LoopDepth++;
+            Node->Child[1] = CompileBody(C);
+            C->LoopDepth--;
+            C->NumLocals = NumLocals;
+            C->BlockUsed = BlockUsed;
+            return Node;
+        }
+
+        case TokenBreak: case TokenContinue:
+            CompileGet(C, NULL);
+            if (C->LoopDepth == 0)
+                CompileFail(C, "break or continue outside a loop");
+
+            Node = CompileNewNode(C, (Token == TokenBreak) ? NodeBreak : NodeContinue);
+            CompileExpect(C, TokenSemicolon);
+            return Node;
+
+        case TokenReturn:
+            CompileGet(C, NULL);
+            Node = CompileNewNode(C, NodeReturn);
+            if (C->Func->ReturnType == &C->pc->VoidType)
+            {
+                if (CompilePeek(C, NULL) != TokenSemicolon)
+                    CompileFail(C, "value in return from a void function");
+            }
+            else
+            {
+                Node->Child[0] = CompileFullExpression(C);
+                if (Node->Child[0]->Typ == CompileTypeVoid)
+                    CompileFail(C, "void value");
+
+                CompileSetPosition(C, Node);
+            }
+            CompileExpect(C, TokenSemicolon);
+            return Node;
+
+        default:
+            CompileFail(C, "unsupported statement");
+            return NULL;
+    }
+}
+
+/* the optimiser works on the syntax tree of the whole body before any code is
+ * generated. A program mustn't be able to tell it ran, so operators are only
+ * worked out beforehand the way the virtual machine would work them out, and
+ * only expressions which don't change anything are shared or moved */
+
+/* a temporary the optimiser keeps a value in, or -1 if there's no room for one */
+static int CompileAddTemporary(struct Compiler *C, enum CompileType Typ)
+{
+    if (C->NumSlots == VM_LOCALS_MAX)
+        return -1;
+
+    C->SlotType[C->NumSlots] = (Typ == CompileTypeFP) ? TypeFP : TypeInt;
+    return C->NumSlots++;
+}
+
+/* is this a call to one of the math library's functions of doubles? They give
+ * the same result for the same arguments and do nothing else */
+static int CompileIsPureCall(struct Compiler *C, struct CompileNode *Node)
+{
+#if !defined(BUILTIN_MINI_STDLIB) && !defined(NO_FP)
+    struct FuncDef *Func = &C->Global[-1 - Node->Variable]->Val->FuncDef;
+    struct LibraryFunction *Library;
+    int Count;
+
+    if (!Node->IsIntrinsic || Func->ReturnType->Base != TypeFP)
+        return FALSE;
+
+    for (Count = 0; Count < Func->NumParams; Count++)
+    {
+        if (Func->ParamType[Count]->Base != TypeFP)
+            return FALSE;
+    }
+
+    for (Library = &MathFunctions[0]; Library->Func != NULL; Library++)
+    {
+        if (Library->Func == Func->Intrinsic)
+            return TRUE;
+    }
+#endif
+    return FALSE;
+}
+
+/* is a global one of the math library's constants? Other values a program can't
+ * assign to, like the arguments of main(), can still change between calls */
+static int CompileIsLibraryConstant(struct Value *Val)
+{
+#if !defined(BUILTIN_MINI_STDLIB) && !defined(NO_FP)
+    LibraryConstant *Constant;
+
+    if (Val->IsLValue)
+        return FALSE;
+
+    for (Constant = &MathConstants[0]; Constant->CstValue != NULL; Constant++)
+    {
+        if (Constant->CstValue == Val->Val)
+            return TRUE;
+    }
+#endif
+    return FALSE;
+}
+
+/* can an expression be evaluated without changing anything? Unless MayFail is
+ * set it mustn't be able to fail either, so it doesn't matter when it's
+ * evaluated or whether it is at all */
+static int CompileIsPure(struct Compiler *C, struct CompileNode *Node, int MayFail)
+{
+    struct CompileNode *Arg;
+    int Count;
+
+    switch (Node->Kind)
+    {
+        case NodeAssign: case NodePrefix: case NodePostfix:
+            return FALSE;
+
+        case NodeInline:
+            /* it sets its temporaries */
+            return FALSE;
+
+        case NodeCall:
+            if (!CompileIsPureCall(C, Node))
+                return FALSE;
+
+            for (Arg = Node->Child[0]; Arg != NULL; Arg = Arg->Next)
+            {
+                if (!CompileIsPure(C, Arg, MayFail))
+                    return FALSE;
+            }
+            return TRUE;
+
+        case NodeInfix:
+            /* an int division fails if it's by 0 */
+            if (!MayFail && (Node->Op == TokenSlash || Node->Op == TokenModulus) && Node->Child[0]->Typ != CompileTypeFP && Node->Child[1]->Typ != CompileTypeFP && (Node->Child[1]->Kind != NodeInteger || Node->Child[1]->Integer == 0))
+                return FALSE;
+            break;
+
+        default:
+            break;
+    }
+
+    if (!MayFail && CompileIsInvalid(Node))
+        return FALSE;
+
+    for (Count = 0; Count < 4; Count++)
+    {
+        if (Node->Child[Count] != NULL && !CompileIsPure(C, Node->Child[Count], MayFail))
+            return FALSE;
+    }
+
+    return TRUE;
+}
+
+static int CompileIsConstant(struct CompileNode *Node)
+{
+    return Node->Kind == NodeInteger || Node->Kind == NodeFP;
+}
+
+/* a constant as a double, converted the way the virtual machine converts an int */
+static double CompileConstantFP(struct CompileNode *Node)
+{
+    return (Node->Kind == NodeFP) ? Node->FP : (double)(long)Node->Integer;
+}
+
+/* turn an expression into a constant where it is */
+static void CompileMakeInteger(struct CompileNode *Node, long Integer)
+{
+    Node->Kind = NodeInteger;
+    Node->Typ = CompileTypeInt;
+    Node->Integer = (int)Integer;
+    memset((void *)Node->Child, '\0', sizeof(Node->Child));
+}
+
+static void CompileMakeFP(struct CompileNode *Node, double FP)
+{
+    Node->Kind = NodeFP;
+    Node->Typ = CompileTypeFP;
+    Node->FP = FP;
+    memset((void *)Node->Child, '\0', sizeof(Node->Child));
+}
+
+/* put a node in place of another, keeping the other's place in its list */
+static void CompileReplace(struct CompileNode *Node, struct CompileNode *With)
+{
+    struct CompileNode *Next = Node->Next;
+
+    *Node = *With;
+    Node->Next = Next;
+}
+
+/* is a constant condition true? Returns -1 if it's too big to say the same way the virtual machine would */
+static int CompileConstantTruth(struct CompileNode *Node)
+{
+    if (Node->Kind == NodeInteger)
+        return Node->Integer != 0;
+
+    /* only inside what a long holds, which is 32 bits on Windows. Both bounds are
+     * exact doubles for a 32 bit long and just round to -2^63 and 2^63 for a 64 bit one */
+    if (Node->FP > (double)LONG_MIN - 1.0 && Node->FP < (double)LONG_MAX + 1.0)
+        return (long)Node->FP != 0;
+
+    return -1;
+}
+
+/* a prefix operator on a constant, see VmUnary() */
+static void CompileFoldUnary(struct CompileNode *Node)
+{
+    struct CompileNode *Child = Node->Child[0];
+
+    if (Node->Op == TokenPlus)
+        CompileReplace(Node, Child);
+
+    else if (Child->Kind == NodeInteger)
+    {
+        long TopInt = Child->Integer;
+
+        switch (Node->Op)
+        {
+            case TokenMinus:        CompileMakeInteger(Node, -TopInt); break;
+            case TokenUnaryNot:     CompileMakeInteger(Node, !TopInt); break;
+            case TokenUnaryExor:    CompileMakeInteger(Node, ~TopInt); break;
+            default:                break;
+        }
+    }
+    else if (Child->Kind == NodeFP)
+    {
+        switch (Node->Op)
+        {
+            case TokenMinus:        CompileMakeFP(Node, -Child->FP); break;
+            case TokenUnaryNot:     CompileMakeFP(Node, !Child->FP); break;
+            default:                break;
+        }
+    }
+}
+
+/* an infix operator on constants, see VmInfixInt() and VmInfixFP(). Anything
+ * which would fail is left to fail when it runs */
+static void CompileFoldInfix(struct CompileNode *Node)
+{
+    struct CompileNode *Left = Node->Child[0];
+    struct CompileNode *Right = Node->Child[1];
+
+    /* the virtual machine doesn't evaluate the right side of these at all */
+    if (Left->Kind == NodeInteger && ((Node->Op == TokenLogicalAnd && Left->Integer == 0) || (Node->Op == TokenLogicalOr && Left->Integer != 0)))
+    {
+        CompileMakeInteger(Node, Node->Op == TokenLogicalOr);
+        return;
+    }
+
+    if (!CompileIsConstant(Left) || !CompileIsConstant(Right))
+        return;
+
+    if (Left->Kind == NodeInteger && Right->Kind == NodeInteger)
+    {
+        long BottomInt = Left->Integer;
+        long TopInt = Right->Integer;
+        long ResultInt;
+
+        switch (Node->Op)
+        {
+            case TokenLogicalOr:        ResultInt = BottomInt || TopInt; break;
+            case TokenLogicalAnd:       ResultInt = BottomInt && TopInt; break;
+            case TokenArithmeticOr:     ResultInt = BottomInt | TopInt; break;
+            case TokenArithmeticExor:   ResultInt = BottomInt ^ TopInt; break;
+            case TokenAmpersand:        ResultInt = BottomInt & TopInt; break;
+            case TokenEqual:            ResultInt = BottomInt == TopInt; break;
+            case TokenNotEqual:         ResultInt = BottomInt != TopInt; break;
+            case TokenLessThan:         ResultInt = BottomInt < TopInt; break;
+            case TokenGreaterThan:      ResultInt = BottomInt > TopInt; break;
+            case TokenLessEqual:        ResultInt = BottomInt <= TopInt; break;
+            case TokenGreaterEqual:     ResultInt = BottomInt >= TopInt; break;
+            case TokenPlus:             ResultInt = BottomInt + TopInt; break;
+            case TokenMinus:            ResultInt = BottomInt - TopInt; break;
+            case TokenAsterisk:         ResultInt = BottomInt * TopInt; break;
+            case TokenShiftLeft:        if (TopInt < 0 || TopInt > 31) return; ResultInt = BottomInt << TopInt; break;
+            case TokenShiftRight:       if (TopInt < 0 || TopInt > 31) return; ResultInt = BottomInt >> TopInt; break;
+            case TokenSlash:            if (TopInt == 0) return; ResultInt = BottomInt / TopInt; break;
+            case TokenModulus:          if (TopInt == 0) return; ResultInt = BottomInt % TopInt; break;
+            default:                    return;
+        }
+
+        CompileMakeInteger(Node, ResultInt);
+    }
+    else
+    {
+        double BottomFP = CompileConstantFP(Left);
+        double TopFP = CompileConstantFP(Right);
+
+        switch (Node->Op)
+        {
+            case TokenEqual:        CompileMakeInteger(Node, BottomFP == TopFP); break;
+            case TokenNotEqual:     CompileMakeInteger(Node, BottomFP != TopFP); break;
+            case TokenLessThan:     CompileMakeInteger(Node, BottomFP < TopFP); break;
+            case TokenGreaterThan:  CompileMakeInteger(Node, BottomFP > TopFP); break;
+            case TokenLessEqual:    CompileMakeInteger(Node, BottomFP <= TopFP); break;
+            case TokenGreaterEqual: CompileMakeInteger(Node, BottomFP >= TopFP); break;
+            case TokenPlus:         CompileMakeFP(Node, BottomFP + TopFP); break;
+            case TokenMinus:        CompileMakeFP(Node, BottomFP - TopFP); break;
+            case TokenAsterisk:     CompileMakeFP(Node, BottomFP * TopFP); break;
+            case TokenSlash:        CompileMakeFP(Node, BottomFP / TopFP); break;
+            default:                break;
+        }
+    }
+}
+
+/* a cast of a constant, or to the type it already has */
+static void CompileFoldCast(struct CompileNode *Node)
+{
+    struct CompileNode *Child = Node->Child[0];
+
+    if (Child->Typ == Node->Typ)
+        CompileReplace(Node, Child);
+
+    else if (Child->Kind == NodeInteger && Node->Typ == CompileTypeFP)
+        CompileMakeFP(Node, (double)(long)Child->Integer);
+
+    else if (Child->Kind == NodeFP && Node->Typ == CompileTypeInt && Child->FP > -2147483649.0 && Child->FP < 2147483648.0)
+        CompileMakeInteger(Node, (long)Child->FP);
+}
+
+/* call a math library function with constant arguments now rather than every time */
+static void CompileFoldCall(struct Compiler *C, struct CompileNode *Node)
+{
+    struct Value ReturnValue;
+    union AnyValue ReturnData;
+    struct Value Param[COMPILE_FOLD_ARGS];
+    union AnyValue ParamData[COMPILE_FOLD_ARGS];
+    struct Value *ParamArray[COMPILE_FOLD_ARGS];
+    struct CompileNode *Arg;
+    int Count = 0;
+
+    if (Node->Integer > COMPILE_FOLD_ARGS || !CompileIsPureCall(C, Node))
+        return;
+
+    for (Arg = Node->Child[0]; Arg != NULL; Arg = Arg->Next)
+    {
+        if (!CompileIsConstant(Arg))
+            return;
+
+        memset((void *)&Param[Count], '\0', sizeof(struct Value));
+        Param[Count].Typ = &C->pc->FPType;
+        Param[Count].Val = &ParamData[Count];
+        ParamData[Count].FP = CompileConstantFP(Arg);
+        ParamArray[Count] = &Param[Count];
+        Count++;
+    }
+
+    memset((void *)&ReturnValue, '\0', sizeof(struct Value));
+    ReturnValue.Typ = &C->pc->FPType;
+    ReturnValue.Val = &ReturnData;
+    C->Global[-1 - Node->Variable]->Val->FuncDef.Intrinsic(&C->Parser, &ReturnValue, ParamArray, Count);
+    CompileMakeFP(Node, ReturnData.FP);
+}
+
+/* work out whatever can be worked out while compiling, from the leaves up */
+static void CompileFold(struct Compiler *C, struct CompileNode *Node)
+{
+    struct CompileNode *Child;
+    struct Value *Val;
+    int Count;
+    int Truth;
+
+    for (Count = 0; Count < 4; Count++)
+    {
+        for (Child = Node->Child[Count]; Child != NULL; Child = Child->Next)
+            CompileFold(C, Child);
+    }
+
+    switch (Node->Kind)
+    {
+        case NodeVariable:
+            if (Node->Variable < 0 && CompileIsLibraryConstant(C->Global[-1 - Node->Variable]))
+            {
+                Val = C->Global[-1 - Node->Variable];
+                if (Node->Typ == CompileTypeFP)
+                    CompileMakeFP(Node, Val->Val->FP);
+                else
+                    CompileMakeInteger(Node, Val->Val->Integer);
+            }
+            break;
+
+        case NodeUnary: CompileFoldUnary(Node); break;
+        case NodeInfix: CompileFoldInfix(Node); break;
+        case NodeCast: CompileFoldCast(Node); break;
+        case NodeCall: CompileFoldCall(C, Node); break;
+
+        case NodeTernary:
+            /* all three are evaluated, the one which isn't picked can only go if nobody would notice */
+            if (CompileIsConstant(Node->Child[0]) && Node->Typ != CompileTypeEither)
+            {
+                Truth = CompileConstantTruth(Node->Child[0]);
+                if (Truth != -1 && CompileIsPure(C, Node->Child[Truth ? 2 : 1], FALSE))
+                    CompileReplace(Node, Node->Child[Truth ? 1 : 2]);
+            }
+            break;
+
+        case NodeIf:
+            if (CompileIsConstant(Node->Child[0]))
+            {
+                Truth = CompileConstantTruth(Node->Child[0]);
+                if (Truth != -1 && Node->Child[Truth ? 1 : 2] != NULL)
+                    CompileReplace(Node, Node->Child[Truth ? 1 : 2]);
+                else if (Truth == 0)
+                {
+                    Node->Kind = NodeBlock;
+                    Node->Integer = -1;
+                    memset((void *)Node->Child, '\0', sizeof(Node->Child));
+                }
+            }
+            break;
+
+        default:
+            break;
+    }
+}
+
+/* mark the variables a statement could change in Changed, which is indexed by
+ * Variable + NumGlobals. A user function could change any global */
+static void CompileMarkChanged(struct Compiler *C, struct CompileNode *Node, unsigned char *Changed)
+{
+    struct CompileNode *Child;
+    int Count;
+
+    switch (Node->Kind)
+    {
+        case NodeAssign: case NodePrefix: case NodePostfix: case NodeDeclare:
+            Changed[Node->Variable + C->NumGlobals] = TRUE;
+            break;
+
+        case NodeCall:
+            if (!Node->IsIntrinsic)
+                memset((void *)Changed, TRUE, C->NumGlobals);
+            break;
+
+        default:
+            break;
+    }
+
+    for (Count = 0; Count < 4; Count++)
+    {
+        for (Child = Node->Child[Count]; Child != NULL; Child = Child->Next)
+            CompileMarkChanged(C, Child, Changed);
+    }
+}
+
+/* does an expression use only variables which aren't marked as changed? */
+static int CompileIsInvariant(struct Compiler *C, struct CompileNode *Node, unsigned char *Changed)
+{
+    struct CompileNode *Child;
+    int Count;
+
+    if (Node->Kind == NodeVariable)
+        return !Changed[Node->Variable + C->NumGlobals];
+
+    for (Count = 0; Count < 4; Count++)
+    {
+        for (Child = Node->Child[Count]; Child != NULL; Child = Child->Next)
+        {
+            if (!CompileIsInvariant(C, Child, Changed))
+                return FALSE;
+        }
+    }
+
+    return TRUE;
+}
+
+/* is an expression more than a constant or a variable? */
+static int CompileIsOperation(struct CompileNode *Node)
+{
+    return Node->Kind != NodeInteger && Node->Kind != NodeFP && Node->Kind != NodeVariable && Node->Kind < NodeExpression && (Node->Typ == CompileTypeInt || Node->Typ == CompileTypeFP);
+}
+
+/* replace the largest expressions in a loop which are the same every time round
+ * it with temporaries, adding the declarations which set them to Last */
+static void CompileHoistFrom(struct Compiler *C, struct CompileNode *Node, struct CompileNode ***Last)
+{
+    struct CompileNode *Child;
+    int Count;
+
+    if (CompileIsOperation(Node) && CompileIsPure(C, Node, FALSE) && CompileIsInvariant(C, Node, C->Changed))
+    {
+        int Slot = CompileAddTemporary(C, Node->Typ);
+
+        if (Slot != -1)
+        {
+            struct CompileNode *Declare = CompileNewNode(C, NodeDeclare);
+            struct CompileNode *Value = CompileNewNode(C, Node->Kind);
+
+            CompileReplace(Value, Node);
+            Declare->Typ = Node->Typ;
+            Declare->Variable = Slot;
+            Declare->Child[0] = Value;
+            Declare->Line = Declare->EndLine = Node->Line;
+            Declare->CharacterPos = Declare->EndCharacterPos = Node->CharacterPos;
+            **Last = Declare;
+            *Last = &Declare->Next;
+
+            Node->Kind = NodeVariable;
+            Node->Variable = Slot;
+            memset((void *)Node->Child, '\0', sizeof(Node->Child));
+            return;
+        }
+    }
+
+    for (Count = 0; Count < 4; Count++)
+    {
+        for (Child = Node->Child[Count]; Child != NULL; Child = Child->Next)
+            CompileHoistFrom(C, Child, Last);
+    }
+}
+
+/* move what doesn't change out of each loop and into a block with the loop,
+ * outer loops first so an expression goes as far out as it can */
+static void CompileHoist(struct Compiler *C, struct CompileNode *Node)
+{
+    struct CompileNode *Child;
+    int Count;
+
+    if (Node->Kind == NodeWhile || Node->Kind == NodeDo || Node->Kind == NodeFor)
+    {
+        struct CompileNode *Hoisted = NULL;
+        struct CompileNode **Last = &Hoisted;
+
+        /* the initialisation of a for runs before the temporaries would be set */
+        memset((void *)C->Changed, FALSE, C->NumGlobals + VM_LOCALS_MAX);
+        CompileMarkChanged(C, Node, C->Changed);
+        for (Count = 0; Count < 4; Count++)
+        {
+            if (Count != 2 && Node->Child[Count] != NULL)
+                CompileHoistFrom(C, Node->Child[Count], &Last);
+        }
+
+        if (Hoisted != NULL)
+        {
+            struct CompileNode *Loop = CompileNewNode(C, Node->Kind);
+
+            CompileReplace(Loop, Node);
+            *Last = Loop;
+            Node->Kind = NodeBlock;
+            Node->Integer = -1;
+            memset((void *)Node->Child, '\0', sizeof(Node->Child));
+            Node->Child[0] = Hoisted;
+            Node = Loop;
+        }
+    }
+
+    for (Count = 0; Count < 4; Count++)
+    {
+        for (Child = Node->Child[Count]; Child != NULL; Child = Child->Next)
+        {
+            if (Child->Kind >= NodeExpression)
+                CompileHoist(C, Child);
+        }
+    }
+}
+
+/* do two expressions give the same value? They're both pure */
+static int CompileIsSame(struct CompileNode *Node1, struct CompileNode *Node2)
+{
+    int Count;
+
+    if (Node1->Kind != Node2->Kind || Node1->Typ != Node2->Typ || Node1->Op != Node2->Op)
+        return FALSE;
+
+    switch (Node1->Kind)
+    {
+        case NodeInteger:
+            return Node1->Integer == Node2->Integer;
+
+        case NodeFP:
+            return memcmp((void *)&Node1->FP, (void *)&Node2->FP, sizeof(double)) == 0;
+
+        case NodeVariable:
+            return Node1->Variable == Node2->Variable;
+
+        case NodeCall:
+            if (Node1->Variable != Node2->Variable)
+                return FALSE;
+
+            for (Node1 = Node1->Child[0], Node2 = Node2->Child[0]; Node1 != NULL && Node2 != NULL; Node1 = Node1->Next, Node2 = Node2->Next)
+            {
+                if (!CompileIsSame(Node1, Node2))
+                    return FALSE;
+            }
+            return Node1 == Node2;
+
+        default:
+            break;
+    }
+
+    for (Count = 0; Count < 4; Count++)
+    {
+        if ((Node1->Child[Count] == NULL) != (Node2->Child[Count] == NULL))
+            return FALSE;
+
+        if (Node1->Child[Count] != NULL && !CompileIsSame(Node1->Child[Count], Node2->Child[Count]))
+            return FALSE;
+    }
+
+    return TRUE;
+}
+
+/* is it cheaper to keep an expression's value than to work it out again? */
+static int CompileIsWorthSharing(struct CompileNode *Node)
+{
+    if (!CompileIsOperation(Node))
+        return FALSE;
+
+    if (Node->Kind == NodeUnary || Node->Kind == NodeCast)
+        return CompileIsOperation(Node->Child[0]);
+
+    return TRUE;
+}
+
+/* replace the copies of Def which are evaluated after it with its temporary,
+ * which is made when the first one's found. Seen is set once we're past Def */
+static void CompileShareCopies(struct Compiler *C, struct CompileNode *Node, struct CompileNode *Def, int *Slot, int *Seen)
+{
+    struct CompileNode *Child;
+    int Count;
+
+    if (Node == Def)
+    {
+        *Seen = TRUE;
+        return;
+    }
+
+    if (*Seen && CompileIsSame(Node, Def))
+    {
+        if (*Slot == -1)
+            *Slot = CompileAddTemporary(C, Def->Typ);
+
+        if (*Slot != -1)
+        {
+            Node->Kind = NodeVariable;
+            Node->Variable = *Slot;
+            memset((void *)Node->Child, '\0', sizeof(Node->Child));
+        }
+        return;
+    }
+
+    for (Count = 0; Count < 4; Count++)
+    {
+        for (Child = Node->Child[Count]; Child != NULL; Child = Child->Next)
+            CompileShareCopies(C, Child, Def, Slot, Seen);
+    }
+}
+
+/* evaluate each expression in a pure expression only once, the first time it's
+ * evaluated assigns it to a temporary which the others use. Something on the
+ * right of && or || might not be evaluated so it can't be the first one */
+static void CompileShareWithin(struct Compiler *C, struct CompileNode *Root, struct CompileNode *Node, int Conditional)
+{
+    struct CompileNode *Child;
+    int Count;
+
+    if (!Conditional && CompileIsWorthSharing(Node))
+    {
+        int Slot = -1;
+        int Seen = FALSE;
+
+        CompileShareCopies(C, Root, Node, &Slot, &Seen);
+        if (Slot != -1)
+        {
+            struct CompileNode *Value = CompileNewNode(C, Node->Kind);
+
+            CompileReplace(Value, Node);
+            Node->Kind = NodeAssign;
+            Node->Op = TokenAssign;
+            Node->Variable = Slot;
+            memset((void *)Node->Child, '\0', sizeof(Node->Child));
+            Node->Child[0] = Value;
+            Node = Value;
+        }
+    }
+
+    for (Count = 0; Count < 4; Count++)
+    {
+        for (Child = Node->Child[Count]; Child != NULL; Child = Child->Next)
+            CompileShareWithin(C, Root, Child, Conditional || (Count == 1 && Node->Kind == NodeInfix && (Node->Op == TokenLogicalAnd || Node->Op == TokenLogicalOr)));
+    }
+}
+
+/* share the common expressions of each of the largest pure expressions */
+static void CompileShare(struct Compiler *C, struct CompileNode *Node)
+{
+    struct CompileNode *Child;
+    int Count;
+
+    if (Node->Kind < NodeExpression && CompileIsPure(C, Node, TRUE))
+    {
+        CompileShareWithin(C, Node, Node, FALSE);
+        return;
+    }
+
+    for (Count = 0; Count < 4; Count++)
+    {
+        for (Child = Node->Child[Count]; Child != NULL; Child = Child->Next)
+            CompileShare(C, Child);
+    }
+}
+
+/* the number of nodes in a tree, what inlining it costs */
+static int CompileCount(struct CompileNode *Node)
+{
+    struct CompileNode *Child;
+    int Total = 1;
+    int Count;
+
+    for (Count = 0; Count < 4; Count++)
+    {
+        for (Child = Node->Child[Count]; Child != NULL; Child = Child->Next)
+            Total += CompileCount(Child);
+    }
+
+    return Total;
+}
+
+/* does a tree read a variable? */
+static int CompileReads(struct CompileNode *Node, int Variable)
+{
+    struct CompileNode *Child;
+    int Count;
+
+    if (Node->Kind == NodeVariable)
+        return Node->Variable == Variable;
+
+    for (Count = 0; Count < 4; Count++)
+    {
+        for (Child = Node->Child[Count]; Child != NULL; Child = Child->Next)
+        {
+            if (CompileReads(Child, Variable))
+                return TRUE;
+        }
+    }
+
+    return FALSE;
+}
+
+/* does a tree assign to a variable? */
+static int CompileAssigns(struct CompileNode *Node, int Variable)
+{
+    struct CompileNode *Child;
+    int Count;
+
+    switch (Node->Kind)
+    {
+        case NodeAssign: case NodePrefix: case NodePostfix: case NodeDeclare:
+            if (Node->Variable == Variable)
+                return TRUE;
+            break;
+
+        default:
+            break;
+    }
+
+    for (Count = 0; Count < 4; Count++)
+    {
+        for (Child = Node->Child[Count]; Child != NULL; Child = Child->Next)
+        {
+            if (CompileAssigns(Child, Variable))
+                return TRUE;
+        }
+    }
+
+    return FALSE;
+}
+
+/* use a constant or variable wherever a tree reads a variable, converted to the variable's type */
+static void CompileSubstitute(struct Compiler *C, struct CompileNode *Node, int Variable, struct CompileNode *With, enum CompileType Typ)
+{
+    struct CompileNode *Child;
+    int Count;
+
+    if (Node->Kind == NodeVariable && Node->Variable == Variable)
+    {
+        CompileReplace(Node, With);
+        if (With->Typ != Typ)
+        {
+            struct CompileNode *Value = CompileNewNode(C, With->Kind);
+
+            CompileReplace(Value, With);
+            Node->Kind = NodeCast;
+            Node->Typ = Typ;
+            Node->Child[0] = Value;
+        }
+        return;
+    }
+
+    for (Count = 0; Count < 4; Count++)
+    {
+        for (Child = Node->Child[Count]; Child != NULL; Child = Child->Next)
+            CompileSubstitute(C, Child, Variable, With, Typ);
+    }
+}
+
+/* is a function named in NOINLINE in the environment? It's a list of names
+ * separated by commas or spaces, for functions which mustn't be inlined */
+static int CompileIsNoInline(const char *FuncName)
+{
+    const char *List = getenv("NOINLINE");
+    size_t Length = strlen(FuncName);
+
+    while (List != NULL && *List != '\0')
+    {
+        size_t NameLength = strcspn(List, ", ");
+
+        if (NameLength == Length && strncmp(List, FuncName, Length) == 0)
+            return TRUE;
+
+        List += NameLength;
+        List += strspn(List, ", ");
+    }
+
+    return FALSE;
+}
+
+static void CompileInline(struct Compiler *C, struct CompileNode *Node);
+
+/* inline a call to a function whose body is only declarations and a return. Its
+ * parameters and locals become temporaries set before the expression it returns
+ * is evaluated, except that arguments which are constants or locals it can't
+ * change are used directly. Returns FALSE if it's not worth it or can't be done */
+static int CompileInlineCall(struct Compiler *C, struct CompileNode *Node)
+{
+    struct FuncDef *Func = &C->Global[-1 - Node->Variable]->Val->FuncDef;
+    struct FuncDef *Caller = C->Func;
+    const unsigned char *Tokens = C->Tokens;
+    int NumLocals = C->NumLocals;
+    int NumSlots = C->NumSlots;
+    struct ParseState Parser;
+    jmp_buf Fail;
+    struct CompileNode *Body;
+    struct CompileNode *Statement;
+    struct CompileNode *Return = NULL;
+    struct CompileNode *Expression;
+    struct CompileNode *Declare;
+    struct CompileNode *Next;
+    struct CompileNode **Last;
+    struct CompileNode *Arg;
+    int Size = 0;
+    int Count;
+
+    if (Node->IsIntrinsic || Func->Body.Pos == NULL || C->InlineDepth == COMPILE_INLINE_DEPTH || CompileTypeOf(C->pc, Func->ReturnType) == CompileTypeVoid)
+        return FALSE;
+
+    /* errors in it have to be reported from the same source */
+    if (Func->Body.FileName != C->Parser.FileName || Func->Body.SourceText != C->Parser.SourceText || CompileIsNoInline(Node->Identifier))
+        return FALSE;
+
+    for (Count = 0; Count <= C->InlineDepth; Count++)
+    {
+        if (C->InlineChain[Count] == Func)
+            return FALSE;
+    }
+
+    /* parse its body as if it was being compiled, with its variables in slots after ours */
+    ParserCopy(&Parser, &C->Parser);
+    memcpy((void *)Fail, (void *)C->Fail, sizeof(jmp_buf));
+    if (!setjmp(C->Fail))
+    {
+        C->Func = Func;
+        C->Tokens = Func->Body.Pos;
+        C->NumLocals = 0;
+        ParserCopy(&C->Parser, &Func->Body);
+        for (Count = 0; Count < Func->NumParams; Count++)
+        {
+            enum CompileType Typ = CompileTypeOf(C->pc, Func->ParamType[Count]);
+            if (Typ == CompileTypeVoid)
+                CompileFail(C, "unsupported parameter type");
+
+            CompileAddLocal(C, Func->ParamName[Count], Typ);
+        }
+
+        if (CompileGet(C, NULL) != TokenLeftBrace)
+            CompileFail(C, "function body expected");
+
+        Body = CompileBlock(C);
+    }
+    else
+        Body = NULL;
+
+    memcpy((void *)C->Fail, (void *)Fail, sizeof(jmp_buf));
+    ParserCopy(&C->Parser, &Parser);
+    C->Func = Caller;
+    C->Tokens = Tokens;
+    C->NumLocals = NumLocals;
+    C->LoopDepth = C->MacroDepth = C->BracketDepth = 0;
+
+    /* only declarations then a return. A local which is used in its own initialiser
+     * would see what it was left with last time instead of 0 */
+    if (Body != NULL)
+    {
+        for (Statement = Body->Child[0]; Statement != NULL; Statement = Statement->Next)
+        {
+            if (Statement->Kind == NodeReturn && Statement->Next == NULL)
+                Return = Statement;
+
+            else if (Statement->Kind != NodeBlock || Statement->Integer >= 0)
+                break;
+
+            else
+            {
+                for (Declare = Statement->Child[0]; Declare != NULL; Declare = Declare->Next)
+                {
+                    if (Declare->Child[0] != NULL && CompileReads(Declare->Child[0], Declare->Variable))
+                        break;
+                }
+
+                if (Declare != NULL)
+                    break;
+            }
+        }
+
+        Size = CompileCount(Body);
+    }
+
+    if (Return == NULL || Size > COMPILE_INLINE_SIZE || Size > C->InlineBudget)
+    {
+        C->NumSlots = NumSlots;
+        return FALSE;
+    }
+
+    C->InlineBudget -= Size;
+    C->Inlined = TRUE;
+    Expression = Return->Child[0];
+    Arg = Node->Child[0];
+    Node->Kind = NodeInline;
+    memset((void *)Node->Child, '\0', sizeof(Node->Child));
+    Last = &Node->Child[0];
+
+    /* the arguments in the order they're evaluated. One which is used directly
+     * mustn't be changed by the arguments after it */
+    for (Count = 0; Count < Func->NumParams; Count++, Arg = Next)
+    {
+        int Substitute = !CompileAssigns(Body, NumSlots + Count) && (CompileIsConstant(Arg) || (Arg->Kind == NodeVariable && Arg->Variable >= 0));
+
+        for (Next = Arg->Next; Next != NULL && Substitute; Next = Next->Next)
+        {
+            if (Arg->Kind == NodeVariable && CompileChanges(Next, Arg->Variable))
+                Substitute = FALSE;
+        }
+
+        Next = Arg->Next;
+        Arg->Next = NULL;
+        if (Substitute)
+            CompileSubstitute(C, Body, NumSlots + Count, Arg, (C->SlotType[NumSlots + Count] == TypeFP) ? CompileTypeFP : CompileTypeInt);
+        else
+        {
+            Declare = CompileNewNode(C, NodeDeclare);
+            Declare->Typ = (C->SlotType[NumSlots + Count] == TypeFP) ? CompileTypeFP : CompileTypeInt;
+            Declare->Variable = NumSlots + Count;
+            Declare->Child[0] = Arg;
+            Declare->Line = Declare->EndLine = Arg->Line;
+            Declare->CharacterPos = Declare->EndCharacterPos = Arg->CharacterPos;
+            *Last = Declare;
+            Last = &Declare->Next;
+        }
+    }
+
+    /* its locals start at 0 every time */
+    for (Statement = Body->Child[0]; Statement != Return; Statement = Statement->Next)
+    {
+        for (Declare = Statement->Child[0]; Declare != NULL; Declare = Next)
+        {
+            Next = Declare->Next;
+            Declare->Next = NULL;
+            if (Declare->Child[0] == NULL)
+            {
+                Declare->Child[0] = CompileNewNode(C, NodeInteger);
+                Declare->Child[0]->Typ = CompileTypeInt;
+            }
+
+            *Last = Declare;
+            Last = &Declare->Next;
+        }
+    }
+
+    /* the value's converted to the return type like a call does */
+    if (Expression->Typ != Node->Typ)
+    {
+        struct CompileNode *Cast = CompileNewNode(C, NodeCast);
+
+        Cast->Typ = Node->Typ;
+        Cast->Child[0] = Expression;
+        Cast->Line = Expression->Line;
+        Cast->CharacterPos = Expression->CharacterPos;
+        Expression = Cast;
+    }
+    Node->Child[1] = Expression;
+
+    /* the arguments are inlined into our function, the rest into the one inlined */
+    for (Declare = Node->Child[0]; Declare != NULL; Declare = Declare->Next)
+    {
+        if (Declare->Variable < NumSlots + Func->NumParams)
+            CompileInline(C, Declare->Child[0]);
+    }
+
+    C->InlineChain[++C->InlineDepth] = Func;
+    for (Declare = Node->Child[0]; Declare != NULL; Declare = Declare->Next)
+    {
+        if (Declare->Variable >= NumSlots + Func->NumParams)
+            CompileInline(C, Declare->Child[0]);
+    }
+    CompileInline(C, Node->Child[1]);
+    C->InlineDepth--;
+
+    if (Node->Child[0] == NULL)
+        CompileReplace(Node, Node->Child[1]);
+
+    return TRUE;
+}
+
+/* inline the calls in a tree which are worth it */
+static void CompileInline(struct Compiler *C, struct CompileNode *Node)
+{
+    struct CompileNode *Child;
+    int Count;
+
+    if (Node->Kind == NodeCall && CompileInlineCall(C, Node))
+        return;
+
+    for (Count = 0; Count < 4; Count++)
+    {
+        for (Child = Node->Child[Count]; Child != NULL; Child = Child->Next)
+            CompileInline(C, Child);
+    }
+}
+
+/* run the optimiser over a function body */
+static void CompileOptimise(struct Compiler *C, struct CompileNode *Body)
+{
+    if (C->Inline)
+    {
+        C->InlineChain[0] = C->Func;
+        C->InlineBudget = COMPILE_INLINE_BUDGET;
+        CompileInline(C, Body);
+    }
+
+    /* inlining adds globals so this has to come after it */
+    C->Changed = (unsigned char *)CompileAlloc(C, NULL, C->NumGlobals + VM_LOCALS_MAX);
+    CompileFold(C, Body);
+    CompileHoist(C, Body);
+    CompileShare(C, Body);
+}
+
+/* add an instruction at a source position */
+static int CompileEmitAt(struct Compiler *C, short int Line, short int CharacterPos, enum VmOp Op, int Token, int Operand)
+{
+    if (C->CodeSize == C->CodeAlloc)
+    {
+        C->CodeAlloc = C->CodeAlloc * 2 + 64;
+        C->Code = (struct VmInstruction *)CompileAlloc(C, C->Code, sizeof(struct VmInstruction) * C->CodeAlloc);
+        C->Position = (struct VmPosition *)CompileAlloc(C, C->Position, sizeof(struct VmPosition) * C->CodeAlloc);
+    }
+
+    C->Code[C->CodeSize].Op = (unsigned char)Op;
+    C->Code[C->CodeSize].Token = (unsigned char)Token;
+    C->Code[C->CodeSize].Operand = Operand;
+    C->Position[C->CodeSize].Line = Line;
+    C->Position[C->CodeSize].CharacterPos = CharacterPos;
+    return C->CodeSize++;
+}
+
+/* add an instruction at the position of a node */
+static int CompileEmit(struct Compiler *C, struct CompileNode *Node, enum VmOp Op, int Token, int Operand)
+{
+    return CompileEmitAt(C, Node->Line, Node->CharacterPos, Op, Token, Operand);
+}
+
+/* keep track of how many values are on the stack */
+static void CompileStack(struct Compiler *C, int Change)
+{
+    C->StackDepth += Change;
+    if (C->StackDepth > C->StackSize)
+    {
+        C->StackSize = C->StackDepth;
+        if (C->StackSize > VM_STACK_MAX)
+            CompileFail(C, "expression too complex");
+    }
+}
+
+/* the operand for a variable, the globals are numbered after the locals */
+static int CompileVariable(struct Compiler *C, struct CompileNode *Node)
+{
+    return (Node->Variable >= 0) ? Node->Variable : C->NumSlots - 1 - Node->Variable;
+}
+
+static int CompileConstant(struct Compiler *C, double FP)
+{
+    C->Constant = (double *)CompileAlloc(C, C->Constant, sizeof(double) * (C->NumConstants + 1));
+    C->Constant[C->NumConstants] = FP;
+    return C->NumConstants++;
+}
+
+/* point a chain of jumps at the next instruction */
+static void CompilePatch(struct Compiler *C, int List, int Target)
+{
+    while (List != -1)
+    {
+        int Next = C->Code[List].Operand;
+        C->Code[List].Operand = Target;
+        List = Next;
+    }
+}
+
+/* the body of a loop, with its breaks and continues */
+static void CompileLoopBody(struct Compiler *C, struct CompileLoop *Loop, struct CompileNode *Body, int ContinueTarget)
+{
+    Loop->Outer = C->Loop;
+    Loop->ContinueTarget = ContinueTarget;
+    Loop->BreakList = -1;
+    Loop->ContinueList = -1;
+    C->Loop = Loop;
+    CompileGenerate(C, Body);
+    C->Loop = Loop->Outer;
+}
+
+/* can an infix or assignment operator be used on doubles? */
+static int CompileIsFPOperator(enum LexToken Op)
+{
+    switch (Op)
+    {
+        case TokenEqual: case TokenNotEqual: case TokenLessThan: case TokenGreaterThan: case TokenLessEqual: case TokenGreaterEqual:
+        case TokenPlus: case TokenMinus: case TokenAsterisk: case TokenSlash:
+        case TokenAssign: case TokenAddAssign: case TokenSubtractAssign: case TokenMultiplyAssign: case TokenDivideAssign:
+            return TRUE;
+
+        default:
+            return FALSE;
+    }
+}
+
+/* generate code for an int or double expression, leaving it as a double */
+static void CompileGenerateFP(struct Compiler *C, struct CompileNode *Node)
+{
+    CompileGenerate(C, Node);
+    if (Node->Typ == CompileTypeInt)
+        CompileEmit(C, Node, VmOpIntToFP, 0, 0);
+}
+
+/* generate code for a node. Where the types of an operator's operands are
+ * known it gets the int or double version of the operator, with any int
+ * operand of a double operator converted as soon as it's worked out */
+static void CompileGenerate(struct Compiler *C, struct CompileNode *Node)
+{
+    struct CompileNode *Child;
+    struct CompileLoop Loop;
+    enum VmOp Op;
+    int Jump;
+    int Start;
+
+    if (Node == NULL)
+        return;
+
+    switch (Node->Kind)
+    {
+        case NodeInteger:
+            CompileEmit(C, Node, VmOpPushInt, 0, Node->Integer);
+            CompileStack(C, 1);
+            break;
+
+        case NodeFP:
+            CompileEmit(C, Node, VmOpPushFP, 0, CompileConstant(C, Node->FP));
+            CompileStack(C, 1);
+            break;
+
+        case NodeVariable:
+            CompileEmit(C, Node, VmOpLoad, 0, CompileVariable(C, Node));
+            CompileStack(C, 1);
+            break;
+
+        case NodeCall:
+            for (Child = Node->Child[0]; Child != NULL; Child = Child->Next)
+                CompileGenerate(C, Child);
+
+            CompileEmit(C, Node, VmOpCall, Node->Integer, -1 - Node->Variable);
+            CompileStack(C, -Node->Integer + (Node->Typ != CompileTypeVoid));
+            break;
+
+        case NodePrefix: case NodePostfix:
+            CompileEmit(C, Node, (Node->Kind == NodePrefix) ? VmOpPrefix : VmOpPostfix, Node->Op, CompileVariable(C, Node));
+            CompileStack(C, 1);
+            break;
+
+        case NodeUnary:
+            CompileGenerate(C, Node->Child[0]);
+            if (Node->Op != TokenPlus)
+                CompileEmit(C, Node, VmOpUnary, Node->Op, 0);
+            break;
+
+        case NodeInfix:
+            if (Node->Child[0]->Typ == CompileTypeInt && Node->Child[1]->Typ == CompileTypeInt)
+                Op = VmOpInfixInt;
+            else if (Node->Child[0]->Typ != CompileTypeEither && Node->Child[1]->Typ != CompileTypeEither && CompileIsFPOperator(Node->Op))
+                Op = VmOpInfixFP;
+            else
+                Op = VmOpInfix;
+
+            if (Op == VmOpInfixFP)
+            {
+                CompileGenerateFP(C, Node->Child[0]);
+                CompileGenerateFP(C, Node->Child[1]);
+            }
+            else
+            {
+                CompileGenerate(C, Node->Child[0]);
+                if (Node->Op == TokenLogicalAnd || Node->Op == TokenLogicalOr)
+                {
+                    Jump = CompileEmit(C, Node, (Node->Op == TokenLogicalAnd) ? VmOpSkipIfFalse : VmOpSkipIfTrue, 0, -1);
+                    CompileGenerate(C, Node->Child[1]);
+                    C->Code[Jump].Operand = C->CodeSize;
+                }
+                else
+                    CompileGenerate(C, Node->Child[1]);
+            }
+
+            CompileEmit(C, Node, Op, Node->Op, 0);
+            CompileStack(C, -1);
+            break;
+
+        case NodeAssign:
+            if (Node->Typ == CompileTypeInt && Node->Child[0]->Typ == CompileTypeInt)
+            {
+                CompileGenerate(C, Node->Child[0]);
+                CompileEmit(C, Node, VmOpAssignInt, Node->Op, CompileVariable(C, Node));
+            }
+            else if (Node->Typ == CompileTypeFP && Node->Child[0]->Typ != CompileTypeEither && CompileIsFPOperator(Node->Op))
+            {
+                CompileGenerateFP(C, Node->Child[0]);
+                CompileEmit(C, Node, VmOpAssignFP, Node->Op, CompileVariable(C, Node));
+            }
+            else
+            {
+                CompileGenerate(C, Node->Child[0]);
+                CompileEmit(C, Node, VmOpAssign, Node->Op, CompileVariable(C, Node));
+            }
+            break;
+
+        case NodeCast:
+            CompileGenerate(C, Node->Child[0]);
+            if (Node->Typ == CompileTypeFP && Node->Child[0]->Typ == CompileTypeInt)
+                CompileEmit(C, Node, VmOpIntToFP, 0, 0);
+            else if (Node->Typ != Node->Child[0]->Typ)
+                CompileEmit(C, Node, VmOpCast, (Node->Typ == CompileTypeFP) ? TypeFP : TypeInt, 0);
+            break;
+
+        case NodeTernary:
+            CompileGenerate(C, Node->Child[0]);
+            CompileGenerate(C, Node->Child[1]);
+            CompileGenerate(C, Node->Child[2]);
+            CompileEmit(C, Node, VmOpTernary, 0, 0);
+            CompileStack(C, -2);
+            break;
+
+        case NodeInline:
+            for (Child = Node->Child[0]; Child != NULL; Child = Child->Next)
+                CompileGenerate(C, Child);
+
+            CompileGenerate(C, Node->Child[1]);
+            break;
+
+        case NodeExpression:
+            CompileGenerate(C, Node->Child[0]);
+            if (Node->Child[0]->Typ != CompileTypeVoid)
+            {
+                CompileEmit(C, Node, VmOpPop, 0, 0);
+                CompileStack(C, -1);
+            }
+            break;
+
+        case NodeDeclare:
+            /* its slot starts at 0 and keeps its value if the declaration's run again */
+            if (Node->Child[0] != NULL)
+            {
+                CompileGenerate(C, Node->Child[0]);
+                CompileEmitAt(C, Node->EndLine, Node->EndCharacterPos, VmOpInitialise, 0, Node->Variable);
+                CompileStack(C, -1);
+            }
+            break;
+
+        case NodeBlock:
+            for (Child = Node->Child[0]; Child != NULL; Child = Child->Next)
+                CompileGenerate(C, Child);
+            break;
+
+        case NodeIf:
+            CompileGenerate(C, Node->Child[0]);
+            Jump = CompileEmit(C, Node, VmOpJumpIfFalse, 0, -1);
+            CompileStack(C, -1);
+            CompileGenerate(C, Node->Child[1]);
+            if (Node->Child[2] != NULL)
+            {
+                int Skip = CompileEmit(C, Node, VmOpJump, 0, -1);
+                C->Code[Jump].Operand = C->CodeSize;
+                CompileGenerate(C, Node->Child[2]);
+                Jump = Skip;
+            }
+            C->Code[Jump].Operand = C->CodeSize;
+            break;
+
+        case NodeWhile:
+            Start = C->CodeSize;
+            CompileGenerate(C, Node->Child[0]);
+            Jump = CompileEmit(C, Node, VmOpJumpIfFalse, 0, -1);
+            CompileStack(C, -1);
+            CompileLoopBody(C, &Loop, Node->Child[1], Start);
+            CompileEmit(C, Node, VmOpLoop, 0, Start);
+            C->Code[Jump].Operand = C->CodeSize;
+            CompilePatch(C, Loop.BreakList, C->CodeSize);
+            break;
+
+        case NodeDo:
+            Start = C->CodeSize;
+            CompileLoopBody(C, &Loop, Node->Child[1], -1);
+            CompilePatch(C, Loop.ContinueList, C->CodeSize);
+            CompileGenerate(C, Node->Child[0]);
+            Jump = CompileEmit(C, Node, VmOpJumpIfFalse, 0, -1);
+            CompileStack(C, -1);
+            CompileEmit(C, Node, VmOpLoop, 0, Start);
+            C->Code[Jump].Operand = C->CodeSize;
+            CompilePatch(C, Loop.BreakList, C->CodeSize);
+            break;
+
+        case NodeFor:
+            CompileGenerate(C, Node->Child[2]);
+            Start = C->CodeSize;
+            Jump = -1;
+            if (Node->Child[0] != NULL)
+            {
+                CompileGenerate(C, Node->Child[0]);
+                Jump = CompileEmit(C, Node, VmOpJumpIfFalse, 0, -1);
+                CompileStack(C, -1);
+            }
+            CompileLoopBody(C, &Loop, Node->Child[1], -1);
+            CompilePatch(C, Loop.ContinueList, C->CodeSize);
+            CompileGenerate(C, Node->Child[3]);
+            CompileEmit(C, Node, VmOpLoop, 0, Start);
+            if (Jump != -1)
+                C->Code[Jump].Operand = C->CodeSize;
+
+            CompilePatch(C, Loop.BreakList, C->CodeSize);
+            break;
+
+        case NodeBreak:
+            C->Loop->BreakList = CompileEmit(C, Node, VmOpJump, 0, C->Loop->BreakList);
+            break;
+
+        case NodeContinue:
+            if (C->Loop->ContinueTarget != -1)
+                CompileEmit(C, Node, VmOpLoop, 0, C->Loop->ContinueTarget);
+            else
+                C->Loop->ContinueList = CompileEmit(C, Node, VmOpJump, 0, C->Loop->ContinueList);
+            break;
+
+        case NodeReturn:
+            if (Node->Child[0] != NULL)
+            {
+                CompileGenerate(C, Node->Child[0]);
+                CompileEmit(C, Node, VmOpReturn, 0, 0);
+                CompileStack(C, -1);
+            }
+            else
+                CompileEmit(C, Node, VmOpReturnVoid, 0, 0);
+            break;
+    }
+}
+
+/* put the compiled function in one allocation so it's freed along with the function */
+static struct VmFunction *CompileFinish(struct Compiler *C)
+{
+    int NumVariables = C->NumSlots + C->NumGlobals;
+    int CodeBytes = MEM_ALIGN(sizeof(struct VmInstruction) * C->CodeSize);
+    int ConstantBytes = MEM_ALIGN(sizeof(double) * C->NumConstants);
+    int GlobalBytes = MEM_ALIGN(sizeof(struct Value *) * C->NumGlobals);
+    int NameBytes = MEM_ALIGN(sizeof(char *) * C->NumGlobals);
+    int PositionBytes = MEM_ALIGN(sizeof(struct VmPosition) * C->CodeSize);
+    char *Mem = (char *)HeapAllocMem(C->pc, MEM_ALIGN(sizeof(struct VmFunction)) + CodeBytes + ConstantBytes + GlobalBytes + NameBytes + PositionBytes + MEM_ALIGN(NumVariables));
+    struct VmFunction *Func = (struct VmFunction *)Mem;
+    int Count;
+
+    if (Mem == NULL)
+        CompileFail(C, "out of memory");
+
+    Mem += MEM_ALIGN(sizeof(struct VmFunction));
+    Func->Code = (struct VmInstruction *)Mem;
+    memcpy((void *)Func->Code, (void *)C->Code, sizeof(struct VmInstruction) * C->CodeSize);
+    Mem += CodeBytes;
+    Func->Constant = (double *)Mem;
+    if (C->NumConstants > 0)
+        memcpy((void *)Func->Constant, (void *)C->Constant, sizeof(double) * C->NumConstants);
+    Mem += ConstantBytes;
+    Func->Global = (struct Value **)Mem;
+    Mem += GlobalBytes;
+    Func->Name = (char **)Mem;
+    if (C->NumGlobals > 0)
+    {
+        memcpy((void *)Func->Global, (void *)C->Global, sizeof(struct Value *) * C->NumGlobals);
+        memcpy((void *)Func->Name, (void *)C->Name, sizeof(char *) * C->NumGlobals);
+    }
+    Mem += NameBytes;
+    Func->Position = (struct VmPosition *)Mem;
+    memcpy((void *)Func->Position, (void *)C->Position, sizeof(struct VmPosition) * C->CodeSize);
+    Mem += PositionBytes;
+    Func->Type = (unsigned char *)Mem;
+    memcpy((void *)Func->Type, (void *)C->SlotType, C->NumSlots);
+    for (Count = 0; Count < C->NumGlobals; Count++)
+        Func->Type[C->NumSlots + Count] = IS_FP(C->Global[Count]) ? TypeFP : TypeInt;
+
+    Func->CodeSize = C->CodeSize;
+    Func->StackSize = C->StackSize;
+    Func->NumLocals = C->NumSlots;
+    Func->NumParams = C->Func->NumParams;
+    Func->Native = NULL;
+    Func->Batch = NULL;
+    Func->Def = C->Func;
+    Func->Next = C->pc->CompiledList;
+    C->pc->CompiledList = Func;
+    return Func;
+}
+
+/* names for the listing of the code, see enum VmOp and enum LexToken */
+static const char *CompileOpName[] =
+{
+    "PushInt", "PushFP", "Load", "Assign", "Initialise", "Prefix", "Postfix", "Unary", "Infix",
+    "InfixInt", "InfixFP", "AssignInt", "AssignFP", "IntToFP", "Cast", "Ternary", "SkipIfFalse",
+    "SkipIfTrue", "Jump", "JumpIfFalse", "Loop", "Call", "Pop", "Return", "ReturnVoid", "End"
+};
+
+static const char *CompileTokenName[] =
+{
+    "", ",", "=", "+=", "-=", "*=", "/=", "%=", "<<=", ">>=", "&=", "|=", "^=", "?", ":",
+    "||", "&&", "|", "^", "&", "==", "!=", "<", ">", "<=", ">=", "<<", ">>", "+", "-",
+    "*", "/", "%", "++", "--", "!", "~"
+};
+
+/* print the code of a function to see what the compiler made of it. Locals
+ * are shown by their slot since temporaries don't have names */
+static void CompileDump(struct Compiler *C, const char *FuncName)
+{
+    int PC;
+
+    printf("%s(): %d locals, stack %d\n", FuncName, C->NumSlots, C->StackSize);
+    for (PC = 0; PC < C->CodeSize; PC++)
+    {
+        struct VmInstruction *Ins = &C->Code[PC];
+
+        printf("%5d %4d:%-4d %-12s", PC, C->Position[PC].Line, C->Position[PC].CharacterPos, CompileOpName[Ins->Op]);
+        switch (Ins->Op)
+        {
+            case VmOpPushInt:
+                printf("%d", Ins->Operand);
+                break;
+
+            case VmOpPushFP:
+                printf("%.17g", C->Constant[Ins->Operand]);
+                break;
+
+            case VmOpLoad: case VmOpInitialise: case VmOpPrefix: case VmOpPostfix:
+            case VmOpAssign: case VmOpAssignInt: case VmOpAssignFP:
+                if (Ins->Op != VmOpLoad && Ins->Op != VmOpInitialise)
+                    printf("%s ", CompileTokenName[Ins->Token]);
+
+                if (Ins->Operand < C->NumSlots)
+                    printf("$%d", Ins->Operand);
+                else
+                    printf("%s", C->Name[Ins->Operand - C->NumSlots]);
+                break;
+
+            case VmOpUnary: case VmOpInfix: case VmOpInfixInt: case VmOpInfixFP:
+                printf("%s", CompileTokenName[Ins->Token]);
+                break;
+
+            case VmOpCast:
+                printf("%s", (Ins->Token == TypeFP) ? "double" : "int");
+                break;
+
+            case VmOpSkipIfFalse: case VmOpSkipIfTrue: case VmOpJump: case VmOpJumpIfFalse: case VmOpLoop:
+                printf("%d", Ins->Operand);
+                break;
+
+            case VmOpCall:
+                printf("%s %d", C->Name[Ins->Operand], Ins->Token);
+                break;
+
+            default:
+                break;
+        }
+        printf("\n");
+    }
+}
+
+/* compile a function's body, returns NULL if it uses something the virtual machine
+ * can't do and sets Reason to what. Inlined is set if calls were inlined */
+static struct VmFunction *CompileAttempt(Picoc *pc, const char *FuncName, struct FuncDef *Func, int Inline, int *Inlined, const char **Reason)
+{
+    struct Compiler *C = (struct Compiler *)calloc(1, sizeof(struct Compiler));
+    struct VmFunction *Result = NULL;
+    struct CompileNode *Body;
+    int Count;
+
+    *Reason = "out of memory";
+    if (C == NULL)
+        return NULL;
+
+    C->pc = pc;
+    C->Func = Func;
+    C->Inline = Inline;
+    ParserCopy(&C->Parser, &Func->Body);
+    C->Tokens = Func->Body.Pos;
+    if (!setjmp(C->Fail))
+    {
+        if (Func->VarArgs || (Func->ReturnType != &pc->VoidType && !IS_INTEGER_NUMERIC_TYPE(Func->ReturnType) && Func->ReturnType->Base != TypeFP))
+            CompileFail(C, "unsupported function type");
+
+        for (Count = 0; Count < Func->NumParams; Count++)
+        {
+            enum CompileType Typ = CompileTypeOf(pc, Func->ParamType[Count]);
+            if (Typ == CompileTypeVoid)
+                CompileFail(C, "unsupported parameter type");
+
+            CompileAddLocal(C, Func->ParamName[Count], Typ);
+        }
+
+        if (CompileGet(C, NULL) != TokenLeftBrace)
+            CompileFail(C, "function body expected");
+
+        Body = CompileBlock(C);
+
+        /* NOOPTIMISE in the environment turns the optimiser off, DUMPCODE lists the code made */
+        if (getenv("NOOPTIMISE") == NULL)
+            CompileOptimise(C, Body);
+
+        CompileGenerate(C, Body);
+        CompileEmit(C, CompileNewNode(C, NodeReturn), VmOpEnd, 0, 0);
+        Result = CompileFinish(C);
+        if (getenv("DUMPCODE") != NULL)
+            CompileDump(C, FuncName);
+    }
+#ifdef DEBUG_COMPILE
+    else
+        printf("%s() is interpreted: %s\n", FuncName, C->Reason);
+#endif
+
+    while (C->Nodes != NULL)
+    {
+        struct CompileNodeBlock *Next = C->Nodes->Next;
+        free(C->Nodes);
+        C->Nodes = Next;
+    }
+
+    free(C->Code);
+    free(C->Position);
+    free(C->Constant);
+    free(C->Global);
+    free(C->Name);
+    free(C->Used);
+    free(C->Changed);
+    *Inlined = C->Inlined;
+    *Reason = C->Reason;
+    free(C);
+    return Result;
+}
+
+/* compile a function's body, returns NULL if it uses something the virtual machine
+ * can't do and sets Reason to what */
+struct VmFunction *CompileFunction(Picoc *pc, const char *FuncName, struct FuncDef *Func, const char **Reason)
+{
+    int Inlined = FALSE;
+    struct VmFunction *Result = CompileAttempt(pc, FuncName, Func, TRUE, &Inlined, Reason);
+
+    /* inlining can make an expression too complex for the virtual machine's stack */
+    if (Result == NULL && Inlined)
+        Result = CompileAttempt(pc, FuncName, Func, FALSE, &Inlined, Reason);
+
+    return Result;
+}
+
+/* free a compiled function along with its machine code and what batch.c has of it */
+void CompileFree(Picoc *pc, struct VmFunction *Func)
+{
+    struct VmFunction **Link;
+
+    for (Link = &pc->CompiledList; *Link != NULL; Link = &(*Link)->Next)
+    {
+        if (*Link == Func)
+        {
+            *Link = Func->Next;
+            break;
+        }
+    }
+
+    JitFree(Func);
+    BatchFreeCode(Func);
+    HeapFreeMem(pc, Func);
+}
+
+/* free what the compiled functions have outside the heap, they go with it */
+void CompileCleanup(Picoc *pc)
+{
+    struct VmFunction *Func;
+
+    for (Func = pc->CompiledList; Func != NULL; Func = Func->Next)
+    {
+        JitFree(Func);
+        BatchFreeCode(Func);
+    }
+
+    pc->CompiledList = NULL;
+}
+
+/* compile all the functions which have been defined so far, then translate them
+ * to machine code, instead of waiting for tier.c to do it once they're hot. The
+ * report says why any of them wasn't, JITREPORT in the environment prints it */
+void PicocCompile(Picoc *pc)
+{
+    struct TableEntry *Entry;
+    int Count;
+
+    for (Count = 0; Count < pc->GlobalTable.Size; Count++)
+    {
+        for (Entry = pc->GlobalTable.HashTable[Count]; Entry != NULL; Entry = Entry->Next)
+        {
+            struct Value *Val = Entry->p.v.Val;
+            struct FuncDef *Func = &Val->Val->FuncDef;
+            const char *Reason;
+
+            if (Val->Typ != &pc->FunctionType || Func->Intrinsic != NULL || Func->Body.Pos == NULL || Func->Compiled != NULL)
+                continue;
+
+            /* it stays as it is now */
+            Func->TierUp = UINT_MAX;
+            Func->Compiled = CompileFunction(pc, Entry->p.v.Key, Func, &Reason);
+            if (Func->Compiled != NULL)
+                JitFunction(pc, Entry->p.v.Key, Func->Compiled);
+            else
+                JitReportAdd(pc, Entry->p.v.Key, "interpreted", Reason);
+        }
+    }
+}
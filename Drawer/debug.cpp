@@ -13,23 +13,6 @@ void DebugInit(Picoc *pc)
     pc->BreakpointCount = 0;
 }
 
-/* free the contents of the breakpoint table */
-void DebugCleanup(Picoc *pc)
-{
-    struct TableEntry *Entry;
-    struct TableEntry *NextEntry;
-    int Count;
-    
-    for (Count = 0; Count < pc->BreakpointTable.Size; Count++)
-    {
-        for (Entry = pc->BreakpointHashTable[Count]; Entry != NULL; Entry = NextEntry)
-        {
-            NextEntry = Entry->Next;
-            HeapFreeMem(pc, Entry);
-        }
-    }
-}
-
 /* search the table for a breakpoint */
 static struct TableEntry *DebugTableSearchBreakpoint(struct ParseState *Parser, int *AddAt)
 {
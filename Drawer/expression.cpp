@@ -295,33 +295,92 @@ void ExpressionStackPushValueNode(struct ParseState *Parser, struct ExpressionSt
 #endif
 }
 
+/* push a new value and the node for it on to the expression stack in one go. They're
+ * laid out the same as if the value was allocated and then pushed, so they're popped
+ * the same way. DataSize bytes for the value's own data follow it, if it has any */
+static struct Value *ExpressionStackPushNew(struct ParseState *Parser, struct ExpressionStack **StackTop, struct ValueType *Typ, int DataSize)
+{
+    int ValueSize = MEM_ALIGN(MEM_ALIGN(sizeof(struct Value)) + DataSize);
+    struct Value *NewValue = (struct Value *)HeapAllocStack(Parser->pc, ValueSize + MEM_ALIGN(sizeof(struct ExpressionStack)));
+    struct ExpressionStack *StackNode;
+    
+    if (NewValue == NULL)
+        ProgramFail(Parser, "out of memory");
+    
+    NewValue->Typ = Typ;
+    if (DataSize > 0)
+    {
+        NewValue->Val = (union AnyValue *)((char *)NewValue + MEM_ALIGN(sizeof(struct Value)));
+        NewValue->ValOnStack = TRUE;
+    }
+    NewValue->ScopeID = Parser->ScopeID;
+    
+    StackNode = (struct ExpressionStack *)((char *)NewValue + ValueSize);
+    StackNode->Next = *StackTop;
+    StackNode->Val = NewValue;
+    *StackTop = StackNode;
+#ifdef FANCY_ERROR_MESSAGES
+    StackNode->Line = Parser->Line;
+    StackNode->CharacterPos = Parser->CharacterPos;
+#endif
+#ifdef DEBUG_EXPRESSIONS
+    ExpressionStackShow(Parser->pc, *StackTop);
+#endif
+    
+    return NewValue;
+}
+
+/* push a value which refers to data somewhere else on to the expression stack */
+static void ExpressionStackPushReference(struct ParseState *Parser, struct ExpressionStack **StackTop, struct ValueType *Typ, union AnyValue *Val, int IsLValue, struct Value *LValueFrom)
+{
+    struct Value *ValueLoc = ExpressionStackPushNew(Parser, StackTop, Typ, 0);
+    ValueLoc->Val = Val;
+    ValueLoc->IsLValue = IsLValue;
+    ValueLoc->LValueFrom = LValueFrom;
+}
+
 /* push a blank value on to the expression stack by type */
 struct Value *ExpressionStackPushValueByType(struct ParseState *Parser, struct ExpressionStack **StackTop, struct ValueType *PushType)
 {
-    struct Value *ValueLoc = VariableAllocValueFromType(Parser->pc, Parser, PushType, FALSE, NULL, FALSE);
-    ExpressionStackPushValueNode(Parser, StackTop, ValueLoc);
+    int Size = TypeSize(PushType, PushType->ArraySize, FALSE);
+    if (Size < 0 && PushType != &Parser->pc->VoidType)
+        ProgramFailNoParser(Parser->pc, "can't allocate a value");
     
-    return ValueLoc;
+    return ExpressionStackPushNew(Parser, StackTop, PushType, Size);
 }
 
 /* push a value on to the expression stack */
 void ExpressionStackPushValue(struct ParseState *Parser, struct ExpressionStack **StackTop, struct Value *PushValue)
 {
-    struct Value *ValueLoc = VariableAllocValueAndCopy(Parser->pc, Parser, PushValue, FALSE);
-    ExpressionStackPushValueNode(Parser, StackTop, ValueLoc);
+    struct Value *ValueLoc;
+    int CopySize = TypeSizeValue(PushValue, TRUE);
+    
+    if (CopySize <= (int)sizeof(double))
+    {
+        /* the value may have just been popped from where it's going, so it's put aside first */
+        double Copy;
+        
+        memcpy((void *)&Copy, (void *)PushValue->Val, CopySize);
+        ValueLoc = ExpressionStackPushNew(Parser, StackTop, PushValue->Typ, CopySize);
+        memcpy((void *)ValueLoc->Val, (void *)&Copy, CopySize);
+        ValueLoc->IsLValue = PushValue->IsLValue;
+        ValueLoc->LValueFrom = PushValue->LValueFrom;
+    }
+    else
+    {
+        ValueLoc = VariableAllocValueAndCopy(Parser->pc, Parser, PushValue, FALSE);
+        ExpressionStackPushValueNode(Parser, StackTop, ValueLoc);
+    }
 }
 
 void ExpressionStackPushLValue(struct ParseState *Parser, struct ExpressionStack **StackTop, struct Value *PushValue, int Offset)
 {
-    struct Value *ValueLoc = VariableAllocValueShared(Parser, PushValue);
-    ValueLoc->Val = (AnyValue *)((char *)ValueLoc->Val + Offset);
-    ExpressionStackPushValueNode(Parser, StackTop, ValueLoc);
+    ExpressionStackPushReference(Parser, StackTop, PushValue->Typ, (union AnyValue *)((char *)PushValue->Val + Offset), PushValue->IsLValue, PushValue->IsLValue ? PushValue : NULL);
 }
 
 void ExpressionStackPushDereference(struct ParseState *Parser, struct ExpressionStack **StackTop, struct Value *DereferenceValue)
 {
     struct Value *DerefVal;
-    struct Value *ValueLoc;
     int Offset;
     struct ValueType *DerefType;
     int DerefIsLValue;
@@ -329,23 +388,20 @@ void ExpressionStackPushDereference(struct ParseState *Parser, struct Expression
     if (DerefDataLoc == NULL)
         ProgramFail(Parser, "NULL pointer dereference");
 
-    ValueLoc = VariableAllocValueFromExistingData(Parser, DerefType, (union AnyValue *)DerefDataLoc, DerefIsLValue, DerefVal);
-    ExpressionStackPushValueNode(Parser, StackTop, ValueLoc);
+    ExpressionStackPushReference(Parser, StackTop, DerefType, (union AnyValue *)DerefDataLoc, DerefIsLValue, DerefVal);
 }
 
 void ExpressionPushInt(struct ParseState *Parser, struct ExpressionStack **StackTop, long IntValue)
 {
-    struct Value *ValueLoc = VariableAllocValueFromType(Parser->pc, Parser, &Parser->pc->IntType, FALSE, NULL, FALSE);
+    struct Value *ValueLoc = ExpressionStackPushNew(Parser, StackTop, &Parser->pc->IntType, sizeof(ALIGN_TYPE));
     ValueLoc->Val->Integer = IntValue;
-    ExpressionStackPushValueNode(Parser, StackTop, ValueLoc);
 }
 
 #ifndef NO_FP
 void ExpressionPushFP(struct ParseState *Parser, struct ExpressionStack **StackTop, double FPValue)
 {
-    struct Value *ValueLoc = VariableAllocValueFromType(Parser->pc, Parser, &Parser->pc->FPType, FALSE, NULL, FALSE);
+    struct Value *ValueLoc = ExpressionStackPushNew(Parser, StackTop, &Parser->pc->FPType, sizeof(double));
     ValueLoc->Val->FP = FPValue;
-    ExpressionStackPushValueNode(Parser, StackTop, ValueLoc);
 }
 #endif
 
@@ -695,7 +751,6 @@ void ExpressionInfixOperator(struct ParseState *Parser, struct ExpressionStack *
     { 
         /* array index */
         int ArrayIndex;
-        struct Value *Result = NULL;
         
         if (!IS_NUMERIC_COERCIBLE(TopValue))
             ProgramFail(Parser, "array index must be an integer");
@@ -705,12 +760,10 @@ void ExpressionInfixOperator(struct ParseState *Parser, struct ExpressionStack *
         /* make the array element result */
         switch (BottomValue->Typ->Base)
         {
-            case TypeArray:   Result = VariableAllocValueFromExistingData(Parser, BottomValue->Typ->FromType, (union AnyValue *)(&BottomValue->Val->ArrayMem[0] + TypeSize(BottomValue->Typ, ArrayIndex, TRUE)), BottomValue->IsLValue, BottomValue->LValueFrom); break;
-            case TypePointer: Result = VariableAllocValueFromExistingData(Parser, BottomValue->Typ->FromType, (union AnyValue *)((char *)BottomValue->Val->Pointer + TypeSize(BottomValue->Typ->FromType, 0, TRUE) * ArrayIndex), BottomValue->IsLValue, BottomValue->LValueFrom); break;
+            case TypeArray:   ExpressionStackPushReference(Parser, StackTop, BottomValue->Typ->FromType, (union AnyValue *)(&BottomValue->Val->ArrayMem[0] + TypeSize(BottomValue->Typ, ArrayIndex, TRUE)), BottomValue->IsLValue, BottomValue->LValueFrom); break;
+            case TypePointer: ExpressionStackPushReference(Parser, StackTop, BottomValue->Typ->FromType, (union AnyValue *)((char *)BottomValue->Val->Pointer + TypeSize(BottomValue->Typ->FromType, 0, TRUE) * ArrayIndex), BottomValue->IsLValue, BottomValue->LValueFrom); break;
             default:          ProgramFail(Parser, "this is not an array");
         }
-        
-        ExpressionStackPushValueNode(Parser, StackTop, Result);
     }
     else if (Op == TokenQuestionMark)
         ExpressionQuestionMarkOperator(Parser, StackTop, TopValue, BottomValue);
@@ -1056,7 +1109,6 @@ void ExpressionGetStructElement(struct ParseState *Parser, struct ExpressionStac
         struct ValueType *StructType = ParamVal->Typ;
         char *DerefDataLoc = (char *)ParamVal->Val;
         struct Value *MemberValue = NULL;
-        struct Value *Result;
 
         /* if we're doing '->' dereference the struct pointer first */
         if (Token == TokenArrow)
@@ -1073,8 +1125,7 @@ void ExpressionGetStructElement(struct ParseState *Parser, struct ExpressionStac
         *StackTop = (*StackTop)->Next;
         
         /* make the result value for this member only */
-        Result = VariableAllocValueFromExistingData(Parser, MemberValue->Typ, (AnyValue *)(DerefDataLoc + MemberValue->Val->Integer), TRUE, (StructVal != NULL) ? StructVal->LValueFrom : NULL);
-        ExpressionStackPushValueNode(Parser, StackTop, Result);
+        ExpressionStackPushReference(Parser, StackTop, MemberValue->Typ, (AnyValue *)(DerefDataLoc + MemberValue->Val->Integer), TRUE, (StructVal != NULL) ? StructVal->LValueFrom : NULL);
     }
 }
 
@@ -1429,8 +1480,7 @@ void ExpressionParseMacroCall(struct ParseState *Parser, struct ExpressionStack
         
         ParserCopy(&MacroParser, &MDef->Body);
         MacroParser.Mode = Parser->Mode;
-        VariableStackFrameAdd(Parser, MacroName, 0);
-        Parser->pc->TopStackFrame->NumParams = ArgCount;
+        VariableStackFrameAdd(Parser, MacroName, NULL, NULL, 0);
         Parser->pc->TopStackFrame->ReturnValue = ReturnValue;
         for (Count = 0; Count < MDef->NumParams; Count++)
             VariableDefine(Parser->pc, Parser, MDef->ParamName[Count], ParamArray[Count], NULL, TRUE);
@@ -1442,6 +1492,42 @@ void ExpressionParseMacroCall(struct ParseState *Parser, struct ExpressionStack
     }
 }
 
+/* run a function once its stack frame is pushed and its arguments are in ParamArray */
+void ExpressionCallFunction(struct ParseState *Parser, const char *FuncName, struct Value *FuncValue, struct Value *ReturnValue, struct Value **ParamArray, int ArgCount)
+{
+    if (FuncValue->Val->FuncDef.Intrinsic == NULL)
+    { 
+        /* run a user-defined function */
+        struct ParseState FuncParser;
+        
+        if (FuncValue->Val->FuncDef.Body.Pos == NULL)
+            ProgramFail(Parser, "'%s' is undefined", FuncName);
+        
+        ParserCopy(&FuncParser, &FuncValue->Val->FuncDef.Body);
+        FuncParser.Function = &FuncValue->Val->FuncDef;
+        VariableStackFrameAdd(Parser, FuncName, FuncValue->Val->FuncDef.ParamName, ParamArray, FuncValue->Val->FuncDef.NumParams);
+        Parser->pc->TopStackFrame->ReturnValue = ReturnValue;
+
+        /* it can be compiled here, then it runs as bytecode from this call on */
+        TIER_COUNT_CALL(Parser, FuncName, &FuncValue->Val->FuncDef);
+        if (FuncValue->Val->FuncDef.Compiled != NULL)
+            VmRun(&FuncParser, FuncValue->Val->FuncDef.Compiled, ParamArray);
+
+        else if (ParseStatement(&FuncParser, TRUE) != ParseResultOk)
+            ProgramFail(&FuncParser, "function body expected");
+        
+        if (FuncParser.Mode == RunModeRun && FuncValue->Val->FuncDef.ReturnType != &Parser->pc->VoidType)
+            ProgramFail(&FuncParser, "no value returned from a function returning something");
+
+        else if (FuncParser.Mode == RunModeGoto)
+            ProgramFail(&FuncParser, "couldn't find goto label '%s'", FuncParser.SearchGotoLabel);
+        
+        VariableStackFramePop(Parser);
+    }
+    else
+        FuncValue->Val->FuncDef.Intrinsic(Parser, ReturnValue, ParamArray, ArgCount);
+}
+
 /* do a function call */
 void ExpressionParseFunctionCall(struct ParseState *Parser, struct ExpressionStack **StackTop, const char *FuncName, int RunIt)
 {
@@ -1455,6 +1541,8 @@ void ExpressionParseFunctionCall(struct ParseState *Parser, struct ExpressionSta
     
     if (RunIt)
     { 
+        CHECK_CANCELLED(Parser);
+        
         /* get the function definition */
         VariableGet(Parser->pc, Parser, FuncName, &FuncValue);
         
@@ -1471,9 +1559,7 @@ void ExpressionParseFunctionCall(struct ParseState *Parser, struct ExpressionSta
         ExpressionStackPushValueByType(Parser, StackTop, FuncValue->Val->FuncDef.ReturnType);
         ReturnValue = (*StackTop)->Val;
         HeapPushStackFrame(Parser->pc);
-        ParamArray = (Value**)HeapAllocStack(Parser->pc, sizeof(struct Value *) * FuncValue->Val->FuncDef.NumParams);    
-        if (ParamArray == NULL)
-            ProgramFail(Parser, "out of memory");
+        ParamArray = VariableAllocParameters(Parser, &FuncValue->Val->FuncDef);
     }
     else
     {
@@ -1484,9 +1570,6 @@ void ExpressionParseFunctionCall(struct ParseState *Parser, struct ExpressionSta
     /* parse arguments */
     ArgCount = 0;
     do {
-        if (RunIt && ArgCount < FuncValue->Val->FuncDef.NumParams)
-            ParamArray[ArgCount] = VariableAllocValueFromType(Parser->pc, Parser, FuncValue->Val->FuncDef.ParamType[ArgCount], FALSE, NULL, FALSE);
-        
         if (ExpressionParse(Parser, &Param))
         {
             if (RunIt)
@@ -1526,46 +1609,7 @@ void ExpressionParseFunctionCall(struct ParseState *Parser, struct ExpressionSta
         if (ArgCount < FuncValue->Val->FuncDef.NumParams)
             ProgramFail(Parser, "not enough arguments to '%s'", FuncName);
         
-        if (FuncValue->Val->FuncDef.Intrinsic == NULL)
-        { 
-            /* run a user-defined function */
-            struct ParseState FuncParser;
-            int Count;
-            int OldScopeID = Parser->ScopeID;
-            
-            if (FuncValue->Val->FuncDef.Body.Pos == NULL)
-                ProgramFail(Parser, "'%s' is undefined", FuncName);
-            
-            ParserCopy(&FuncParser, &FuncValue->Val->FuncDef.Body);
-            VariableStackFrameAdd(Parser, FuncName, FuncValue->Val->FuncDef.Intrinsic ? FuncValue->Val->FuncDef.NumParams : 0);
-            Parser->pc->TopStackFrame->NumParams = ArgCount;
-            Parser->pc->TopStackFrame->ReturnValue = ReturnValue;
-
-            /* Function parameters should not go out of scope */
-            Parser->ScopeID = -1;
-
-            for (Count = 0; Count < FuncValue->Val->FuncDef.NumParams; Count++)
-                VariableDefine(Parser->pc, Parser, FuncValue->Val->FuncDef.ParamName[Count], ParamArray[Count], NULL, TRUE);
-
-            Parser->ScopeID = OldScopeID;
-                
-            if (ParseStatement(&FuncParser, TRUE) != ParseResultOk)
-                ProgramFail(&FuncParser, "function body expected");
-            
-            if (RunIt)
-            {
-                if (FuncParser.Mode == RunModeRun && FuncValue->Val->FuncDef.ReturnType != &Parser->pc->VoidType)
-                    ProgramFail(&FuncParser, "no value returned from a function returning something");
-
-                else if (FuncParser.Mode == RunModeGoto)
-                    ProgramFail(&FuncParser, "couldn't find goto label '%s'", FuncParser.SearchGotoLabel);
-            }
-            
-            VariableStackFramePop(Parser);
-        }
-        else
-            FuncValue->Val->FuncDef.Intrinsic(Parser, ReturnValue, ParamArray, ArgCount);
-
+        ExpressionCallFunction(Parser, FuncName, FuncValue, ReturnValue, ParamArray, ArgCount);
         HeapPopStackFrame(Parser->pc);
     }
 
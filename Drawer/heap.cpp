@@ -2,10 +2,43 @@
  * allocator for embedded systems which have no memory allocator. Alternatively
  * you can define USE_MALLOC_HEAP to use your system's own malloc() allocator */
  
-/* stack grows up from the bottom and heap grows down from the top of heap space */
+/* stack grows up from the bottom and heap grows down from the top of heap space.
+ * With USE_MALLOC_HEAP the heap is an arena instead. Allocations are carved from
+ * chunks taken from malloc(), each one is of a size class and when it's freed it
+ * goes on its class's free list for the next one of that size. Only allocations
+ * too big for a class are malloc()ed on their own. Nothing is given back before
+ * HeapCleanup(), which hands all the chunks at once to a cache the next
+ * interpreter takes its chunks from */
 #include "interpreter.h"
 
-#ifdef DEBUG_HEAP
+#ifdef USE_MALLOC_HEAP
+#include <mutex>
+
+/* a chunk, the allocations follow it */
+struct HeapChunk
+{
+    struct HeapChunk *Next;
+};
+
+/* an allocation too big for a class, they're listed so they can be freed together */
+struct HeapLarge
+{
+    struct HeapLarge *Next;
+    struct HeapLarge *Previous;
+};
+
+#define HEAP_HEADER MEM_ALIGN(sizeof(int))                      /* the class, before each allocation */
+#define HEAP_CHUNK_HEADER MEM_ALIGN(sizeof(struct HeapChunk))
+#define HEAP_LARGE_HEADER MEM_ALIGN(sizeof(struct HeapLarge))
+#define HEAP_LARGE_CLASS ((int)HEAP_CLASSES)
+
+/* chunks interpreters have finished with, shared by all of them */
+static std::mutex HeapCacheMutex;
+static struct HeapChunk *HeapCache = NULL;
+static int HeapCacheCount = 0;
+#endif
+
+#if defined(DEBUG_HEAP) && !defined(USE_MALLOC_HEAP)
 void ShowBigList(Picoc *pc)
 {
     struct AllocNode *LPos;
@@ -50,13 +83,65 @@ void HeapInit(Picoc *pc, int StackOrHeapSize)
     pc->HeapStackTop = &(pc->HeapMemory)[AlignOffset];
     *(void **)(pc->StackFrame) = NULL;
     pc->HeapBottom = &(pc->HeapMemory)[StackOrHeapSize-sizeof(ALIGN_TYPE)+AlignOffset];
+#ifdef USE_MALLOC_HEAP
+    pc->HeapChunks = NULL;
+    pc->HeapChunkLast = NULL;
+    pc->HeapChunkCount = 0;
+    pc->HeapChunkNext = NULL;
+    pc->HeapChunkEnd = NULL;
+    pc->HeapLarge = NULL;
+    for (Count = 0; Count < (int)HEAP_CLASSES; Count++)
+        pc->HeapFreeList[Count] = NULL;
+#else
     pc->FreeListBig = NULL;
     for (Count = 0; Count < FREELIST_BUCKETS; Count++)
         pc->FreeListBucket[Count] = NULL;
+#endif
 }
 
+/* free the stack and the whole heap. the chunks go to the cache unless it's full */
 void HeapCleanup(Picoc *pc)
 {
+#ifdef USE_MALLOC_HEAP
+    struct HeapChunk *Chunk = pc->HeapChunks;
+    struct HeapLarge *Large = pc->HeapLarge;
+
+    while (Large != NULL)
+    {
+        struct HeapLarge *Next = Large->Next;
+
+        free(Large);
+        Large = Next;
+    }
+
+    if (Chunk != NULL)
+    {
+        std::lock_guard<std::mutex> Lock(HeapCacheMutex);
+
+        if (HeapCacheCount + pc->HeapChunkCount <= HEAP_CHUNK_CACHE)
+        {
+            pc->HeapChunkLast->Next = HeapCache;
+            HeapCache = Chunk;
+            HeapCacheCount += pc->HeapChunkCount;
+            Chunk = NULL;
+        }
+    }
+
+    while (Chunk != NULL)
+    {
+        struct HeapChunk *Next = Chunk->Next;
+
+        free(Chunk);
+        Chunk = Next;
+    }
+
+    pc->HeapChunks = NULL;
+    pc->HeapChunkLast = NULL;
+    pc->HeapChunkCount = 0;
+    pc->HeapChunkNext = NULL;
+    pc->HeapChunkEnd = NULL;
+    pc->HeapLarge = NULL;
+#endif
 #ifdef USE_MALLOC_STACK
     free(pc->HeapMemory);
 #endif
@@ -134,11 +219,108 @@ int HeapPopStackFrame(Picoc *pc)
         return FALSE;
 }
 
+#ifdef USE_MALLOC_HEAP
+/* the size class of an allocation and the space it takes */
+static int HeapClass(int Size, int *ClassSize)
+{
+    int Class = HEAP_SMALL_MAX / sizeof(ALIGN_TYPE);
+    int Bytes;
+
+    if (Size <= HEAP_SMALL_MAX)
+    {
+        *ClassSize = (Size > 0) ? MEM_ALIGN(Size) : sizeof(ALIGN_TYPE);
+        return *ClassSize / sizeof(ALIGN_TYPE) - 1;
+    }
+
+    for (Bytes = HEAP_SMALL_MAX * 2; Bytes < Size; Bytes *= 2)
+        Class++;
+
+    *ClassSize = Bytes;
+    return Class;
+}
+
+/* start carving from another chunk, out of the cache if there's one there */
+static int HeapNewChunk(Picoc *pc)
+{
+    struct HeapChunk *Chunk = NULL;
+
+    {
+        std::lock_guard<std::mutex> Lock(HeapCacheMutex);
+
+        if (HeapCache != NULL)
+        {
+            Chunk = HeapCache;
+            HeapCache = Chunk->Next;
+            HeapCacheCount--;
+        }
+    }
+
+    if (Chunk == NULL)
+    {
+        Chunk = (struct HeapChunk *)malloc(HEAP_CHUNK_SIZE);
+        if (Chunk == NULL)
+            return FALSE;
+    }
+
+    Chunk->Next = pc->HeapChunks;
+    pc->HeapChunks = Chunk;
+    if (Chunk->Next == NULL)
+        pc->HeapChunkLast = Chunk;
+
+    pc->HeapChunkCount++;
+    pc->HeapChunkNext = (char *)Chunk + HEAP_CHUNK_HEADER;
+    pc->HeapChunkEnd = (char *)Chunk + HEAP_CHUNK_SIZE;
+    return TRUE;
+}
+
+static void *HeapAllocLarge(Picoc *pc, int Size)
+{
+    struct HeapLarge *Large = (struct HeapLarge *)calloc(1, HEAP_LARGE_HEADER + HEAP_HEADER + Size);
+    char *NewMem;
+
+    if (Large == NULL)
+        return NULL;
+
+    Large->Next = pc->HeapLarge;
+    Large->Previous = NULL;
+    if (Large->Next != NULL)
+        Large->Next->Previous = Large;
+
+    pc->HeapLarge = Large;
+    NewMem = (char *)Large + HEAP_LARGE_HEADER;
+    *(int *)NewMem = HEAP_LARGE_CLASS;
+    return NewMem + HEAP_HEADER;
+}
+#endif
+
 /* allocate some dynamically allocated memory. memory is cleared. can return NULL if out of memory */
 void *HeapAllocMem(Picoc *pc, int Size)
 {
 #ifdef USE_MALLOC_HEAP
-    return calloc(Size, 1);
+    char *NewMem;
+    int ClassSize;
+    int Class;
+
+    if (Size > HEAP_LARGE_MIN)
+        return HeapAllocLarge(pc, Size);
+
+    /* a freed one of the same class, or the next space in the chunk */
+    Class = HeapClass(Size, &ClassSize);
+    NewMem = (char *)pc->HeapFreeList[Class];
+    if (NewMem != NULL)
+        pc->HeapFreeList[Class] = *(void **)NewMem;
+    else
+    {
+        if (pc->HeapChunkEnd - pc->HeapChunkNext < (int)HEAP_HEADER + ClassSize && !HeapNewChunk(pc))
+            return NULL;
+
+        *(int *)pc->HeapChunkNext = Class;
+        NewMem = pc->HeapChunkNext + HEAP_HEADER;
+        pc->HeapChunkNext = NewMem + ClassSize;
+    }
+
+    memset((void *)NewMem, '\0', Size);
+    return NewMem;
 #else
     struct AllocNode *NewMem = NULL;
     struct AllocNode **FreeNode;
@@ -229,7 +411,32 @@ void *HeapAllocMem(Picoc *pc, int Size)
 void HeapFreeMem(Picoc *pc, void *Mem)
 {
 #ifdef USE_MALLOC_HEAP
-    free(Mem);
+    int Class;
+
+    if (Mem == NULL)
+        return;
+
+    Class = *(int *)((char *)Mem - HEAP_HEADER);
+    if (Class == HEAP_LARGE_CLASS)
+    {
+        struct HeapLarge *Large = (struct HeapLarge *)((char *)Mem - HEAP_HEADER - HEAP_LARGE_HEADER);
+
+        if (Large->Previous != NULL)
+            Large->Previous->Next = Large->Next;
+        else
+            pc->HeapLarge = Large->Next;
+
+        if (Large->Next != NULL)
+            Large->Next->Previous = Large->Previous;
+
+        free(Large);
+    }
+    else
+    {
+        /* it's kept for the next allocation of its class */
+        *(void **)Mem = pc->HeapFreeList[Class];
+        pc->HeapFreeList[Class] = Mem;
+    }
 #else
     struct AllocNode *MemNode = (struct AllocNode *)((char *)Mem - MEM_ALIGN(sizeof(MemNode->Size)));
     int Bucket = MemNode->Size >> 2;
@@ -27,22 +27,6 @@ void IncludeInit(Picoc *pc)
 #endif
 }
 
-/* clean up space used by the include system */
-void IncludeCleanup(Picoc *pc)
-{
-    struct IncludeLibrary *ThisInclude = pc->IncludeLibList;
-    struct IncludeLibrary *NextInclude;
-    
-    while (ThisInclude != NULL)
-    {
-        NextInclude = ThisInclude->NextLib;
-        HeapFreeMem(pc, ThisInclude);
-        ThisInclude = NextInclude;
-    }
-
-    pc->IncludeLibList = NULL;
-}
-
 /* register a new build-in include file */
 void IncludeRegister(Picoc *pc, const char *IncludeName, void (*SetupFunction)(Picoc *pc), struct LibraryFunction *FuncList, struct LibraryConstant *CstList, const char *SetupCSource)
 {
@@ -7,6 +7,7 @@
 
 #include "platform.h"
 #include <string>
+#include <atomic>
 
 /* handy definitions */
 #ifndef TRUE
@@ -23,6 +24,15 @@
 
 #define GETS_BUF_MAX 256
 
+/* stop the program at a statement or call once the job running it has been cancelled */
+#define CHECK_CANCELLED(Parser) do { if ((Parser)->pc->Cancel != NULL && (Parser)->pc->Cancel->load(std::memory_order_relaxed)) ProgramFail(Parser, "cancelled"); } while (0)
+
+/* count a call of a user function, moving it up a tier once it's hot enough, see tier.c */
+#define TIER_COUNT_CALL(Parser, FuncName, Func) do { if (++(Func)->Calls + (Func)->BackEdges >= (Func)->TierUp) TierPromote(Parser, FuncName, Func); } while (0)
+
+/* count a loop going round in the function being interpreted */
+#define TIER_COUNT_LOOP(Parser) do { if ((Parser)->Function != NULL) (Parser)->Function->BackEdges++; } while (0)
+
 /* for debugging */
 #define PRINT_SOURCE_POS ({ PrintSourceTextErrorLine(Parser->pc, Parser->FileName, Parser->SourceText, Parser->Line, Parser->CharacterPos); PlatformPrintf(Parser->pc, "\n"); })
 
@@ -53,9 +63,17 @@ typedef FILE IOFILE;
 
 struct Table;
 struct Picoc_Struct;
+struct NativeProgram;
+struct BatchProgram;
+struct TierJob;
+struct HeapChunk;
+struct HeapLarge;
 
 typedef struct Picoc_Struct Picoc;
 
+/* cancellation token of an evaluation job, shared by all the programs running for it */
+typedef std::atomic<bool> CancelToken;
+
 /* lexical tokens */
 enum LexToken
 {
@@ -123,7 +141,8 @@ struct ParseState
     short int HashIfLevel;      /* how many "if"s we're nested down */
     short int HashIfEvaluateToLevel;    /* if we're not evaluating an if branch, what the last evaluated level was */
     char DebugMode;             /* debugging mode */
-    int ScopeID;                /* for keeping track of local variables (free them after they go out of scope) */
+    intptr_t ScopeID;           /* for keeping track of local variables (free them after they go out of scope) */
+    struct FuncDef *Function;   /* the function whose body this is, NULL outside of them */
 };
 
 /* values */
@@ -178,6 +197,11 @@ struct FuncDef
     char **ParamName;               /* array of parameter names */
     void (*Intrinsic)(struct ParseState *Parser, struct Value *, struct Value **, int);            /* intrinsic call address or NULL */
     struct ParseState Body;         /* lexical tokens of the function body if not intrinsic */
+    struct VmFunction *Compiled;    /* the body compiled to bytecode, or NULL to interpret it */
+    int ParamSize;                  /* bytes taken by the parameters of a call, worked out on the first call */
+    unsigned int Calls;             /* how hot it is, see tier.c */
+    unsigned int BackEdges;         /* the times loops in it have gone round */
+    unsigned int TierUp;            /* Calls + BackEdges when tier.c looks at it again */
 };
 
 /* macro definition */
@@ -219,7 +243,7 @@ struct Value
     char ValOnStack;                /* the AnyValue is on the stack along with this Value */
     char AnyValOnHeap;              /* the AnyValue is separately allocated from the Value on the heap */
     char IsLValue;                  /* is modifiable and is allocated somewhere we can usefully modify it */
-    int ScopeID;                    /* to know when it goes out of scope */
+    intptr_t ScopeID;               /* to know when it goes out of scope */
     char OutOfScope;
 };
 
@@ -227,6 +251,7 @@ struct Value
 struct TableEntry
 {
     struct TableEntry *Next;        /* next item in this hash chain */
+    struct TableEntry *ScopeNext;   /* next variable defined in the same scope */
     const char *DeclFileName;       /* where the variable was declared */
     unsigned short DeclLine;
     unsigned short DeclColumn;
@@ -256,17 +281,120 @@ struct Table
     short Size;
     short OnHeap;
     struct TableEntry **HashTable;
+    short ScopesSize;
+    short NumScopes;
+    struct VariableScope **Scopes;  /* the scopes which have defined variables in this table, by ScopeID. NULL until there's one */
+};
+
+/* the variables defined directly in a block, to hide them when it's left and
+ * bring them back when it's entered again */
+struct VariableScope
+{
+    intptr_t ScopeID;               /* where the block starts in its tokens */
+    struct VariableScope *Next;
+    struct TableEntry *Entries;     /* chained through ScopeNext */
+};
+
+/* the value a global or static variable had when the program was ready to run,
+ * put back before each sample so they all start alike. The data follows it */
+struct VariableSnapshot
+{
+    struct VariableSnapshot *Next;
+    union AnyValue *Val;            /* where the variable's data is */
+    int Size;
+};
+
+/* virtual machine instructions. Variables are numbered at compile time, the
+ * function's locals come first and then the globals it uses */
+enum VmOp
+{
+    VmOpPushInt,                    /* push the integer Operand */
+    VmOpPushFP,                     /* push Constant[Operand] */
+    VmOpLoad,                       /* push variable Operand */
+    VmOpAssign,                     /* apply the assignment operator Token to variable Operand, leaving the result */
+    VmOpInitialise,                 /* pop the initial value of local Operand */
+    VmOpPrefix,                     /* ++ or -- variable Operand, leaving the new value */
+    VmOpPostfix,                    /* variable Operand ++ or --, leaving the old value */
+    VmOpUnary,                      /* apply the prefix operator Token */
+    VmOpInfix,                      /* apply the infix operator Token */
+    VmOpInfixInt,                   /* apply the infix operator Token to two ints */
+    VmOpInfixFP,                    /* apply the infix operator Token to two doubles */
+    VmOpAssignInt,                  /* apply the assignment operator Token to int variable Operand with an int */
+    VmOpAssignFP,                   /* apply the assignment operator Token to double variable Operand with a double */
+    VmOpIntToFP,                    /* convert an int to a double */
+    VmOpCast,                       /* convert to the base type Token */
+    VmOpTernary,                    /* pick one of two values by the value below them */
+    VmOpSkipIfFalse,                /* left side of && is false - push 0 and go to the && at Operand */
+    VmOpSkipIfTrue,                 /* left side of || is true - push 0 and go to the || at Operand */
+    VmOpJump,                       /* go to Operand */
+    VmOpJumpIfFalse,                /* pop a condition and go to Operand if it's false */
+    VmOpLoop,                       /* go back to Operand for another iteration */
+    VmOpCall,                       /* call the function Global[Operand] with Token arguments */
+    VmOpPop,                        /* discard a value */
+    VmOpReturn,                     /* pop the return value and leave the function */
+    VmOpReturnVoid,                 /* leave a void function */
+    VmOpEnd                         /* fell off the end of the function body */
+};
+
+struct VmInstruction
+{
+    unsigned char Op;               /* an enum VmOp */
+    unsigned char Token;            /* the operator, base type or argument count */
+    int Operand;                    /* an integer, jump target, variable number or index into the function's tables */
+};
+
+/* where an instruction came from in the source, for error messages */
+struct VmPosition
+{
+    short int Line;
+    short int CharacterPos;
+};
+
+/* the value of an int or double variable. Globals are used in place through
+ * their union AnyValue, which starts the same way */
+union VmNumber
+{
+    int Integer;
+    double FP;
+};
+
+/* a function body compiled to bytecode */
+struct VmFunction
+{
+    struct VmInstruction *Code;     /* the instructions */
+    struct VmPosition *Position;    /* the source position of each instruction */
+    double *Constant;               /* floating point constants */
+    struct Value **Global;          /* the global variables and functions it uses */
+    char **Name;                    /* the names of the globals (registered strings) */
+    unsigned char *Type;            /* the base type of each variable, TypeInt or TypeFP */
+    int CodeSize;                   /* the number of instructions */
+    int StackSize;                  /* the most values on the stack at once */
+    int NumLocals;                  /* parameters and local variables, the parameters first */
+    int NumParams;
+    void *Native;                   /* the code translated to machine code by jit.c, or NULL */
+    int NativeSize;                 /* the bytes of machine code */
+    int NativeEntry;                /* where Native is in them */
+    struct BatchCode *Batch;        /* what batch.c has worked out about it, or NULL */
+    struct FuncDef *Def;            /* the function it's the body of */
+    struct VmFunction *Next;        /* the next in pc->CompiledList */
+};
+
+/* a value on the virtual machine's stack - arithmetic only produces ints and doubles */
+struct VmValue
+{
+    enum BaseType Typ;              /* TypeInt or TypeFP */
+    union VmNumber Val;
 };
 
 /* stack frame for function calls */
 struct StackFrame
 {
-    struct ParseState ReturnParser;         /* how we got here */
     const char *FuncName;                   /* the name of the function we're in */
     struct Value *ReturnValue;              /* copy the return value here */
-    struct Value **Parameter;               /* array of parameter values */
+    struct Value **Parameter;               /* array of parameter values, they're variables of the function as they are */
+    char **ParamName;                       /* array of parameter names */
     int NumParams;                          /* the number of parameters */
-    struct Table LocalTable;                /* the local variables and parameters */
+    struct Table LocalTable;                /* the local variables, set up when the first one is defined */
     struct TableEntry *LocalHashTable[LOCAL_TABLE_SIZE];
     struct StackFrame *PreviousStackFrame;  /* the next lower stack frame */
 };
@@ -340,6 +468,53 @@ struct CleanupTokenNode
     struct CleanupTokenNode *Next;
 };
 
+/* where a statement which has been parsed without running ends, so it can be jumped over next time */
+struct ParseSkip
+{
+    const unsigned char *Start;         /* the first token of the statement */
+    const unsigned char *End;           /* just past its last token */
+    short int Line;                     /* the line and column at the end */
+    short int CharacterPos;
+    char Declares;                      /* it declares variables, which a goto passing through still defines */
+    struct ParseSkip *Next;
+};
+
+/* somewhere in the token stream which can be jumped to */
+struct ParseJump
+{
+    const unsigned char *Pos;
+    short int Line;
+    short int CharacterPos;
+};
+
+/* a case label of a switch */
+struct ParseCase
+{
+    int Value;
+    int Used;
+    struct ParseJump Target;            /* the statement after the label */
+};
+
+/* the case labels of a switch, hashed by their value */
+struct ParseSwitch
+{
+    const unsigned char *Start;         /* the first token of the switch's body */
+    int NumSlots;                       /* size of the case hash table, a power of two. -1 if the cases can't be indexed */
+    int HasDefault;
+    struct ParseJump Default;
+    struct ParseJump End;               /* the closing brace, where we go if nothing matches */
+    struct ParseCase *Cases;
+    struct ParseSwitch *Next;
+};
+
+/* where a goto label is */
+struct ParseLabel
+{
+    const char *Name;                   /* registered string */
+    const unsigned char *Pos;
+    struct ParseLabel *Next;
+};
+
 /* linked list of lexical tokens used in interactive mode */
 struct TokenLine
 {
@@ -361,6 +536,9 @@ struct IncludeLibrary
 
 #define FREELIST_BUCKETS 8                          /* freelists for 4, 8, 12 ... 32 byte allocs */
 #define SPLIT_MEM_THRESHOLD 16                      /* don't split memory which is close in size */
+#define HEAP_SMALL_MAX 256                          /* allocations up to this size have a size class every MEM_ALIGN() bytes */
+#define HEAP_LARGE_MIN (HEAP_CHUNK_SIZE / 4)        /* and above it one for each power of two up to this, bigger ones are malloc()ed */
+#define HEAP_CLASSES (HEAP_SMALL_MAX / sizeof(ALIGN_TYPE) + 8)
 #define BREAKPOINT_TABLE_SIZE 21
 #define ERROR_BUFFER_SIZE 1024
 
@@ -372,6 +550,13 @@ struct Picoc_Struct
     struct Table GlobalTable;
     struct CleanupTokenNode *CleanupTokenList;
     struct TableEntry *GlobalHashTable[GLOBAL_TABLE_SIZE];
+    struct ParseSkip *SkipHashTable[SKIP_TABLE_SIZE];
+    struct ParseSwitch *SwitchHashTable[SKIP_TABLE_SIZE];
+    struct ParseLabel *LabelHashTable[SKIP_TABLE_SIZE];
+    int SkipBarrier;                    /* bumped by anything which has an effect even when skipped, so it isn't jumped over */
+    int DeclarationCount;               /* bumped by every declaration */
+    struct VariableSnapshot *Snapshot;  /* the variables to put back before a sample, see VariableSnapshotTake() */
+    int SnapshotTaken;                  /* statics are added to the snapshot when they're first initialised */
     
     /* lexer global data */
     struct TokenLine *InteractiveHead;
@@ -380,6 +565,7 @@ struct Picoc_Struct
     int LexUseStatementPrompt;
     union AnyValue LexAnyValue;
     struct Value LexValue;
+    int LexStatic;                      /* a static has been lexed, whose variable only appears once it's run */
     struct Table ReservedWordTable;
     struct TableEntry *ReservedWordHashTable[RESERVED_WORD_TABLE_SIZE];
 
@@ -417,8 +603,18 @@ struct Picoc_Struct
 # endif
 #endif
 
+#ifdef USE_MALLOC_HEAP
+    struct HeapChunk *HeapChunks;       /* the chunks allocations are carved from, the one in use first */
+    struct HeapChunk *HeapChunkLast;
+    int HeapChunkCount;
+    char *HeapChunkNext;                /* what's left of the chunk in use */
+    char *HeapChunkEnd;
+    void *HeapFreeList[HEAP_CLASSES];   /* freed allocations of each size class, see heap.c */
+    struct HeapLarge *HeapLarge;        /* allocations too big for a class */
+#else
     struct AllocNode *FreeListBucket[FREELIST_BUCKETS];      /* we keep a pool of freelist buckets to reduce fragmentation */
     struct AllocNode *FreeListBig;                           /* free memory which doesn't fit in a bucket */
+#endif
 
     /* types */    
     struct ValueType UberType;
@@ -443,6 +639,8 @@ struct Picoc_Struct
     struct ValueType *CharPtrPtrType;
     struct ValueType *CharArrayType;
     struct ValueType *VoidPtrType;
+    char StructTempNameBuf[7];          /* names given to anonymous structs and enums */
+    char EnumTempNameBuf[7];
 
     /* debugger */
     struct Table BreakpointTable;
@@ -457,6 +655,19 @@ struct Picoc_Struct
 	char ErrorBuffer[ERROR_BUFFER_SIZE];
 	unsigned ErrorBufferLength;
 
+    /* set from another thread to stop the program, can be NULL */
+    CancelToken *Cancel;
+
+    /* why functions weren't translated to machine code, a line for each, or NULL */
+    char *JitReport;
+
+    /* every function compiled to bytecode, they've memory outside the heap */
+    struct VmFunction *CompiledList;
+
+    /* translations and builds tier.c has asked for, and the last report of how functions run */
+    struct TierJob *TierJobs;
+    char *TierReport;
+
     /* the picoc version string */
     const char *VersionString;
     
@@ -480,14 +691,13 @@ char *TableStrRegister(Picoc *pc, const char *Str);
 char *TableStrRegister2(Picoc *pc, const char *Str, int Len);
 void TableInitTable(struct Table *Tbl, struct TableEntry **HashTable, int Size, int OnHeap);
 int TableSet(Picoc *pc, struct Table *Tbl, char *Key, struct Value *Val, const char *DeclFileName, int DeclLine, int DeclColumn);
+struct TableEntry *TableAdd(Picoc *pc, struct Table *Tbl, char *Key, struct Value *Val, const char *DeclFileName, int DeclLine, int DeclColumn);
 int TableGet(struct Table *Tbl, const char *Key, struct Value **Val, const char **DeclFileName, int *DeclLine, int *DeclColumn);
 struct Value *TableDelete(Picoc *pc, struct Table *Tbl, const char *Key);
 char *TableSetIdentifier(Picoc *pc, struct Table *Tbl, const char *Ident, int IdentLen);
-void TableStrFree(Picoc *pc);
 
 /* lex.c */
 void LexInit(Picoc *pc);
-void LexCleanup(Picoc *pc);
 void *LexAnalyse(Picoc *pc, const char *FileName, const char *Source, int SourceLen, int *TokenLen);
 void LexInitParser(struct ParseState *Parser, Picoc *pc, const char *SourceText, void *TokenSource, char *FileName, int RunIt, int SetDebugMode);
 enum LexToken LexGetToken(struct ParseState *Parser, struct Value **Value, int IncPos);
@@ -505,9 +715,10 @@ void LexInteractiveStatementPrompt(Picoc *pc);
 void PicocParseInteractiveNoStartPrompt(Picoc *pc, int EnableDebugger);
 enum ParseResult ParseStatement(struct ParseState *Parser, int CheckTrailingSemicolon);
 struct Value *ParseFunctionDefinition(struct ParseState *Parser, struct ValueType *ReturnType, char *Identifier);
-void ParseCleanup(Picoc *pc);
+void ParseInit(Picoc *pc);
 void ParserCopyPos(struct ParseState *To, struct ParseState *From);
 void ParserCopy(struct ParseState *To, struct ParseState *From);
+void ParseSkipClear(Picoc *pc);
 
 /* expression.c */
 int ExpressionParse(struct ParseState *Parser, struct Value **Result);
@@ -518,10 +729,47 @@ unsigned long ExpressionCoerceUnsignedInteger(struct Value *Val);
 #ifndef NO_FP
 double ExpressionCoerceFP(struct Value *Val);
 #endif
+void ExpressionCallFunction(struct ParseState *Parser, const char *FuncName, struct Value *FuncValue, struct Value *ReturnValue, struct Value **ParamArray, int ArgCount);
+
+/* compile.c */
+/* the following are defined in picoc.h:
+ * void PicocCompile(Picoc *pc); */
+struct VmFunction *CompileFunction(Picoc *pc, const char *FuncName, struct FuncDef *Func, const char **Reason);
+void CompileFree(Picoc *pc, struct VmFunction *Func);
+void CompileCleanup(Picoc *pc);
+
+/* vm.c */
+void VmRun(struct ParseState *Parser, struct VmFunction *Func, struct Value **ParamArray);
+int VmCall(struct ParseState *Parser, const char *FuncName, struct Value *FuncValue, struct VmValue *Arg, int ArgCount, struct VmValue *Result);
+
+/* jit.c */
+void JitFunction(Picoc *pc, const char *FuncName, struct VmFunction *Func);
+const char *JitTranslate(Picoc *pc, struct VmFunction *Func, struct VmFunction *Into);
+int JitExecute(struct ParseState *Parser, struct VmFunction *Func, union VmNumber *Local, struct VmValue *Result);
+void JitFree(struct VmFunction *Func);
+void JitReportAdd(Picoc *pc, const char *FuncName, const char *RunsAs, const char *Reason);
+void JitCleanup(Picoc *pc);
+
+/* batch.c */
+struct BatchProgram *BatchPrepare(Picoc *pc, int NumArgs);
+int BatchRun(struct BatchProgram *Program, const double *Args, int Count, double *Results);
+void BatchFree(struct BatchProgram *Program);
+void BatchFreeCode(struct VmFunction *Func);
+
+/* native.c */
+struct NativeProgram *NativeLoad(const char *Source, int NumArgs);
+int NativeCall(struct NativeProgram *Program, const double *Args, double *Result);
+void NativeFree(struct NativeProgram *Program);
+
+/* tier.c */
+void TierPromote(struct ParseState *Parser, const char *FuncName, struct FuncDef *Func);
+int TierBuildNative(Picoc *pc, const char *Source, int NumArgs);
+int TierNativeDone(Picoc *pc, struct NativeProgram **Native);
+const char *TierReport(Picoc *pc, int Native, int Batch);
+void TierCleanup(Picoc *pc);
 
 /* type.c */
 void TypeInit(Picoc *pc);
-void TypeCleanup(Picoc *pc);
 int TypeSize(struct ValueType *Typ, int ArraySize, int Compact);
 int TypeSizeValue(struct Value *Val, int Compact);
 int TypeStackSizeValue(struct Value *Val);
@@ -546,9 +794,7 @@ void HeapFreeMem(Picoc *pc, void *Mem);
 
 /* variable.c */
 void VariableInit(Picoc *pc);
-void VariableCleanup(Picoc *pc);
 void VariableFree(Picoc *pc, struct Value *Val);
-void VariableTableCleanup(Picoc *pc, struct Table *HashTable);
 void *VariableAlloc(Picoc *pc, struct ParseState *Parser, int Size, int OnHeap);
 void VariableStackPop(struct ParseState *Parser, struct Value *Var);
 struct Value *VariableAllocValueAndData(Picoc *pc, struct ParseState *Parser, int DataSize, int IsLValue, struct Value *LValueFrom, int OnHeap);
@@ -563,13 +809,17 @@ int VariableDefinedAndOutOfScope(Picoc *pc, const char *Ident);
 void VariableRealloc(struct ParseState *Parser, struct Value *FromValue, int NewSize);
 void VariableGet(Picoc *pc, struct ParseState *Parser, const char *Ident, struct Value **LVal);
 void VariableDefinePlatformVar(Picoc *pc, struct ParseState *Parser, const char *Ident, struct ValueType *Typ, union AnyValue *FromValue, int IsWritable);
-void VariableStackFrameAdd(struct ParseState *Parser, const char *FuncName, int NumParams);
+void VariableSnapshotTake(Picoc *pc);
+void VariableSnapshotAdd(Picoc *pc, struct Value *Val);
+void VariableSnapshotRestore(Picoc *pc);
+struct Value **VariableAllocParameters(struct ParseState *Parser, struct FuncDef *Func);
+void VariableStackFrameAdd(struct ParseState *Parser, const char *FuncName, char **ParamName, struct Value **Parameter, int NumParams);
 void VariableStackFramePop(struct ParseState *Parser);
 struct Value *VariableStringLiteralGet(Picoc *pc, char *Ident);
 void VariableStringLiteralDefine(Picoc *pc, char *Ident, struct Value *Val);
 void *VariableDereferencePointer(struct ParseState *Parser, struct Value *PointerValue, struct Value **DerefVal, int *DerefOffset, struct ValueType **DerefType, int *DerefIsLValue);
-int VariableScopeBegin(struct ParseState * Parser, int* PrevScopeID);
-void VariableScopeEnd(struct ParseState * Parser, int ScopeID, int PrevScopeID);
+intptr_t VariableScopeBegin(struct ParseState * Parser, intptr_t* PrevScopeID);
+void VariableScopeEnd(struct ParseState * Parser, intptr_t ScopeID, intptr_t PrevScopeID);
 
 /* clibrary.c */
 void BasicIOInit(Picoc *pc);
@@ -609,7 +859,6 @@ char *PlatformMakeTempName(Picoc *pc, char *TempNameBuffer);
 
 /* include.c */
 void IncludeInit(Picoc *pc);
-void IncludeCleanup(Picoc *pc);
 void IncludeRegister(Picoc *pc, const char *IncludeName, void (*SetupFunction)(Picoc *pc), struct LibraryFunction *FuncList, struct LibraryConstant *CstList, const char *SetupCSource);
 void IncludeFile(Picoc *pc, char *Filename);
 void GetBuiltInFunctionConstants(std::string& list);
@@ -618,7 +867,6 @@ void GetBuiltInFunctionConstants(std::string& list);
  
 /* debug.c */
 void DebugInit(Picoc* pc);
-void DebugCleanup(Picoc* pc);
 void DebugCheckStatement(struct ParseState *Parser);
 
 
@@ -0,0 +1,1729 @@
+/* picoc machine code generator - translates the bytecode compile.c makes into
+ * x86-64 code, so functions of ints and doubles run directly on the processor
+ * instead of in the loop of vm.c. The code does exactly what the virtual
+ * machine would, including the errors it gives. A function it can't translate
+ * stays with the virtual machine, and why is added to the program's report */
+
+#include "picoc.h"
+#include "interpreter.h"
+
+#include <stddef.h>
+#include <stdint.h>
+
+#if defined(_M_X64) || defined(__x86_64__)
+#define JIT_X64
+#endif
+
+#ifdef JIT_X64
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#endif
+#endif
+
+/* registers, numbered the way instructions encode them */
+#define JIT_RAX 0
+#define JIT_RCX 1
+#define JIT_RDX 2
+#define JIT_RBX 3                           /* the function's variables */
+#define JIT_RSP 4
+#define JIT_RSI 6
+#define JIT_RDI 7
+#define JIT_R8 8
+#define JIT_R9 9
+#define JIT_R11 11                          /* the address of a global or a constant */
+#define JIT_R12 12                          /* the struct JitFrame */
+
+/* the integer arguments of a call in the host's calling convention */
+#ifdef _WIN32
+#define JIT_ARG0 JIT_RCX
+#define JIT_ARG1 JIT_RDX
+#define JIT_ARG2 JIT_R8
+#else
+#define JIT_ARG0 JIT_RDI
+#define JIT_ARG1 JIT_RSI
+#define JIT_ARG2 JIT_RDX
+#endif
+
+/* condition codes */
+#define JIT_BELOW 0x2
+#define JIT_ABOVE_EQUAL 0x3
+#define JIT_EQUAL 0x4
+#define JIT_NOT_EQUAL 0x5
+#define JIT_ABOVE 0x7
+#define JIT_PARITY 0xa
+#define JIT_NO_PARITY 0xb
+#define JIT_LESS 0xc
+#define JIT_GREATER_EQUAL 0xd
+#define JIT_LESS_EQUAL 0xe
+#define JIT_GREATER 0xf
+
+/* long is what the virtual machine does int arithmetic in, so shifts and conversions use its size */
+#define JIT_LONG (sizeof(long) == 8)
+
+/* the type of the ternary operator on an int and a double while the types are
+ * worked out. It's kept as a double, which is only right where the virtual
+ * machine would have given the same answer for the int */
+#define JIT_EITHER 0xff
+
+/* why the machine code of a function stopped */
+enum JitExit
+{
+    JitExitReturn,                  /* returned the value in Result */
+    JitExitReturnVoid,
+    JitExitEnd,                     /* fell off the end of the function body */
+    JitExitDivisionByZero,
+    JitExitInvalid,                 /* an operator which can't be used on its operands */
+    JitExitCancelled,
+    JitExitFailed                   /* a function it called failed, which has been reported */
+};
+
+/* what the machine code of a function is given besides its variables */
+struct JitFrame
+{
+    struct ParseState *Parser;
+    struct VmFunction *Func;
+    struct VmValue Result;          /* the value it returned, or the value of a function it called */
+    int PC;                         /* the instruction which stopped it */
+};
+
+typedef int (*JitCode)(union VmNumber *Local, struct JitFrame *Frame);
+
+/* where a value on the stack is while code is generated. Only the top one can
+ * be in a register, or the one below it when the top one is still to be read
+ * so an infix operator can use both where they are. The others are in their
+ * slot or are still to be read */
+enum JitWhere
+{
+    JitInSlot,                      /* its slot in the machine stack frame */
+    JitInRegister,                  /* eax if it's an int, xmm0 if it's a double */
+    JitInVariable,                  /* variable Operand, which hasn't changed since it was pushed */
+    JitInInteger,                   /* the constant Operand */
+    JitInConstant                   /* Func->Constant[Operand] */
+};
+
+struct JitEntry
+{
+    unsigned char Typ;              /* TypeInt or TypeFP */
+    unsigned char Where;            /* an enum JitWhere */
+    int Operand;
+};
+
+/* a register or a place in memory an instruction works on */
+struct JitOperand
+{
+    int IsMemory;
+    int Reg;                        /* the register, or the base of the address */
+    int Disp;
+};
+
+/* a jump to an instruction which hasn't got any code yet */
+struct JitPatch
+{
+    int At;                         /* where the 32 bit displacement is */
+    int Target;                     /* the instruction */
+};
+
+struct Jit
+{
+    Picoc *pc;
+    struct VmFunction *Func;
+    jmp_buf Fail;                   /* where to go if the function can't be translated */
+    const char *Reason;             /* why it couldn't be */
+
+    /* what's on the stack before each instruction, worked out before any code is made */
+    int *Depth;                     /* the number of values, -1 if the instruction can't be reached */
+    unsigned char *StackType;       /* their types, VM_STACK_MAX for each instruction */
+    unsigned char *IsTarget;        /* instructions which are jumped to */
+
+    /* code generation */
+    unsigned char *Code;
+    int CodeSize;
+    int CodeAlloc;
+    int *Address;                   /* where the code of each instruction starts */
+    struct JitPatch *Patch;
+    int NumPatches;
+    int PatchAlloc;
+    int Epilogue;                   /* where the code returns from */
+    int ArgBase;                    /* where the arguments of a call go in the machine stack frame */
+    int SlotBase;                   /* where the stack's slots are */
+    int FrameSize;
+    struct JitEntry Stack[VM_STACK_MAX];
+    int Top;                        /* the index of the top value, -1 if the stack's empty */
+};
+
+/* the math library's functions of doubles which are called directly or worked out in place */
+enum JitMathKind
+{
+    JitMathCall,
+    JitMathSqrt,
+    JitMathFabs,
+    JitMathMin,
+    JitMathMax
+};
+
+struct JitMathFunction
+{
+    const char *Name;
+    enum JitMathKind Kind;
+    void *Address;
+};
+
+static double JitRound(double x)
+{
+    /* see MathRound() */
+    return ceil(x - 0.5);
+}
+
+static double JitClamp(double s, double Low, double High)
+{
+    if (s < Low)
+        s = Low;
+    else if (s > High)
+        s = High;
+
+    return s;
+}
+
+static double JitLerp(double i, double a, double b)
+{
+    return (1.0-i) * a + i * b;
+}
+
+static struct JitMathFunction JitMathFunctions[] =
+{
+    { "acos",   JitMathCall,    (void *)(double (*)(double))acos },
+    { "asin",   JitMathCall,    (void *)(double (*)(double))asin },
+    { "atan",   JitMathCall,    (void *)(double (*)(double))atan },
+    { "atan2",  JitMathCall,    (void *)(double (*)(double, double))atan2 },
+    { "ceil",   JitMathCall,    (void *)(double (*)(double))ceil },
+    { "cos",    JitMathCall,    (void *)(double (*)(double))cos },
+    { "cosh",   JitMathCall,    (void *)(double (*)(double))cosh },
+    { "exp",    JitMathCall,    (void *)(double (*)(double))exp },
+    { "fabs",   JitMathFabs,    NULL },
+    { "floor",  JitMathCall,    (void *)(double (*)(double))floor },
+    { "fmod",   JitMathCall,    (void *)(double (*)(double, double))fmod },
+    { "log",    JitMathCall,    (void *)(double (*)(double))log },
+    { "log10",  JitMathCall,    (void *)(double (*)(double))log10 },
+    { "pow",    JitMathCall,    (void *)(double (*)(double, double))pow },
+    { "round",  JitMathCall,    (void *)JitRound },
+    { "sin",    JitMathCall,    (void *)(double (*)(double))sin },
+    { "sinh",   JitMathCall,    (void *)(double (*)(double))sinh },
+    { "sqrt",   JitMathSqrt,    NULL },
+    { "tan",    JitMathCall,    (void *)(double (*)(double))tan },
+    { "tanh",   JitMathCall,    (void *)(double (*)(double))tanh },
+    { "min",    JitMathMin,     NULL },
+    { "max",    JitMathMax,     NULL },
+    { "clamp",  JitMathCall,    (void *)JitClamp },
+    { "lerp",   JitMathCall,    (void *)JitLerp },
+    { NULL,     JitMathCall,    NULL }
+};
+
+/* add a line to the report of the functions which aren't translated, saying how they run instead and why */
+void JitReportAdd(Picoc *pc, const char *FuncName, const char *RunsAs, const char *Reason)
+{
+    int Length = (pc->JitReport != NULL) ? (int)strlen(pc->JitReport) : 0;
+    int LineLength = (int)(strlen(FuncName) + strlen(RunsAs) + strlen(Reason)) + 8;
+    char *Report = (char *)realloc(pc->JitReport, Length + LineLength);
+
+    if (Report == NULL)
+        return;
+
+    sprintf(&Report[Length], "%s(): %s, %s\n", FuncName, RunsAs, Reason);
+    pc->JitReport = Report;
+}
+
+/* JITREPORT in the environment prints the report when the program is done with */
+void JitCleanup(Picoc *pc)
+{
+    if (getenv("JITREPORT") != NULL && pc->JitReport != NULL)
+        printf("%s", pc->JitReport);
+
+    free(pc->JitReport);
+    pc->JitReport = NULL;
+}
+
+#ifdef JIT_X64
+
+/* give up on translating this function */
+static void JitFail(struct Jit *J, const char *Reason)
+{
+    J->Reason = Reason;
+    longjmp(J->Fail, 1);
+}
+
+static void *JitAlloc(struct Jit *J, void *Mem, int Size)
+{
+    void *NewMem = realloc(Mem, Size);
+
+    if (NewMem == NULL)
+        JitFail(J, "out of memory");
+
+    return NewMem;
+}
+
+/* the stack before an instruction which is reached from another one. It has
+ * to be the same whichever way it's reached */
+static void JitReach(struct Jit *J, int PC, int Depth, unsigned char *Types)
+{
+    if (PC < 0 || PC >= J->Func->CodeSize)
+        JitFail(J, "jump out of the function");
+
+    if (J->Depth[PC] == -1)
+    {
+        J->Depth[PC] = Depth;
+        memcpy((void *)&J->StackType[PC * VM_STACK_MAX], (void *)Types, Depth);
+    }
+    else if (J->Depth[PC] != Depth || memcmp((void *)&J->StackType[PC * VM_STACK_MAX], (void *)Types, Depth) != 0)
+        JitFail(J, "mixes int and double values");
+}
+
+/* the type an infix operator gives */
+static unsigned char JitInfixType(enum LexToken Op, unsigned char Left, unsigned char Right)
+{
+    if (Left == TypeFP || Right == TypeFP)
+    {
+        switch (Op)
+        {
+            case TokenPlus: case TokenMinus: case TokenAsterisk: case TokenSlash:
+                return TypeFP;
+
+            default:
+                return TypeInt;
+        }
+    }
+
+    return TypeInt;
+}
+
+/* an int or a double from the ternary operator is only allowed where it's
+ * used the same way whichever it is */
+static void JitEither(struct Jit *J, int Allowed)
+{
+    if (!Allowed)
+        JitFail(J, "mixes int and double values");
+}
+
+/* work out the types of the values on the stack before each instruction. The
+ * compiler knows the type of everything but the ternary operator on an int
+ * and a double, see JIT_EITHER */
+static void JitCheck(struct Jit *J)
+{
+    struct VmFunction *Func = J->Func;
+    unsigned char Types[VM_STACK_MAX + 1];
+    int Depth = 0;
+    int PC;
+
+    for (PC = 0; PC < Func->CodeSize; PC++)
+        J->Depth[PC] = -1;
+
+    J->Depth[0] = 0;
+    for (PC = 0; PC < Func->CodeSize; PC++)
+    {
+        const struct VmInstruction *Ins = &Func->Code[PC];
+        struct FuncDef *Callee;
+        int Count;
+
+        if (J->Depth[PC] == -1)
+        {
+            /* code after a jump which nothing jumps to */
+            if (Depth == -1)
+                continue;
+
+            JitReach(J, PC, Depth, Types);
+        }
+        else if (Depth != -1)
+            JitReach(J, PC, Depth, Types);
+
+        Depth = J->Depth[PC];
+        memcpy((void *)Types, (void *)&J->StackType[PC * VM_STACK_MAX], Depth);
+        switch (Ins->Op)
+        {
+            case VmOpPushInt:
+                Types[Depth++] = TypeInt;
+                break;
+
+            case VmOpPushFP:
+                Types[Depth++] = TypeFP;
+                break;
+
+            case VmOpLoad: case VmOpPrefix: case VmOpPostfix:
+                Types[Depth++] = Func->Type[Ins->Operand];
+                break;
+
+            case VmOpAssign: case VmOpAssignInt: case VmOpAssignFP:
+                if (Types[Depth-1] == JIT_EITHER)
+                    JitEither(J, Ins->Op == VmOpAssignFP || Ins->Token == TokenAssign || Func->Type[Ins->Operand] == TypeFP);
+
+                Types[Depth-1] = Func->Type[Ins->Operand];
+                break;
+
+            case VmOpInitialise: case VmOpPop:
+                Depth--;
+                break;
+
+            case VmOpUnary:
+                JitEither(J, Types[Depth-1] != JIT_EITHER);
+                break;
+
+            case VmOpInfix: case VmOpInfixInt: case VmOpInfixFP:
+                /* comparisons are the same done on ints or doubles, arithmetic only with a double */
+                if (Types[Depth-2] == JIT_EITHER || Types[Depth-1] == JIT_EITHER)
+                {
+                    switch (Ins->Token)
+                    {
+                        case TokenEqual: case TokenNotEqual: case TokenLessThan: case TokenGreaterThan:
+                        case TokenLessEqual: case TokenGreaterEqual:
+                            break;
+
+                        case TokenPlus: case TokenMinus: case TokenAsterisk: case TokenSlash:
+                            JitEither(J, Types[Depth-2] == TypeFP || Types[Depth-1] == TypeFP);
+                            break;
+
+                        default:
+                            JitEither(J, FALSE);
+                            break;
+                    }
+                }
+
+                Depth--;
+                Types[Depth-1] = JitInfixType((enum LexToken)Ins->Token, Types[Depth-1], Types[Depth]);
+                break;
+
+            case VmOpIntToFP:
+                Types[Depth-1] = TypeFP;
+                break;
+
+            case VmOpCast:
+                Types[Depth-1] = Ins->Token;
+                break;
+
+            case VmOpTernary:
+                if (Types[Depth-2] != Types[Depth-1])
+                    Types[Depth-1] = JIT_EITHER;
+
+                Depth -= 2;
+                Types[Depth-1] = Types[Depth+1];
+                break;
+
+            case VmOpSkipIfFalse: case VmOpSkipIfTrue:
+                JitEither(J, Types[Depth-1] != JIT_EITHER);
+                Types[Depth] = TypeInt;
+                JitReach(J, Ins->Operand, Depth + 1, Types);
+                J->IsTarget[Ins->Operand] = TRUE;
+                break;
+
+            case VmOpJumpIfFalse:
+                Depth--;
+                JitReach(J, Ins->Operand, Depth, Types);
+                J->IsTarget[Ins->Operand] = TRUE;
+                break;
+
+            case VmOpJump: case VmOpLoop:
+                JitReach(J, Ins->Operand, Depth, Types);
+                J->IsTarget[Ins->Operand] = TRUE;
+                Depth = -1;
+                break;
+
+            case VmOpCall:
+                Callee = &Func->Global[Ins->Operand]->Val->FuncDef;
+                Depth -= Ins->Token;
+                for (Count = 0; Count < Ins->Token; Count++)
+                {
+                    if (Types[Depth+Count] == JIT_EITHER)
+                        JitEither(J, Count < Callee->NumParams && (Callee->ParamType[Count]->Base == TypeInt || Callee->ParamType[Count]->Base == TypeFP));
+                }
+
+                if (Callee->ReturnType->Base == TypeFP)
+                    Types[Depth++] = TypeFP;
+                else if (Callee->ReturnType != &J->pc->VoidType)
+                    Types[Depth++] = TypeInt;
+
+                if (Ins->Token * (int)sizeof(struct VmValue) > J->ArgBase - 32)
+                    J->ArgBase = 32 + Ins->Token * (int)sizeof(struct VmValue);
+                break;
+
+            case VmOpReturn: case VmOpReturnVoid: case VmOpEnd:
+                Depth = -1;
+                break;
+        }
+    }
+}
+
+static void JitByte(struct Jit *J, int Byte)
+{
+    if (J->CodeSize == J->CodeAlloc)
+    {
+        J->CodeAlloc = J->CodeAlloc * 2 + 256;
+        J->Code = (unsigned char *)JitAlloc(J, J->Code, J->CodeAlloc);
+    }
+
+    J->Code[J->CodeSize++] = (unsigned char)Byte;
+}
+
+static void JitInt32(struct Jit *J, int Value)
+{
+    JitByte(J, Value);
+    JitByte(J, Value >> 8);
+    JitByte(J, Value >> 16);
+    JitByte(J, Value >> 24);
+}
+
+static void JitPatch32(struct Jit *J, int At, int Value)
+{
+    J->Code[At] = (unsigned char)Value;
+    J->Code[At + 1] = (unsigned char)(Value >> 8);
+    J->Code[At + 2] = (unsigned char)(Value >> 16);
+    J->Code[At + 3] = (unsigned char)(Value >> 24);
+}
+
+static struct JitOperand JitRegister(int Reg)
+{
+    struct JitOperand Operand;
+
+    Operand.IsMemory = FALSE;
+    Operand.Reg = Reg;
+    Operand.Disp = 0;
+    return Operand;
+}
+
+static struct JitOperand JitMemory(int Base, int Disp)
+{
+    struct JitOperand Operand;
+
+    Operand.IsMemory = TRUE;
+    Operand.Reg = Base;
+    Operand.Disp = Disp;
+    return Operand;
+}
+
+/* an instruction with a ModRM byte: a prefix which is part of the opcode (0
+ * for none), REX if it's needed, then an opcode of one or two bytes. Reg goes
+ * in the reg field, which is also used to extend some opcodes */
+static void JitInstruction(struct Jit *J, int Prefix, int Wide, int Opcode, int Reg, struct JitOperand Rm)
+{
+    int Rex = 0x40 | (Wide ? 8 : 0) | ((Reg & 8) ? 4 : 0) | ((Rm.Reg & 8) ? 1 : 0);
+    int Mod;
+
+    if (Prefix != 0)
+        JitByte(J, Prefix);
+
+    if (Rex != 0x40)
+        JitByte(J, Rex);
+
+    if (Opcode > 0xff)
+        JitByte(J, Opcode >> 8);
+
+    JitByte(J, Opcode);
+    if (!Rm.IsMemory)
+    {
+        JitByte(J, 0xc0 | ((Reg & 7) << 3) | (Rm.Reg & 7));
+        return;
+    }
+
+    if (Rm.Disp == 0 && (Rm.Reg & 7) != 5)
+        Mod = 0;
+    else if (Rm.Disp >= -128 && Rm.Disp <= 127)
+        Mod = 1;
+    else
+        Mod = 2;
+
+    JitByte(J, (Mod << 6) | ((Reg & 7) << 3) | (Rm.Reg & 7));
+    if ((Rm.Reg & 7) == JIT_RSP)
+        JitByte(J, 0x24);
+
+    if (Mod == 1)
+        JitByte(J, Rm.Disp);
+    else if (Mod == 2)
+        JitInt32(J, Rm.Disp);
+}
+
+/* the instructions used, in the order of the operands they take */
+static void JitMovsdLoad(struct Jit *J, int Xmm, struct JitOperand From)   { JitInstruction(J, 0xf2, FALSE, 0x0f10, Xmm, From); }
+static void JitMovsdStore(struct Jit *J, struct JitOperand To, int Xmm)    { JitInstruction(J, 0xf2, FALSE, 0x0f11, Xmm, To); }
+static void JitSSE(struct Jit *J, int Opcode, int Xmm, struct JitOperand From) { JitInstruction(J, 0xf2, FALSE, Opcode, Xmm, From); }
+static void JitUcomisd(struct Jit *J, int Xmm, struct JitOperand With)     { JitInstruction(J, 0x66, FALSE, 0x0f2e, Xmm, With); }
+static void JitCvtsi2sd(struct Jit *J, int Xmm, struct JitOperand From)    { JitInstruction(J, 0xf2, FALSE, 0x0f2a, Xmm, From); }
+static void JitCvttsd2si(struct Jit *J, int Reg, struct JitOperand From)   { JitInstruction(J, 0xf2, JIT_LONG, 0x0f2c, Reg, From); }
+static void JitMovqToXmm(struct Jit *J, int Xmm, int Reg)                  { JitInstruction(J, 0x66, TRUE, 0x0f6e, Xmm, JitRegister(Reg)); }
+static void JitMovqFromXmm(struct Jit *J, int Reg, int Xmm)                { JitInstruction(J, 0x66, TRUE, 0x0f7e, Xmm, JitRegister(Reg)); }
+static void JitLoad32(struct Jit *J, int Reg, struct JitOperand From)      { JitInstruction(J, 0, FALSE, 0x8b, Reg, From); }
+static void JitStore32(struct Jit *J, struct JitOperand To, int Reg)       { JitInstruction(J, 0, FALSE, 0x89, Reg, To); }
+static void JitLoad64(struct Jit *J, int Reg, struct JitOperand From)      { JitInstruction(J, 0, TRUE, 0x8b, Reg, From); }
+static void JitStore64(struct Jit *J, struct JitOperand To, int Reg)       { JitInstruction(J, 0, TRUE, 0x89, Reg, To); }
+static void JitArithmetic(struct Jit *J, int Opcode, int Reg, struct JitOperand From) { JitInstruction(J, 0, FALSE, Opcode, Reg, From); }
+
+#define JIT_ADD 0x03
+#define JIT_OR 0x0b
+#define JIT_AND 0x23
+#define JIT_SUB 0x2b
+#define JIT_XOR 0x33
+#define JIT_CMP 0x3b
+#define JIT_IMUL 0x0faf
+#define JIT_ADDSD 0x0f58
+#define JIT_MULSD 0x0f59
+#define JIT_SUBSD 0x0f5c
+#define JIT_MINSD 0x0f5d
+#define JIT_DIVSD 0x0f5e
+#define JIT_MAXSD 0x0f5f
+#define JIT_SQRTSD 0x0f51
+
+static void JitMovImmediate(struct Jit *J, int Reg, int Value)
+{
+    if (Reg & 8)
+        JitByte(J, 0x41);
+
+    JitByte(J, 0xb8 + (Reg & 7));
+    JitInt32(J, Value);
+}
+
+static void JitMovImmediate64(struct Jit *J, int Reg, const void *Value)
+{
+    unsigned long long Bits = (unsigned long long)(uintptr_t)Value;
+    int Count;
+
+    JitByte(J, (Reg & 8) ? 0x49 : 0x48);
+    JitByte(J, 0xb8 + (Reg & 7));
+    for (Count = 0; Count < 8; Count++)
+        JitByte(J, (int)(Bits >> (Count * 8)));
+}
+
+/* store a 32 bit constant, sign extended if it's Wide */
+static void JitStoreImmediate(struct Jit *J, int Wide, struct JitOperand To, int Value)
+{
+    JitInstruction(J, 0, Wide, 0xc7, 0, To);
+    JitInt32(J, Value);
+}
+
+/* set the low byte of a register to a condition */
+static void JitSetByte(struct Jit *J, int Condition, int Reg)
+{
+    JitInstruction(J, 0, FALSE, 0x0f90 + Condition, 0, JitRegister(Reg));
+}
+
+/* set al to a condition and widen it to eax */
+static void JitSetFlag(struct Jit *J, int Condition)
+{
+    JitSetByte(J, Condition, JIT_RAX);
+    JitInstruction(J, 0, FALSE, 0x0fb6, JIT_RAX, JitRegister(JIT_RAX));
+}
+
+/* set al to a condition anded or ored with the one already in dl, and widen it to eax */
+static void JitSetFlagWith(struct Jit *J, int Condition, int Or)
+{
+    JitSetByte(J, Condition, JIT_RAX);
+    JitInstruction(J, 0, FALSE, Or ? 0x08 : 0x20, JIT_RDX, JitRegister(JIT_RAX));
+    JitInstruction(J, 0, FALSE, 0x0fb6, JIT_RAX, JitRegister(JIT_RAX));
+}
+
+static void JitTest(struct Jit *J, int Wide, int Reg)
+{
+    JitInstruction(J, 0, Wide, 0x85, Reg, JitRegister(Reg));
+}
+
+static void JitMovsdRegister(struct Jit *J, int To, int From)
+{
+    JitMovsdLoad(J, To, JitRegister(From));
+}
+
+/* a conditional jump forward over a few bytes, returns where to patch its displacement */
+static int JitJumpShort(struct Jit *J, int Condition)
+{
+    JitByte(J, 0x70 + Condition);
+    JitByte(J, 0);
+    return J->CodeSize - 1;
+}
+
+static void JitLand(struct Jit *J, int At)
+{
+    J->Code[At] = (unsigned char)(J->CodeSize - At - 1);
+}
+
+/* jump to an instruction, a Condition of -1 always jumps */
+static void JitJump(struct Jit *J, int Condition, int Target)
+{
+    if (Condition == -1)
+        JitByte(J, 0xe9);
+    else
+    {
+        JitByte(J, 0x0f);
+        JitByte(J, 0x80 + Condition);
+    }
+
+    JitInt32(J, 0);
+    if (J->NumPatches == J->PatchAlloc)
+    {
+        J->PatchAlloc = J->PatchAlloc * 2 + 16;
+        J->Patch = (struct JitPatch *)JitAlloc(J, J->Patch, sizeof(struct JitPatch) * J->PatchAlloc);
+    }
+
+    J->Patch[J->NumPatches].At = J->CodeSize - 4;
+    J->Patch[J->NumPatches].Target = Target;
+    J->NumPatches++;
+}
+
+/* stop, saying why and at which instruction */
+static void JitExit(struct Jit *J, int PC, enum JitExit Exit)
+{
+    JitStoreImmediate(J, FALSE, JitMemory(JIT_R12, offsetof(struct JitFrame, PC)), PC);
+    JitMovImmediate(J, JIT_RAX, Exit);
+    JitByte(J, 0xe9);
+    JitInt32(J, J->Epilogue - (J->CodeSize + 4));
+}
+
+/* stop unless a condition holds */
+static void JitExitUnless(struct Jit *J, int Condition, int PC, enum JitExit Exit)
+{
+    int Skip = JitJumpShort(J, Condition);
+
+    JitExit(J, PC, Exit);
+    JitLand(J, Skip);
+}
+
+static void JitCall(struct Jit *J, const void *Address)
+{
+    JitMovImmediate64(J, JIT_RAX, Address);
+    JitInstruction(J, 0, FALSE, 0xff, 2, JitRegister(JIT_RAX));
+}
+
+/* where a variable is. A global is found through its value, like vm.c does */
+static struct JitOperand JitVariable(struct Jit *J, int Variable)
+{
+    if (Variable < J->Func->NumLocals)
+        return JitMemory(JIT_RBX, Variable * (int)sizeof(union VmNumber));
+
+    JitMovImmediate64(J, JIT_R11, &J->Func->Global[Variable - J->Func->NumLocals]->Val);
+    JitLoad64(J, JIT_R11, JitMemory(JIT_R11, 0));
+    return JitMemory(JIT_R11, 0);
+}
+
+static struct JitOperand JitSlot(struct Jit *J, int Index)
+{
+    return JitMemory(JIT_RSP, J->SlotBase + Index * 8);
+}
+
+/* somewhere an instruction can read a value on the stack from. An int
+ * constant is put in the Scratch register */
+static struct JitOperand JitSource(struct Jit *J, int Index, int Scratch)
+{
+    struct JitEntry *Entry = &J->Stack[Index];
+
+    switch (Entry->Where)
+    {
+        case JitInRegister:
+            return JitRegister((Entry->Typ == TypeFP) ? 0 : JIT_RAX);
+
+        case JitInVariable:
+            return JitVariable(J, Entry->Operand);
+
+        case JitInInteger:
+            JitMovImmediate(J, Scratch, Entry->Operand);
+            return JitRegister(Scratch);
+
+        case JitInConstant:
+            JitMovImmediate64(J, JIT_R11, &J->Func->Constant[Entry->Operand]);
+            return JitMemory(JIT_R11, 0);
+
+        default:
+            return JitSlot(J, Index);
+    }
+}
+
+/* a value on the stack as a double in an xmm register */
+static void JitLoadFP(struct Jit *J, int Index, int Xmm)
+{
+    struct JitEntry *Entry = &J->Stack[Index];
+    struct JitOperand From;
+
+    if (Entry->Where == JitInInteger)
+    {
+        /* an int constant is converted now */
+        double Value = (double)Entry->Operand;
+        uintptr_t Bits;
+
+        memcpy((void *)&Bits, (void *)&Value, sizeof(Bits));
+        JitMovImmediate64(J, JIT_RCX, (const void *)Bits);
+        JitMovqToXmm(J, Xmm, JIT_RCX);
+        return;
+    }
+
+    From = JitSource(J, Index, JIT_RCX);
+    if (Entry->Typ == TypeFP)
+    {
+        if (From.IsMemory || From.Reg != Xmm)
+            JitMovsdLoad(J, Xmm, From);
+    }
+    else
+        JitCvtsi2sd(J, Xmm, From);
+}
+
+/* a value on the stack as an int in a register */
+static void JitLoadInt(struct Jit *J, int Index, int Reg)
+{
+    struct JitEntry *Entry = &J->Stack[Index];
+
+    if (Entry->Where == JitInInteger)
+        JitMovImmediate(J, Reg, Entry->Operand);
+    else
+    {
+        struct JitOperand From = JitSource(J, Index, Reg);
+
+        if (From.IsMemory || From.Reg != Reg)
+            JitLoad32(J, Reg, From);
+    }
+}
+
+/* put a value on the stack in its slot */
+static void JitFlushEntry(struct Jit *J, int Index)
+{
+    struct JitEntry *Entry = &J->Stack[Index];
+
+    switch (Entry->Where)
+    {
+        case JitInSlot:
+            return;
+
+        case JitInInteger:
+            JitStoreImmediate(J, FALSE, JitSlot(J, Index), Entry->Operand);
+            break;
+
+        case JitInRegister:
+            if (Entry->Typ == TypeFP)
+                JitMovsdStore(J, JitSlot(J, Index), 0);
+            else
+                JitStore32(J, JitSlot(J, Index), JIT_RAX);
+            break;
+
+        default:
+            /* a variable or a constant, moved through registers the top of the stack can't be in */
+            if (Entry->Typ == TypeFP)
+            {
+                JitMovsdLoad(J, 3, JitSource(J, Index, JIT_RDX));
+                JitMovsdStore(J, JitSlot(J, Index), 3);
+            }
+            else
+            {
+                JitLoad32(J, JIT_RDX, JitSource(J, Index, JIT_RDX));
+                JitStore32(J, JitSlot(J, Index), JIT_RDX);
+            }
+            break;
+    }
+
+    Entry->Where = JitInSlot;
+}
+
+/* put every value on the stack in its slot, where jumps expect them */
+static void JitFlush(struct Jit *J)
+{
+    int Count;
+
+    for (Count = 0; Count <= J->Top; Count++)
+        JitFlushEntry(J, Count);
+}
+
+/* values below Limit which are still to be read from a variable which is about to change */
+static void JitFlushVariable(struct Jit *J, int Variable, int Limit)
+{
+    int Count;
+
+    for (Count = 0; Count < Limit; Count++)
+    {
+        if (J->Stack[Count].Where == JitInVariable && J->Stack[Count].Operand == Variable)
+            JitFlushEntry(J, Count);
+    }
+}
+
+/* free the registers for a new value */
+static void JitSpill(struct Jit *J)
+{
+    if (J->Top >= 0 && J->Stack[J->Top].Where == JitInRegister)
+        JitFlushEntry(J, J->Top);
+
+    if (J->Top >= 1 && J->Stack[J->Top - 1].Where == JitInRegister)
+        JitFlushEntry(J, J->Top - 1);
+}
+
+static void JitPush(struct Jit *J, unsigned char Typ, enum JitWhere Where, int Operand)
+{
+    if (Where == JitInRegister)
+        JitSpill(J);
+    else if (J->Top >= 1 && J->Stack[J->Top - 1].Where == JitInRegister)
+        JitFlushEntry(J, J->Top - 1);
+
+    J->Top++;
+    J->Stack[J->Top].Typ = Typ;
+    J->Stack[J->Top].Where = (unsigned char)Where;
+    J->Stack[J->Top].Operand = Operand;
+}
+
+/* the top of the stack has been replaced by a value in a register */
+static void JitResult(struct Jit *J, unsigned char Typ)
+{
+    J->Stack[J->Top].Typ = Typ;
+    J->Stack[J->Top].Where = JitInRegister;
+}
+
+/* the top of the stack in a register */
+static void JitLoadTop(struct Jit *J)
+{
+    struct JitEntry *Entry = &J->Stack[J->Top];
+
+    if (Entry->Typ == TypeFP)
+        JitLoadFP(J, J->Top, 0);
+    else
+        JitLoadInt(J, J->Top, JIT_RAX);
+
+    Entry->Where = JitInRegister;
+}
+
+/* the truth of a value as ?, && and || see it, in the flags. Only rcx and xmm1 are used */
+static void JitTruth(struct Jit *J, int Index)
+{
+    if (J->Stack[Index].Typ == TypeFP)
+    {
+        JitCvttsd2si(J, JIT_RCX, JitSource(J, Index, JIT_RCX));
+        JitTest(J, JIT_LONG, JIT_RCX);
+    }
+    else
+    {
+        JitLoadInt(J, Index, JIT_RCX);
+        JitTest(J, FALSE, JIT_RCX);
+    }
+}
+
+/* xmm0 = xmm0 Op Right for the arithmetic operators of doubles, or ProgramFail() for the others */
+static void JitOperatorFP(struct Jit *J, int PC, enum LexToken Op, struct JitOperand Right)
+{
+    switch (Op)
+    {
+        case TokenPlus: case TokenAddAssign:            JitSSE(J, JIT_ADDSD, 0, Right); break;
+        case TokenMinus: case TokenSubtractAssign:      JitSSE(J, JIT_SUBSD, 0, Right); break;
+        case TokenAsterisk: case TokenMultiplyAssign:   JitSSE(J, JIT_MULSD, 0, Right); break;
+        case TokenSlash: case TokenDivideAssign:        JitSSE(J, JIT_DIVSD, 0, Right); break;
+        case TokenAssign:                               JitMovsdLoad(J, 0, Right); break;
+        default:                                        JitExit(J, PC, JitExitInvalid); break;
+    }
+}
+
+/* eax = eax Op ecx for ints, see VmInfixInt() and VmAssignInt() */
+static void JitOperatorInt(struct Jit *J, int PC, enum LexToken Op)
+{
+    struct JitOperand Right = JitRegister(JIT_RCX);
+    int Condition;
+
+    switch (Op)
+    {
+        case TokenPlus: case TokenAddAssign:                JitArithmetic(J, JIT_ADD, JIT_RAX, Right); return;
+        case TokenMinus: case TokenSubtractAssign:          JitArithmetic(J, JIT_SUB, JIT_RAX, Right); return;
+        case TokenAsterisk: case TokenMultiplyAssign:       JitArithmetic(J, JIT_IMUL, JIT_RAX, Right); return;
+        case TokenAmpersand: case TokenArithmeticAndAssign: JitArithmetic(J, JIT_AND, JIT_RAX, Right); return;
+        case TokenArithmeticOr: case TokenArithmeticOrAssign: JitArithmetic(J, JIT_OR, JIT_RAX, Right); return;
+        case TokenArithmeticExor: case TokenArithmeticExorAssign: JitArithmetic(J, JIT_XOR, JIT_RAX, Right); return;
+        case TokenAssign:                                   JitLoad32(J, JIT_RAX, Right); return;
+
+        case TokenShiftLeft: case TokenShiftLeftAssign:
+        case TokenShiftRight: case TokenShiftRightAssign:
+            /* in a long, so a count past the size of an int works like it does in vm.c */
+            if (JIT_LONG)
+                JitInstruction(J, 0, TRUE, 0x63, JIT_RAX, JitRegister(JIT_RAX));
+
+            JitInstruction(J, 0, JIT_LONG, 0xd3, (Op == TokenShiftLeft || Op == TokenShiftLeftAssign) ? 4 : 7, JitRegister(JIT_RAX));
+            return;
+
+        case TokenSlash: case TokenDivideAssign:
+        case TokenModulus: case TokenModulusAssign:
+            /* 64 bit, so dividing the smallest int by -1 doesn't trap */
+            JitTest(J, FALSE, JIT_RCX);
+            JitExitUnless(J, JIT_NOT_EQUAL, PC, JitExitDivisionByZero);
+            JitInstruction(J, 0, TRUE, 0x63, JIT_RAX, JitRegister(JIT_RAX));
+            JitInstruction(J, 0, TRUE, 0x63, JIT_RCX, JitRegister(JIT_RCX));
+            JitByte(J, 0x48);
+            JitByte(J, 0x99);
+            JitInstruction(J, 0, TRUE, 0xf7, 7, JitRegister(JIT_RCX));
+            if (Op == TokenModulus || Op == TokenModulusAssign)
+                JitLoad32(J, JIT_RAX, JitRegister(JIT_RDX));
+            return;
+
+        case TokenLogicalAnd: case TokenLogicalOr:
+            JitTest(J, FALSE, JIT_RAX);
+            JitSetByte(J, JIT_NOT_EQUAL, JIT_RDX);
+            JitTest(J, FALSE, JIT_RCX);
+            JitSetFlagWith(J, JIT_NOT_EQUAL, Op == TokenLogicalOr);
+            return;
+
+        case TokenEqual:            Condition = JIT_EQUAL; break;
+        case TokenNotEqual:         Condition = JIT_NOT_EQUAL; break;
+        case TokenLessThan:         Condition = JIT_LESS; break;
+        case TokenGreaterThan:      Condition = JIT_GREATER; break;
+        case TokenLessEqual:        Condition = JIT_LESS_EQUAL; break;
+        case TokenGreaterEqual:     Condition = JIT_GREATER_EQUAL; break;
+        default:                    JitExit(J, PC, JitExitInvalid); return;
+    }
+
+    JitArithmetic(J, JIT_CMP, JIT_RAX, Right);
+    JitSetFlag(J, Condition);
+}
+
+/* an infix operator on the top two values of the stack, see VmInfix() */
+static void JitInfix(struct Jit *J, int PC, enum LexToken Op)
+{
+    struct JitEntry *Left = &J->Stack[J->Top - 1];
+    struct JitEntry *Right = &J->Stack[J->Top];
+
+    if (Left->Typ == TypeFP || Right->Typ == TypeFP)
+    {
+        struct JitOperand RightOperand;
+        int Condition = -1;
+
+        switch (Op)
+        {
+            case TokenEqual: case TokenNotEqual: case TokenGreaterThan: case TokenGreaterEqual:
+            case TokenPlus: case TokenMinus: case TokenAsterisk: case TokenSlash:
+                break;
+
+            case TokenLessThan: case TokenLessEqual:
+                /* the other way round, so a NaN makes it false */
+                Condition = (Op == TokenLessThan) ? JIT_ABOVE : JIT_ABOVE_EQUAL;
+                break;
+
+            default:
+                JitExit(J, PC, JitExitInvalid);
+                J->Top--;
+                JitResult(J, TypeInt);
+                return;
+        }
+
+        /* the right side is read in place unless it's in a register the left side needs */
+        if (Right->Where == JitInRegister)
+        {
+            if (Right->Typ == TypeFP)
+                JitMovsdRegister(J, 1, 0);
+            else
+                JitCvtsi2sd(J, 1, JitRegister(JIT_RAX));
+
+            Right->Where = JitInSlot;
+            RightOperand = JitRegister(1);
+            JitLoadFP(J, J->Top - 1, 0);
+        }
+        else
+        {
+            JitLoadFP(J, J->Top - 1, 0);
+            if (Right->Typ == TypeFP && Condition == -1)
+                RightOperand = JitSource(J, J->Top, JIT_RCX);
+            else
+            {
+                JitLoadFP(J, J->Top, 1);
+                RightOperand = JitRegister(1);
+            }
+        }
+
+        J->Top--;
+        switch (Op)
+        {
+            case TokenLessThan: case TokenLessEqual:
+                JitUcomisd(J, 1, JitRegister(0));
+                JitSetFlag(J, Condition);
+                JitResult(J, TypeInt);
+                return;
+
+            case TokenGreaterThan: case TokenGreaterEqual:
+                JitUcomisd(J, 0, RightOperand);
+                JitSetFlag(J, (Op == TokenGreaterThan) ? JIT_ABOVE : JIT_ABOVE_EQUAL);
+                JitResult(J, TypeInt);
+                return;
+
+            case TokenEqual: case TokenNotEqual:
+                /* equal and ordered, or unequal or unordered */
+                JitUcomisd(J, 0, RightOperand);
+                JitSetByte(J, (Op == TokenEqual) ? JIT_NO_PARITY : JIT_PARITY, JIT_RDX);
+                JitSetFlagWith(J, (Op == TokenEqual) ? JIT_EQUAL : JIT_NOT_EQUAL, Op == TokenNotEqual);
+                JitResult(J, TypeInt);
+                return;
+
+            default:
+                JitOperatorFP(J, PC, Op, RightOperand);
+                JitResult(J, TypeFP);
+                return;
+        }
+    }
+
+    if (Right->Where == JitInRegister)
+    {
+        JitLoad32(J, JIT_RCX, JitRegister(JIT_RAX));
+        Right->Where = JitInSlot;
+        JitLoadInt(J, J->Top - 1, JIT_RAX);
+    }
+    else
+    {
+        JitLoadInt(J, J->Top - 1, JIT_RAX);
+        JitLoadInt(J, J->Top, JIT_RCX);
+    }
+
+    J->Top--;
+    JitOperatorInt(J, PC, Op);
+    JitResult(J, TypeInt);
+}
+
+/* an assignment operator, see VmAssign(). The value is the top of the stack and stays there as the result */
+static void JitAssign(struct Jit *J, int PC, enum LexToken Op, int Variable)
+{
+    struct JitEntry *Top = &J->Stack[J->Top];
+    unsigned char Typ = J->Func->Type[Variable];
+    struct JitOperand Var;
+
+    JitFlushVariable(J, Variable, J->Top);
+    if (Typ == TypeFP || Top->Typ == TypeFP)
+    {
+        /* the value is kept in xmm1 while the variable's read */
+        JitLoadFP(J, J->Top, 1);
+        Var = JitVariable(J, Variable);
+        if (Op != TokenAssign)
+        {
+            if (Typ == TypeFP)
+                JitMovsdLoad(J, 0, Var);
+            else
+                JitCvtsi2sd(J, 0, Var);
+        }
+
+        JitOperatorFP(J, PC, Op, JitRegister(1));
+        if (Typ == TypeFP)
+            JitMovsdStore(J, Var, 0);
+        else
+        {
+            JitCvttsd2si(J, JIT_RAX, JitRegister(0));
+            JitStore32(J, Var, JIT_RAX);
+        }
+    }
+    else
+    {
+        JitLoadInt(J, J->Top, JIT_RCX);
+        Var = JitVariable(J, Variable);
+        if (Op != TokenAssign)
+            JitLoad32(J, JIT_RAX, Var);
+
+        JitOperatorInt(J, PC, Op);
+        JitStore32(J, Var, JIT_RAX);
+    }
+
+    JitResult(J, Typ);
+}
+
+/* ++ or -- on a variable, pushing its new value or its old one if it's an int postfix */
+static void JitIncrement(struct Jit *J, enum LexToken Op, int Postfix, int Variable)
+{
+    unsigned char Typ = J->Func->Type[Variable];
+    struct JitOperand Var;
+
+    JitFlushVariable(J, Variable, J->Top + 1);
+    JitPush(J, Typ, JitInRegister, 0);
+    Var = JitVariable(J, Variable);
+    if (Typ == TypeFP)
+    {
+        static const double One = 1.0;
+
+        JitMovsdLoad(J, 0, Var);
+        JitMovImmediate64(J, JIT_RAX, &One);
+        JitSSE(J, (Op == TokenIncrement) ? JIT_ADDSD : JIT_SUBSD, 0, JitMemory(JIT_RAX, 0));
+        JitMovsdStore(J, Var, 0);
+    }
+    else
+    {
+        JitLoad32(J, JIT_RAX, Var);
+        JitInstruction(J, 0, FALSE, 0x8d, JIT_RCX, JitMemory(JIT_RAX, (Op == TokenIncrement) ? 1 : -1));
+        JitStore32(J, Var, JIT_RCX);
+        if (!Postfix)
+            JitLoad32(J, JIT_RAX, JitRegister(JIT_RCX));
+    }
+}
+
+/* a prefix operator, see VmUnary() */
+static void JitUnary(struct Jit *J, int PC, enum LexToken Op)
+{
+    JitLoadTop(J);
+    if (J->Stack[J->Top].Typ == TypeFP)
+    {
+        switch (Op)
+        {
+            case TokenMinus:
+                JitMovqFromXmm(J, JIT_RAX, 0);
+                JitInstruction(J, 0, TRUE, 0x0fba, 7, JitRegister(JIT_RAX));
+                JitByte(J, 63);
+                JitMovqToXmm(J, 0, JIT_RAX);
+                break;
+
+            case TokenUnaryNot:
+                /* 1.0 if it's 0, NaN included in what isn't */
+                JitInstruction(J, 0x66, FALSE, 0x0f57, 1, JitRegister(1));
+                JitUcomisd(J, 0, JitRegister(1));
+                JitSetByte(J, JIT_NO_PARITY, JIT_RDX);
+                JitSetFlagWith(J, JIT_EQUAL, FALSE);
+                JitCvtsi2sd(J, 0, JitRegister(JIT_RAX));
+                break;
+
+            default:
+                JitExit(J, PC, JitExitInvalid);
+                break;
+        }
+    }
+    else
+    {
+        switch (Op)
+        {
+            case TokenMinus:        JitInstruction(J, 0, FALSE, 0xf7, 3, JitRegister(JIT_RAX)); break;
+            case TokenUnaryExor:    JitInstruction(J, 0, FALSE, 0xf7, 2, JitRegister(JIT_RAX)); break;
+            case TokenUnaryNot:     JitTest(J, FALSE, JIT_RAX); JitSetFlag(J, JIT_EQUAL); break;
+            default:                JitExit(J, PC, JitExitInvalid); break;
+        }
+    }
+}
+
+/* convert the top of the stack, see VmOpCast */
+static void JitConvert(struct Jit *J, unsigned char Typ)
+{
+    struct JitEntry *Entry = &J->Stack[J->Top];
+
+    if (Entry->Typ == Typ)
+        return;
+
+    if (Typ == TypeFP)
+        JitCvtsi2sd(J, 0, JitSource(J, J->Top, JIT_RCX));
+    else
+        JitCvttsd2si(J, JIT_RAX, JitSource(J, J->Top, JIT_RCX));
+
+    JitResult(J, Typ);
+}
+
+/* the math library's function a call is to, or NULL if it's to something else */
+static struct JitMathFunction *JitFindMath(struct FuncDef *Callee)
+{
+#if !defined(BUILTIN_MINI_STDLIB) && !defined(NO_FP)
+    struct LibraryFunction *Library;
+    struct JitMathFunction *Math;
+
+    if (Callee->Intrinsic == NULL)
+        return NULL;
+
+    for (Library = &MathFunctions[0]; Library->Func != NULL; Library++)
+    {
+        if (Library->Func != Callee->Intrinsic)
+            continue;
+
+        /* the prototypes are "double name(...);" */
+        for (Math = &JitMathFunctions[0]; Math->Name != NULL; Math++)
+        {
+            int Length = (int)strlen(Math->Name);
+
+            if (strncmp(&Library->Prototype[7], Math->Name, Length) == 0 && Library->Prototype[7 + Length] == '(')
+                return Math;
+        }
+    }
+#endif
+    return NULL;
+}
+
+/* call a function the virtual machine's way, from the machine code. A failure
+ * comes back here rather than jumping over the machine code's frames, which
+ * the host might not know how to unwind. Returns FALSE if it failed */
+static int JitCallFunction(struct JitFrame *Frame, int PC, struct VmValue *Arg)
+{
+    struct ParseState *Parser = Frame->Parser;
+    Picoc *pc = Parser->pc;
+    struct VmFunction *Func = Frame->Func;
+    const struct VmInstruction *Ins = &Func->Code[PC];
+    jmp_buf ExitBuf;
+
+    memcpy((void *)&ExitBuf, (void *)&pc->PicocExitBuf, sizeof(jmp_buf));
+    if (setjmp(pc->PicocExitBuf))
+    {
+        memcpy((void *)&pc->PicocExitBuf, (void *)&ExitBuf, sizeof(jmp_buf));
+        return FALSE;
+    }
+
+    Parser->Line = Func->Position[PC].Line;
+    Parser->CharacterPos = Func->Position[PC].CharacterPos;
+    VmCall(Parser, Func->Name[Ins->Operand], Func->Global[Ins->Operand], Arg, Ins->Token, &Frame->Result);
+    memcpy((void *)&pc->PicocExitBuf, (void *)&ExitBuf, sizeof(jmp_buf));
+    return TRUE;
+}
+
+/* a call to a function with its arguments on the top of the stack */
+static void JitCallInstruction(struct Jit *J, int PC, const struct VmInstruction *Ins)
+{
+    struct FuncDef *Callee = &J->Func->Global[Ins->Operand]->Val->FuncDef;
+    struct JitMathFunction *Math = JitFindMath(Callee);
+    int First = J->Top - Ins->Token + 1;
+    int Count;
+
+    if (Math != NULL && Ins->Token <= 3)
+    {
+        /* the arguments go in xmm0 to xmm2 in either calling convention */
+        JitSpill(J);
+        for (Count = 0; Count < Ins->Token; Count++)
+            JitLoadFP(J, First + Count, Count);
+
+        switch (Math->Kind)
+        {
+            case JitMathSqrt:
+                JitSSE(J, JIT_SQRTSD, 0, JitRegister(0));
+                break;
+
+            case JitMathFabs:
+                JitMovqFromXmm(J, JIT_RAX, 0);
+                JitInstruction(J, 0, TRUE, 0x0fba, 6, JitRegister(JIT_RAX));
+                JitByte(J, 63);
+                JitMovqToXmm(J, 0, JIT_RAX);
+                break;
+
+            case JitMathMin: case JitMathMax:
+                /* these give the second one unless the first is less or greater, like MathMin() and MathMax() */
+                JitSSE(J, (Math->Kind == JitMathMin) ? JIT_MINSD : JIT_MAXSD, 0, JitRegister(1));
+                break;
+
+            default:
+                JitCall(J, Math->Address);
+                break;
+        }
+
+        J->Top = First;
+        JitResult(J, TypeFP);
+        return;
+    }
+
+    /* anything else is called through the virtual machine, which can change globals */
+    JitFlush(J);
+    for (Count = 0; Count < Ins->Token; Count++)
+    {
+        int At = 32 + Count * (int)sizeof(struct VmValue);
+
+        JitStoreImmediate(J, FALSE, JitMemory(JIT_RSP, At + offsetof(struct VmValue, Typ)), J->Stack[First + Count].Typ);
+        JitLoad64(J, JIT_RAX, JitSlot(J, First + Count));
+        JitStore64(J, JitMemory(JIT_RSP, At + offsetof(struct VmValue, Val)), JIT_RAX);
+    }
+
+    JitLoad64(J, JIT_ARG0, JitRegister(JIT_R12));
+    JitMovImmediate(J, JIT_ARG1, PC);
+    JitInstruction(J, 0, TRUE, 0x8d, JIT_ARG2, JitMemory(JIT_RSP, 32));
+    JitCall(J, (void *)JitCallFunction);
+    JitTest(J, FALSE, JIT_RAX);
+    JitExitUnless(J, JIT_NOT_EQUAL, PC, JitExitFailed);
+
+    J->Top = First - 1;
+    if (Callee->ReturnType->Base == TypeFP)
+    {
+        JitPush(J, TypeFP, JitInRegister, 0);
+        JitMovsdLoad(J, 0, JitMemory(JIT_R12, offsetof(struct JitFrame, Result) + offsetof(struct VmValue, Val)));
+    }
+    else if (Callee->ReturnType != &J->pc->VoidType)
+    {
+        JitPush(J, TypeInt, JitInRegister, 0);
+        JitLoad32(J, JIT_RAX, JitMemory(JIT_R12, offsetof(struct JitFrame, Result) + offsetof(struct VmValue, Val)));
+    }
+}
+
+/* the ternary operator, see VmOpTernary. All three values have been worked out */
+static void JitTernary(struct Jit *J)
+{
+    unsigned char Typ = (J->Stack[J->Top - 1].Typ == TypeFP) ? (unsigned char)TypeFP : J->Stack[J->Top].Typ;
+    int Skip;
+
+    /* an int and a double give a double, see JIT_EITHER */
+    JitConvert(J, Typ);
+    JitLoadTop(J);
+    JitTruth(J, J->Top - 2);
+    Skip = JitJumpShort(J, JIT_EQUAL);
+    if (Typ == TypeFP)
+        JitLoadFP(J, J->Top - 1, 0);
+    else
+        JitLoadInt(J, J->Top - 1, JIT_RAX);
+
+    if (J->CodeSize - Skip - 1 > 127)
+        JitFail(J, "expression too complex");
+
+    JitLand(J, Skip);
+    J->Top -= 2;
+    JitResult(J, Typ);
+}
+
+/* translate each instruction */
+static void JitGenerate(struct Jit *J)
+{
+    struct VmFunction *Func = J->Func;
+    int Reachable = TRUE;
+    int PC;
+
+    for (PC = 0; PC < Func->CodeSize; PC++)
+    {
+        const struct VmInstruction *Ins = &Func->Code[PC];
+        int Count;
+
+        if (J->IsTarget[PC] && J->Depth[PC] != -1)
+        {
+            /* every value is in its slot when it's jumped to */
+            if (Reachable)
+                JitFlush(J);
+
+            J->Top = J->Depth[PC] - 1;
+            for (Count = 0; Count <= J->Top; Count++)
+            {
+                J->Stack[Count].Typ = (J->StackType[PC * VM_STACK_MAX + Count] == JIT_EITHER) ? (unsigned char)TypeFP : J->StackType[PC * VM_STACK_MAX + Count];
+                J->Stack[Count].Where = JitInSlot;
+            }
+            Reachable = TRUE;
+        }
+
+        J->Address[PC] = J->CodeSize;
+        if (!Reachable || J->Depth[PC] == -1)
+        {
+            Reachable = FALSE;
+            continue;
+        }
+
+        /* only an infix operator uses the value below the top where it is */
+        if (J->Top >= 1 && J->Stack[J->Top - 1].Where == JitInRegister && Ins->Op != VmOpInfix && Ins->Op != VmOpInfixInt && Ins->Op != VmOpInfixFP)
+            JitFlushEntry(J, J->Top - 1);
+
+        switch (Ins->Op)
+        {
+            case VmOpPushInt:
+                JitPush(J, TypeInt, JitInInteger, Ins->Operand);
+                break;
+
+            case VmOpPushFP:
+                JitPush(J, TypeFP, JitInConstant, Ins->Operand);
+                break;
+
+            case VmOpLoad:
+                JitPush(J, Func->Type[Ins->Operand], JitInVariable, Ins->Operand);
+                break;
+
+            case VmOpAssign: case VmOpAssignInt: case VmOpAssignFP:
+                JitAssign(J, PC, (enum LexToken)Ins->Token, Ins->Operand);
+                break;
+
+            case VmOpInitialise:
+                JitFlushVariable(J, Ins->Operand, J->Top);
+                if (Func->Type[Ins->Operand] == TypeFP)
+                {
+                    JitLoadFP(J, J->Top, 0);
+                    JitMovsdStore(J, JitVariable(J, Ins->Operand), 0);
+                }
+                else
+                {
+                    JitConvert(J, TypeInt);
+                    JitLoadInt(J, J->Top, JIT_RAX);
+                    JitStore32(J, JitVariable(J, Ins->Operand), JIT_RAX);
+                }
+                J->Top--;
+                break;
+
+            case VmOpPrefix: case VmOpPostfix:
+                JitIncrement(J, (enum LexToken)Ins->Token, Ins->Op == VmOpPostfix, Ins->Operand);
+                break;
+
+            case VmOpUnary:
+                JitUnary(J, PC, (enum LexToken)Ins->Token);
+                break;
+
+            case VmOpInfix: case VmOpInfixInt: case VmOpInfixFP:
+                JitInfix(J, PC, (enum LexToken)Ins->Token);
+                break;
+
+            case VmOpIntToFP:
+                JitConvert(J, TypeFP);
+                break;
+
+            case VmOpCast:
+                JitConvert(J, Ins->Token);
+                break;
+
+            case VmOpTernary:
+                JitTernary(J);
+                break;
+
+            case VmOpSkipIfFalse: case VmOpSkipIfTrue:
+                /* the 0 which stands for the skipped side can go in its slot either way */
+                JitFlush(J);
+                JitStoreImmediate(J, TRUE, JitSlot(J, J->Top + 1), 0);
+                JitTruth(J, J->Top);
+                JitJump(J, (Ins->Op == VmOpSkipIfTrue) ? JIT_NOT_EQUAL : JIT_EQUAL, Ins->Operand);
+                break;
+
+            case VmOpJump:
+                JitFlush(J);
+                JitJump(J, -1, Ins->Operand);
+                Reachable = FALSE;
+                break;
+
+            case VmOpJumpIfFalse:
+                /* the condition is truncated to an int, see VM_CONDITION() */
+                JitLoadTop(J);
+                J->Top--;
+                JitFlush(J);
+                if (J->Stack[J->Top + 1].Typ == TypeFP)
+                    JitCvttsd2si(J, JIT_RAX, JitRegister(0));
+
+                JitTest(J, FALSE, JIT_RAX);
+                JitJump(J, JIT_EQUAL, Ins->Operand);
+                break;
+
+            case VmOpLoop:
+                JitFlush(J);
+                if (J->pc->Cancel != NULL)
+                {
+                    /* a relaxed load of the atomic flag is an ordinary one */
+                    JitMovImmediate64(J, JIT_R11, J->pc->Cancel);
+                    JitInstruction(J, 0, FALSE, 0x80, 7, JitMemory(JIT_R11, 0));
+                    JitByte(J, 0);
+                    JitExitUnless(J, JIT_EQUAL, PC, JitExitCancelled);
+                }
+                JitJump(J, -1, Ins->Operand);
+                Reachable = FALSE;
+                break;
+
+            case VmOpCall:
+                JitCallInstruction(J, PC, Ins);
+                break;
+
+            case VmOpPop:
+                J->Top--;
+                break;
+
+            case VmOpReturn:
+                JitStoreImmediate(J, FALSE, JitMemory(JIT_R12, offsetof(struct JitFrame, Result) + offsetof(struct VmValue, Typ)), J->Stack[J->Top].Typ);
+                JitLoadTop(J);
+                if (J->Stack[J->Top].Typ == TypeFP)
+                    JitMovsdStore(J, JitMemory(JIT_R12, offsetof(struct JitFrame, Result) + offsetof(struct VmValue, Val)), 0);
+                else
+                    JitStore32(J, JitMemory(JIT_R12, offsetof(struct JitFrame, Result) + offsetof(struct VmValue, Val)), JIT_RAX);
+
+                JitExit(J, PC, JitExitReturn);
+                Reachable = FALSE;
+                break;
+
+            case VmOpReturnVoid:
+                JitExit(J, PC, JitExitReturnVoid);
+                Reachable = FALSE;
+                break;
+
+            case VmOpEnd:
+                JitExit(J, PC, JitExitEnd);
+                Reachable = FALSE;
+                break;
+        }
+    }
+}
+
+/* the code which returns comes first so exits can jump back to it, then
+ * the entry point which sets up the frame */
+static int JitPrologue(struct Jit *J)
+{
+    int Entry;
+
+    J->SlotBase = J->ArgBase;
+    J->FrameSize = J->SlotBase + J->Func->StackSize * 8;
+
+    /* two registers and the return address are pushed, the calls it makes need the stack 16 byte aligned */
+    if (J->FrameSize % 16 != 8)
+        J->FrameSize += 8;
+
+    J->Epilogue = J->CodeSize;
+    JitInstruction(J, 0, TRUE, 0x81, 0, JitRegister(JIT_RSP));
+    JitInt32(J, J->FrameSize);
+    JitByte(J, 0x41);
+    JitByte(J, 0x5c);
+    JitByte(J, 0x5b);
+    JitByte(J, 0xc3);
+
+    Entry = J->CodeSize;
+    JitByte(J, 0x53);
+    JitByte(J, 0x41);
+    JitByte(J, 0x54);
+    JitInstruction(J, 0, TRUE, 0x81, 5, JitRegister(JIT_RSP));
+    JitInt32(J, J->FrameSize);
+    JitLoad64(J, JIT_RBX, JitRegister(JIT_ARG0));
+    JitLoad64(J, JIT_R12, JitRegister(JIT_ARG1));
+    return Entry;
+}
+
+/* copy the code somewhere it can run */
+static void *JitInstall(struct Jit *J)
+{
+    void *Mem;
+
+#ifdef _WIN32
+    DWORD OldProtect;
+
+    Mem = VirtualAlloc(NULL, J->CodeSize, MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE);
+    if (Mem == NULL)
+        JitFail(J, "no executable memory");
+
+    memcpy(Mem, (void *)J->Code, J->CodeSize);
+    if (!VirtualProtect(Mem, J->CodeSize, PAGE_EXECUTE_READ, &OldProtect))
+    {
+        VirtualFree(Mem, 0, MEM_RELEASE);
+        JitFail(J, "no executable memory");
+    }
+    FlushInstructionCache(GetCurrentProcess(), Mem, J->CodeSize);
+#else
+    Mem = mmap(NULL, J->CodeSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (Mem == MAP_FAILED)
+        JitFail(J, "no executable memory");
+
+    memcpy(Mem, (void *)J->Code, J->CodeSize);
+    if (mprotect(Mem, J->CodeSize, PROT_READ | PROT_EXEC) != 0)
+    {
+        munmap(Mem, J->CodeSize);
+        JitFail(J, "no executable memory");
+    }
+#endif
+    return Mem;
+}
+
+/* translate a function compiled to bytecode into machine code, which is put in
+ * Native, NativeSize and NativeEntry of Into. Nothing else is written, so Into
+ * can be a struct of its own and tier.c can do it on another thread while Func
+ * runs. Returns why it couldn't be translated, or NULL */
+const char *JitTranslate(Picoc *pc, struct VmFunction *Func, struct VmFunction *Into)
+{
+    struct Jit *J;
+    const char *Reason = NULL;
+    int Count;
+
+    J = (struct Jit *)calloc(1, sizeof(struct Jit));
+    if (J == NULL)
+        return "out of memory";
+
+    J->pc = pc;
+    J->Func = Func;
+    J->ArgBase = 32;
+    if (!setjmp(J->Fail))
+    {
+        int Entry;
+
+        J->Depth = (int *)JitAlloc(J, NULL, sizeof(int) * Func->CodeSize);
+        J->StackType = (unsigned char *)JitAlloc(J, NULL, VM_STACK_MAX * Func->CodeSize);
+        J->IsTarget = (unsigned char *)JitAlloc(J, NULL, Func->CodeSize);
+        J->Address = (int *)JitAlloc(J, NULL, sizeof(int) * Func->CodeSize);
+        memset((void *)J->IsTarget, '\0', Func->CodeSize);
+        JitCheck(J);
+
+        Entry = JitPrologue(J);
+        J->Top = -1;
+        JitGenerate(J);
+        for (Count = 0; Count < J->NumPatches; Count++)
+            JitPatch32(J, J->Patch[Count].At, J->Address[J->Patch[Count].Target] - (J->Patch[Count].At + 4));
+
+        Into->Native = (unsigned char *)JitInstall(J) + Entry;
+        Into->NativeSize = J->CodeSize;
+        Into->NativeEntry = Entry;
+    }
+    else
+        Reason = J->Reason;
+
+    free(J->Depth);
+    free(J->StackType);
+    free(J->IsTarget);
+    free(J->Address);
+    free(J->Code);
+    free(J->Patch);
+    free(J);
+    return Reason;
+}
+
+/* run a function's machine code, see VmExecute() */
+int JitExecute(struct ParseState *Parser, struct VmFunction *Func, union VmNumber *Local, struct VmValue *Result)
+{
+    struct JitFrame Frame;
+    enum JitExit Exit;
+
+    Frame.Parser = Parser;
+    Frame.Func = Func;
+    Exit = (enum JitExit)((JitCode)Func->Native)(Local, &Frame);
+    if (Exit == JitExitFailed)
+        PlatformExit(Parser->pc, Parser->pc->PicocExitValue);
+
+    if (Exit != JitExitReturnVoid)
+    {
+        Parser->Line = Func->Position[Frame.PC].Line;
+        Parser->CharacterPos = Func->Position[Frame.PC].CharacterPos;
+    }
+
+    switch (Exit)
+    {
+        case JitExitReturn:
+            *Result = Frame.Result;
+            Parser->Mode = RunModeReturn;
+            return TRUE;
+
+        case JitExitReturnVoid:
+            Parser->Mode = RunModeReturn;
+            return FALSE;
+
+        case JitExitDivisionByZero:
+            ProgramFail(Parser, "division by zero");
+            return FALSE;
+
+        case JitExitInvalid:
+            ProgramFail(Parser, "invalid operation");
+            return FALSE;
+
+        case JitExitCancelled:
+            ProgramFail(Parser, "cancelled");
+            return FALSE;
+
+        default:
+            return FALSE;
+    }
+}
+
+/* free a function's machine code */
+void JitFree(struct VmFunction *Func)
+{
+    void *Mem;
+
+    if (Func->Native == NULL)
+        return;
+
+    Mem = (unsigned char *)Func->Native - Func->NativeEntry;
+#ifdef _WIN32
+    VirtualFree(Mem, 0, MEM_RELEASE);
+#else
+    munmap(Mem, Func->NativeSize);
+#endif
+    Func->Native = NULL;
+}
+
+#else
+
+const char *JitTranslate(Picoc *pc, struct VmFunction *Func, struct VmFunction *Into)
+{
+    return "not an x86-64 build";
+}
+
+int JitExecute(struct ParseState *Parser, struct VmFunction *Func, union VmNumber *Local, struct VmValue *Result)
+{
+    return FALSE;
+}
+
+void JitFree(struct VmFunction *Func)
+{
+}
+
+#endif
+
+/* translate a function compiled to bytecode into machine code, or add why it can't be to the report */
+void JitFunction(Picoc *pc, const char *FuncName, struct VmFunction *Func)
+{
+    const char *Reason;
+
+    /* NOJIT in the environment leaves everything to the virtual machine */
+    if (getenv("NOJIT") != NULL)
+        return;
+
+    Reason = JitTranslate(pc, Func, Func);
+    if (Reason != NULL)
+        JitReportAdd(pc, FuncName, "bytecode", Reason);
+}
@@ -106,17 +106,6 @@ void LexInit(Picoc *pc)
     pc->LexValue.IsLValue = FALSE;
 }
 
-/* deallocate */
-void LexCleanup(Picoc *pc)
-{
-    int Count;
-
-    LexInteractiveClear(pc, NULL);
-
-    for (Count = 0; Count < sizeof(ReservedWords) / sizeof(struct ReservedWord); Count++)
-        TableDelete(pc, &pc->ReservedWordTable, TableStrRegister(pc, ReservedWords[Count].Word));
-}
-
 /* check if a word is a reserved word - used while scanning */
 enum LexToken LexCheckReservedWord(Picoc *pc, const char *Word)
 {
@@ -255,6 +244,7 @@ enum LexToken LexGetWord(Picoc *pc, struct LexState *Lexer, struct Value *Value)
     {
         case TokenHashInclude: Lexer->Mode = LexModeHashInclude; break;
         case TokenHashDefine: Lexer->Mode = LexModeHashDefine; break;
+        case TokenStaticType: pc->LexStatic = TRUE; break;
         default: break;
     }
         
@@ -624,6 +614,7 @@ void LexInitParser(struct ParseState *Parser, Picoc *pc, const char *SourceText,
     Parser->CharacterPos = 0;
     Parser->SourceText = SourceText;
     Parser->DebugMode = EnableDebugger;
+    Parser->Function = NULL;
 }
 
 /* get the next token, without pre-processing */
@@ -915,6 +906,9 @@ enum LexToken LexGetToken(struct ParseState *Parser, struct Value **Value, int I
             default:                WasPreProcToken = FALSE; break;
         }
 
+        if (WasPreProcToken)
+            Parser->pc->SkipBarrier++;
+
         /* if we're going to reject this token, increment the token pointer to the next one */
         TryNextToken = (Parser->HashIfEvaluateToLevel < Parser->HashIfLevel && Token != TokenEOF) || WasPreProcToken;
         if (!IncPos && TryNextToken)
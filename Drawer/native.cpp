@@ -0,0 +1,457 @@
+/* picoc native build - hands the whole script to the system's C compiler as a
+ * shared library and loads it, so a program runs fully optimised code instead
+ * of being interpreted. NATIVECC in the environment is the compiler to use, for
+ * example "cc" or "gcc", without it everything stays with picoc. Libraries are
+ * kept in a cache directory of the user's under the hash of what was compiled,
+ * so the same script is only compiled once, and loaded once for all the
+ * programs running it. Anything which fails, the compiler included, leaves the
+ * program with picoc.
+ *
+ * The native code doesn't do the checks the interpreter does, a division of
+ * ints by zero or a pointer out of bounds takes the process down, which is why
+ * it has to be asked for */
+
+#include "picoc.h"
+#include "interpreter.h"
+
+#include <stdint.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <mutex>
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#include <aclapi.h>
+#include <direct.h>
+#include <process.h>
+#pragma comment(lib, "advapi32.lib")
+#define NATIVE_SUFFIX ".dll"
+#define NATIVE_SEPARATOR "\\"
+#define NATIVE_FLAGS "-O2 -w -shared"
+#else
+#include <dlfcn.h>
+#include <unistd.h>
+#define NATIVE_SUFFIX ".so"
+#define NATIVE_SEPARATOR "/"
+#define NATIVE_FLAGS "-O2 -w -shared -fPIC"
+#endif
+
+#define NATIVE_PATH_MAX 1024
+#define NATIVE_RETRY (60*60)            /* seconds before a script the compiler failed on is tried again */
+
+/* what the script is wrapped in. The builtins picoc has which C doesn't, or
+ * has differently, are defined the way cstdlib/math.c does them. main is
+ * renamed, it's called through NativeRun() and exit() goes back there too.
+ * The library is shared by the programs on every thread, so that's kept per
+ * thread */
+static const char NativePrologue[] =
+    "#define _USE_MATH_DEFINES\n"
+    "#include <math.h>\n"
+    "#include <stdio.h>\n"
+    "#include <stdlib.h>\n"
+    "#include <string.h>\n"
+    "#include <ctype.h>\n"
+    "#include <errno.h>\n"
+    "#include <time.h>\n"
+    "#include <stdbool.h>\n"
+    "#include <setjmp.h>\n"
+    "#if defined(_MSC_VER)\n"
+    "#define NATIVE_THREAD __declspec(thread)\n"
+    "#elif defined(__GNUC__)\n"
+    "#define NATIVE_THREAD __thread\n"
+    "#else\n"
+    "#define NATIVE_THREAD _Thread_local\n"
+    "#endif\n"
+    "static double NativeRound(double v) { return ceil(v - 0.5); }\n"
+    "static double min(double a, double b) { return (a < b) ? a : b; }\n"
+    "static double max(double a, double b) { return (a > b) ? a : b; }\n"
+    "static double clamp(double s, double a, double b) { if (s < a) s = a; else if (s > b) s = b; return s; }\n"
+    "static double lerp(double i, double a, double b) { return (1.0 - i) * a + i * b; }\n"
+    "static NATIVE_THREAD jmp_buf NativeExitBuf;\n"
+    "static NATIVE_THREAD int NativeExitValue;\n"
+    "static void NativeExit(int Value) { NativeExitValue = Value; longjmp(NativeExitBuf, 1); }\n"
+    "#define round NativeRound\n"
+    "#define exit NativeExit\n"
+    "#define main NativeMain\n"
+    "#line 1 \"script\"\n";
+
+static const char NativeEpilogue[] =
+    "\n"
+    "#undef main\n"
+    "#ifdef _WIN32\n"
+    "__declspec(dllexport)\n"
+    "#endif\n"
+    "int NativeRun(const double *Arg, double *Result)\n"
+    "{\n"
+    "    if (setjmp(NativeExitBuf))\n"
+    "    {\n"
+    "        *Result = NativeExitValue;\n"
+    "        return 1;\n"
+    "    }\n"
+    "\n"
+    "    *Result = %s;\n"
+    "    return 0;\n"
+    "}\n";
+
+/* a library loaded once for all the programs of the same script */
+struct NativeProgram
+{
+    struct NativeProgram *Next;
+    uint64_t Hash;                  /* of what it was compiled from */
+    int References;                 /* programs using it, it's unloaded when there are none left */
+    void *Library;
+    int (*Run)(const double *Arg, double *Result);
+};
+
+/* programs building the same script at once build and load it once */
+static std::mutex NativeMutex;
+static struct NativeProgram *NativeLoaded = NULL;
+
+/* 64 bit FNV-1a */
+static uint64_t NativeHash(uint64_t Hash, const char *Text)
+{
+    for (; *Text != '\0'; Text++)
+        Hash = (Hash ^ (unsigned char)*Text) * 0x100000001b3ULL;
+
+    return Hash;
+}
+
+static int NativeProcessId()
+{
+#ifdef _WIN32
+    return _getpid();
+#else
+    return (int)getpid();
+#endif
+}
+
+/* snprintf() which says whether it all fitted. A path cut short would name
+ * another file, maybe another script's library, so it's not to be used */
+static int NativePrint(char *Buffer, size_t Size, const char *Format, ...)
+{
+    va_list Args;
+    int Length;
+
+    va_start(Args, Format);
+    Length = vsnprintf(Buffer, Size, Format, Args);
+    va_end(Args);
+    return Length >= 0 && (size_t)Length < Size;
+}
+
+/* is Path a directory of the user's which nobody else can write to? What's in
+ * the cache gets loaded and run, so one someone else could have put there isn't
+ * used */
+static int NativeIsPrivate(const char *Path)
+{
+#ifdef _WIN32
+    DWORD Attributes = GetFileAttributesA(Path);
+    PSID Owner = NULL;
+    PSECURITY_DESCRIPTOR Descriptor = NULL;
+    HANDLE Token = NULL;
+    char User[SECURITY_MAX_SID_SIZE + sizeof(TOKEN_USER)];
+    char DefaultOwner[SECURITY_MAX_SID_SIZE + sizeof(TOKEN_OWNER)];
+    DWORD Size;
+    int Ok = FALSE;
+
+    /* a link may lead anywhere */
+    if (Attributes == INVALID_FILE_ATTRIBUTES || !(Attributes & FILE_ATTRIBUTE_DIRECTORY) || (Attributes & FILE_ATTRIBUTE_REPARSE_POINT))
+        return FALSE;
+
+    /* the directory's owner has to be the user, or who the user's files are given to, like
+     * the administrators. Nobody else can write in LOCALAPPDATA, where it's made by default */
+    if (GetNamedSecurityInfoA(Path, SE_FILE_OBJECT, OWNER_SECURITY_INFORMATION, &Owner, NULL, NULL, NULL, &Descriptor) != ERROR_SUCCESS)
+        return FALSE;
+
+    if (OpenProcessToken(GetCurrentProcess(), TOKEN_QUERY, &Token))
+    {
+        if (GetTokenInformation(Token, TokenUser, User, sizeof(User), &Size) && EqualSid(Owner, ((TOKEN_USER *)User)->User.Sid))
+            Ok = TRUE;
+        else if (GetTokenInformation(Token, TokenOwner, DefaultOwner, sizeof(DefaultOwner), &Size) && EqualSid(Owner, ((TOKEN_OWNER *)DefaultOwner)->Owner))
+            Ok = TRUE;
+
+        CloseHandle(Token);
+    }
+
+    LocalFree(Descriptor);
+    return Ok;
+#else
+    struct stat Status;
+
+    /* a link isn't followed, someone else may have made it */
+    if (lstat(Path, &Status) != 0)
+        return FALSE;
+
+    return S_ISDIR(Status.st_mode) && Status.st_uid == geteuid() && (Status.st_mode & (S_IWGRP | S_IWOTH)) == 0;
+#endif
+}
+
+/* NATIVECACHE in the environment, or c-plot-native in the user's cache directory,
+ * XDG_CACHE_HOME or ~/.cache, or LOCALAPPDATA on Windows. FALSE if there's none
+ * or it isn't private to the user */
+static int NativeCacheDirectory(char *Path)
+{
+    const char *Cache = getenv("NATIVECACHE");
+
+    if (Cache != NULL && *Cache != '\0')
+    {
+        if (!NativePrint(Path, NATIVE_PATH_MAX, "%s", Cache))
+            return FALSE;
+    }
+    else
+    {
+#ifdef _WIN32
+        const char *Base = getenv("LOCALAPPDATA");
+
+        if (Base == NULL || *Base == '\0')
+            return FALSE;
+
+        if (!NativePrint(Path, NATIVE_PATH_MAX, "%s\\c-plot-native", Base))
+            return FALSE;
+#else
+        const char *Base = getenv("XDG_CACHE_HOME");
+
+        /* a relative one is to be ignored */
+        if (Base != NULL && *Base == '/')
+        {
+            if (!NativePrint(Path, NATIVE_PATH_MAX, "%s/c-plot-native", Base))
+                return FALSE;
+        }
+        else
+        {
+            const char *Home = getenv("HOME");
+
+            if (Home == NULL || *Home == '\0')
+                return FALSE;
+
+            if (!NativePrint(Path, NATIVE_PATH_MAX, "%s/.cache", Home))
+                return FALSE;
+
+            mkdir(Path, 0700);
+            if (!NativePrint(Path, NATIVE_PATH_MAX, "%s/.cache/c-plot-native", Home))
+                return FALSE;
+        }
+#endif
+    }
+
+#ifdef _WIN32
+    _mkdir(Path);
+#else
+    mkdir(Path, 0700);
+#endif
+    return NativeIsPrivate(Path);
+}
+
+/* when Path was last written, or -1 if it isn't there */
+static time_t NativeModified(const char *Path)
+{
+#ifdef _WIN32
+    struct _stat Status;
+
+    if (_stat(Path, &Status) != 0)
+        return (time_t)-1;
+#else
+    struct stat Status;
+
+    if (stat(Path, &Status) != 0)
+        return (time_t)-1;
+#endif
+    return Status.st_mtime;
+}
+
+static int NativeExists(const char *Path)
+{
+    FILE *File = fopen(Path, "rb");
+
+    if (File == NULL)
+        return FALSE;
+
+    fclose(File);
+    return TRUE;
+}
+
+/* compile Text to the library Path unless it's in the cache already. The
+ * library is written under another name first so it never appears half done.
+ * A script the compiler fails on is marked so it isn't tried again for
+ * NATIVE_RETRY seconds. The mark is under the same hash as the library, which
+ * the compiler is part of, so another NATIVECC tries it right away.
+ * NativeMutex must be locked */
+static int NativeBuild(const char *Compiler, const char *Text, const char *Base, const char *Path)
+{
+    char SourcePath[NATIVE_PATH_MAX];
+    char BuildPath[NATIVE_PATH_MAX];
+    char FailedPath[NATIVE_PATH_MAX];
+    char Command[NATIVE_PATH_MAX * 3];
+    FILE *File;
+    time_t Failed;
+    int Ok;
+
+    if (NativeExists(Path))
+        return TRUE;
+
+    if (!NativePrint(FailedPath, sizeof(FailedPath), "%s.failed", Base) ||
+            !NativePrint(SourcePath, sizeof(SourcePath), "%s.c", Base) ||
+            !NativePrint(BuildPath, sizeof(BuildPath), "%s.%d.tmp", Base, NativeProcessId()))
+        return FALSE;
+
+    Failed = NativeModified(FailedPath);
+    if (Failed != (time_t)-1 && time(NULL) - Failed < NATIVE_RETRY)
+        return FALSE;
+
+    remove(FailedPath);
+
+    File = fopen(SourcePath, "wb");
+    if (File == NULL)
+        return FALSE;
+
+    Ok = fputs(Text, File) >= 0;
+    if (fclose(File) != 0 || !Ok)
+        return FALSE;
+
+#ifdef _WIN32
+    Ok = NativePrint(Command, sizeof(Command), "%s %s -o \"%s\" \"%s\" > NUL 2>&1", Compiler, NATIVE_FLAGS, BuildPath, SourcePath);
+#else
+    Ok = NativePrint(Command, sizeof(Command), "%s %s -o '%s' '%s' -lm > /dev/null 2>&1", Compiler, NATIVE_FLAGS, BuildPath, SourcePath);
+#endif
+    if (!Ok)
+    {
+        remove(SourcePath);
+        return FALSE;
+    }
+
+    /* another process may have put it there since, which is as good */
+    Ok = system(Command) == 0 && (rename(BuildPath, Path) == 0 || NativeExists(Path));
+    remove(BuildPath);
+    remove(SourcePath);
+    if (!Ok)
+    {
+        /* what failed, for whoever looks in the cache */
+        File = fopen(FailedPath, "wb");
+        if (File != NULL)
+        {
+            fprintf(File, "%s\n", Compiler);
+            fclose(File);
+        }
+    }
+
+    return Ok;
+}
+
+/* load the library, NativeMutex must be locked */
+static struct NativeProgram *NativeOpen(const char *Path, uint64_t Hash)
+{
+    struct NativeProgram *Program = (struct NativeProgram *)calloc(1, sizeof(struct NativeProgram));
+
+    if (Program == NULL)
+        return NULL;
+
+#ifdef _WIN32
+    Program->Library = (void *)LoadLibraryA(Path);
+    if (Program->Library != NULL)
+        Program->Run = (int (*)(const double *, double *))GetProcAddress((HMODULE)Program->Library, "NativeRun");
+#else
+    Program->Library = dlopen(Path, RTLD_NOW | RTLD_LOCAL);
+    if (Program->Library != NULL)
+        Program->Run = (int (*)(const double *, double *))dlsym(Program->Library, "NativeRun");
+#endif
+
+    if (Program->Run == NULL)
+    {
+#ifdef _WIN32
+        if (Program->Library != NULL)
+            FreeLibrary((HMODULE)Program->Library);
+#else
+        if (Program->Library != NULL)
+            dlclose(Program->Library);
+#endif
+        free(Program);
+        return NULL;
+    }
+
+    Program->Hash = Hash;
+    Program->References = 1;
+    Program->Next = NativeLoaded;
+    NativeLoaded = Program;
+    return Program;
+}
+
+/* build a script whose main() takes NumArgs doubles, returns NULL if it has to stay with picoc.
+ * Programs of the same script get the same library, which they can call at the same time on
+ * different threads. It has only one copy of the script's global variables, so a script with
+ * some of them which change can't be run this way */
+struct NativeProgram *NativeLoad(const char *Source, int NumArgs)
+{
+    const char *Compiler = getenv("NATIVECC");
+    char Directory[NATIVE_PATH_MAX];
+    char Base[NATIVE_PATH_MAX];
+    char Path[NATIVE_PATH_MAX];
+    char Epilogue[sizeof(NativeEpilogue) + 32];
+    char *Text;
+    size_t TextLength;
+    uint64_t Hash;
+    struct NativeProgram *Program;
+
+    if (Compiler == NULL || *Compiler == '\0' || !NativeCacheDirectory(Directory))
+        return NULL;
+
+    snprintf(Epilogue, sizeof(Epilogue), NativeEpilogue, (NumArgs == 1) ? "NativeMain(Arg[0])" : "NativeMain(Arg[0], Arg[1])");
+    TextLength = strlen(NativePrologue) + strlen(Source) + strlen(Epilogue) + 1;
+    Text = (char *)malloc(TextLength);
+    if (Text == NULL)
+        return NULL;
+
+    snprintf(Text, TextLength, "%s%s%s", NativePrologue, Source, Epilogue);
+
+    /* a different compiler makes a different library */
+    Hash = NativeHash(NativeHash(0xcbf29ce484222325ULL, Compiler), Text);
+    if (!NativePrint(Base, sizeof(Base), "%s" NATIVE_SEPARATOR "%016llx", Directory, (unsigned long long)Hash) ||
+            !NativePrint(Path, sizeof(Path), "%s%s", Base, NATIVE_SUFFIX))
+    {
+        free(Text);
+        return NULL;
+    }
+
+    std::lock_guard<std::mutex> Lock(NativeMutex);
+    for (Program = NativeLoaded; Program != NULL; Program = Program->Next)
+    {
+        if (Program->Hash == Hash)
+        {
+            Program->References++;
+            free(Text);
+            return Program;
+        }
+    }
+
+    Program = NativeBuild(Compiler, Text, Base, Path) ? NativeOpen(Path, Hash) : NULL;
+    free(Text);
+    return Program;
+}
+
+/* call main(), returns TRUE if it called exit() instead of returning, whose value is then the result */
+int NativeCall(struct NativeProgram *Program, const double *Args, double *Result)
+{
+    return Program->Run(Args, Result);
+}
+
+/* unload the library once no program uses it any more */
+void NativeFree(struct NativeProgram *Program)
+{
+    std::lock_guard<std::mutex> Lock(NativeMutex);
+    struct NativeProgram **Loaded;
+
+    if (Program == NULL || --Program->References > 0)
+        return;
+
+    for (Loaded = &NativeLoaded; *Loaded != Program; Loaded = &(*Loaded)->Next)
+        ;
+
+    *Loaded = Program->Next;
+#ifdef _WIN32
+    FreeLibrary((HMODULE)Program->Library);
+#else
+    dlclose(Program->Library);
+#endif
+    free(Program);
+}
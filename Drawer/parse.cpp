@@ -3,22 +3,331 @@
 #include "picoc.h"
 #include "interpreter.h"
 
-bool gResetParser = false;
+/* initialise the parser */
+void ParseInit(Picoc *pc)
+{
+    memset((void *)pc->SkipHashTable, '\0', sizeof(pc->SkipHashTable));
+    memset((void *)pc->SwitchHashTable, '\0', sizeof(pc->SwitchHashTable));
+    memset((void *)pc->LabelHashTable, '\0', sizeof(pc->LabelHashTable));
+    pc->SkipBarrier = 0;
+    pc->DeclarationCount = 0;
+}
 
-/* deallocate any memory */
-void ParseCleanup(Picoc *pc)
+/* forget every recorded statement end, switch and label, the tokens they point into are going away */
+void ParseSkipClear(Picoc *pc)
 {
-    while (pc->CleanupTokenList != NULL)
+    int Count;
+
+    for (Count = 0; Count < SKIP_TABLE_SIZE; Count++)
     {
-        struct CleanupTokenNode *Next = pc->CleanupTokenList->Next;
-        
-        HeapFreeMem(pc, pc->CleanupTokenList->Tokens);
-        if (pc->CleanupTokenList->SourceText != NULL)
-            HeapFreeMem(pc, (void *)pc->CleanupTokenList->SourceText);
-            
-        HeapFreeMem(pc, pc->CleanupTokenList);
-        pc->CleanupTokenList = Next;
+        while (pc->SkipHashTable[Count] != NULL)
+        {
+            struct ParseSkip *Next = pc->SkipHashTable[Count]->Next;
+
+            HeapFreeMem(pc, pc->SkipHashTable[Count]);
+            pc->SkipHashTable[Count] = Next;
+        }
+
+        while (pc->SwitchHashTable[Count] != NULL)
+        {
+            struct ParseSwitch *Next = pc->SwitchHashTable[Count]->Next;
+
+            HeapFreeMem(pc, pc->SwitchHashTable[Count]);
+            pc->SwitchHashTable[Count] = Next;
+        }
+
+        while (pc->LabelHashTable[Count] != NULL)
+        {
+            struct ParseLabel *Next = pc->LabelHashTable[Count]->Next;
+
+            HeapFreeMem(pc, pc->LabelHashTable[Count]);
+            pc->LabelHashTable[Count] = Next;
+        }
+    }
+}
+
+/* find where a statement starting at this token ends, if it's been parsed without running before */
+static struct ParseSkip *ParseSkipFind(Picoc *pc, const unsigned char *Start)
+{
+    struct ParseSkip *Skip;
+
+    for (Skip = pc->SkipHashTable[(uintptr_t)Start % SKIP_TABLE_SIZE]; Skip != NULL; Skip = Skip->Next)
+    {
+        if (Skip->Start == Start)
+            return Skip;
+    }
+
+    return NULL;
+}
+
+/* remember where a statement ends. running out of memory only means it'll be parsed again */
+static void ParseSkipAdd(struct ParseState *Parser, const unsigned char *Start, int Declares)
+{
+    Picoc *pc = Parser->pc;
+    int HashValue = (uintptr_t)Start % SKIP_TABLE_SIZE;
+    struct ParseSkip *Skip = (struct ParseSkip *)HeapAllocMem(pc, sizeof(struct ParseSkip));
+
+    if (Skip == NULL)
+        return;
+
+    Skip->Start = Start;
+    Skip->End = Parser->Pos;
+    Skip->Line = Parser->Line;
+    Skip->CharacterPos = Parser->CharacterPos;
+    Skip->Declares = Declares;
+    Skip->Next = pc->SkipHashTable[HashValue];
+    pc->SkipHashTable[HashValue] = Skip;
+}
+
+/* note where a goto label is. a statement which has been parsed once has all its labels noted */
+static void ParseLabelAdd(struct ParseState *Parser, const char *Name, const unsigned char *Pos)
+{
+    Picoc *pc = Parser->pc;
+    int HashValue = (uintptr_t)Name % SKIP_TABLE_SIZE;
+    struct ParseLabel *Label;
+
+    for (Label = pc->LabelHashTable[HashValue]; Label != NULL; Label = Label->Next)
+    {
+        if (Label->Name == Name && Label->Pos == Pos)
+            return;
+    }
+
+    Label = (struct ParseLabel *)HeapAllocMem(pc, sizeof(struct ParseLabel));
+    if (Label == NULL)
+        ProgramFail(Parser, "out of memory");
+
+    Label->Name = Name;
+    Label->Pos = Pos;
+    Label->Next = pc->LabelHashTable[HashValue];
+    pc->LabelHashTable[HashValue] = Label;
+}
+
+/* is there a goto label of this name in a recorded statement */
+static int ParseLabelWithin(Picoc *pc, const char *Name, struct ParseSkip *Skip)
+{
+    struct ParseLabel *Label;
+
+    for (Label = pc->LabelHashTable[(uintptr_t)Name % SKIP_TABLE_SIZE]; Label != NULL; Label = Label->Next)
+    {
+        if (Label->Name == Name && Label->Pos >= Skip->Start && Label->Pos < Skip->End)
+            return TRUE;
+    }
+
+    return FALSE;
+}
+
+/* where the parser is now, to jump back to later */
+static void ParseJumpSet(struct ParseJump *Jump, struct ParseState *Parser)
+{
+    Jump->Pos = Parser->Pos;
+    Jump->Line = Parser->Line;
+    Jump->CharacterPos = Parser->CharacterPos;
+}
+
+/* go to somewhere recorded earlier */
+static void ParseJumpTo(struct ParseState *Parser, struct ParseJump *Jump)
+{
+    Parser->Pos = Jump->Pos;
+    Parser->Line = Jump->Line;
+    Parser->CharacterPos = Jump->CharacterPos;
+}
+
+/* add a case label to a switch's hash table. if the same value is used twice the first one wins */
+static void ParseSwitchAddCase(struct ParseSwitch *Switch, int Value, struct ParseState *Parser)
+{
+    int Slot = (unsigned int)Value & (Switch->NumSlots - 1);
+
+    while (Switch->Cases[Slot].Used)
+    {
+        if (Switch->Cases[Slot].Value == Value)
+            return;
+
+        Slot = (Slot + 1) & (Switch->NumSlots - 1);
+    }
+
+    Switch->Cases[Slot].Value = Value;
+    Switch->Cases[Slot].Used = TRUE;
+    ParseJumpSet(&Switch->Cases[Slot].Target, Parser);
+}
+
+/* read through a switch's body for its case labels. only cases with a literal value which are
+ * statements of the body itself can be indexed, otherwise this returns -1 and the switch searches
+ * for its case the slow way. with a NULL Switch the cases are only counted */
+static int ParseSwitchScan(struct ParseState *Parser, struct ParseSwitch *Switch)
+{
+    struct ParseState Scan;
+    struct ParseState BeforeToken;
+    struct Value *LexValue;
+    enum LexToken Token;
+    enum LexToken PrevToken = TokenLeftBrace;
+    int Depth = 0;
+    int NestedSwitchDepth = 0;
+    int SwitchPending = FALSE;
+    int NumCases = 0;
+
+    ParserCopy(&Scan, Parser);
+    for (;;)
+    {
+        ParserCopy(&BeforeToken, &Scan);
+        Token = LexGetToken(&Scan, &LexValue, TRUE);
+        switch (Token)
+        {
+            case TokenEOF:
+                return -1;
+
+            case TokenSwitch:
+                SwitchPending = TRUE;
+                break;
+
+            case TokenLeftBrace:
+                Depth++;
+                if (SwitchPending && NestedSwitchDepth == 0)
+                    NestedSwitchDepth = Depth;   /* the cases in here belong to another switch */
+
+                SwitchPending = FALSE;
+                break;
+
+            case TokenRightBrace:
+                if (Depth == 0)
+                {
+                    if (Switch != NULL)
+                        ParseJumpSet(&Switch->End, &BeforeToken);
+
+                    return NumCases;
+                }
+
+                if (Depth == NestedSwitchDepth)
+                    NestedSwitchDepth = 0;
+
+                Depth--;
+                break;
+
+            case TokenCase:
+            case TokenDefault:
+                if (NestedSwitchDepth != 0)
+                    break;
+
+                /* a label inside another statement can't be jumped to without going through that statement */
+                if (Depth != 0 || (PrevToken != TokenSemicolon && PrevToken != TokenLeftBrace && PrevToken != TokenRightBrace && PrevToken != TokenColon))
+                    return -1;
+
+                if (Token == TokenCase)
+                {
+                    int Negate = FALSE;
+                    int Value;
+
+                    Token = LexGetToken(&Scan, &LexValue, TRUE);
+                    if (Token == TokenMinus)
+                    {
+                        Negate = TRUE;
+                        Token = LexGetToken(&Scan, &LexValue, TRUE);
+                    }
+
+                    if (Token == TokenIntegerConstant)
+                        Value = (int)LexValue->Val->LongInteger;
+                    else if (Token == TokenCharacterConstant)
+                        Value = LexValue->Val->Character;
+                    else
+                        return -1;
+
+                    if (LexGetToken(&Scan, NULL, TRUE) != TokenColon)
+                        return -1;
+
+                    if (Switch != NULL)
+                        ParseSwitchAddCase(Switch, Negate ? -Value : Value, &Scan);
+
+                    NumCases++;
+                }
+                else
+                {
+                    if (LexGetToken(&Scan, NULL, TRUE) != TokenColon)
+                        return -1;
+
+                    if (Switch != NULL && !Switch->HasDefault)
+                    {
+                        Switch->HasDefault = TRUE;
+                        ParseJumpSet(&Switch->Default, &Scan);
+                    }
+                }
+
+                Token = TokenColon;
+                break;
+
+            default:
+                break;
+        }
+
+        PrevToken = Token;
+    }
+}
+
+/* index the case labels of the switch whose body starts here */
+static struct ParseSwitch *ParseSwitchIndex(struct ParseState *Parser)
+{
+    Picoc *pc = Parser->pc;
+    int HashValue = (uintptr_t)Parser->Pos % SKIP_TABLE_SIZE;
+    int NumCases = ParseSwitchScan(Parser, NULL);
+    int NumSlots = 0;
+    struct ParseSwitch *Switch;
+
+    if (NumCases >= 0)
+    {
+        for (NumSlots = 4; NumSlots < NumCases * 2; NumSlots *= 2)
+        {}
+    }
+
+    Switch = (struct ParseSwitch *)HeapAllocMem(pc, sizeof(struct ParseSwitch) + sizeof(struct ParseCase) * NumSlots);
+    if (Switch == NULL)
+        ProgramFail(Parser, "out of memory");
+
+    Switch->Start = Parser->Pos;
+    Switch->NumSlots = NumCases >= 0 ? NumSlots : -1;
+    Switch->HasDefault = FALSE;
+    Switch->Cases = (struct ParseCase *)((char *)Switch + sizeof(struct ParseSwitch));
+    if (NumCases >= 0)
+        ParseSwitchScan(Parser, Switch);
+
+    Switch->Next = pc->SwitchHashTable[HashValue];
+    pc->SwitchHashTable[HashValue] = Switch;
+    return Switch;
+}
+
+/* go straight to the case label a switch is searching for. if the switch's cases
+ * can't be indexed this leaves the parser where it was, to search statement by statement */
+static void ParseSwitchJump(struct ParseState *Parser)
+{
+    struct ParseSwitch *Switch;
+    int Slot;
+
+    for (Switch = Parser->pc->SwitchHashTable[(uintptr_t)Parser->Pos % SKIP_TABLE_SIZE]; Switch != NULL; Switch = Switch->Next)
+    {
+        if (Switch->Start == Parser->Pos)
+            break;
+    }
+
+    if (Switch == NULL)
+        Switch = ParseSwitchIndex(Parser);
+
+    if (Switch->NumSlots < 0)
+        return;
+
+    for (Slot = (unsigned int)Parser->SearchLabel & (Switch->NumSlots - 1); Switch->Cases[Slot].Used; Slot = (Slot + 1) & (Switch->NumSlots - 1))
+    {
+        if (Switch->Cases[Slot].Value == Parser->SearchLabel)
+        {
+            ParseJumpTo(Parser, &Switch->Cases[Slot].Target);
+            Parser->Mode = RunModeRun;
+            return;
+        }
+    }
+
+    if (Switch->HasDefault)
+    {
+        ParseJumpTo(Parser, &Switch->Default);
+        Parser->Mode = RunModeRun;
     }
+    else
+        ParseJumpTo(Parser, &Switch->End);
 }
 
 /* parse a statement, but only run it if Condition is TRUE */
@@ -73,6 +382,7 @@ struct Value *ParseFunctionDefinition(struct ParseState *Parser, struct ValueTyp
     if (pc->TopStackFrame != NULL)
         ProgramFail(Parser, "nested function definitions are not allowed");
         
+    pc->SkipBarrier++;
     LexGetToken(Parser, NULL, TRUE);  /* open bracket */
     ParserCopy(&ParamParser, Parser);
     ParamCount = ParseCountParams(Parser);
@@ -321,6 +631,7 @@ int ParseDeclaration(struct ParseState *Parser, enum LexToken Token)
     int FirstVisit = FALSE;
     Picoc *pc = Parser->pc;
 
+    pc->DeclarationCount++;
     TypeParseFront(Parser, &BasicType, &IsStatic);
     do
     {
@@ -350,6 +661,10 @@ int ParseDeclaration(struct ParseState *Parser, enum LexToken Token)
                     LexGetToken(Parser, NULL, TRUE);
                     ParseDeclarationAssignment(Parser, NewVariable, !IsStatic || FirstVisit);
                 }
+
+                /* a static starts again from its first value with every sample */
+                if (IsStatic && FirstVisit)
+                    VariableSnapshotAdd(pc, NewVariable);
             }
         }
         
@@ -373,6 +688,7 @@ void ParseMacroDefinition(struct ParseState *Parser)
     if (LexGetToken(Parser, &MacroName, TRUE) != TokenIdentifier)
         ProgramFail(Parser, "identifier expected");
     
+    Parser->pc->SkipBarrier++;
     MacroNameStr = MacroName->Val->Identifier;
     
     if (LexRawPeekToken(Parser) == TokenOpenMacroBracket)
@@ -452,7 +768,7 @@ void ParseFor(struct ParseState *Parser)
     
     enum RunMode OldMode = Parser->Mode;
     
-    int PrevScopeID = 0, ScopeID = VariableScopeBegin(Parser, &PrevScopeID);
+    intptr_t PrevScopeID = 0, ScopeID = VariableScopeBegin(Parser, &PrevScopeID);
 
     if (LexGetToken(Parser, NULL, TRUE) != TokenOpenBracket)
         ProgramFail(Parser, "'(' expected");
@@ -486,8 +802,8 @@ void ParseFor(struct ParseState *Parser)
         
     while (Condition && Parser->Mode == RunModeRun)
     {
-		if (gResetParser)
-			ProgramFail(Parser, "Reset");
+		CHECK_CANCELLED(Parser);
+		TIER_COUNT_LOOP(Parser);
 
         ParserCopyPos(Parser, &PreIncrement);
         ParseStatement(Parser, FALSE);
@@ -519,7 +835,7 @@ void ParseFor(struct ParseState *Parser)
 /* parse a block of code and return what mode it returned in */
 enum RunMode ParseBlock(struct ParseState *Parser, int AbsorbOpenBrace, int Condition)
 {
-    int PrevScopeID = 0, ScopeID = VariableScopeBegin(Parser, &PrevScopeID);
+    intptr_t PrevScopeID = 0, ScopeID = VariableScopeBegin(Parser, &PrevScopeID);
 
     if (AbsorbOpenBrace && LexGetToken(Parser, NULL, TRUE) != TokenLeftBrace)
         ProgramFail(Parser, "'{' expected");
@@ -531,18 +847,21 @@ enum RunMode ParseBlock(struct ParseState *Parser, int AbsorbOpenBrace, int Cond
         Parser->Mode = RunModeSkip;
         while (ParseStatement(Parser, TRUE) == ParseResultOk)
         {
-			if (gResetParser)
-				ProgramFail(Parser, "Reset");
+			CHECK_CANCELLED(Parser);
 		}
         Parser->Mode = OldMode;
     }
     else
     { 
+        /* a switch's body is the only block which comes in searching for a case with its brace
+         * still to absorb. it goes straight to the case if it can */
+        if (AbsorbOpenBrace && Parser->Mode == RunModeCaseSearch)
+            ParseSwitchJump(Parser);
+        
         /* just run it in its current mode */
         while (ParseStatement(Parser, TRUE) == ParseResultOk)
         {
-			if (gResetParser)
-				ProgramFail(Parser, "Reset");
+			CHECK_CANCELLED(Parser);
 		}
     }
     
@@ -582,11 +901,33 @@ enum ParseResult ParseStatement(struct ParseState *Parser, int CheckTrailingSemi
     int Condition;
     struct ParseState PreState;
     enum LexToken Token;
+    int SkipBarrier = -1;
+    int DeclarationCount = Parser->pc->DeclarationCount;
     
     /* if we're debugging, check for a breakpoint */
     if (Parser->DebugMode && Parser->Mode == RunModeRun)
         DebugCheckStatement(Parser);
     
+    CHECK_CANCELLED(Parser);
+    
+    /* code which doesn't run only has to be parsed once, after that we jump straight over it.
+     * a goto can jump over anything which doesn't hold its label or declare variables */
+    if ((Parser->Mode == RunModeSkip || Parser->Mode == RunModeReturn || Parser->Mode == RunModeBreak || Parser->Mode == RunModeContinue || Parser->Mode == RunModeGoto) &&
+        CheckTrailingSemicolon && Parser->FileName != Parser->pc->StrEmpty)
+    {
+        struct ParseSkip *Skip = ParseSkipFind(Parser->pc, Parser->Pos);
+        if (Skip == NULL)
+            SkipBarrier = Parser->pc->SkipBarrier;
+        
+        else if (Parser->Mode != RunModeGoto || (!Skip->Declares && !ParseLabelWithin(Parser->pc, Parser->SearchGotoLabel, Skip)))
+        {
+            Parser->Pos = Skip->End;
+            Parser->Line = Skip->Line;
+            Parser->CharacterPos = Skip->CharacterPos;
+            return ParseResultOk;
+        }
+    }
+    
     /* take note of where we are and then grab a token to see what statement we have */   
     ParserCopy(&PreState, Parser);
     Token = LexGetToken(Parser, &LexerValue, TRUE);
@@ -616,6 +957,7 @@ enum ParseResult ParseStatement(struct ParseState *Parser, int CheckTrailingSemi
                 {
                     /* declare the identifier as a goto label */
                     LexGetToken(Parser, NULL, TRUE);
+                    ParseLabelAdd(Parser, LexerValue->Val->Identifier, PreState.Pos);
                     if (Parser->Mode == RunModeGoto && LexerValue->Val->Identifier == Parser->SearchGotoLabel)
                         Parser->Mode = RunModeRun;
         
@@ -701,8 +1043,8 @@ enum ParseResult ParseStatement(struct ParseState *Parser, int CheckTrailingSemi
                 ParserCopyPos(&PreConditional, Parser);
                 do
                 {
-					if (gResetParser)
-						ProgramFail(Parser, "Reset");
+					CHECK_CANCELLED(Parser);
+					TIER_COUNT_LOOP(Parser);
 
                     ParserCopyPos(Parser, &PreConditional);
                     Condition = ExpressionParseInt(Parser);
@@ -731,8 +1073,8 @@ enum ParseResult ParseStatement(struct ParseState *Parser, int CheckTrailingSemi
                 ParserCopyPos(&PreStatement, Parser);
                 do
                 {
-					if (gResetParser)
-						ProgramFail(Parser, "Reset");
+					CHECK_CANCELLED(Parser);
+					TIER_COUNT_LOOP(Parser);
 
                     ParserCopyPos(Parser, &PreStatement);
                     if (ParseStatement(Parser, TRUE) != ParseResultOk)
@@ -797,6 +1139,7 @@ enum ParseResult ParseStatement(struct ParseState *Parser, int CheckTrailingSemi
             if (LexGetToken(Parser, &LexerValue, TRUE) != TokenStringConstant)
                 ProgramFail(Parser, "\"filename.h\" expected");
             
+            Parser->pc->SkipBarrier++;
             IncludeFile(Parser->pc, (char *)LexerValue->Val->Pointer);
             CheckTrailingSemicolon = FALSE;
             break;
@@ -814,6 +1157,7 @@ enum ParseResult ParseStatement(struct ParseState *Parser, int CheckTrailingSemi
             if (LexGetToken(Parser, NULL, FALSE) != TokenLeftBrace)
                 ProgramFail(Parser, "'{' expected");
             
+            if (Parser->Mode == RunModeRun)
             { 
                 /* new block so we can store parser state */
                 enum RunMode OldMode = Parser->Mode;
@@ -821,13 +1165,26 @@ enum ParseResult ParseStatement(struct ParseState *Parser, int CheckTrailingSemi
                 Parser->Mode = RunModeCaseSearch;
                 Parser->SearchLabel = Condition;
                 
-                ParseBlock(Parser, TRUE, (OldMode != RunModeSkip) && (OldMode != RunModeReturn));
+                ParseBlock(Parser, TRUE, TRUE);
                 
                 if (Parser->Mode != RunModeReturn)
                     Parser->Mode = OldMode;
 
                 Parser->SearchLabel = OldSearchLabel;
             }
+            else if (Parser->Mode == RunModeGoto)
+            {
+                /* the label may be in the body, a break after it leaves the switch */
+                ParseBlock(Parser, TRUE, TRUE);
+                if (Parser->Mode == RunModeBreak)
+                    Parser->Mode = RunModeRun;
+            }
+            else
+            {
+                /* a switch which isn't run doesn't look for its case, so nothing in it runs.
+                 * the statement around it can then be jumped over, see ParseSkipAdd() */
+                ParseBlock(Parser, TRUE, FALSE);
+            }
 
             CheckTrailingSemicolon = FALSE;
             break;
@@ -944,14 +1301,16 @@ enum ParseResult ParseStatement(struct ParseState *Parser, int CheckTrailingSemi
             ProgramFail(Parser, "';' expected");
     }
     
+    /* nothing ran and nothing got defined, so next time it can be jumped over */
+    if (SkipBarrier == Parser->pc->SkipBarrier)
+        ParseSkipAdd(Parser, PreState.Pos, Parser->pc->DeclarationCount != DeclarationCount);
+    
     return ParseResultOk;
 }
 
 /* quick scan a source file for definitions */
 void PicocParse(Picoc *pc, const char *FileName, const char *Source, int SourceLen, int RunIt, int CleanupNow, int CleanupSource, int EnableDebugger)
 {
-    struct ParseState Parser;
-    enum ParseResult Ok;
     struct CleanupTokenNode *NewCleanupNode;
     char *RegFileName = TableStrRegister(pc, FileName);
     
@@ -975,21 +1334,33 @@ void PicocParse(Picoc *pc, const char *FileName, const char *Source, int SourceL
     }
     
     /* do the parsing */
-    LexInitParser(&Parser, pc, Source, Tokens, RegFileName, RunIt, EnableDebugger);
+    PicocParseTokens(pc, RegFileName, Source, Tokens, RunIt, EnableDebugger);
+    
+    /* clean up */
+    if (CleanupNow)
+    {
+        ParseSkipClear(pc);
+        HeapFreeMem(pc, Tokens);
+    }
+}
+
+/* parse an already lexed token stream. the tokens are left untouched so they
+ * can be run again */
+void PicocParseTokens(Picoc *pc, const char *FileName, const char *Source, void *Tokens, int RunIt, int EnableDebugger)
+{
+    struct ParseState Parser;
+    enum ParseResult Ok;
+    
+    LexInitParser(&Parser, pc, Source, Tokens, TableStrRegister(pc, FileName), RunIt, EnableDebugger);
 
     do {
-		if (gResetParser)
-			ProgramFail(&Parser, "Reset");
+		CHECK_CANCELLED(&Parser);
 
         Ok = ParseStatement(&Parser, TRUE);
     } while (Ok == ParseResultOk);
     
     if (Ok == ParseResultError)
         ProgramFail(&Parser, "parse error");
-    
-    /* clean up */
-    if (CleanupNow)
-        HeapFreeMem(pc, Tokens);
 }
 
 /* parse interactively */
@@ -1004,8 +1375,7 @@ void PicocParseInteractiveNoStartPrompt(Picoc *pc, int EnableDebugger)
 
     do
     {
-		if (gResetParser)
-			ProgramFail(&Parser, "Reset");
+		CHECK_CANCELLED(&Parser);
 
         LexInteractiveStatementPrompt(pc);
         Ok = ParseStatement(&Parser, TRUE);
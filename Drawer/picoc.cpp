@@ -13,12 +13,9 @@
 
 #define PICOC_STACK_SIZE (128*1024)              /* space for the the stack */
 
-extern bool gResetParser;
-
 double parse(const char* fCode, double* arg, int paramCount, bool& isCrash, char errorBuffer[ERROR_BUFFER_SIZE])
 {
 	isCrash = false;
-	gResetParser = false;
 
     int StackSize = getenv("STACKSIZE") ? atoi(getenv("STACKSIZE")) : PICOC_STACK_SIZE;
     Picoc pc;
@@ -57,3 +54,250 @@ double parse(const char* fCode, double* arg, int paramCount, bool& isCrash, char
     return pc.PicocExitValue;
 }
 
+int parseBatch(const char* fCode, const double* args, int paramCount, int count, double* results, char errorBuffer[ERROR_BUFFER_SIZE])
+{
+	CompiledProgram program(fCode, paramCount);
+	return program.callBatch(args, results, count, errorBuffer);
+}
+
+CompiledProgram::CompiledProgram(const char* fCode, int paramCount, CancelToken* cancel)
+	: mPc(new Picoc)
+	, mNative(NULL)
+	, mNativeBuilding(false)
+	, mBatch(NULL)
+	, mBatchTried(false)
+	, mMain(NULL)
+	, mSource(NULL)
+	, mParamCount(paramCount)
+	, mBatchIndex(0)
+	, mStartup(NULL)
+	, mStartupTokens(NULL)
+	, mStackFrame(NULL)
+	, mStackTop(NULL)
+{
+	mArgs[0] = mArgs[1] = 0.0;
+	mError[0] = '\0';
+
+	int StackSize = getenv("STACKSIZE") ? atoi(getenv("STACKSIZE")) : PICOC_STACK_SIZE;
+	memset(mPc, '\0', sizeof(*mPc));
+	mPc->Cancel = cancel;
+
+	/* function bodies point back into the source to report errors, so it must live as long as the program */
+	size_t SourceLen = strlen(fCode) + 1;
+	mSource = (char*)malloc(SourceLen);
+	memcpy(mSource, fCode, SourceLen);
+
+	if (PicocPlatformSetExitPoint(mPc))
+	{
+		strcpy_s(mError, ERROR_BUFFER_SIZE, mPc->ErrorBuffer);
+		PicocCleanup(mPc);
+		delete mPc;
+		mPc = NULL;
+		return;
+	}
+
+	PicocInitialise(mPc, StackSize);
+	PicocPlatformScanFile(mPc, mSource);
+
+	/* the globals as they are now are what every sample starts from */
+	VariableSnapshotTake(mPc);
+
+	/* functions are compiled once they're called often enough, see tier.c. NOTIERS in the
+	 * environment compiles them all now, and waits for the native build */
+	bool upFront = getenv("NOTIERS") != NULL;
+	if (upFront)
+		PicocCompile(mPc);
+
+	/* bind main's arguments once and lex the call to main, every sample then only runs it */
+	mStartup = PicocPrepareMain(mPc, mArgs, paramCount);
+	mStartupTokens = LexAnalyse(mPc, TableStrRegister(mPc, "startup"), mStartup, strlen(mStartup), NULL);
+
+	struct Value* mainValue = NULL;
+	VariableGet(mPc, NULL, TableStrRegister(mPc, "main"), &mainValue);
+	mMain = &mainValue->Val->FuncDef;
+
+	/* picoc has checked the script and runs it until the native build is loaded, or if it doesn't work.
+	 * the build is shared by all the programs of the script, which couldn't each start their samples
+	 * from their own globals, so a script with global or static variables stays with picoc */
+	bool hasVariables = mPc->Snapshot != NULL || mPc->LexStatic;
+	if (!hasVariables)
+	{
+		if (upFront)
+			mNative = NativeLoad(mSource, paramCount);
+		else
+			mNativeBuilding = TierBuildNative(mPc, mSource, paramCount) != 0;
+	}
+
+	/* the stack to go back to if a call fails halfway */
+	mStackFrame = mPc->StackFrame;
+	mStackTop = mPc->HeapStackTop;
+}
+
+CompiledProgram::~CompiledProgram()
+{
+	NativeFree(mNative);
+	BatchFree(mBatch);
+	if (mPc != NULL)
+	{
+		if (mStartupTokens != NULL)
+			HeapFreeMem(mPc, mStartupTokens);
+
+		PicocCleanup(mPc);
+		delete mPc;
+	}
+	free(mSource);
+}
+
+double CompiledProgram::call(double x, bool& isCrash, char errorBuffer[ERROR_BUFFER_SIZE])
+{
+	mArgs[0] = x;
+	return run(isCrash, errorBuffer);
+}
+
+double CompiledProgram::call(double x, double y, bool& isCrash, char errorBuffer[ERROR_BUFFER_SIZE])
+{
+	mArgs[0] = x;
+	mArgs[1] = y;
+	return run(isCrash, errorBuffer);
+}
+
+double CompiledProgram::run(bool& isCrash, char errorBuffer[ERROR_BUFFER_SIZE])
+{
+	isCrash = false;
+
+	if (mPc == NULL)
+	{
+		isCrash = true;
+		strcpy_s(errorBuffer, ERROR_BUFFER_SIZE, mError);
+		return 0.0;
+	}
+
+	if (PicocPlatformSetExitPoint(mPc))
+	{
+		isCrash = true;
+		unwind(errorBuffer);
+		return mPc->PicocExitValue;
+	}
+
+	promote();
+	if (mNative != NULL)
+	{
+		double result;
+		isCrash = runNative(mArgs, result, errorBuffer);
+		return result;
+	}
+
+	VariableSnapshotRestore(mPc);
+	PicocParseTokens(mPc, "startup", mStartup, mStartupTokens, TRUE, TRUE);
+	return mPc->PicocExitValue;
+}
+
+int CompiledProgram::callBatch(const double* args, double* results, int count, char errorBuffer[ERROR_BUFFER_SIZE])
+{
+	if (mPc == NULL)
+	{
+		strcpy_s(errorBuffer, ERROR_BUFFER_SIZE, mError);
+		return 0;
+	}
+
+	promote();
+	if (mNative != NULL)
+	{
+		for (int i = 0; i < count; i++)
+		{
+			if (runNative(&args[i * mParamCount], results[i], errorBuffer))
+				return i;
+		}
+		return -1;
+	}
+
+	/* one exit point for the whole batch, a failing sample stops it */
+	mBatchIndex = 0;
+	int scalarEnd = 0;
+	if (PicocPlatformSetExitPoint(mPc))
+	{
+		unwind(errorBuffer);
+		return mBatchIndex;
+	}
+
+	for (; mBatchIndex < count; mBatchIndex++)
+	{
+		/* groups of samples can be run once main() is compiled */
+		if (mBatch == NULL && !mBatchTried && mMain->Compiled != NULL)
+		{
+			mBatchTried = true;
+			mBatch = BatchPrepare(mPc, mParamCount);
+		}
+
+		/* a group the batch evaluator gives up on is run again one sample at a time, which
+		 * gives any error the way it would have been. the batch evaluator only takes a main()
+		 * which changes no global or static variable, so the lanes can't change what they read */
+		if (mBatch != NULL && mBatchIndex >= scalarEnd)
+		{
+			int lanes = (count - mBatchIndex < BATCH_LANES) ? count - mBatchIndex : BATCH_LANES;
+			if (BatchRun(mBatch, &args[mBatchIndex * mParamCount], lanes, &results[mBatchIndex]))
+			{
+				mBatchIndex += lanes - 1;
+				continue;
+			}
+			scalarEnd = mBatchIndex + lanes;
+		}
+
+		mArgs[0] = args[mBatchIndex * mParamCount];
+		if (mParamCount == 2)
+			mArgs[1] = args[mBatchIndex * mParamCount + 1];
+
+		/* and there's nothing to put back */
+		if (mBatch == NULL)
+			VariableSnapshotRestore(mPc);
+
+		PicocParseTokens(mPc, "startup", mStartup, mStartupTokens, TRUE, TRUE);
+		results[mBatchIndex] = mPc->PicocExitValue;
+	}
+
+	return -1;
+}
+
+/* take on the native build once tier.c has it, the samples after that run as native code */
+void CompiledProgram::promote()
+{
+	if (mNativeBuilding && TierNativeDone(mPc, &mNative))
+		mNativeBuilding = false;
+}
+
+/* call the native main(). it can't be stopped halfway, so cancelling is only seen between
+ * samples. exit() fails the call with its value like it does in picoc. returns true if it failed */
+bool CompiledProgram::runNative(const double* args, double& result, char errorBuffer[ERROR_BUFFER_SIZE])
+{
+	if (mPc->Cancel != NULL && mPc->Cancel->load(std::memory_order_relaxed))
+	{
+		strcpy_s(errorBuffer, ERROR_BUFFER_SIZE, "cancelled");
+		result = 0.0;
+		return true;
+	}
+
+	if (NativeCall(mNative, args, &result))
+	{
+		errorBuffer[0] = '\0';
+		return true;
+	}
+
+	return false;
+}
+
+/* copy the error and drop whatever a failed call left on the stack so the program can be called again.
+ * cancelling is seen wherever the call happens to be, the startup line included, so it's said plainly
+ * like runNative() does */
+void CompiledProgram::unwind(char errorBuffer[ERROR_BUFFER_SIZE])
+{
+	if (mPc->Cancel != NULL && mPc->Cancel->load(std::memory_order_relaxed))
+		strcpy_s(errorBuffer, ERROR_BUFFER_SIZE, "cancelled");
+	else
+		strcpy_s(errorBuffer, ERROR_BUFFER_SIZE, mPc->ErrorBuffer);
+
+	mPc->TopStackFrame = NULL;
+	mPc->StackFrame = mStackFrame;
+	mPc->HeapStackTop = mStackTop;
+	mPc->ErrorBuffer[0] = '\0';
+	mPc->ErrorBufferLength = 0;
+}
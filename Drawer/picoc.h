@@ -19,6 +19,64 @@
 #include "interpreter.h"
 
 double parse(const char* fCode, double* arg, int paramCount, bool& isCrash, char errorBuffer[ERROR_BUFFER_SIZE]);
+int parseBatch(const char* fCode, const double* args, int paramCount, int count, double* results, char errorBuffer[ERROR_BUFFER_SIZE]);
+
+/* a script scanned once and kept in an initialised interpreter, so main() can be
+ * called for many samples without booting picoc again. every call starts with
+ * the global and static variables as they were once the script was scanned. programs don't share any state, so
+ * several of them can run on different threads. setting cancel makes the running
+ * and later calls fail. functions start out interpreted and are compiled as
+ * they get hot, see tier.c. with NATIVECC in the environment a script without
+ * global or static variables is also built with the system's C compiler, and
+ * main() runs as native code once it's loaded, see native.c */
+class CompiledProgram
+{
+public:
+	CompiledProgram(const char* fCode, int paramCount, CancelToken* cancel = NULL);
+	~CompiledProgram();
+
+	bool isValid() const { return mPc != NULL; }
+	bool isNative() const { return mNative != NULL; }
+
+	/* a line for each function which isn't run as machine code, saying how it runs and why */
+	const char* jitReport() const { return (mPc != NULL && mPc->JitReport != NULL) ? mPc->JitReport : ""; }
+
+	/* how each function runs at the moment, like "main() batched, f() machine code, g() interpreted" */
+	const char* tierReport() const { return (mPc != NULL) ? TierReport(mPc, mNative != NULL, mBatch != NULL) : ""; }
+
+	double call(double x, bool& isCrash, char errorBuffer[ERROR_BUFFER_SIZE]);
+	double call(double x, double y, bool& isCrash, char errorBuffer[ERROR_BUFFER_SIZE]);
+
+	/* args holds paramCount doubles per sample. returns the index of the first failing
+	 * sample, whose error is copied in errorBuffer, or -1 if all of them succeeded.
+	 * samples are run BATCH_LANES at a time when main() allows it, see batch.c */
+	int callBatch(const double* args, double* results, int count, char errorBuffer[ERROR_BUFFER_SIZE]);
+
+private:
+	CompiledProgram(const CompiledProgram&);
+	CompiledProgram& operator=(const CompiledProgram&);
+
+	double run(bool& isCrash, char errorBuffer[ERROR_BUFFER_SIZE]);
+	bool runNative(const double* args, double& result, char errorBuffer[ERROR_BUFFER_SIZE]);
+	void promote();
+	void unwind(char errorBuffer[ERROR_BUFFER_SIZE]);
+
+	Picoc* mPc;
+	NativeProgram* mNative;
+	bool mNativeBuilding;
+	BatchProgram* mBatch;
+	bool mBatchTried;
+	FuncDef* mMain;
+	char* mSource;
+	int mParamCount;
+	int mBatchIndex;
+	double mArgs[2];
+	const char* mStartup;
+	void* mStartupTokens;
+	void* mStackFrame;
+	void* mStackTop;
+	char mError[ERROR_BUFFER_SIZE];
+};
 
 #include <setjmp.h>
 
@@ -35,9 +93,14 @@ extern int PicocExitBuf[];
 
 /* parse.c */
 void PicocParse(Picoc *pc, const char *FileName, const char *Source, int SourceLen, int RunIt, int CleanupNow, int CleanupSource, int EnableDebugger);
+void PicocParseTokens(Picoc *pc, const char *FileName, const char *Source, void *Tokens, int RunIt, int EnableDebugger);
 void PicocParseInteractive(Picoc *pc);
 
+/* compile.c */
+void PicocCompile(Picoc *pc);
+
 /* platform.c */
+const char *PicocPrepareMain(Picoc *pc, double *Args, int NumArgs);
 void PicocCallMain(Picoc *pc, double arg);
 void PicocCallMain(Picoc *pc, double arg1, double arg2);
 void PicocInitialise(Picoc *pc, int StackSize);
@@ -13,6 +13,7 @@ void PicocInitialise(Picoc *pc, int StackSize)
     HeapInit(pc, StackSize);
     TableInit(pc);
     VariableInit(pc);
+    ParseInit(pc);
     LexInit(pc);
     TypeInit(pc);
 #ifndef NO_HASH_INCLUDE
@@ -26,18 +27,13 @@ void PicocInitialise(Picoc *pc, int StackSize)
     DebugInit(pc);
 }
 
-/* free memory */
+/* free memory. everything picoc allocated is on the heap, which goes all at
+ * once, only what compiled functions have outside it is freed one by one */
 void PicocCleanup(Picoc *pc)
 {
-    DebugCleanup(pc);
-#ifndef NO_HASH_INCLUDE
-    IncludeCleanup(pc);
-#endif
-    ParseCleanup(pc);
-    LexCleanup(pc);
-    VariableCleanup(pc);
-    TypeCleanup(pc);
-    TableStrFree(pc);
+    TierCleanup(pc);
+    CompileCleanup(pc);
+    JitCleanup(pc);
     HeapCleanup(pc);
     PlatformCleanup(pc);
 }
@@ -48,7 +44,9 @@ void PicocCleanup(Picoc *pc)
 #define CALL_MAIN_WITH_ARGS_RETURN_DOUBLE "__exit_value = main(__arg);"
 #define CALL_MAIN_WITH_2ARGS_RETURN_DOUBLE "__exit_value = main(__arg1, __arg2);"
 
-void PicocCallMain(Picoc *pc, double arg)
+/* check main() can be called with NumArgs doubles and bind its arguments to Args,
+ * which must stay valid while the program runs. returns the statement which calls it */
+const char *PicocPrepareMain(Picoc *pc, double *Args, int NumArgs)
 {
     /* check if the program wants arguments */
     struct Value *FuncValue = NULL;
@@ -63,56 +61,42 @@ void PicocCallMain(Picoc *pc, double arg)
     if (FuncValue->Val->FuncDef.NumParams != 0)
     {
         /* define the arguments */
-        VariableDefinePlatformVar(pc, NULL, "__arg", &pc->FPType, (union AnyValue *)&arg, FALSE);
+        if (NumArgs == 1)
+            VariableDefinePlatformVar(pc, NULL, "__arg", &pc->FPType, (union AnyValue *)&Args[0], FALSE);
+        else
+        {
+            VariableDefinePlatformVar(pc, NULL, "__arg1", &pc->FPType, (union AnyValue *)&Args[0], FALSE);
+            VariableDefinePlatformVar(pc, NULL, "__arg2", &pc->FPType, (union AnyValue *)&Args[1], FALSE);
+        }
     }
 
     if (FuncValue->Val->FuncDef.ReturnType != &pc->FPType)
-    {
 		ProgramFailNoParser(pc, "main function must return a double");
-    }
-    else
-    {
-        VariableDefinePlatformVar(pc, NULL, "__exit_value", &pc->FPType, (union AnyValue *)&pc->PicocExitValue, TRUE);
+
+    VariableDefinePlatformVar(pc, NULL, "__exit_value", &pc->FPType, (union AnyValue *)&pc->PicocExitValue, TRUE);
     
-        if (FuncValue->Val->FuncDef.NumParams == 1)// && FuncValue->Val->FuncDef.ParamType == &pc->FPType)
-			PicocParse(pc, "startup", CALL_MAIN_WITH_ARGS_RETURN_DOUBLE, strlen(CALL_MAIN_WITH_ARGS_RETURN_DOUBLE), TRUE, TRUE, FALSE, TRUE);
-        else
+    if (FuncValue->Val->FuncDef.NumParams != NumArgs)// && FuncValue->Val->FuncDef.ParamType == &pc->FPType)
+    {
+        if (NumArgs == 1)
 			ProgramFailNoParser(pc, "main function must take a double as a param");
+        else
+			ProgramFailNoParser(pc, "main function must take two double as a param");
     }
+
+    return (NumArgs == 1) ? CALL_MAIN_WITH_ARGS_RETURN_DOUBLE : CALL_MAIN_WITH_2ARGS_RETURN_DOUBLE;
 }
 
-void PicocCallMain(Picoc *pc, double arg1, double arg2)
+void PicocCallMain(Picoc *pc, double arg)
 {
-	/* check if the program wants arguments */
-	struct Value *FuncValue = NULL;
-
-	if (!VariableDefined(pc, TableStrRegister(pc, "main")))
-		ProgramFailNoParser(pc, "main() is not defined");
-
-	VariableGet(pc, NULL, TableStrRegister(pc, "main"), &FuncValue);
-	if (FuncValue->Typ->Base != TypeFunction)
-		ProgramFailNoParser(pc, "main is not a function - can't call it");
-
-	if (FuncValue->Val->FuncDef.NumParams != 0)
-	{
-		/* define the arguments */
-		VariableDefinePlatformVar(pc, NULL, "__arg1", &pc->FPType, (union AnyValue *)&arg1, FALSE);
-		VariableDefinePlatformVar(pc, NULL, "__arg2", &pc->FPType, (union AnyValue *)&arg2, FALSE);
-	}
-
-	if (FuncValue->Val->FuncDef.ReturnType != &pc->FPType)
-	{
-		ProgramFailNoParser(pc, "main function must return a double");
-	}
-	else
-	{
-		VariableDefinePlatformVar(pc, NULL, "__exit_value", &pc->FPType, (union AnyValue *)&pc->PicocExitValue, TRUE);
+    const char *Startup = PicocPrepareMain(pc, &arg, 1);
+    PicocParse(pc, "startup", Startup, strlen(Startup), TRUE, TRUE, FALSE, TRUE);
+}
 
-		if (FuncValue->Val->FuncDef.NumParams == 2)// && FuncValue->Val->FuncDef.ParamType == &pc->FPType)
-			PicocParse(pc, "startup", CALL_MAIN_WITH_2ARGS_RETURN_DOUBLE, strlen(CALL_MAIN_WITH_2ARGS_RETURN_DOUBLE), TRUE, TRUE, FALSE, TRUE);
-		else
-			ProgramFailNoParser(pc, "main function must take two double as a param");
-	}
+void PicocCallMain(Picoc *pc, double arg1, double arg2)
+{
+    double Args[2] = { arg1, arg2 };
+    const char *Startup = PicocPrepareMain(pc, Args, 2);
+    PicocParse(pc, "startup", Startup, strlen(Startup), TRUE, TRUE, FALSE, TRUE);
 }
 #endif
 
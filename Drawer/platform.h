@@ -25,7 +25,18 @@
 #define RESERVED_WORD_TABLE_SIZE 97         /* reserved word table size */
 #define PARAMETER_MAX 16                    /* maximum number of parameters to a function */
 #define LINEBUFFER_MAX 256                  /* maximum number of characters on a line */
+#define SKIP_TABLE_SIZE 97                  /* statements which can be jumped over when skipped */
 #define LOCAL_TABLE_SIZE 11                 /* size of local variable table (can expand) */
+#define SCOPE_TABLE_SIZE 11                 /* blocks defining variables in a table (can expand) */
+#define VM_STACK_MAX 32                     /* most values a compiled function keeps on its stack */
+#define VM_LOCALS_MAX 64                    /* most parameters and local variables in a compiled function */
+#define BATCH_LANES 16                      /* samples the batch evaluator runs at once */
+#define BATCH_MEMORY 4096                   /* variables and stack values for each lane of the functions it's running */
+#define TIER_BYTECODE 4                     /* calls and loop turns after which an interpreted function is compiled */
+#define TIER_MACHINE_CODE 256               /* more of them as bytecode before it's translated to machine code */
+#define TIER_POLL 64                        /* more of them between looks at whether the translation is done */
+#define HEAP_CHUNK_SIZE (64*1024)           /* memory the heap takes from malloc() at a time */
+#define HEAP_CHUNK_CACHE 64                 /* chunks kept for the next interpreters once one is cleaned up */
 #define STRUCT_TABLE_SIZE 11                /* size of struct/union member table (can expand) */
 
 #define INTERACTIVE_PROMPT_START "starting picoc " PICOC_VERSION "\n"
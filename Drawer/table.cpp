@@ -34,6 +34,9 @@ void TableInitTable(struct Table *Tbl, struct TableEntry **HashTable, int Size,
     Tbl->Size = Size;
     Tbl->OnHeap = OnHeap;
     Tbl->HashTable = HashTable;
+    Tbl->ScopesSize = 0;
+    Tbl->NumScopes = 0;
+    Tbl->Scopes = NULL;
     memset((void *)HashTable, '\0', sizeof(struct TableEntry *) * Size);
 }
 
@@ -56,6 +59,12 @@ static struct TableEntry *TableSearch(struct Table *Tbl, const char *Key, int *A
 /* set an identifier to a value. returns FALSE if it already exists. 
  * Key must be a shared string from TableStrRegister() */
 int TableSet(Picoc *pc, struct Table *Tbl, char *Key, struct Value *Val, const char *DeclFileName, int DeclLine, int DeclColumn)
+{
+    return TableAdd(pc, Tbl, Key, Val, DeclFileName, DeclLine, DeclColumn) != NULL;
+}
+
+/* the same as TableSet() but returns the new entry, or NULL if it already exists */
+struct TableEntry *TableAdd(Picoc *pc, struct Table *Tbl, char *Key, struct Value *Val, const char *DeclFileName, int DeclLine, int DeclColumn)
 {
     int AddAt;
     struct TableEntry *FoundEntry = TableSearch(Tbl, Key, &AddAt);
@@ -68,12 +77,13 @@ int TableSet(Picoc *pc, struct Table *Tbl, char *Key, struct Value *Val, const c
         NewEntry->DeclColumn = DeclColumn;
         NewEntry->p.v.Key = Key;
         NewEntry->p.v.Val = Val;
+        NewEntry->ScopeNext = NULL;
         NewEntry->Next = Tbl->HashTable[AddAt];
         Tbl->HashTable[AddAt] = NewEntry;
-        return TRUE;
+        return NewEntry;
     }
 
-    return FALSE;
+    return NULL;
 }
 
 /* find a value in a table. returns FALSE if not found. 
@@ -167,20 +177,3 @@ char *TableStrRegister(Picoc *pc, const char *Str)
 {
     return TableStrRegister2(pc, Str, strlen((char *)Str));
 }
-
-/* free all the strings */
-void TableStrFree(Picoc *pc)
-{
-    struct TableEntry *Entry;
-    struct TableEntry *NextEntry;
-    int Count;
-    
-    for (Count = 0; Count < pc->StringTable.Size; Count++)
-    {
-        for (Entry = pc->StringTable.HashTable[Count]; Entry != NULL; Entry = NextEntry)
-        {
-            NextEntry = Entry->Next;
-            HeapFreeMem(pc, Entry);
-        }
-    }
-}
@@ -0,0 +1,89 @@
+// Runs the regression scripts given and checks main() returns what their "expect:" line says on
+// every sample, with a fresh interpreter for each one like parse() and with one CompiledProgram
+// called many times over, one sample at a time and in batches. See README for building it.
+//
+//     check script.c...
+
+#include "picoc.h"
+
+#include <fstream>
+#include <sstream>
+#include <string>
+
+static bool checkScript(const char* name)
+{
+	const int numSample = 200;
+	char errorBuffer[ERROR_BUFFER_SIZE];
+
+	std::ifstream file(name);
+	if (!file)
+	{
+		printf("%s: can't read it\n", name);
+		return false;
+	}
+	std::stringstream text;
+	text << file.rdbuf();
+	std::string source = text.str();
+
+	size_t expectPos = source.find("expect:");
+	if (expectPos == std::string::npos)
+	{
+		printf("%s: no \"expect:\" line\n", name);
+		return false;
+	}
+	double expect = atof(source.c_str() + expectPos + 7);
+
+	double inputs[numSample];
+	double outputs[numSample];
+	for (int i = 0; i < numSample; i++)
+	{
+		inputs[i] = -5.0 + 10.0 * i / numSample;
+	}
+
+	auto fail = [&](const char* how, int sample, double result, bool isCrash)
+	{
+		if (isCrash)
+			printf("%s: %s sample %d failed: %s\n", name, how, sample, errorBuffer);
+		else
+			printf("%s: %s sample %d gave %.17g instead of %.17g\n", name, how, sample, result, expect);
+		return false;
+	};
+
+	bool isCrash = false;
+	double result = parse(source.c_str(), &inputs[0], 1, isCrash, errorBuffer);
+	if (isCrash || result != expect)
+		return fail("parsed", 0, result, isCrash);
+
+	CompiledProgram program(source.c_str(), 1);
+	for (int i = 0; i < numSample; i++)
+	{
+		result = program.call(inputs[i], isCrash, errorBuffer);
+		if (isCrash || result != expect)
+			return fail("called", i, result, isCrash);
+	}
+
+	CompiledProgram batched(source.c_str(), 1);
+	int failed = batched.callBatch(inputs, outputs, numSample, errorBuffer);
+	if (failed >= 0)
+		return fail("batched", failed, 0.0, true);
+	for (int i = 0; i < numSample; i++)
+	{
+		if (outputs[i] != expect)
+			return fail("batched", i, outputs[i], false);
+	}
+
+	printf("%s: ok\n", name);
+	return true;
+}
+
+int main(int argc, char** argv)
+{
+	int numFailed = 0;
+	for (int i = 1; i < argc; i++)
+	{
+		if (!checkScript(argv[i]))
+			numFailed++;
+	}
+
+	return (numFailed == 0) ? 0 : 1;
+}
@@ -0,0 +1,26 @@
+/* expect: 11
+ * nor a switch in a switch after a break */
+double main(double x)
+{
+    double r = 0;
+    int i;
+    int k = 0;
+
+    for (i = 0; i < 2; i++)
+    {
+        if (i >= 1)
+            break;
+
+        r += 1;
+        switch (k)
+        {
+            case 0:
+                switch (k)
+                {
+                    case 0: r += 10;
+                }
+        }
+    }
+
+    return r;
+}
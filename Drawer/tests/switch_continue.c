@@ -0,0 +1,22 @@
+/* expect: 101
+ * the switch after a continue isn't run, on the first sample or any later one */
+double main(double x)
+{
+    double r = 0;
+    int i;
+    int k = 0;
+
+    for (i = 0; i < 4; i++)
+    {
+        if (i >= 1)
+            continue;
+
+        r += 1;
+        switch (k)
+        {
+            case 0: r += 100;
+        }
+    }
+
+    return r;
+}
@@ -0,0 +1,411 @@
+/* picoc tiers - decides how each function runs. A function starts out
+ * interpreted from its tokens, so a script runs as soon as it's scanned, and
+ * its calls and the times its loops go round are counted. Once it's been
+ * called a few times it's compiled to bytecode by compile.c, along with the
+ * functions it calls. When it's hotter still it's translated to machine code
+ * by jit.c on a worker thread, which does it for every program, while the
+ * program carries on with the bytecode. The machine code is taken on at a call
+ * of the function, so a sweep gets faster halfway through without stopping.
+ * The native build of native.c is done by the worker too, and CompiledProgram
+ * changes over to it between two samples.
+ *
+ * NOTIERS in the environment has everything done before the first sample
+ * instead, see PicocCompile() */
+
+#include "picoc.h"
+#include "interpreter.h"
+
+#include <limits.h>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+
+/* something for the worker to do */
+struct TierJob
+{
+    struct TierJob *Next;           /* the next job of the same program */
+    struct TierJob *Queued;         /* the next one waiting for the worker */
+    Picoc *pc;
+    struct VmFunction *Func;        /* the function to translate, or NULL to build the script */
+    struct VmFunction Translated;   /* its machine code, in Native, NativeSize and NativeEntry */
+    const char *Reason;             /* why it couldn't be translated */
+    char *Source;                   /* a copy of the script to build, so a build can outlive its program */
+    int NumArgs;
+    struct NativeProgram *Native;   /* what the build made, NULL if it didn't work */
+    int Done;                       /* the worker has finished it */
+    int Abandoned;                  /* the program is gone, the worker frees it when it's finished */
+};
+
+/* the worker thread and what it's doing. There's one for the whole process, which is never freed */
+struct TierWorker
+{
+    std::mutex Lock;                /* for all of this and the jobs' Done and Abandoned */
+    std::condition_variable Wake;   /* a job has been queued */
+    std::condition_variable Finished;   /* a job is done */
+    struct TierJob *Queue;          /* the oldest first */
+    struct TierJob *Running;
+};
+
+static void TierWork(struct TierWorker *Worker)
+{
+    std::unique_lock<std::mutex> Lock(Worker->Lock);
+
+    for (;;)
+    {
+        struct TierJob *Job;
+
+        while (Worker->Queue == NULL)
+            Worker->Wake.wait(Lock);
+
+        Job = Worker->Queue;
+        Worker->Queue = Job->Queued;
+        Worker->Running = Job;
+        Lock.unlock();
+
+        /* nothing of the program is written, it's running meanwhile */
+        if (Job->Func != NULL)
+            Job->Reason = JitTranslate(Job->pc, Job->Func, &Job->Translated);
+        else
+            Job->Native = NativeLoad(Job->Source, Job->NumArgs);
+
+        Lock.lock();
+        Worker->Running = NULL;
+        if (Job->Abandoned)
+        {
+            NativeFree(Job->Native);
+            free(Job);
+        }
+        else
+            Job->Done = TRUE;
+
+        Worker->Finished.notify_all();
+    }
+}
+
+static struct TierWorker *TierStartWorker()
+{
+    struct TierWorker *Worker = new TierWorker();
+
+    std::thread(TierWork, Worker).detach();
+    return Worker;
+}
+
+static struct TierWorker *TierGetWorker()
+{
+    static struct TierWorker *Worker = TierStartWorker();
+
+    return Worker;
+}
+
+/* a job for a program, Size is its bytes with whatever comes after it. Returns NULL if there's no memory for it */
+static struct TierJob *TierNewJob(Picoc *pc, int Size, struct VmFunction *Func)
+{
+    struct TierJob *Job = (struct TierJob *)calloc(1, Size);
+
+    if (Job == NULL)
+        return NULL;
+
+    Job->pc = pc;
+    Job->Func = Func;
+    Job->Next = pc->TierJobs;
+    pc->TierJobs = Job;
+    return Job;
+}
+
+/* give the worker a job, it's not to be touched from then on until it's done */
+static void TierQueue(struct TierJob *Job)
+{
+    struct TierWorker *Worker = TierGetWorker();
+    std::lock_guard<std::mutex> Lock(Worker->Lock);
+    struct TierJob **Last;
+
+    for (Last = &Worker->Queue; *Last != NULL; Last = &(*Last)->Queued)
+        ;
+
+    *Last = Job;
+    Worker->Wake.notify_one();
+}
+
+static int TierIsDone(struct TierJob *Job)
+{
+    std::lock_guard<std::mutex> Lock(TierGetWorker()->Lock);
+
+    return Job->Done;
+}
+
+/* compile a function to bytecode, and the ones it calls which are still
+ * interpreted. They're sure to be called, and bytecode calls bytecode without
+ * making values for the arguments. batch.c needs all of them compiled too */
+static void TierCompile(Picoc *pc, const char *FuncName, struct FuncDef *Func)
+{
+    struct VmFunction *Compiled;
+    const char *Reason;
+    int PC;
+
+    Func->TierUp = UINT_MAX;
+    Compiled = CompileFunction(pc, FuncName, Func, &Reason);
+    if (Compiled == NULL)
+    {
+        JitReportAdd(pc, FuncName, "interpreted", Reason);
+        return;
+    }
+
+    /* NOJIT in the environment leaves it as bytecode */
+    Func->Compiled = Compiled;
+    if (getenv("NOJIT") == NULL)
+        Func->TierUp = Func->Calls + Func->BackEdges + TIER_MACHINE_CODE;
+
+    for (PC = 0; PC < Compiled->CodeSize; PC++)
+    {
+        if (Compiled->Code[PC].Op == VmOpCall)
+        {
+            struct FuncDef *Callee = &Compiled->Global[Compiled->Code[PC].Operand]->Val->FuncDef;
+
+            if (Callee->Intrinsic == NULL && Callee->Compiled == NULL && Callee->TierUp != UINT_MAX)
+                TierCompile(pc, Compiled->Name[Compiled->Code[PC].Operand], Callee);
+        }
+    }
+}
+
+/* have the worker translate a function to machine code, or take the machine code on once it's done */
+static void TierTranslate(Picoc *pc, const char *FuncName, struct FuncDef *Func, unsigned int Hotness)
+{
+    struct VmFunction *Compiled = Func->Compiled;
+    struct TierJob *Job;
+
+    for (Job = pc->TierJobs; Job != NULL && Job->Func != Compiled; Job = Job->Next)
+        ;
+
+    if (Job == NULL)
+    {
+        Job = TierNewJob(pc, sizeof(struct TierJob), Compiled);
+        if (Job != NULL)
+            TierQueue(Job);
+
+        Func->TierUp = (Job != NULL) ? Hotness + TIER_POLL : UINT_MAX;
+        return;
+    }
+
+    if (!TierIsDone(Job))
+    {
+        Func->TierUp = Hotness + TIER_POLL;
+        return;
+    }
+
+    /* calls already running go on with the bytecode */
+    Func->TierUp = UINT_MAX;
+    if (Job->Reason != NULL)
+        JitReportAdd(pc, FuncName, "bytecode", Job->Reason);
+    else
+    {
+        Compiled->NativeSize = Job->Translated.NativeSize;
+        Compiled->NativeEntry = Job->Translated.NativeEntry;
+        Compiled->Native = Job->Translated.Native;
+        Job->Translated.Native = NULL;
+    }
+}
+
+/* a function has got as hot as its TierUp, move it up a tier if it can go
+ * further. The first call sets when it's compiled */
+void TierPromote(struct ParseState *Parser, const char *FuncName, struct FuncDef *Func)
+{
+    Picoc *pc = Parser->pc;
+    unsigned int Hotness = Func->Calls + Func->BackEdges;
+
+    if (Func->TierUp == UINT_MAX)
+    {
+        /* it stays where it is, the counts have gone round */
+        Func->Calls = 0;
+        Func->BackEdges = 0;
+    }
+    else if (Func->Compiled == NULL)
+    {
+        if (Func->TierUp == 0 && Hotness < TIER_BYTECODE)
+            Func->TierUp = TIER_BYTECODE;
+        else
+            TierCompile(pc, FuncName, Func);
+    }
+    else if (Func->Compiled->Native == NULL)
+        TierTranslate(pc, FuncName, Func, Hotness);
+    else
+        Func->TierUp = UINT_MAX;
+}
+
+/* have the worker build the script with native.c if NATIVECC asks for it. Returns FALSE if it won't be */
+int TierBuildNative(Picoc *pc, const char *Source, int NumArgs)
+{
+    const char *Compiler = getenv("NATIVECC");
+    int SourceLen = (int)strlen(Source) + 1;
+    struct TierJob *Job;
+
+    if (Compiler == NULL || *Compiler == '\0')
+        return FALSE;
+
+    Job = TierNewJob(pc, sizeof(struct TierJob) + SourceLen, NULL);
+    if (Job == NULL)
+        return FALSE;
+
+    Job->Source = (char *)(Job + 1);
+    memcpy((void *)Job->Source, (void *)Source, SourceLen);
+    Job->NumArgs = NumArgs;
+    TierQueue(Job);
+    return TRUE;
+}
+
+/* see if the build TierBuildNative() started is done. Native is then what it
+ * made, NULL if the script has to stay with picoc */
+int TierNativeDone(Picoc *pc, struct NativeProgram **Native)
+{
+    struct TierJob *Job;
+
+    for (Job = pc->TierJobs; Job != NULL && Job->Func != NULL; Job = Job->Next)
+        ;
+
+    if (Job == NULL)
+    {
+        *Native = NULL;
+        return TRUE;
+    }
+
+    if (!TierIsDone(Job))
+        return FALSE;
+
+    *Native = Job->Native;
+    Job->Native = NULL;
+    return TRUE;
+}
+
+struct TierEntry
+{
+    const char *Name;
+    struct FuncDef *Func;
+};
+
+static int TierIsScriptFunction(Picoc *pc, struct Value *Val)
+{
+    return Val->Typ == &pc->FunctionType && Val->Val->FuncDef.Intrinsic == NULL && Val->Val->FuncDef.Body.Pos != NULL;
+}
+
+/* in the order they're in the script */
+static int TierCompareEntries(const void *Entry1, const void *Entry2)
+{
+    const struct FuncDef *Func1 = ((const struct TierEntry *)Entry1)->Func;
+    const struct FuncDef *Func2 = ((const struct TierEntry *)Entry2)->Func;
+
+    if (Func1->Body.Line != Func2->Body.Line)
+        return Func1->Body.Line - Func2->Body.Line;
+
+    return Func1->Body.CharacterPos - Func2->Body.CharacterPos;
+}
+
+/* say how each function of the script runs at the moment, like "main()
+ * batched, f() machine code, g() interpreted". Native says the whole script
+ * is native code and Batch that main() is run in batches, see batch.c */
+const char *TierReport(Picoc *pc, int Native, int Batch)
+{
+    struct TierEntry *Entry;
+    struct TableEntry *TableEntry;
+    int NumEntries = 0;
+    int Length = 1;
+    int Count;
+
+    for (Count = 0; Count < pc->GlobalTable.Size; Count++)
+    {
+        for (TableEntry = pc->GlobalTable.HashTable[Count]; TableEntry != NULL; TableEntry = TableEntry->Next)
+        {
+            if (TierIsScriptFunction(pc, TableEntry->p.v.Val))
+            {
+                Length += (int)strlen(TableEntry->p.v.Key) + 32;
+                NumEntries++;
+            }
+        }
+    }
+
+    free(pc->TierReport);
+    pc->TierReport = (char *)malloc(Length);
+    Entry = (struct TierEntry *)malloc(sizeof(struct TierEntry) * (NumEntries + 1));
+    if (pc->TierReport == NULL || Entry == NULL)
+    {
+        free(Entry);
+        return "";
+    }
+
+    NumEntries = 0;
+    for (Count = 0; Count < pc->GlobalTable.Size; Count++)
+    {
+        for (TableEntry = pc->GlobalTable.HashTable[Count]; TableEntry != NULL; TableEntry = TableEntry->Next)
+        {
+            if (TierIsScriptFunction(pc, TableEntry->p.v.Val))
+            {
+                Entry[NumEntries].Name = TableEntry->p.v.Key;
+                Entry[NumEntries].Func = &TableEntry->p.v.Val->Val->FuncDef;
+                NumEntries++;
+            }
+        }
+    }
+
+    qsort((void *)Entry, NumEntries, sizeof(struct TierEntry), TierCompareEntries);
+    pc->TierReport[0] = '\0';
+    for (Count = 0, Length = 0; Count < NumEntries; Count++)
+    {
+        struct FuncDef *Func = Entry[Count].Func;
+        const char *RunsAs;
+
+        if (Native)
+            RunsAs = "native code";
+        else if (Batch && strcmp(Entry[Count].Name, "main") == 0)
+            RunsAs = "batched";
+        else if (Func->Compiled == NULL)
+            RunsAs = "interpreted";
+        else if (Func->Compiled->Native == NULL)
+            RunsAs = "bytecode";
+        else
+            RunsAs = "machine code";
+
+        Length += sprintf(&pc->TierReport[Length], "%s%s() %s", (Count > 0) ? ", " : "", Entry[Count].Name, RunsAs);
+    }
+
+    free(Entry);
+    return pc->TierReport;
+}
+
+/* drop the jobs the worker hasn't started and wait for the translation it's on.
+ * A build takes too long, the worker is left to finish it and throw it away */
+void TierCleanup(Picoc *pc)
+{
+    struct TierJob *Job;
+
+    if (pc->TierJobs != NULL)
+    {
+        struct TierWorker *Worker = TierGetWorker();
+        std::unique_lock<std::mutex> Lock(Worker->Lock);
+        struct TierJob **Link = &Worker->Queue;
+
+        while (*Link != NULL)
+        {
+            if ((*Link)->pc == pc)
+                *Link = (*Link)->Queued;
+            else
+                Link = &(*Link)->Queued;
+        }
+
+        while (Worker->Running != NULL && Worker->Running->pc == pc && Worker->Running->Func != NULL)
+            Worker->Finished.wait(Lock);
+
+        while ((Job = pc->TierJobs) != NULL)
+        {
+            pc->TierJobs = Job->Next;
+            if (Job == Worker->Running)
+                Job->Abandoned = TRUE;
+            else
+            {
+                JitFree(&Job->Translated);
+                NativeFree(Job->Native);
+                free(Job);
+            }
+        }
+    }
+
+    free(pc->TierReport);
+    pc->TierReport = NULL;
+}
@@ -141,37 +141,8 @@ void TypeInit(Picoc *pc)
     pc->CharPtrType = TypeAdd(pc, NULL, &pc->CharType, TypePointer, 0, pc->StrEmpty, sizeof(void *), PointerAlignBytes);
     pc->CharPtrPtrType = TypeAdd(pc, NULL, pc->CharPtrType, TypePointer, 0, pc->StrEmpty, sizeof(void *), PointerAlignBytes);
     pc->VoidPtrType = TypeAdd(pc, NULL, &pc->VoidType, TypePointer, 0, pc->StrEmpty, sizeof(void *), PointerAlignBytes);
-}
-
-/* deallocate heap-allocated types */
-void TypeCleanupNode(Picoc *pc, struct ValueType *Typ)
-{
-    struct ValueType *SubType;
-    struct ValueType *NextSubType;
-    
-    /* clean up and free all the sub-nodes */
-    for (SubType = Typ->DerivedTypeList; SubType != NULL; SubType = NextSubType)
-    {
-        NextSubType = SubType->Next;
-        TypeCleanupNode(pc, SubType);
-        if (SubType->OnHeap)
-        {
-            /* if it's a struct or union deallocate all the member values */
-            if (SubType->Members != NULL)
-            {
-                VariableTableCleanup(pc, SubType->Members);
-                HeapFreeMem(pc, SubType->Members);
-            }
-
-            /* free this node */
-            HeapFreeMem(pc, SubType);
-        }
-    }
-}
-
-void TypeCleanup(Picoc *pc)
-{
-    TypeCleanupNode(pc, &pc->UberType);
+    strcpy(pc->StructTempNameBuf, "^s0000");
+    strcpy(pc->EnumTempNameBuf, "^e0000");
 }
 
 /* parse a struct or union declaration */
@@ -195,8 +166,7 @@ void TypeParseStruct(struct ParseState *Parser, struct ValueType **Typ, int IsSt
     }
     else
     {
-        static char TempNameBuf[7] = "^s0000";
-        StructIdentifier = PlatformMakeTempName(pc, TempNameBuf);
+        StructIdentifier = PlatformMakeTempName(pc, pc->StructTempNameBuf);
     }
 
     *Typ = TypeGetMatching(pc, Parser, &Parser->pc->UberType, IsStruct ? TypeStruct : TypeUnion, 0, StructIdentifier, TRUE);
@@ -217,6 +187,7 @@ void TypeParseStruct(struct ParseState *Parser, struct ValueType **Typ, int IsSt
     if (pc->TopStackFrame != NULL)
         ProgramFail(Parser, "struct/union definitions can only be globals");
         
+    pc->SkipBarrier++;
     LexGetToken(Parser, NULL, TRUE);    
     (*Typ)->Members = (Table*)VariableAlloc(pc, Parser, sizeof(struct Table) + STRUCT_TABLE_SIZE * sizeof(struct TableEntry), TRUE);
     (*Typ)->Members->HashTable = (struct TableEntry **)((char *)(*Typ)->Members + sizeof(struct Table));
@@ -301,8 +272,7 @@ void TypeParseEnum(struct ParseState *Parser, struct ValueType **Typ)
     }
     else
     {
-        static char TempNameBuf[7] = "^e0000";
-        EnumIdentifier = PlatformMakeTempName(pc, TempNameBuf);
+        EnumIdentifier = PlatformMakeTempName(pc, pc->EnumTempNameBuf);
     }
 
     TypeGetMatching(pc, Parser, &pc->UberType, TypeEnum, 0, EnumIdentifier, Token != TokenLeftBrace);
@@ -319,6 +289,7 @@ void TypeParseEnum(struct ParseState *Parser, struct ValueType **Typ)
     if (pc->TopStackFrame != NULL)
         ProgramFail(Parser, "enum definitions can only be globals");
         
+    pc->SkipBarrier++;
     LexGetToken(Parser, NULL, TRUE);    
     (*Typ)->Members = &pc->GlobalTable;
     memset((void *)&InitValue, '\0', sizeof(struct Value));
@@ -21,9 +21,16 @@ void VariableFree(Picoc *pc, struct Value *Val)
 {
     if (Val->ValOnHeap || Val->AnyValOnHeap)
     {
-        /* free function bodies */
+        /* free function bodies, along with whatever was learnt about skipping through them */
         if (Val->Typ == &pc->FunctionType && Val->Val->FuncDef.Intrinsic == NULL && Val->Val->FuncDef.Body.Pos != NULL)
+        {
+            ParseSkipClear(pc);
             HeapFreeMem(pc, (void *)Val->Val->FuncDef.Body.Pos);
+        }
+
+        /* free compiled function bodies */
+        if (Val->Typ == &pc->FunctionType && Val->Val->FuncDef.Compiled != NULL)
+            CompileFree(pc, Val->Val->FuncDef.Compiled);
 
         /* free macro bodies */
         if (Val->Typ == &pc->MacroType)
@@ -39,32 +46,6 @@ void VariableFree(Picoc *pc, struct Value *Val)
         HeapFreeMem(pc, Val);
 }
 
-/* deallocate the global table and the string literal table */
-void VariableTableCleanup(Picoc *pc, struct Table *HashTable)
-{
-    struct TableEntry *Entry;
-    struct TableEntry *NextEntry;
-    int Count;
-    
-    for (Count = 0; Count < HashTable->Size; Count++)
-    {
-        for (Entry = HashTable->HashTable[Count]; Entry != NULL; Entry = NextEntry)
-        {
-            NextEntry = Entry->Next;
-            VariableFree(pc, Entry->p.v.Val);
-                
-            /* free the hash table entry */
-            HeapFreeMem(pc, Entry);
-        }
-    }
-}
-
-void VariableCleanup(Picoc *pc)
-{
-    VariableTableCleanup(pc, &pc->GlobalTable);
-    VariableTableCleanup(pc, &pc->StringLiteralTable);
-}
-
 /* allocate some memory, either on the heap or the stack and check if we've run out */
 void *VariableAlloc(Picoc *pc, struct ParseState *Parser, int Size, int OnHeap)
 {
@@ -165,76 +146,186 @@ void VariableRealloc(struct ParseState *Parser, struct Value *FromValue, int New
     FromValue->AnyValOnHeap = TRUE;
 }
 
-int VariableScopeBegin(struct ParseState * Parser, int* OldScopeID)
+/* the table variables are defined in, the local one if we're in a function. A function's
+ * local table is only set up once it defines a variable, until then this gives NULL unless Create */
+static struct Table *VariableTable(Picoc *pc, int Create)
+{
+    struct StackFrame *Frame = pc->TopStackFrame;
+
+    if (Frame == NULL)
+        return &pc->GlobalTable;
+
+    if (Frame->LocalTable.HashTable == NULL)
+    {
+        if (!Create)
+            return NULL;
+
+        TableInitTable(&Frame->LocalTable, &Frame->LocalHashTable[0], LOCAL_TABLE_SIZE, FALSE);
+    }
+
+    return &Frame->LocalTable;
+}
+
+/* a parameter of the function we're in, or NULL. Ident must be registered */
+static struct Value *VariableGetParameter(Picoc *pc, const char *Ident)
+{
+    struct StackFrame *Frame = pc->TopStackFrame;
+    int Count;
+
+    if (Frame == NULL)
+        return NULL;
+
+    for (Count = 0; Count < Frame->NumParams; Count++)
+    {
+        if (Frame->ParamName[Count] == Ident)
+            return Frame->Parameter[Count];
+    }
+
+    return NULL;
+}
+
+/* find the variables a scope has defined in a table. They're hashed by ScopeID, so
+ * a block which has defined none, which is most of them, is known at once */
+static struct VariableScope *VariableScopeFind(struct Table *HashTable, intptr_t ScopeID)
+{
+    struct VariableScope *Scope;
+
+    if (HashTable->Scopes == NULL)
+        return NULL;
+
+    for (Scope = HashTable->Scopes[(uintptr_t)ScopeID % HashTable->ScopesSize]; Scope != NULL; Scope = Scope->Next)
+    {
+        if (Scope->ScopeID == ScopeID)
+            return Scope;
+    }
+
+    return NULL;
+}
+
+/* make the hash of a table's scopes bigger once it has as many scopes as it has room for.
+ * The old one is left to the stack frame it's in if the table is on the stack */
+static void VariableScopeGrow(struct ParseState *Parser, struct Table *HashTable)
+{
+    int NewSize = (HashTable->Scopes == NULL) ? SCOPE_TABLE_SIZE : HashTable->ScopesSize * 2 + 1;
+    struct VariableScope **NewScopes = (struct VariableScope **)VariableAlloc(Parser->pc, Parser, sizeof(struct VariableScope *) * NewSize, HashTable->OnHeap);
+    int Count;
+
+    memset((void *)NewScopes, '\0', sizeof(struct VariableScope *) * NewSize);
+    for (Count = 0; Count < HashTable->ScopesSize; Count++)
+    {
+        struct VariableScope *Scope = HashTable->Scopes[Count];
+
+        while (Scope != NULL)
+        {
+            struct VariableScope *Next = Scope->Next;
+            int HashValue = (uintptr_t)Scope->ScopeID % NewSize;
+
+            Scope->Next = NewScopes[HashValue];
+            NewScopes[HashValue] = Scope;
+            Scope = Next;
+        }
+    }
+
+    if (HashTable->Scopes != NULL && HashTable->OnHeap)
+        HeapFreeMem(Parser->pc, HashTable->Scopes);
+
+    HashTable->Scopes = NewScopes;
+    HashTable->ScopesSize = NewSize;
+}
+
+/* remember a variable was defined in a scope so it's hidden when the scope's left */
+static void VariableScopeAdd(struct ParseState *Parser, struct Table *HashTable, intptr_t ScopeID, struct TableEntry *Entry)
+{
+    struct VariableScope *Scope = VariableScopeFind(HashTable, ScopeID);
+
+    if (Scope == NULL)
+    {
+        int HashValue;
+
+        if (HashTable->NumScopes >= HashTable->ScopesSize)
+            VariableScopeGrow(Parser, HashTable);
+
+        /* it goes wherever the table's entries go, so it's freed along with the stack frame */
+        HashValue = (uintptr_t)ScopeID % HashTable->ScopesSize;
+        Scope = (struct VariableScope *)VariableAlloc(Parser->pc, Parser, sizeof(struct VariableScope), HashTable->OnHeap);
+        Scope->ScopeID = ScopeID;
+        Scope->Entries = NULL;
+        Scope->Next = HashTable->Scopes[HashValue];
+        HashTable->Scopes[HashValue] = Scope;
+        HashTable->NumScopes++;
+    }
+
+    Entry->ScopeNext = Scope->Entries;
+    Scope->Entries = Entry;
+}
+
+intptr_t VariableScopeBegin(struct ParseState * Parser, intptr_t* OldScopeID)
 {
     struct TableEntry *Entry;
-    struct TableEntry *NextEntry;
+    struct VariableScope *Scope;
     Picoc * pc = Parser->pc;
-    int Count;
     #ifdef VAR_SCOPE_DEBUG
     int FirstPrint = 0;
     #endif
     
-    struct Table * HashTable = (pc->TopStackFrame == NULL) ? &(pc->GlobalTable) : &(pc->TopStackFrame)->LocalTable;
+    struct Table * HashTable = VariableTable(pc, FALSE);
 
     if (Parser->ScopeID == -1) return -1;
 
-    /* XXX dumb hash, let's hope for no collisions... */
+    /* a block is known by where it starts, no two blocks start at the same token */
     *OldScopeID = Parser->ScopeID;
-    Parser->ScopeID = (int)(intptr_t)(Parser->SourceText) * ((int)(intptr_t)(Parser->Pos) / sizeof(char*));
-    /* or maybe a more human-readable hash for debugging? */
-    /* Parser->ScopeID = Parser->Line * 0x10000 + Parser->CharacterPos; */
-    
-    for (Count = 0; Count < HashTable->Size; Count++)
+    Parser->ScopeID = (intptr_t)Parser->Pos;
+
+    /* only the variables the block defined the last time it was run can come back */
+    if (HashTable == NULL)
+        return Parser->ScopeID;
+
+    Scope = VariableScopeFind(HashTable, Parser->ScopeID);
+    if (Scope == NULL)
+        return Parser->ScopeID;
+
+    for (Entry = Scope->Entries; Entry != NULL; Entry = Entry->ScopeNext)
     {
-        for (Entry = HashTable->HashTable[Count]; Entry != NULL; Entry = NextEntry)
+        if (Entry->p.v.Val->OutOfScope)
         {
-            NextEntry = Entry->Next;
-            if (Entry->p.v.Val->ScopeID == Parser->ScopeID && Entry->p.v.Val->OutOfScope)
-            {
-                Entry->p.v.Val->OutOfScope = FALSE;
-                Entry->p.v.Key = (char*)((intptr_t)Entry->p.v.Key & ~1);
-                #ifdef VAR_SCOPE_DEBUG
-                if (!FirstPrint) { PRINT_SOURCE_POS; }
-                FirstPrint = 1;
-                printf(">>> back into scope: %s %x %d\n", Entry->p.v.Key, Entry->p.v.Val->ScopeID, Entry->p.v.Val->Val->Integer);
-                #endif
-            }
+            Entry->p.v.Val->OutOfScope = FALSE;
+            Entry->p.v.Key = (char*)((intptr_t)Entry->p.v.Key & ~1);
+            #ifdef VAR_SCOPE_DEBUG
+            if (!FirstPrint) { PRINT_SOURCE_POS; }
+            FirstPrint = 1;
+            printf(">>> back into scope: %s %lx %d\n", Entry->p.v.Key, (long)Entry->p.v.Val->ScopeID, Entry->p.v.Val->Val->Integer);
+            #endif
         }
     }
 
     return Parser->ScopeID;
 }
 
-void VariableScopeEnd(struct ParseState * Parser, int ScopeID, int PrevScopeID)
+void VariableScopeEnd(struct ParseState * Parser, intptr_t ScopeID, intptr_t PrevScopeID)
 {
     struct TableEntry *Entry;
-    struct TableEntry *NextEntry;
+    struct VariableScope *Scope;
     Picoc * pc = Parser->pc;
-    int Count;
     #ifdef VAR_SCOPE_DEBUG
     int FirstPrint = 0;
     #endif
 
-    struct Table * HashTable = (pc->TopStackFrame == NULL) ? &(pc->GlobalTable) : &(pc->TopStackFrame)->LocalTable;
+    struct Table * HashTable = VariableTable(pc, FALSE);
 
     if (ScopeID == -1) return;
 
-    for (Count = 0; Count < HashTable->Size; Count++)
+    Scope = (HashTable != NULL) ? VariableScopeFind(HashTable, ScopeID) : NULL;
+    for (Entry = (Scope != NULL) ? Scope->Entries : NULL; Entry != NULL; Entry = Entry->ScopeNext)
     {
-        for (Entry = HashTable->HashTable[Count]; Entry != NULL; Entry = NextEntry)
+        if (!Entry->p.v.Val->OutOfScope)
         {
-            NextEntry = Entry->Next;
-            if (Entry->p.v.Val->ScopeID == ScopeID && !Entry->p.v.Val->OutOfScope)
-            {
-                #ifdef VAR_SCOPE_DEBUG
-                if (!FirstPrint) { PRINT_SOURCE_POS; }
-                FirstPrint = 1;
-                printf(">>> out of scope: %s %x %d\n", Entry->p.v.Key, Entry->p.v.Val->ScopeID, Entry->p.v.Val->Val->Integer);
-                #endif
-                Entry->p.v.Val->OutOfScope = TRUE;
-                Entry->p.v.Key = (char*)((intptr_t)Entry->p.v.Key | 1); /* alter the key so it won't be found by normal searches */
-            }
+            #ifdef VAR_SCOPE_DEBUG
+            if (!FirstPrint) { PRINT_SOURCE_POS; }
+            FirstPrint = 1;
+            printf(">>> out of scope: %s %lx %d\n", Entry->p.v.Key, (long)Entry->p.v.Val->ScopeID, Entry->p.v.Val->Val->Integer);
+            #endif
+            Entry->p.v.Val->OutOfScope = TRUE;
+            Entry->p.v.Key = (char*)((intptr_t)Entry->p.v.Key | 1); /* alter the key so it won't be found by normal searches */
         }
     }
 
@@ -246,7 +337,10 @@ int VariableDefinedAndOutOfScope(Picoc * pc, const char* Ident)
     struct TableEntry *Entry;
     int Count;
 
-    struct Table * HashTable = (pc->TopStackFrame == NULL) ? &(pc->GlobalTable) : &(pc->TopStackFrame)->LocalTable;
+    struct Table * HashTable = VariableTable(pc, FALSE);
+    if (HashTable == NULL)
+        return FALSE;
+
     for (Count = 0; Count < HashTable->Size; Count++)
     {
         for (Entry = HashTable->HashTable[Count]; Entry != NULL; Entry = Entry->Next)
@@ -262,13 +356,17 @@ int VariableDefinedAndOutOfScope(Picoc * pc, const char* Ident)
 struct Value *VariableDefine(Picoc *pc, struct ParseState *Parser, char *Ident, struct Value *InitValue, struct ValueType *Typ, int MakeWritable)
 {
     struct Value * AssignValue;
-    struct Table * currentTable = (pc->TopStackFrame == NULL) ? &(pc->GlobalTable) : &(pc->TopStackFrame)->LocalTable;
+    struct Table * currentTable = VariableTable(pc, TRUE);
     
-    int ScopeID = Parser ? Parser->ScopeID : -1;
+    struct TableEntry *Entry;
+    intptr_t ScopeID = Parser ? Parser->ScopeID : -1;
 #ifdef VAR_SCOPE_DEBUG
-    if (Parser) fprintf(stderr, "def %s %x (%s:%d:%d)\n", Ident, ScopeID, Parser->FileName, Parser->Line, Parser->CharacterPos);
+    if (Parser) fprintf(stderr, "def %s %lx (%s:%d:%d)\n", Ident, (long)ScopeID, Parser->FileName, Parser->Line, Parser->CharacterPos);
 #endif
     
+    if (VariableGetParameter(pc, Ident) != NULL)
+        ProgramFail(Parser, "'%s' is already defined", Ident);
+    
     if (InitValue != NULL)
         AssignValue = VariableAllocValueAndCopy(pc, Parser, InitValue, pc->TopStackFrame == NULL);
     else
@@ -278,8 +376,13 @@ struct Value *VariableDefine(Picoc *pc, struct ParseState *Parser, char *Ident,
     AssignValue->ScopeID = ScopeID;
     AssignValue->OutOfScope = FALSE;
 
-    if (!TableSet(pc, currentTable, Ident, AssignValue, Parser ? ((char *)Parser->FileName) : NULL, Parser ? Parser->Line : 0, Parser ? Parser->CharacterPos : 0))
+    Entry = TableAdd(pc, currentTable, Ident, AssignValue, Parser ? ((char *)Parser->FileName) : NULL, Parser ? Parser->Line : 0, Parser ? Parser->CharacterPos : 0);
+    if (Entry == NULL)
         ProgramFail(Parser, "'%s' is already defined", Ident);
+
+    /* 0 is outside any block and -1 is never out of scope */
+    if (ScopeID != 0 && ScopeID != -1)
+        VariableScopeAdd(Parser, currentTable, ScopeID, Entry);
     
     return AssignValue;
 }
@@ -337,7 +440,9 @@ struct Value *VariableDefineButIgnoreIdentical(struct ParseState *Parser, char *
     }
     else
     {
-        if (Parser->Line != 0 && TableGet((pc->TopStackFrame == NULL) ? &pc->GlobalTable : &pc->TopStackFrame->LocalTable, Ident, &ExistingValue, &DeclFileName, &DeclLine, &DeclColumn)
+        struct Table *HashTable = VariableTable(pc, FALSE);
+
+        if (Parser->Line != 0 && HashTable != NULL && TableGet(HashTable, Ident, &ExistingValue, &DeclFileName, &DeclLine, &DeclColumn)
                 && DeclFileName == Parser->FileName && DeclLine == Parser->Line && DeclColumn == Parser->CharacterPos)
             return ExistingValue;
         else
@@ -349,8 +454,12 @@ struct Value *VariableDefineButIgnoreIdentical(struct ParseState *Parser, char *
 int VariableDefined(Picoc *pc, const char *Ident)
 {
     struct Value *FoundValue;
+    struct Table *HashTable = VariableTable(pc, FALSE);
     
-    if (pc->TopStackFrame == NULL || !TableGet(&pc->TopStackFrame->LocalTable, Ident, &FoundValue, NULL, NULL, NULL))
+    if (VariableGetParameter(pc, Ident) != NULL)
+        return TRUE;
+
+    if (pc->TopStackFrame == NULL || HashTable == NULL || !TableGet(HashTable, Ident, &FoundValue, NULL, NULL, NULL))
     {
         if (!TableGet(&pc->GlobalTable, Ident, &FoundValue, NULL, NULL, NULL))
             return FALSE;
@@ -362,7 +471,13 @@ int VariableDefined(Picoc *pc, const char *Ident)
 /* get the value of a variable. must be defined. Ident must be registered */
 void VariableGet(Picoc *pc, struct ParseState *Parser, const char *Ident, struct Value **LVal)
 {
-    if (pc->TopStackFrame == NULL || !TableGet(&pc->TopStackFrame->LocalTable, Ident, LVal, NULL, NULL, NULL))
+    struct Table *HashTable = VariableTable(pc, FALSE);
+
+    *LVal = VariableGetParameter(pc, Ident);
+    if (*LVal != NULL)
+        return;
+
+    if (pc->TopStackFrame == NULL || HashTable == NULL || !TableGet(HashTable, Ident, LVal, NULL, NULL, NULL))
     {
         if (!TableGet(&pc->GlobalTable, Ident, LVal, NULL, NULL, NULL))
         {
@@ -378,13 +493,70 @@ void VariableGet(Picoc *pc, struct ParseState *Parser, const char *Ident, struct
 void VariableDefinePlatformVar(Picoc *pc, struct ParseState *Parser, const char *Ident, struct ValueType *Typ, union AnyValue *FromValue, int IsWritable)
 {
     struct Value *SomeValue = VariableAllocValueAndData(pc, NULL, 0, IsWritable, NULL, TRUE);
+    char *RegIdent = TableStrRegister(pc, Ident);
     SomeValue->Typ = Typ;
     SomeValue->Val = FromValue;
     
-    if (!TableSet(pc, (pc->TopStackFrame == NULL) ? &pc->GlobalTable : &pc->TopStackFrame->LocalTable, TableStrRegister(pc, Ident), SomeValue, Parser ? Parser->FileName : NULL, Parser ? Parser->Line : 0, Parser ? Parser->CharacterPos : 0))
+    if (VariableGetParameter(pc, RegIdent) != NULL || !TableSet(pc, VariableTable(pc, TRUE), RegIdent, SomeValue, Parser ? Parser->FileName : NULL, Parser ? Parser->Line : 0, Parser ? Parser->CharacterPos : 0))
         ProgramFail(Parser, "'%s' is already defined", Ident);
 }
 
+/* remember the global and static variables as they are now. Platform variables
+ * and functions aren't the program's own state, statics which aren't defined
+ * yet are added by VariableSnapshotAdd() once they're initialised */
+void VariableSnapshotTake(Picoc *pc)
+{
+    struct TableEntry *Entry;
+    int Count;
+
+    pc->SnapshotTaken = TRUE;
+    for (Count = 0; Count < pc->GlobalTable.Size; Count++)
+    {
+        for (Entry = pc->GlobalTable.HashTable[Count]; Entry != NULL; Entry = Entry->Next)
+        {
+            struct Value *Val = Entry->p.v.Val;
+
+            /* a platform variable's data is somewhere else */
+            if (!Val->IsLValue || (!Val->AnyValOnHeap && Val->Val != (union AnyValue *)((char *)Val + MEM_ALIGN(sizeof(struct Value)))))
+                continue;
+
+            if (Val->Typ->Base == TypeFunction || Val->Typ->Base == TypeMacro || Val->Typ->Base == Type_Type || Val->Typ->Base == TypeGotoLabel)
+                continue;
+
+            VariableSnapshotAdd(pc, Val);
+        }
+    }
+}
+
+/* add a variable to the snapshot with the value it has now */
+void VariableSnapshotAdd(Picoc *pc, struct Value *Val)
+{
+    int Size = TypeSizeValue(Val, FALSE);
+    struct VariableSnapshot *Snapshot;
+
+    if (!pc->SnapshotTaken || Size <= 0)
+        return;
+
+    Snapshot = (struct VariableSnapshot *)HeapAllocMem(pc, MEM_ALIGN(sizeof(struct VariableSnapshot)) + Size);
+    if (Snapshot == NULL)
+        ProgramFailNoParser(pc, "out of memory");
+
+    Snapshot->Val = Val->Val;
+    Snapshot->Size = Size;
+    memcpy((void *)((char *)Snapshot + MEM_ALIGN(sizeof(struct VariableSnapshot))), (void *)Val->Val, Size);
+    Snapshot->Next = pc->Snapshot;
+    pc->Snapshot = Snapshot;
+}
+
+/* put the variables in the snapshot back the way they were */
+void VariableSnapshotRestore(Picoc *pc)
+{
+    struct VariableSnapshot *Snapshot;
+
+    for (Snapshot = pc->Snapshot; Snapshot != NULL; Snapshot = Snapshot->Next)
+        memcpy((void *)Snapshot->Val, (void *)((char *)Snapshot + MEM_ALIGN(sizeof(struct VariableSnapshot))), Snapshot->Size);
+}
+
 /* free and/or pop the top value off the stack. Var must be the top value on the stack! */
 void VariableStackPop(struct ParseState *Parser, struct Value *Var)
 {
@@ -411,20 +583,65 @@ void VariableStackPop(struct ParseState *Parser, struct Value *Var)
         ProgramFail(Parser, "stack underrun");
 }
 
-/* add a stack frame when doing a function call */
-void VariableStackFrameAdd(struct ParseState *Parser, const char *FuncName, int NumParams)
+/* allocate the parameters of a call in one go, each a value of its parameter's type. They're
+ * freed with the stack frame the caller pushed for the call */
+struct Value **VariableAllocParameters(struct ParseState *Parser, struct FuncDef *Func)
+{
+    struct Value **Parameter;
+    char *Pos;
+    int Count;
+
+    if (Func->ParamSize == 0)
+    {
+        Func->ParamSize = MEM_ALIGN(sizeof(struct Value *) * Func->NumParams);
+        for (Count = 0; Count < Func->NumParams; Count++)
+            Func->ParamSize += MEM_ALIGN(sizeof(struct Value)) + MEM_ALIGN(TypeSize(Func->ParamType[Count], Func->ParamType[Count]->ArraySize, FALSE));
+    }
+
+    Parameter = (struct Value **)HeapAllocStack(Parser->pc, Func->ParamSize);
+    if (Parameter == NULL)
+        ProgramFail(Parser, "out of memory");
+
+    Pos = (char *)Parameter + MEM_ALIGN(sizeof(struct Value *) * Func->NumParams);
+    for (Count = 0; Count < Func->NumParams; Count++)
+    {
+        struct Value *Param = (struct Value *)Pos;
+
+        Param->Typ = Func->ParamType[Count];
+        Param->Val = (union AnyValue *)(Pos + MEM_ALIGN(sizeof(struct Value)));
+        Param->ValOnStack = TRUE;
+        Param->ScopeID = Parser->ScopeID;
+        Parameter[Count] = Param;
+        Pos += MEM_ALIGN(sizeof(struct Value)) + MEM_ALIGN(TypeSize(Param->Typ, Param->Typ->ArraySize, FALSE));
+    }
+
+    return Parameter;
+}
+
+/* add a stack frame when doing a function call. The parameters become variables of the
+ * function as they are, they're found by name before its local variables */
+void VariableStackFrameAdd(struct ParseState *Parser, const char *FuncName, char **ParamName, struct Value **Parameter, int NumParams)
 {
     struct StackFrame *NewFrame;
+    int Count;
     
     HeapPushStackFrame(Parser->pc);
-    NewFrame = (StackFrame*)HeapAllocStack(Parser->pc, sizeof(struct StackFrame) + sizeof(struct Value *) * NumParams);
+    NewFrame = (StackFrame*)HeapAllocStack(Parser->pc, sizeof(struct StackFrame));
     if (NewFrame == NULL)
         ProgramFail(Parser, "out of memory");
         
-    ParserCopy(&NewFrame->ReturnParser, Parser);
     NewFrame->FuncName = FuncName;
-    NewFrame->Parameter = (NumParams > 0) ? ((Value**)((char *)NewFrame + sizeof(struct StackFrame))) : NULL;
-    TableInitTable(&NewFrame->LocalTable, &NewFrame->LocalHashTable[0], LOCAL_TABLE_SIZE, FALSE);
+    NewFrame->Parameter = Parameter;
+    NewFrame->ParamName = ParamName;
+    NewFrame->NumParams = NumParams;
+    for (Count = 0; Count < NumParams; Count++)
+    {
+        /* parameters never go out of scope */
+        Parameter[Count]->IsLValue = TRUE;
+        Parameter[Count]->ScopeID = -1;
+        Parameter[Count]->OutOfScope = FALSE;
+    }
+
     NewFrame->PreviousStackFrame = Parser->pc->TopStackFrame;
     Parser->pc->TopStackFrame = NewFrame;
 }
@@ -435,7 +652,6 @@ void VariableStackFramePop(struct ParseState *Parser)
     if (Parser->pc->TopStackFrame == NULL)
         ProgramFail(Parser, "stack is empty - can't go back");
         
-    ParserCopy(Parser, &Parser->pc->TopStackFrame->ReturnParser);
     Parser->pc->TopStackFrame = Parser->pc->TopStackFrame->PreviousStackFrame;
     HeapPopStackFrame(Parser->pc);
 }
@@ -0,0 +1,536 @@
+/* picoc virtual machine - runs the bytecode compile.c makes from function
+ * bodies. Operators work like they do in expression.c, including the errors
+ * they give, so it doesn't matter to a program which one runs it */
+
+#include "interpreter.h"
+
+/* a double from a value on the stack, ints go through ExpressionCoerceInteger() like in the interpreter */
+#define VM_FP(v) (((v)->Typ == TypeFP) ? (v)->Val.FP : (double)(long)(v)->Val.Integer)
+
+/* the truth of a condition of a statement - ExpressionParseInt() truncates it to an int */
+#define VM_CONDITION(v) (((v)->Typ == TypeFP) ? (int)(long)(v)->Val.FP : (v)->Val.Integer)
+
+/* the truth of the operand of ?, && and || */
+#define VM_TRUTH(v) (((v)->Typ == TypeFP) ? ((long)(v)->Val.FP != 0) : ((v)->Val.Integer != 0))
+
+/* note where the instruction came from before doing anything which can fail */
+#define VM_POSITION() do { Parser->Line = Func->Position[PC].Line; Parser->CharacterPos = Func->Position[PC].CharacterPos; } while (0)
+
+/* where variable n of the function is, see enum VmOp */
+#define VM_VARIABLE(n) (((n) < Func->NumLocals) ? &Local[n] : (union VmNumber *)Func->Global[(n) - Func->NumLocals]->Val)
+
+static void VmLoad(enum BaseType Typ, union VmNumber *Var, struct VmValue *To)
+{
+    To->Typ = Typ;
+    if (Typ == TypeFP)
+        To->Val.FP = Var->FP;
+    else
+        To->Val.Integer = Var->Integer;
+}
+
+/* make a temporary value out of a value on the stack to pass to ExpressionAssign() */
+static void VmValueOf(Picoc *pc, struct VmValue *From, struct Value *To, union AnyValue *Val)
+{
+    memset((void *)To, '\0', sizeof(*To));
+    To->Val = Val;
+    if (From->Typ == TypeFP)
+    {
+        To->Typ = &pc->FPType;
+        Val->FP = From->Val.FP;
+    }
+    else
+    {
+        To->Typ = &pc->IntType;
+        Val->Integer = From->Val.Integer;
+    }
+}
+
+/* the new value of a variable given an assignment operator and both sides as doubles */
+static inline double VmAssignFP(struct ParseState *Parser, enum LexToken Op, double BottomFP, double TopFP)
+{
+    switch (Op)
+    {
+        case TokenAssign:           return TopFP;
+        case TokenAddAssign:        return BottomFP + TopFP;
+        case TokenSubtractAssign:   return BottomFP - TopFP;
+        case TokenMultiplyAssign:   return BottomFP * TopFP;
+        case TokenDivideAssign:     return BottomFP / TopFP;
+        default:                    ProgramFail(Parser, "invalid operation"); return 0.0;
+    }
+}
+
+/* an assignment operator on an int variable with an int value. The result is left in Top */
+static inline void VmAssignInt(struct ParseState *Parser, enum LexToken Op, union VmNumber *Var, struct VmValue *Top)
+{
+    long TopInt = Top->Val.Integer;
+    long BottomInt = Var->Integer;
+    long ResultInt;
+
+    switch (Op)
+    {
+        case TokenAssign:               ResultInt = TopInt; break;
+        case TokenAddAssign:            ResultInt = BottomInt + TopInt; break;
+        case TokenSubtractAssign:       ResultInt = BottomInt - TopInt; break;
+        case TokenMultiplyAssign:       ResultInt = BottomInt * TopInt; break;
+        case TokenDivideAssign:         if (TopInt == 0) ProgramFail(Parser, "division by zero"); ResultInt = BottomInt / TopInt; break;
+        case TokenModulusAssign:        if (TopInt == 0) ProgramFail(Parser, "division by zero"); ResultInt = BottomInt % TopInt; break;
+        case TokenShiftLeftAssign:      ResultInt = BottomInt << TopInt; break;
+        case TokenShiftRightAssign:     ResultInt = BottomInt >> TopInt; break;
+        case TokenArithmeticAndAssign:  ResultInt = BottomInt & TopInt; break;
+        case TokenArithmeticOrAssign:   ResultInt = BottomInt | TopInt; break;
+        case TokenArithmeticExorAssign: ResultInt = BottomInt ^ TopInt; break;
+        default:                        ProgramFail(Parser, "invalid operation"); return;
+    }
+
+    Var->Integer = ResultInt;
+    Top->Val.Integer = (int)ResultInt;
+}
+
+/* an assignment operator, see ExpressionInfixOperator(). The result is left in Top */
+static void VmAssign(struct ParseState *Parser, enum LexToken Op, enum BaseType Typ, union VmNumber *Var, struct VmValue *Top)
+{
+    if (Typ == TypeFP || Top->Typ == TypeFP)
+    {
+        double ResultFP = VmAssignFP(Parser, Op, (Typ == TypeFP) ? Var->FP : (double)(long)Var->Integer, VM_FP(Top));
+
+        if (Typ == TypeFP)
+        {
+            Var->FP = ResultFP;
+            Top->Typ = TypeFP;
+            Top->Val.FP = ResultFP;
+        }
+        else
+        {
+            Var->Integer = (long)ResultFP;
+            Top->Typ = TypeInt;
+            Top->Val.Integer = (int)(long)ResultFP;
+        }
+    }
+    else
+        VmAssignInt(Parser, Op, Var, Top);
+}
+
+/* ++ and -- on a variable, see ExpressionPrefixOperator() and ExpressionPostfixOperator() */
+static void VmIncrement(enum LexToken Op, int Postfix, enum BaseType Typ, union VmNumber *Var, struct VmValue *Result)
+{
+    if (Typ == TypeFP)
+    {
+        /* the interpreter gives the new value of a double whichever side the operator's on */
+        Var->FP = (Op == TokenIncrement) ? Var->FP + 1.0 : Var->FP - 1.0;
+        Result->Typ = TypeFP;
+        Result->Val.FP = Var->FP;
+    }
+    else
+    {
+        long TopInt = Var->Integer;
+        long ResultInt = (Op == TokenIncrement) ? TopInt + 1 : TopInt - 1;
+
+        Var->Integer = ResultInt;
+        Result->Typ = TypeInt;
+        Result->Val.Integer = (int)(Postfix ? TopInt : ResultInt);
+    }
+}
+
+/* a prefix operator on a value, see ExpressionPrefixOperator() */
+static void VmUnary(struct ParseState *Parser, enum LexToken Op, struct VmValue *Top)
+{
+    if (Top->Typ == TypeFP)
+    {
+        switch (Op)
+        {
+            case TokenMinus:        Top->Val.FP = -Top->Val.FP; break;
+            case TokenUnaryNot:     Top->Val.FP = !Top->Val.FP; break;
+            default:                ProgramFail(Parser, "invalid operation"); break;
+        }
+    }
+    else
+    {
+        long TopInt = Top->Val.Integer;
+
+        switch (Op)
+        {
+            case TokenMinus:        Top->Val.Integer = (int)-TopInt; break;
+            case TokenUnaryNot:     Top->Val.Integer = (int)!TopInt; break;
+            case TokenUnaryExor:    Top->Val.Integer = (int)~TopInt; break;
+            default:                ProgramFail(Parser, "invalid operation"); break;
+        }
+    }
+}
+
+/* an infix operator on two doubles. The result is left in Bottom. This and the other
+ * kernels are inline since the instructions for typed operands run them directly */
+static inline void VmInfixFP(struct ParseState *Parser, enum LexToken Op, struct VmValue *Bottom, double BottomFP, double TopFP)
+{
+    int ResultInt;
+
+    switch (Op)
+    {
+        case TokenEqual:        ResultInt = BottomFP == TopFP; break;
+        case TokenNotEqual:     ResultInt = BottomFP != TopFP; break;
+        case TokenLessThan:     ResultInt = BottomFP < TopFP; break;
+        case TokenGreaterThan:  ResultInt = BottomFP > TopFP; break;
+        case TokenLessEqual:    ResultInt = BottomFP <= TopFP; break;
+        case TokenGreaterEqual: ResultInt = BottomFP >= TopFP; break;
+        case TokenPlus:         Bottom->Typ = TypeFP; Bottom->Val.FP = BottomFP + TopFP; return;
+        case TokenMinus:        Bottom->Typ = TypeFP; Bottom->Val.FP = BottomFP - TopFP; return;
+        case TokenAsterisk:     Bottom->Typ = TypeFP; Bottom->Val.FP = BottomFP * TopFP; return;
+        case TokenSlash:        Bottom->Typ = TypeFP; Bottom->Val.FP = BottomFP / TopFP; return;
+        default:                ProgramFail(Parser, "invalid operation"); return;
+    }
+
+    Bottom->Typ = TypeInt;
+    Bottom->Val.Integer = ResultInt;
+}
+
+/* an infix operator on two ints. The result is left in Bottom */
+static inline void VmInfixInt(struct ParseState *Parser, enum LexToken Op, struct VmValue *Bottom, struct VmValue *Top)
+{
+    long BottomInt = Bottom->Val.Integer;
+    long TopInt = Top->Val.Integer;
+    long ResultInt;
+
+    switch (Op)
+    {
+        case TokenLogicalOr:        ResultInt = BottomInt || TopInt; break;
+        case TokenLogicalAnd:       ResultInt = BottomInt && TopInt; break;
+        case TokenArithmeticOr:     ResultInt = BottomInt | TopInt; break;
+        case TokenArithmeticExor:   ResultInt = BottomInt ^ TopInt; break;
+        case TokenAmpersand:        ResultInt = BottomInt & TopInt; break;
+        case TokenEqual:            ResultInt = BottomInt == TopInt; break;
+        case TokenNotEqual:         ResultInt = BottomInt != TopInt; break;
+        case TokenLessThan:         ResultInt = BottomInt < TopInt; break;
+        case TokenGreaterThan:      ResultInt = BottomInt > TopInt; break;
+        case TokenLessEqual:        ResultInt = BottomInt <= TopInt; break;
+        case TokenGreaterEqual:     ResultInt = BottomInt >= TopInt; break;
+        case TokenShiftLeft:        ResultInt = BottomInt << TopInt; break;
+        case TokenShiftRight:       ResultInt = BottomInt >> TopInt; break;
+        case TokenPlus:             ResultInt = BottomInt + TopInt; break;
+        case TokenMinus:            ResultInt = BottomInt - TopInt; break;
+        case TokenAsterisk:         ResultInt = BottomInt * TopInt; break;
+        case TokenSlash:            if (TopInt == 0) ProgramFail(Parser, "division by zero"); ResultInt = BottomInt / TopInt; break;
+        case TokenModulus:          if (TopInt == 0) ProgramFail(Parser, "division by zero"); ResultInt = BottomInt % TopInt; break;
+        default:                    ProgramFail(Parser, "invalid operation"); return;
+    }
+
+    Bottom->Typ = TypeInt;
+    Bottom->Val.Integer = (int)ResultInt;
+}
+
+/* an infix operator on values of any type, see ExpressionInfixOperator(). The result is left in Bottom */
+static void VmInfix(struct ParseState *Parser, enum LexToken Op, struct VmValue *Bottom, struct VmValue *Top)
+{
+    if (Bottom->Typ == TypeFP || Top->Typ == TypeFP)
+        VmInfixFP(Parser, Op, Bottom, VM_FP(Bottom), VM_FP(Top));
+    else
+        VmInfixInt(Parser, Op, Bottom, Top);
+}
+
+static int VmExecute(struct ParseState *Parser, struct VmFunction *Func, union VmNumber *Local, struct VmValue *Result);
+
+/* call a compiled function which returns an int, a double or nothing. The
+ * arguments go straight into its variables and the result straight back onto
+ * the stack without making values for them. Returns TRUE if it gave a value */
+static int VmCallCompiled(struct ParseState *Parser, const char *FuncName, struct FuncDef *FuncDef, struct VmValue *Arg, struct VmValue *Result)
+{
+    Picoc *pc = Parser->pc;
+    struct VmFunction *Func = FuncDef->Compiled;
+    struct ParseState FuncParser;
+    union VmNumber *Local;
+    int Count;
+
+    /* machine code is as far up as a function goes */
+    if (Func->Native == NULL)
+        TIER_COUNT_CALL(Parser, FuncName, FuncDef);
+
+    ParserCopy(&FuncParser, &FuncDef->Body);
+    VariableStackFrameAdd(Parser, FuncName, NULL, NULL, 0);
+    pc->TopStackFrame->ReturnValue = NULL;
+
+    /* the variables go on the picoc stack so deep recursion runs out of it rather than the C stack */
+    Local = (union VmNumber *)HeapAllocStack(pc, sizeof(union VmNumber) * Func->NumLocals);
+    if (Local == NULL)
+        ProgramFail(Parser, "out of memory");
+
+    for (Count = 0; Count < Func->NumParams; Count++)
+    {
+        if (Func->Type[Count] == TypeFP)
+            Local[Count].FP = VM_FP(&Arg[Count]);
+        else
+            Local[Count].Integer = (Arg[Count].Typ == TypeFP) ? (int)(long)Arg[Count].Val.FP : Arg[Count].Val.Integer;
+    }
+
+    if (VmExecute(&FuncParser, Func, Local, Result))
+    {
+        if (FuncDef->ReturnType->Base == TypeFP)
+        {
+            Result->Val.FP = VM_FP(Result);
+            Result->Typ = TypeFP;
+        }
+        else if (Result->Typ == TypeFP)
+        {
+            Result->Val.Integer = (int)(long)Result->Val.FP;
+            Result->Typ = TypeInt;
+        }
+    }
+    else if (FuncParser.Mode == RunModeRun && FuncDef->ReturnType != &pc->VoidType)
+        ProgramFail(&FuncParser, "no value returned from a function returning something");
+
+    VariableStackFramePop(Parser);
+    return FuncDef->ReturnType != &pc->VoidType;
+}
+
+/* call a function with the arguments on the top of the stack, see ExpressionParseFunctionCall().
+ * The compiler has checked the arguments match. Returns TRUE if it gave a value. The
+ * machine code from jit.c calls functions through this too */
+int VmCall(struct ParseState *Parser, const char *FuncName, struct Value *FuncValue, struct VmValue *Arg, int ArgCount, struct VmValue *Result)
+{
+    Picoc *pc = Parser->pc;
+    struct FuncDef *FuncDef = &FuncValue->Val->FuncDef;
+    struct Value *ReturnValue;
+    struct Value **ParamArray;
+    struct Value Temp;
+    union AnyValue TempVal;
+    int Count;
+
+    CHECK_CANCELLED(Parser);
+    if (FuncDef->Compiled != NULL && (FuncDef->ReturnType == &pc->VoidType || FuncDef->ReturnType == &pc->IntType || FuncDef->ReturnType == &pc->FPType))
+        return VmCallCompiled(Parser, FuncName, FuncDef, Arg, Result);
+
+    ReturnValue = VariableAllocValueFromType(pc, Parser, FuncDef->ReturnType, FALSE, NULL, FALSE);
+    HeapPushStackFrame(pc);
+    ParamArray = VariableAllocParameters(Parser, FuncDef);
+
+    for (Count = 0; Count < ArgCount; Count++)
+    {
+        VmValueOf(pc, &Arg[Count], &Temp, &TempVal);
+        ExpressionAssign(Parser, ParamArray[Count], &Temp, TRUE, FuncName, Count+1, FALSE);
+    }
+
+    ExpressionCallFunction(Parser, FuncName, FuncValue, ReturnValue, ParamArray, ArgCount);
+    HeapPopStackFrame(pc);
+
+    if (ReturnValue->Typ == &pc->VoidType)
+    {
+        VariableStackPop(Parser, ReturnValue);
+        return FALSE;
+    }
+
+    if (IS_FP(ReturnValue))
+    {
+        Result->Typ = TypeFP;
+        Result->Val.FP = ReturnValue->Val->FP;
+    }
+    else
+    {
+        Result->Typ = TypeInt;
+        Result->Val.Integer = (int)ExpressionCoerceInteger(ReturnValue);
+    }
+
+    VariableStackPop(Parser, ReturnValue);
+    return TRUE;
+}
+
+/* run a compiled function body with its parameters already in Local. Parser
+ * is a copy of the function's body the same as if it was being parsed, it's
+ * left in RunModeReturn if the function returns or at the end of the body if
+ * it falls off it. Returns TRUE if it returned a value, which is left in Result */
+static int VmExecute(struct ParseState *Parser, struct VmFunction *Func, union VmNumber *Local, struct VmValue *Result)
+{
+    const struct VmInstruction *Code = Func->Code;
+    struct VmValue Stack[VM_STACK_MAX];
+    struct VmValue *Top = &Stack[0] - 1;
+    int PC = 0;
+
+    /* the rest start at 0 like a newly defined variable */
+    memset((void *)&Local[Func->NumParams], '\0', sizeof(union VmNumber) * (Func->NumLocals - Func->NumParams));
+    if (Func->Native != NULL)
+        return JitExecute(Parser, Func, Local, Result);
+
+    for (;;)
+    {
+        const struct VmInstruction *Ins = &Code[PC];
+
+        switch (Ins->Op)
+        {
+            case VmOpPushInt:
+                Top++;
+                Top->Typ = TypeInt;
+                Top->Val.Integer = Ins->Operand;
+                break;
+
+            case VmOpPushFP:
+                Top++;
+                Top->Typ = TypeFP;
+                Top->Val.FP = Func->Constant[Ins->Operand];
+                break;
+
+            case VmOpLoad:
+                Top++;
+                VmLoad((enum BaseType)Func->Type[Ins->Operand], VM_VARIABLE(Ins->Operand), Top);
+                break;
+
+            case VmOpAssign:
+                VM_POSITION();
+                VmAssign(Parser, (enum LexToken)Ins->Token, (enum BaseType)Func->Type[Ins->Operand], VM_VARIABLE(Ins->Operand), Top);
+                break;
+
+            case VmOpInitialise:
+                if (Func->Type[Ins->Operand] == TypeFP)
+                    Local[Ins->Operand].FP = VM_FP(Top);
+                else
+                    Local[Ins->Operand].Integer = (Top->Typ == TypeFP) ? (long)Top->Val.FP : Top->Val.Integer;
+                Top--;
+                break;
+
+            case VmOpPrefix: case VmOpPostfix:
+                Top++;
+                VmIncrement((enum LexToken)Ins->Token, Ins->Op == VmOpPostfix, (enum BaseType)Func->Type[Ins->Operand], VM_VARIABLE(Ins->Operand), Top);
+                break;
+
+            case VmOpUnary:
+                VM_POSITION();
+                VmUnary(Parser, (enum LexToken)Ins->Token, Top);
+                break;
+
+            case VmOpInfix:
+                VM_POSITION();
+                Top--;
+                VmInfix(Parser, (enum LexToken)Ins->Token, Top, Top + 1);
+                break;
+
+            case VmOpInfixInt:
+                VM_POSITION();
+                Top--;
+                VmInfixInt(Parser, (enum LexToken)Ins->Token, Top, Top + 1);
+                break;
+
+            case VmOpInfixFP:
+                Top--;
+                VmInfixFP(Parser, (enum LexToken)Ins->Token, Top, Top->Val.FP, Top[1].Val.FP);
+                break;
+
+            case VmOpAssignInt:
+                VM_POSITION();
+                VmAssignInt(Parser, (enum LexToken)Ins->Token, VM_VARIABLE(Ins->Operand), Top);
+                break;
+
+            case VmOpAssignFP:
+            {
+                union VmNumber *Var = VM_VARIABLE(Ins->Operand);
+
+                Var->FP = VmAssignFP(Parser, (enum LexToken)Ins->Token, Var->FP, Top->Val.FP);
+                Top->Val.FP = Var->FP;
+                break;
+            }
+
+            case VmOpIntToFP:
+                Top->Typ = TypeFP;
+                Top->Val.FP = (double)Top->Val.Integer;
+                break;
+
+            case VmOpCast:
+                if (Ins->Token == TypeFP && Top->Typ != TypeFP)
+                    Top->Val.FP = (double)(long)Top->Val.Integer;
+                else if (Ins->Token == TypeInt && Top->Typ == TypeFP)
+                    Top->Val.Integer = (int)(long)Top->Val.FP;
+
+                Top->Typ = (enum BaseType)Ins->Token;
+                break;
+
+            case VmOpTernary:
+                Top -= 2;
+                *Top = VM_TRUTH(Top) ? Top[1] : Top[2];
+                break;
+
+            case VmOpSkipIfFalse: case VmOpSkipIfTrue:
+                if (VM_TRUTH(Top) == (Ins->Op == VmOpSkipIfTrue))
+                {
+                    /* like the interpreter, the skipped side of the operator counts as 0 */
+                    Top++;
+                    Top->Typ = TypeInt;
+                    Top->Val.Integer = 0;
+                    PC = Ins->Operand;
+                    continue;
+                }
+                break;
+
+            case VmOpJump:
+                PC = Ins->Operand;
+                continue;
+
+            case VmOpJumpIfFalse:
+                Top--;
+                if (!VM_CONDITION(Top + 1))
+                {
+                    PC = Ins->Operand;
+                    continue;
+                }
+                break;
+
+            case VmOpLoop:
+                VM_POSITION();
+                CHECK_CANCELLED(Parser);
+                Func->Def->BackEdges++;
+                PC = Ins->Operand;
+                continue;
+
+            case VmOpCall:
+            {
+                struct VmValue Result;
+
+                VM_POSITION();
+                Top -= Ins->Token;
+                if (VmCall(Parser, Func->Name[Ins->Operand], Func->Global[Ins->Operand], Top + 1, Ins->Token, &Result))
+                    *++Top = Result;
+                break;
+            }
+
+            case VmOpPop:
+                Top--;
+                break;
+
+            case VmOpReturn:
+                VM_POSITION();
+                *Result = *Top;
+                Parser->Mode = RunModeReturn;
+                return TRUE;
+
+            case VmOpReturnVoid:
+                Parser->Mode = RunModeReturn;
+                return FALSE;
+
+            case VmOpEnd:
+                VM_POSITION();
+                return FALSE;
+        }
+
+        PC++;
+    }
+}
+
+/* run a compiled function body called by the interpreter. The parameters come
+ * from ParamArray, they aren't defined as variables */
+void VmRun(struct ParseState *Parser, struct VmFunction *Func, struct Value **ParamArray)
+{
+    Picoc *pc = Parser->pc;
+    union VmNumber Local[VM_LOCALS_MAX];
+    struct VmValue Result;
+    int Count;
+
+    for (Count = 0; Count < Func->NumParams; Count++)
+    {
+        if (Func->Type[Count] == TypeFP)
+            Local[Count].FP = ParamArray[Count]->Val->FP;
+        else
+            Local[Count].Integer = ParamArray[Count]->Val->Integer;
+    }
+
+    if (VmExecute(Parser, Func, Local, &Result))
+    {
+        struct Value Temp;
+        union AnyValue TempVal;
+
+        VmValueOf(pc, &Result, &Temp, &TempVal);
+        ExpressionAssign(Parser, pc->TopStackFrame->ReturnValue, &Temp, TRUE, NULL, 0, FALSE);
+    }
+}